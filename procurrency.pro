@@ -311,6 +311,8 @@ HEADERS += \
     src/bloom.h \
     src/init.h \
     src/mruset.h \
+    src/seencache.h \
+    src/blockmap.h \
     src/rpcprotocol.h \
     src/rpcserver.h \
     src/rpcclient.h \
@@ -386,53 +386,247 @@ void CAddrMan::Attempt_(const CService &addr, int64_t nTime)
     info.nAttempts++;
 }
 
-CAddress CAddrMan::Select_(int nUnkBias)
+CAddrInfo CAddrManSnapshot::Get(int nIndex) const
 {
-    if (size() == 0)
+    CAddrInfo info = vInfo[nIndex];
+    const CAddrManSnapshotTimes &times = pTimes[nIndex];
+    info.nLastTry = times.nLastTry.load(boost::memory_order_relaxed);
+    info.nLastSuccess = times.nLastSuccess.load(boost::memory_order_relaxed);
+    info.nTime = times.nTime.load(boost::memory_order_relaxed);
+    info.nAttempts = times.nAttempts.load(boost::memory_order_relaxed);
+    return info;
+}
+
+bool CAddrManSnapshot::UpdateTimes(int nId, const CAddrInfo &info) const
+{
+    std::map<int, int>::const_iterator it = mapIndex.find(nId);
+    if (it == mapIndex.end())
+        return false;
+
+    const CAddrInfo &infoSnapshot = vInfo[it->second];
+    if (infoSnapshot != info || infoSnapshot.fInTried != info.fInTried)
+        return false;
+
+    CAddrManSnapshotTimes &times = pTimes[it->second];
+    times.nLastTry.store(info.nLastTry, boost::memory_order_relaxed);
+    times.nLastSuccess.store(info.nLastSuccess, boost::memory_order_relaxed);
+    times.nTime.store(info.nTime, boost::memory_order_relaxed);
+    times.nAttempts.store(info.nAttempts, boost::memory_order_relaxed);
+    return true;
+}
+
+CAddress CAddrManSnapshot::Select(int nUnkBias) const
+{
+    if (vInfo.size() == 0)
         return CAddress();
-    
+
     int nTries = fTestNet ? 100 : 100000;
-    
+    int64_t nNow = GetAdjustedTime();
+
+    // only non-empty buckets are kept, which gives the same distribution as
+    // retrying random buckets of the full table until a non-empty one is hit
     double nCorTried = sqrt(nTried) * (100.0 - nUnkBias);
     double nCorNew = sqrt(nNew) * nUnkBias;
-    if ((nCorTried + nCorNew)*GetRandInt(1<<30)/(1<<30) < nCorTried)
+    const std::vector<std::vector<int> > &vvBuckets = ((nCorTried + nCorNew)*GetRandInt(1<<30)/(1<<30) < nCorTried) ? vvTried : vvNew;
+    if (vvBuckets.size() == 0)
+        return CAddress();
+
+    double fChanceFactor = 1.0;
+    for (int i = 0; i < nTries; ++i)
     {
-        // use a tried node
-        double fChanceFactor = 1.0;
-        for (int i = 0; i < nTries; ++i)
-        {
-            int nKBucket = GetRandInt(vvTried.size());
-            std::vector<int> &vTried = vvTried[nKBucket];
-            if (vTried.size() == 0) continue;
-            int nPos = GetRandInt(vTried.size());
-            assert(mapInfo.count(vTried[nPos]) == 1);
-            CAddrInfo &info = mapInfo[vTried[nPos]];
-            if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
-                return info;
-            fChanceFactor *= fTestNet ? 12 : 1.2;
-        };
-    } else
+        const std::vector<int> &vBucket = vvBuckets[GetRandInt(vvBuckets.size())];
+        CAddrInfo info = Get(vBucket[GetRandInt(vBucket.size())]);
+        if (GetRandInt(1<<30) < fChanceFactor*info.GetChance(nNow)*(1<<30))
+            return info;
+        fChanceFactor *= fTestNet ? 12 : 1.2;
+    };
+
+    return CAddress();
+}
+
+void CAddrManSnapshot::GetAddr(std::vector<CAddress> &vAddr) const
+{
+    int nNodes = ADDRMAN_GETADDR_MAX_PCT*vInfo.size()/100;
+    if (nNodes > ADDRMAN_GETADDR_MAX)
+        nNodes = ADDRMAN_GETADDR_MAX;
+
+    // partial random shuffle over a private index, the snapshot itself is shared
+    std::vector<int> vIndex(vInfo.size());
+    for (unsigned int n = 0; n < vIndex.size(); n++)
+        vIndex[n] = n;
+
+    vAddr.reserve(nNodes);
+    for (int n = 0; n < nNodes; n++)
+    {
+        int nRndPos = GetRandInt(vIndex.size() - n) + n;
+        std::swap(vIndex[n], vIndex[nRndPos]);
+        vAddr.push_back(Get(vIndex[n]));
+    }
+}
+
+bool CAddrMan::QueueAdd(const std::vector<CAddress> &vAddr, const CNetAddr& source, int64_t nTimePenalty)
+{
+    bool fFull = false;
+    bool fFlush = false;
     {
-        // use a new node
-        double fChanceFactor = 1.0;
-        for (int i = 0; i < nTries; ++i)
+        LOCK(cs_pending);
+        int64_t nNow = GetTime();
+        for (std::vector<CAddress>::const_iterator it = vAddr.begin(); it != vAddr.end(); it++)
         {
-            int nUBucket = GetRandInt(vvNew.size());
-            std::set<int> &vNew = vvNew[nUBucket];
-            if (vNew.size() == 0) continue;
-            int nPos = GetRandInt(vNew.size());
-            std::set<int>::iterator it = vNew.begin();
-            while (nPos--)
-                it++;
-            assert(mapInfo.count(*it) == 1);
-            CAddrInfo &info = mapInfo[*it];
-            if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
-                return info;
-            fChanceFactor *= fTestNet ? 12 : 1.2;
+            // cheap rejections are done here, outside of cs
+            if (!it->IsRoutable())
+                continue;
+            if (vPending.size() >= ADDRMAN_ADD_QUEUE_MAX)
+            {
+                fFull = true;
+                break;
+            };
+            if (vPending.empty())
+                nPendingSince = nNow;
+            vPending.push_back(CAddrManPending(*it, source, nTimePenalty));
         };
+        fFlush = vPending.size() >= ADDRMAN_ADD_BATCH_SIZE
+              || (!vPending.empty() && nNow - nPendingSince >= ADDRMAN_ADD_BATCH_DELAY);
+    }
+
+    if (fFlush)
+        FlushPending();
+
+    return !fFull;
+}
+
+int CAddrMan::ApplyPending_()
+{
+    std::vector<CAddrManPending> vBatch;
+    {
+        LOCK(cs_pending);
+        vBatch.swap(vPending);
+        nPendingSince = 0;
+    }
+
+    int nAdd = 0;
+    for (std::vector<CAddrManPending>::const_iterator it = vBatch.begin(); it != vBatch.end(); it++)
+        nAdd += Add_(it->addr, it->source, it->nTimePenalty) ? 1 : 0;
+
+    if (vBatch.size())
+        MarkSnapshotDirty(false);
+    return nAdd;
+}
+
+void CAddrMan::RefreshSnapshot_()
+{
+    // build outside cs_snapshot, readers keep using the previous copy meanwhile
+    boost::shared_ptr<CAddrManSnapshot> snapshot(new CAddrManSnapshot());
+    snapshot->nTried = nTried;
+    snapshot->nNew = nNew;
+    snapshot->nTimeCreated = GetTime();
+    snapshot->vInfo.reserve(mapInfo.size());
+    snapshot->pTimes.reset(new CAddrManSnapshotTimes[mapInfo.size()]);
+
+    std::map<int, int> &mapIndex = snapshot->mapIndex;
+    for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++)
+    {
+        int nIndex = snapshot->vInfo.size();
+        mapIndex.insert(mapIndex.end(), std::make_pair(it->first, nIndex));
+        snapshot->vInfo.push_back(it->second);
+        snapshot->UpdateTimes(it->first, it->second);
     };
-    
-    return CAddress();
+
+    for (std::vector<std::vector<int> >::const_iterator it = vvTried.begin(); it != vvTried.end(); it++)
+    {
+        if (it->empty())
+            continue;
+        snapshot->vvTried.push_back(std::vector<int>());
+        std::vector<int> &vBucket = snapshot->vvTried.back();
+        vBucket.reserve(it->size());
+        for (std::vector<int>::const_iterator it2 = it->begin(); it2 != it->end(); it2++)
+            vBucket.push_back(mapIndex[*it2]);
+    };
+
+    for (std::vector<std::set<int> >::const_iterator it = vvNew.begin(); it != vvNew.end(); it++)
+    {
+        if (it->empty())
+            continue;
+        snapshot->vvNew.push_back(std::vector<int>());
+        std::vector<int> &vBucket = snapshot->vvNew.back();
+        vBucket.reserve(it->size());
+        for (std::set<int>::const_iterator it2 = it->begin(); it2 != it->end(); it2++)
+            vBucket.push_back(mapIndex[*it2]);
+    };
+
+    {
+        LOCK(cs_snapshot);
+        pSnapshot = snapshot;
+        fSnapshotDirty = false;
+        fSnapshotStale = false;
+    }
+}
+
+void CAddrMan::MarkSnapshotDirty(bool fStale)
+{
+    LOCK(cs_snapshot);
+    fSnapshotDirty = true;
+    if (fStale)
+        fSnapshotStale = true;
+}
+
+void CAddrMan::UpdateSnapshotEntry_(const CService &addr)
+{
+    int nId;
+    CAddrInfo *pinfo = Find(addr, &nId);
+    if (!pinfo)
+        return;
+
+    boost::shared_ptr<const CAddrManSnapshot> snapshot;
+    {
+        LOCK(cs_snapshot);
+        snapshot = pSnapshot;
+    }
+
+    // entries added since the snapshot was built are already flagged by Add
+    if (snapshot && !snapshot->mapIndex.count(nId))
+        return;
+
+    // a promotion to "tried" has to be visible to Select at once
+    if (!snapshot || !snapshot->UpdateTimes(nId, *pinfo))
+        MarkSnapshotDirty(true);
+}
+
+boost::shared_ptr<const CAddrManSnapshot> CAddrMan::GetSnapshot()
+{
+    boost::shared_ptr<const CAddrManSnapshot> snapshot;
+    bool fRefresh;
+    {
+        LOCK(cs_snapshot);
+        snapshot = pSnapshot;
+        fRefresh = !snapshot || fSnapshotStale
+            || (fSnapshotDirty && (snapshot->vInfo.empty() || GetTime() - snapshot->nTimeCreated >= ADDRMAN_SNAPSHOT_INTERVAL));
+    }
+
+    bool fPending;
+    {
+        LOCK(cs_pending);
+        fPending = !vPending.empty() && GetTime() - nPendingSince >= ADDRMAN_ADD_BATCH_DELAY;
+    }
+
+    if (!fRefresh && !fPending)
+        return snapshot;
+
+    {
+        // only the first reader ever waits for cs, later ones keep the old
+        // snapshot while a writer holds the lock
+        CCriticalBlock lock(cs, "cs", __FILE__, __LINE__, !!snapshot);
+        if (!lock)
+            return snapshot;
+        Check();
+        if (fPending)
+            ApplyPending_();
+        RefreshSnapshot_();
+        Check();
+    }
+
+    LOCK(cs_snapshot);
+    return pSnapshot;
 }
 
 #ifdef DEBUG_ADDRMAN
@@ -496,22 +690,6 @@ int CAddrMan::Check_()
 }
 #endif
 
-void CAddrMan::GetAddr_(std::vector<CAddress> &vAddr)
-{
-    int nNodes = ADDRMAN_GETADDR_MAX_PCT*vRandom.size()/100;
-    if (nNodes > ADDRMAN_GETADDR_MAX)
-        nNodes = ADDRMAN_GETADDR_MAX;
-
-    // perform a random shuffle over the first nNodes elements of vRandom (selecting from all)
-    for (int n = 0; n<nNodes; n++)
-    {
-        int nRndPos = GetRandInt(vRandom.size() - n) + n;
-        SwapRandom(n, nRndPos);
-        assert(mapInfo.count(vRandom[n]) == 1);
-        vAddr.push_back(mapInfo[vRandom[n]]);
-    }
-}
-
 void CAddrMan::Connected_(const CService &addr, int64_t nTime)
 {
     CAddrInfo *pinfo = Find(addr);
@@ -17,6 +17,10 @@
 #include <map>
 #include <vector>
 
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/shared_ptr.hpp>
+
 #include <openssl/rand.h>
 
 
@@ -46,6 +50,7 @@ private:
     int nRandomPos;
 
     friend class CAddrMan;
+    friend class CAddrManSnapshot;
 
 public:
 
@@ -165,6 +170,77 @@ public:
 // the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+// seconds a read snapshot may lag behind additions to the tables
+#define ADDRMAN_SNAPSHOT_INTERVAL 10
+
+// number of queued addresses that forces a batch to be applied
+#define ADDRMAN_ADD_BATCH_SIZE 1000
+
+// seconds queued addresses may wait before a batch is applied
+#define ADDRMAN_ADD_BATCH_DELAY 5
+
+// maximum number of queued addresses, further ones are dropped until the next batch
+#define ADDRMAN_ADD_QUEUE_MAX 20000
+
+/** Connection times of a snapshot entry, kept current in place by Good, Attempt and Connected */
+struct CAddrManSnapshotTimes
+{
+    boost::atomic<int64_t> nLastTry;
+    boost::atomic<int64_t> nLastSuccess;
+    boost::atomic<unsigned int> nTime;
+    boost::atomic<int> nAttempts;
+};
+
+/** Copy of the address tables, used to serve Select and GetAddr without holding CAddrMan::cs.
+ *  The tables are immutable, only the connection times of the entries change. */
+class CAddrManSnapshot
+{
+public:
+    // all entries, each unique address once
+    std::vector<CAddrInfo> vInfo;
+
+    // current connection times of the entries in vInfo
+    boost::scoped_array<CAddrManSnapshotTimes> pTimes;
+
+    // nId to position in vInfo
+    std::map<int, int> mapIndex;
+
+    // non-empty "tried" buckets, as indexes into vInfo
+    std::vector<std::vector<int> > vvTried;
+
+    // non-empty "new" buckets, as indexes into vInfo
+    std::vector<std::vector<int> > vvNew;
+
+    int nTried;
+    int nNew;
+    int64_t nTimeCreated;
+
+    CAddrManSnapshot() : nTried(0), nNew(0), nTimeCreated(0) {}
+
+    // Entry at nIndex with its current connection times
+    CAddrInfo Get(int nIndex) const;
+
+    // Copy the connection times of info, false if the entry or its table changed since the snapshot was built
+    bool UpdateTimes(int nId, const CAddrInfo &info) const;
+
+    // Select an address to connect to, with the same weighting as CAddrMan::Select.
+    CAddress Select(int nUnkBias) const;
+
+    // Select several addresses at once.
+    void GetAddr(std::vector<CAddress> &vAddr) const;
+};
+
+/** Address queued by CAddrMan::QueueAdd, waiting to be added in a batch */
+struct CAddrManPending
+{
+    CAddress addr;
+    CNetAddr source;
+    int64_t nTimePenalty;
+
+    CAddrManPending(const CAddress &addrIn, const CNetAddr &sourceIn, int64_t nTimePenaltyIn) :
+        addr(addrIn), source(sourceIn), nTimePenalty(nTimePenaltyIn) {}
+};
+
 /** Stochastical (IP) address manager */
 class CAddrMan
 {
@@ -199,6 +275,27 @@ private:
     // list of "new" buckets
     std::vector<std::set<int> > vvNew;
 
+    // protects pSnapshot and the dirty flags; never held while taking cs
+    mutable CCriticalSection cs_snapshot;
+
+    // last published read snapshot
+    boost::shared_ptr<const CAddrManSnapshot> pSnapshot;
+
+    // tables changed since pSnapshot was built
+    bool fSnapshotDirty;
+
+    // tables changed in a way that Select must see at once (promotions, loading)
+    bool fSnapshotStale;
+
+    // protects vPending and nPendingSince; may be taken while holding cs
+    mutable CCriticalSection cs_pending;
+
+    // addresses queued by QueueAdd
+    std::vector<CAddrManPending> vPending;
+
+    // time the oldest entry in vPending was queued
+    int64_t nPendingSince;
+
 protected:
 
     // Find an entry.
@@ -232,17 +329,25 @@ protected:
     // Mark an entry as attempted to connect.
     void Attempt_(const CService &addr, int64_t nTime);
 
-    // Select an address to connect to.
-    // nUnkBias determines how much to favor new addresses over tried ones (min=0, max=100)
-    CAddress Select_(int nUnkBias);
-
 #ifdef DEBUG_ADDRMAN
     // Perform consistency check. Returns an error code or zero.
     int Check_();
 #endif
 
-    // Select several addresses at once.
-    void GetAddr_(std::vector<CAddress> &vAddr);
+    // Add all queued addresses to the "new" table. Returns the number of new entries.
+    int ApplyPending_();
+
+    // Build a new read snapshot of the tables and publish it.
+    void RefreshSnapshot_();
+
+    // Flag the snapshot as outdated; fStale makes the next reader rebuild it regardless of its age.
+    void MarkSnapshotDirty(bool fStale);
+
+    // Copy the connection times of addr into the current snapshot, or flag it stale if addr moved between tables.
+    void UpdateSnapshotEntry_(const CService &addr);
+
+    // Return the current read snapshot, rebuilding it if it is outdated and cs is free.
+    boost::shared_ptr<const CAddrManSnapshot> GetSnapshot();
 
     // Mark an entry as currently-connected-to.
     void Connected_(const CService &addr, int64_t nTime);
@@ -362,6 +467,7 @@ public:
                     }
                 }
                 am->nTried -= nLost;
+                am->MarkSnapshotDirty(true);
                 for (int b = 0; b < nUBuckets; b++)
                 {
                     std::set<int> &vNew = am->vvNew[b];
@@ -391,6 +497,9 @@ public:
          nIdCount = 0;
          nTried = 0;
          nNew = 0;
+         fSnapshotDirty = true;
+         fSnapshotStale = true;
+         nPendingSince = 0;
     }
 
     // Return the number of (unique) addresses in all tables.
@@ -422,6 +531,8 @@ public:
             fRet |= Add_(addr, source, nTimePenalty);
             Check();
         }
+        if (fRet)
+            MarkSnapshotDirty(false);
         if (fRet)
             LogPrintf("Added %s from %s: %i tried, %i new\n", addr.ToStringIPPort().c_str(), source.ToString().c_str(), nTried, nNew);
         return fRet;
@@ -438,11 +549,31 @@ public:
                 nAdd += Add_(*it, source, nTimePenalty) ? 1 : 0;
             Check();
         }
+        if (nAdd)
+            MarkSnapshotDirty(false);
         if (nAdd)
             LogPrintf("Added %i addresses from %s: %i tried, %i new\n", nAdd, source.ToString().c_str(), nTried, nNew);
         return nAdd > 0;
     }
 
+    // Queue addresses received from a peer; they are added in batches, so callers on the
+    // message handling path rarely contend for cs. Returns false if the queue was full.
+    bool QueueAdd(const std::vector<CAddress> &vAddr, const CNetAddr& source, int64_t nTimePenalty = 0);
+
+    // Add all queued addresses now.
+    void FlushPending()
+    {
+        int nAdd;
+        {
+            LOCK(cs);
+            Check();
+            nAdd = ApplyPending_();
+            Check();
+        }
+        if (nAdd)
+            LogPrint("addrman", "Added %i queued addresses: %i tried, %i new\n", nAdd, nTried, nNew);
+    }
+
     // Mark an entry as accessible.
     void Good(const CService &addr, int64_t nTime = GetAdjustedTime())
     {
@@ -451,6 +582,7 @@ public:
             Check();
             Good_(addr, nTime);
             Check();
+            UpdateSnapshotEntry_(addr);
         }
     }
 
@@ -462,33 +594,26 @@ public:
             Check();
             Attempt_(addr, nTime);
             Check();
+            UpdateSnapshotEntry_(addr);
         }
     }
 
     // Choose an address to connect to.
     // nUnkBias determines how much "new" entries are favored over "tried" ones (0-100).
+    // Served from the read snapshot, so it does not wait for writers.
     CAddress Select(int nUnkBias = 50)
     {
-        CAddress addrRet;
-        {
-            LOCK(cs);
-            Check();
-            addrRet = Select_(nUnkBias);
-            Check();
-        }
-        return addrRet;
+        boost::shared_ptr<const CAddrManSnapshot> snapshot = GetSnapshot();
+        return snapshot->Select(nUnkBias);
     }
 
     // Return a bunch of addresses, selected at random.
+    // Served from the read snapshot, so it does not wait for writers.
     std::vector<CAddress> GetAddr()
     {
-        Check();
         std::vector<CAddress> vAddr;
-        {
-            LOCK(cs);
-            GetAddr_(vAddr);
-        }
-        Check();
+        boost::shared_ptr<const CAddrManSnapshot> snapshot = GetSnapshot();
+        snapshot->GetAddr(vAddr);
         return vAddr;
     }
 
@@ -500,6 +625,7 @@ public:
             Check();
             Connected_(addr, nTime);
             Check();
+            UpdateSnapshotEntry_(addr);
         }
     }
 };
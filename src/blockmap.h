@@ -0,0 +1,82 @@
+// Copyright (c) 2017-2019 The ProCurrency developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKMAP_H
+#define BITCOIN_BLOCKMAP_H
+
+#include "uint256.h"
+
+#include <new>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+class CBlockIndex;
+class CBlockThinIndex;
+
+/** Bucket hash of a block hash for the block index maps.
+ *  Mixes two words of the block hash with a per process salt, so peers can't pick hashes that pile
+ *  up in one bucket.
+ */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const;
+};
+
+// node based, CBlockIndex::phashBlock points at the key and has to stay put when the table grows
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+typedef boost::unordered_map<uint256, CBlockThinIndex*, BlockHasher> BlockThinMap;
+
+/** Allocates block index entries in large chunks instead of one by one.
+ *
+ *  Entries are constructed in place in memory from Alloc() and given back with Delete(), which reuses
+ *  them for the next Alloc(). Clear() frees all chunks at once without running destructors, so T must
+ *  not own any memory of its own.
+ */
+template <typename T> class CIndexArena
+{
+private:
+    enum { CHUNK_ENTRIES = 4096 };
+
+    std::vector<T*> vChunks;
+    size_t nUsed;           // entries handed out from the last chunk
+    std::vector<T*> vFree;  // deleted entries, handed out first
+
+public:
+    CIndexArena() : nUsed(CHUNK_ENTRIES) {}
+    ~CIndexArena() { Clear(); }
+
+    // Room for one T, construct it with placement new
+    void* Alloc()
+    {
+        if (!vFree.empty())
+        {
+            T* p = vFree.back();
+            vFree.pop_back();
+            return p;
+        }
+        if (nUsed == CHUNK_ENTRIES)
+        {
+            vChunks.push_back(static_cast<T*>(::operator new(sizeof(T) * CHUNK_ENTRIES)));
+            nUsed = 0;
+        }
+        return vChunks.back() + nUsed++;
+    }
+
+    void Delete(T* p)
+    {
+        p->~T();
+        vFree.push_back(p);
+    }
+
+    void Clear()
+    {
+        for (size_t i = 0; i < vChunks.size(); i++)
+            ::operator delete(vChunks[i]);
+        vChunks.clear();
+        vFree.clear();
+        nUsed = CHUNK_ENTRIES;
+    }
+};
+
+#endif // BITCOIN_BLOCKMAP_H
@@ -8,6 +8,7 @@
 
 
 #include <vector>
+#include <stdint.h>
 
 #include "core.h"
 #include "serialize.h"
@@ -99,4 +100,38 @@ public:
     void UpdateEmptyFull();
 };
 
+/**
+ * RollingBloomFilter is a probabilistic "keep track of most recently inserted" set.
+ * Construct it with the number of items to keep track of, and a false-positive
+ * rate. Unlike CBloomFilter, by default nTweak is set to a cryptographically
+ * secure random value for you.
+ *
+ * It needs around 1.8 bytes per element per factor 0.1 of false positive rate.
+ * Entries are stored with a 2 bit generation counter, when a generation fills
+ * the oldest one is wiped so the filter never needs to be rebuilt.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+
+    void reset();
+
+    // Approximate memory used by the filter, for reporting
+    size_t DynamicMemoryUsage() const { return data.size() * sizeof(uint64_t); };
+
+private:
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    std::vector<uint64_t> data;
+    unsigned int nTweak;
+    int nHashFuncs;
+};
+
 #endif /* BITCOIN_BLOOM_H */
@@ -7,6 +7,7 @@
 #include <map>
 #include "net.h"
 #include "util.h"
+#include "blockmap.h"
 
 class uint256;
 class CBlockIndex;
@@ -25,8 +26,8 @@ namespace Checkpoints
     int GetTotalBlocksEstimate();
 
     // Returns last CBlockIndex* in mapBlockIndex that is a checkpoint
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex);
-    CBlockThinIndex* GetLastCheckpoint(const std::map<uint256, CBlockThinIndex*>& mapBlockThinIndex);
+    CBlockIndex* GetLastCheckpoint(const BlockMap& mapBlockIndex);
+    CBlockThinIndex* GetLastCheckpoint(const BlockThinMap& mapBlockThinIndex);
 
     extern MapCheckpoints mapCheckpoints;
     extern MapCheckpoints mapCheckpointsTestnet;
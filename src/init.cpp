@@ -142,24 +142,18 @@ void Shutdown()
     
     if (nNodeMode == NT_FULL)
     {
-        std::map<uint256, CBlockIndex*>::iterator it;
+        if (GetBoolArg("-indexsnapshot", true))
+            CTxDB().WriteBlockIndexSnapshot();
 
-        for (it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it)
-        {
-            delete it->second;
-        };
+        // entries go with their arena chunks
         mapBlockIndex.clear();
+        arenaBlockIndex.Clear();
         if (fDebug)
             LogPrintf("mapBlockIndex cleared.\n");
     } else
     {
-        std::map<uint256, CBlockThinIndex*>::iterator it;
-
-        for (it = mapBlockThinIndex.begin(); it != mapBlockThinIndex.end(); ++it)
-        {
-            delete it->second;
-        };
         mapBlockThinIndex.clear();
+        arenaBlockThinIndex.Clear();
         if (fDebug)
             LogPrintf("mapBlockThinIndex cleared.\n");
     };
@@ -177,6 +171,7 @@ void Shutdown()
 	globalVerifyHandle.reset();
     ECC_Stop();
 	LogPrintf("Shutdown completed.\n\n");
+    StopDebugLogThread();
 }
 
 /*void Shutdown()
@@ -299,6 +294,7 @@ std::string HelpMessage()
     strUsage += "  -debugchain            " + _("Output extra blockchain debugging information") + "\n";
     strUsage += "  -debugpos              " + _("Output extra Proof of Stake debugging information") + "\n";
     strUsage += "  -logtimestamps         " + _("Prepend debug output with timestamp") + "\n";
+    strUsage += "  -logasync              " + _("Write debug.log from a background thread (default: 1)") + "\n";
     strUsage += "  -shrinkdebugfile       " + _("Shrink debug.log file on client startup (default: 1 when no -debug)") + "\n";
     strUsage += "  -printtoconsole        " + _("Send trace/debug info to console instead of debug.log file") + "\n";
     strUsage += "  -printtodebuglog       " + _("Send trace/debug info to debug.log file") + "\n";
@@ -324,9 +320,14 @@ std::string HelpMessage()
     strUsage += "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n";
     strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n";
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
+    strUsage += "  -checkthreads=<n>      " + _("Number of threads verifying blocks at startup (default: number of cores)") + "\n";
+    strUsage += "  -checkbackground       " + _("Verify blocks at startup in the background while the node runs, at most at level 3 (default: 0)") + "\n";
+    strUsage += "  -indexsnapshot         " + _("Write the block index to blkindexsnap.dat on shutdown and load it from there on the next start (default: 1)") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
+    strUsage += "  -importthreads=<n>     " + _("Number of threads checking blocks during -loadblock or bootstrap.dat import (default: number of cores)") + "\n";
     strUsage += "  -maxorphanblocksmib=<n> " + strprintf(_("Keep at most <n> MiB of unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";	
     strUsage += "  -reindex               " + _("Rebuild block chain index from current blk000?.dat files on startup") + "\n";
+    strUsage += "  -paralleldownload      " + _("Download blocks from several peers at once during initial sync (default: 1)") + "\n";
 	/**** automatic backups ***/
 	strUsage += "  -createwalletbackups=<n> " + _("Number of automatic wallet backups (default: 10)") + "\n";
 
@@ -353,7 +354,8 @@ std::string HelpMessage()
     strUsage += "\n" + _("Secure messaging options:") + "\n";
     strUsage += "  -nosmsg                                  " + _("Disable secure messaging.") + "\n";
     strUsage += "  -debugsmsg                               " + _("Log extra debug messages.") + "\n";
-    strUsage += "  -smsgscanchain                           " + _("Scan the block chain for public key addresses on startup.") + "\n";
+    strUsage += "  -smsgscanchain                           " + _("Scan the block chain for public key addresses on startup, later starts resume from the last block scanned.") + "\n";
+    strUsage += "  -smsgpowthreads=<n>                      " + _("Number of threads searching for secure message proof of work (default: number of cores)") + "\n";
     
     return strUsage;
 }
@@ -630,6 +632,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (GetBoolArg("-shrinkdebugfile", !fDebug))
         ShrinkDebugFile();
 
+    if (GetBoolArg("-logasync", true))
+        StartDebugLogThread();
+
     LogPrintf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     LogPrintf("ProCurrency version %s (%s)\n", FormatFullVersion().c_str(), CLIENT_DATE.c_str());
     LogPrintf("Operating in %s mode.\n", GetNodeModeName(nNodeMode));
@@ -1012,7 +1017,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         std::string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -1117,6 +1122,10 @@ bool AppInit2(boost::thread_group& threadGroup)
             vImportFiles.push_back(strFile);
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+
+    // -checkblocks verification skipped by LoadBlockIndex()
+    if (nNodeMode == NT_FULL && GetBoolArg("-checkbackground", false))
+        threadGroup.create_thread(boost::bind(&ThreadVerifyBlockIndex));
     
     // ********************************************************* Step 10: load peers
 
@@ -463,7 +463,7 @@ static bool GetKernelStakeModifierThin(uint256 hashBlockFrom, uint64_t& nStakeMo
     int64_t nFoundTime;
     int64_t nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
     
-    std::map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.find(hashBlockFrom);
+    BlockThinMap::iterator mi = mapBlockThinIndex.find(hashBlockFrom);
     if (mi == mapBlockThinIndex.end())
     {
         if (fThinFullIndex
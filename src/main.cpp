@@ -37,8 +37,21 @@ CCriticalSection cs_main;
 
 CTxMemPool mempool;
 
-std::map<uint256, CBlockIndex*> mapBlockIndex;
-std::map<uint256, CBlockThinIndex*> mapBlockThinIndex;
+BlockMap mapBlockIndex;
+BlockThinMap mapBlockThinIndex;
+// storage of the entries in mapBlockIndex and mapBlockThinIndex
+CIndexArena<CBlockIndex> arenaBlockIndex;
+CIndexArena<CBlockThinIndex> arenaBlockThinIndex;
+
+size_t BlockHasher::operator()(const uint256& hash) const
+{
+    static const uint64_t k0 = GetRand(std::numeric_limits<uint64_t>::max());
+    static const uint64_t k1 = GetRand(std::numeric_limits<uint64_t>::max());
+
+    uint64_t h = (hash.Get64(0) ^ k0) * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ hash.Get64(1) ^ k1) * 0xC2B2AE3D27D4EB4FULL;
+    return (size_t)(h ^ (h >> 32));
+}
 
 std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 
@@ -153,6 +166,13 @@ struct CMainSignals {
 } g_signals;
 }*/
 
+CSpendSignals& GetSpendSignals()
+{
+    // function local, listeners may connect during static initialisation
+    static CSpendSignals spendSignals;
+    return spendSignals;
+}
+
 void RegisterWallet(CWallet* pwalletIn)
 //void RegisterWallet(CWalletInterface* pwalletIn)
 {
@@ -466,7 +486,7 @@ bool GetCoinAgeThin(CTransaction txCoinStake, uint64_t& nCoinAge, std::vector<co
 
         int64_t nBlockTime = 0;
 
-        std::map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.find(txPrev->hashBlock);
+        BlockThinMap::iterator mi = mapBlockThinIndex.find(txPrev->hashBlock);
         if (mi == mapBlockThinIndex.end())
         {
             if (fThinFullIndex
@@ -528,15 +548,41 @@ struct CNodeState {
     // Whether this peer should be disconnected and banned.
     bool fShouldBan;
     std::string name;
+    // Blocks requested from this peer by the parallel downloader.
+    std::set<uint256> setBlocksInFlight;
+    // Don't assign new block requests before this time (seconds), set after a stall.
+    int64_t nStallingUntil;
 
     CNodeState() {
         nMisbehavior = 0;
         fShouldBan = false;
+        nStallingUntil = 0;
     }
 };
 
 map<NodeId, CNodeState> mapNodeState;
 
+// Parallel block download for full nodes.
+// lBlocksToDownload holds block hashes learnt from getblocks inventories, in
+// chain order. It serves as the header skeleton: bodies for the first
+// BLOCK_DOWNLOAD_WINDOW entries are fetched from all suitable peers at once,
+// and entries are dropped from the front as they connect, so blocks still
+// connect in order (out-of-order arrivals wait in mapOrphanBlocks).
+struct CQueuedBlock {
+    uint256 hash;
+    NodeId nodeid;          // peer the block is in flight from, -1 when not requested
+    int64_t nTimeRequested; // seconds
+    int nRequests;
+    bool fReceived;
+
+    CQueuedBlock(const uint256& hashIn) : hash(hashIn), nodeid(-1), nTimeRequested(0), nRequests(0), fReceived(false) {}
+};
+
+list<CQueuedBlock> lBlocksToDownload;
+map<uint256, list<CQueuedBlock>::iterator> mapBlocksToDownload;
+uint256 hashLastSkeletonRequest = 0;
+int64_t nTimeLastSkeletonRequest = 0;
+
 // Requires cs_main.
 CNodeState *State(NodeId pnode) {
     map<NodeId, CNodeState>::iterator it = mapNodeState.find(pnode);
@@ -560,11 +606,171 @@ void InitializeNode(NodeId nodeid, const CNode *pnode) {
     state.name = pnode->addrName;
 }
 
+// Requires cs_main.
+void MarkBlockAsNotInFlight(CQueuedBlock& queued)
+{
+    if (queued.nodeid == -1)
+        return;
+    CNodeState *state = State(queued.nodeid);
+    if (state)
+        state->setBlocksInFlight.erase(queued.hash);
+    queued.nodeid = -1;
+}
+
 void FinalizeNode(NodeId nodeid) {
     LOCK(cs_main);
+    CNodeState *state = State(nodeid);
+    if (state)
+    {
+        BOOST_FOREACH(const uint256& hash, state->setBlocksInFlight)
+        {
+            map<uint256, list<CQueuedBlock>::iterator>::iterator mi = mapBlocksToDownload.find(hash);
+            if (mi != mapBlocksToDownload.end())
+                mi->second->nodeid = -1;
+        };
+    };
     mapNodeState.erase(nodeid);
 }
 
+// Requires cs_main.
+bool QueueBlockDownload(const uint256& hash)
+{
+    if (mapBlocksToDownload.count(hash))
+        return false;
+    list<CQueuedBlock>::iterator it = lBlocksToDownload.insert(lBlocksToDownload.end(), CQueuedBlock(hash));
+    mapBlocksToDownload[hash] = it;
+    return true;
+}
+
+// Requires cs_main.
+void RemoveQueuedBlock(list<CQueuedBlock>::iterator it)
+{
+    MarkBlockAsNotInFlight(*it);
+    mapBlocksToDownload.erase(it->hash);
+    lBlocksToDownload.erase(it);
+}
+
+// Requires cs_main. Drop connected blocks from the front of the queue.
+void PruneBlockDownloadQueue()
+{
+    while (!lBlocksToDownload.empty()
+        && mapBlockIndex.count(lBlocksToDownload.front().hash))
+        RemoveQueuedBlock(lBlocksToDownload.begin());
+}
+
+// Requires cs_main.
+void MarkBlockAsReceived(const uint256& hash)
+{
+    map<uint256, list<CQueuedBlock>::iterator>::iterator mi = mapBlocksToDownload.find(hash);
+    if (mi == mapBlocksToDownload.end())
+        return;
+
+    list<CQueuedBlock>::iterator it = mi->second;
+    if (!mapBlockIndex.count(hash) && !mapOrphanBlocks.count(hash))
+    {
+        // rejected, don't ask anyone else for it
+        RemoveQueuedBlock(it);
+        return;
+    };
+
+    MarkBlockAsNotInFlight(*it);
+    it->fReceived = true;
+    PruneBlockDownloadQueue();
+}
+
+// Requires cs_main.
+// Blocks ahead of the tip wait in the orphan pool until their parents connect, so only
+// request as many as three quarters of -maxorphanblocksmib can hold. Anything more is
+// pruned from the pool on arrival and fetched again.
+unsigned int GetBlockDownloadWindow()
+{
+    size_t nMaxOrphanBlocksSize = GetArg("-maxorphanblocksmib", DEFAULT_MAX_ORPHAN_BLOCKS) * ((size_t) 1 << 20);
+    size_t nBlockSize = BLOCK_DOWNLOAD_SIZE_GUESS;
+    if (!mapOrphanBlocks.empty())
+        nBlockSize = std::max(nOrphanBlocksSize / mapOrphanBlocks.size(), (size_t)1);
+
+    size_t nWindow = nMaxOrphanBlocksSize / 4 * 3 / nBlockSize;
+    return std::max(std::min(nWindow, (size_t)BLOCK_DOWNLOAD_WINDOW), (size_t)MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+}
+
+// Requires cs_main.
+// Release stalled requests from pto, then assign it up to MAX_BLOCKS_IN_TRANSIT_PER_PEER
+// blocks from the download window that are not yet in flight.
+void FindNextBlocksToDownload(CNode* pto, int64_t nNow, std::vector<CInv>& vGetBlocks)
+{
+    CNodeState *state = State(pto->GetId());
+    if (!state)
+        return;
+
+    std::vector<uint256> vStalled;
+    BOOST_FOREACH(const uint256& hash, state->setBlocksInFlight)
+    {
+        map<uint256, list<CQueuedBlock>::iterator>::iterator mi = mapBlocksToDownload.find(hash);
+        if (mi == mapBlocksToDownload.end())
+            vStalled.push_back(hash);
+        else
+        if (nNow - mi->second->nTimeRequested > BLOCK_STALLING_TIMEOUT)
+            vStalled.push_back(hash);
+    };
+
+    BOOST_FOREACH(const uint256& hash, vStalled)
+    {
+        state->setBlocksInFlight.erase(hash);
+
+        map<uint256, list<CQueuedBlock>::iterator>::iterator mi = mapBlocksToDownload.find(hash);
+        if (mi == mapBlocksToDownload.end())
+            continue;
+
+        list<CQueuedBlock>::iterator it = mi->second;
+        it->nodeid = -1;
+        if (fDebugNet)
+            LogPrintf("Block download stalled: %s from peer %d, request %d\n", hash.ToString().c_str(), pto->GetId(), it->nRequests);
+
+        state->nStallingUntil = nNow + BLOCK_STALLING_TIMEOUT * 2;
+        if (it->nRequests >= MAX_BLOCK_REQUESTS)
+        {
+            LogPrintf("Block download: giving up on %s after %d requests\n", hash.ToString().c_str(), it->nRequests);
+            RemoveQueuedBlock(it);
+
+            // Children already received wait on it as orphans and hold the front of the
+            // window, ask for the block they need directly so they can connect
+            multimap<uint256, COrphanBlock*>::iterator mo = mapOrphanBlocksByPrev.find(hash);
+            if (mo != mapOrphanBlocksByPrev.end())
+                pto->AskFor(CInv(MSG_BLOCK, WantedByOrphan(mo->second)));
+        };
+    };
+
+    if (state->nStallingUntil > nNow
+        || pto->nChainHeight <= nBestHeight)
+        return;
+
+    unsigned int nWindow = 0;
+    unsigned int nWindowSize = GetBlockDownloadWindow();
+    list<CQueuedBlock>::iterator it = lBlocksToDownload.begin();
+    for (; it != lBlocksToDownload.end() && nWindow < nWindowSize; ++it, ++nWindow)
+    {
+        if (state->setBlocksInFlight.size() >= MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+            break;
+
+        if (it->nodeid != -1)
+            continue;
+
+        if (it->fReceived)
+        {
+            // orphan was pruned before its parent arrived, fetch it again
+            if (mapBlockIndex.count(it->hash) || mapOrphanBlocks.count(it->hash))
+                continue;
+            it->fReceived = false;
+        };
+
+        it->nodeid = pto->GetId();
+        it->nTimeRequested = nNow;
+        it->nRequests++;
+        state->setBlocksInFlight.insert(it->hash);
+        vGetBlocks.push_back(CInv(MSG_BLOCK, it->hash));
+    };
+}
+
 }
 
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
@@ -937,7 +1143,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     vMerkleBranch = pblock->GetMerkleBranch(nIndex);
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
 
     if (mi == mapBlockIndex.end())
         return 0;
@@ -1106,8 +1312,8 @@ bool AcceptToMemoryPool(CTxMemPool &pool, CTransaction &tx, CTxDB &txdb, bool *p
     if (!tx.IsStandard())
         return error("AcceptToMemoryPool() : nonstandard transaction type");
 
-    // Do we already have it?
-    uint256 hash = tx.GetHash();
+    // Do we already have it? Hashed once here, the pool, relay and wallets take copies that keep it
+    uint256 hash = tx.UpdateHash();
 
     if (pool.exists(hash))
         return false;
@@ -1265,7 +1471,7 @@ int CTxIndex::GetDepthInMainChainFromIndex() const
         if (!block.ReadBlockThinFromDisk(pos.nFile, pos.nBlockPos))
             return 0;
 
-        map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.find(block.GetHash());
+        BlockThinMap::iterator mi = mapBlockThinIndex.find(block.GetHash());
         if (mi == mapBlockThinIndex.end())
             return 0;
         CBlockThinIndex* pindex = (*mi).second;
@@ -1279,7 +1485,7 @@ int CTxIndex::GetDepthInMainChainFromIndex() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1577,7 +1783,7 @@ bool CBlockThin::AcceptBlockThin()
         return error("AcceptBlockThin() : header already in mapBlockThinIndex");
 
     // Get prev block index
-    map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.find(hashPrevBlock);
+    BlockThinMap::iterator mi = mapBlockThinIndex.find(hashPrevBlock);
 
     if (mi == mapBlockThinIndex.end())
         return error("AcceptBlockThin() : prev header not found");
@@ -1628,12 +1834,12 @@ bool CBlockThin::AddToBlockThinIndex(unsigned int nFile, unsigned int nBlockPos,
         return error("AddToBlockThinIndex() : %s already exists", hash.ToString().substr(0,20).c_str());
 
     // Construct new block index object
-    CBlockThinIndex* pindexNew = new CBlockThinIndex(nFile, nBlockPos, *this);
+    CBlockThinIndex* pindexNew = new (arenaBlockThinIndex.Alloc()) CBlockThinIndex(nFile, nBlockPos, *this);
     if (!pindexNew)
         return error("AddToBlockThinIndex() : new CBlockThinIndex failed");
 
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockThinIndex*>::iterator miPrev = mapBlockThinIndex.find(hashPrevBlock);
+    BlockThinMap::iterator miPrev = mapBlockThinIndex.find(hashPrevBlock);
     if (miPrev != mapBlockThinIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -1655,7 +1861,7 @@ bool CBlockThin::AddToBlockThinIndex(unsigned int nFile, unsigned int nBlockPos,
     pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
     
     // Add to mapBlockThinIndex
-    std::map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockThinMap::iterator mi = mapBlockThinIndex.insert(make_pair(hash, pindexNew)).first;
     //if (pindexNew->IsProofOfStake())
     //    setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
@@ -1687,11 +1893,11 @@ bool CBlockThin::AddToBlockThinIndex(unsigned int nFile, unsigned int nBlockPos,
         pindexRear = pindexRear->pnext;
         pindexRear->pprev = NULL;
 
-        std::map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.find(*pRemHash);
+        BlockThinMap::iterator mi = mapBlockThinIndex.find(*pRemHash);
 
         if (mi != mapBlockThinIndex.end())
         {
-            delete mi->second;
+            arenaBlockThinIndex.Delete(mi->second);
             mapBlockThinIndex.erase(mi);
         };
     };
@@ -2801,6 +3007,16 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this, false, false);
 
+    if (!GetSpendSignals().TransactionInputs.empty())
+    {
+        BOOST_FOREACH(CTransaction& tx, vtx)
+            GetSpendSignals().TransactionInputs(tx, true, false);
+    };
+
+    // Keep the secure messaging key scan following the chain
+    if (fSecMsgEnabled)
+        SecureMsgDisconnectBlock(pindex);
+
     return true;
 }
 /* //TODO: BuildAddrIndex
@@ -3086,6 +3302,16 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this, true);
 
+    if (!GetSpendSignals().TransactionInputs.empty())
+    {
+        BOOST_FOREACH(CTransaction& tx, vtx)
+            GetSpendSignals().TransactionInputs(tx, true, true);
+    };
+
+    // Harvest public keys for secure messaging
+    if (fSecMsgEnabled)
+        SecureMsgScanBlock(*this, pindex);
+
     return true;
 }
 
@@ -3342,7 +3568,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
     AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -3380,7 +3606,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockThinIndex* &pindexRet) const
     AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
-    map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.find(hashBlock);
+    BlockThinMap::iterator mi = mapBlockThinIndex.find(hashBlock);
     if (mi == mapBlockThinIndex.end())
     {
         pindexRet = NULL;
@@ -3708,12 +3934,12 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         return error("AddToBlockIndex() : %s already exists", hash.ToString());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
+    CBlockIndex* pindexNew = new (arenaBlockIndex.Alloc()) CBlockIndex(nFile, nBlockPos, *this);
     if (!pindexNew)
         return error("AddToBlockIndex() : new CBlockIndex failed");
 
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -3739,7 +3965,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     pindexNew->bnStakeModifierV2 = ComputeStakeModifierV2(pindexNew->pprev, IsProofOfWork() ? hash : vtx[1].vin[0].prevout.hash);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
@@ -3776,7 +4002,13 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
 
 
 
-bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) const
+int64_t GetMaxBlockTime()
+{
+    AssertLockHeld(cs_main);
+    return FutureDrift(GetAdjustedTime(), nBestHeight + 1);
+}
+
+bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig, int64_t nMaxBlockTime) const
 {
     // These are checks that are independent of context
     // that can be verified before saving an orphan block.
@@ -3790,7 +4022,9 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
         return DoS(50, error("CheckBlock() : proof of work failed"));
 
     // Check timestamp
-    if (GetBlockTime() > FutureDrift(GetAdjustedTime(), nBestHeight + 1))
+    if (nMaxBlockTime == 0)
+        nMaxBlockTime = GetMaxBlockTime();
+    if (GetBlockTime() > nMaxBlockTime)
         return error("CheckBlock() : block timestamp too far in the future");
 
     // First transaction must be coinbase, the rest must not be
@@ -3829,6 +4063,9 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
             return DoS(50, error("CheckBlock() : block timestamp earlier than transaction timestamp"));
     }
 
+    // Hashes every transaction once, later checks and ConnectBlock() reuse them
+    uint256 hashMerkleBuilt = BuildMerkleTree();
+
     // Check for duplicate txids. This is caught by ConnectInputs(),
     // but catching it earlier avoids a potential DoS attack:
     set<uint256> uniqueTx;
@@ -3849,7 +4086,7 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
         return DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
 
     // Check merkle root
-    if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
+    if (fCheckMerkleRoot && hashMerkleRoot != hashMerkleBuilt)
         return DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
 
@@ -3871,7 +4108,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -4013,7 +4250,7 @@ uint256 CBlockThinIndex::GetBlockTrust() const
     return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
 }
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock, uint256& hash)
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, uint256& hash, bool fCheckedBlock)
 {
     AssertLockHeld(cs_main);
 
@@ -4045,8 +4282,8 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock, uint256& hash)
         }
     };
 
-    // Preliminary checks
-    if (!pblock->CheckBlock())
+    // Preliminary checks, the importer runs these ahead on its worker threads
+    if (!fCheckedBlock && !pblock->CheckBlock())
         return error("ProcessBlock() : CheckBlock FAILED");
 
     // If don't already have its previous block, shunt it off to holding area until we get it
@@ -4067,8 +4304,11 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock, uint256& hash)
             PruneOrphanBlocks();
             const COrphanBlock* orphan = AddOrphanBlock(pblock);
 
-            // Ask this guy to fill in what we're missing
-            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(hash));
+            // Ask this guy to fill in what we're missing, unless the parallel downloader
+            // already has the missing blocks queued. Stalled requests are retried from there.
+            uint256 hashRoot = GetOrphanRoot(hash);
+            if (!mapBlocksToDownload.count(hash) && !mapBlocksToDownload.count(hashRoot))
+                pfrom->PushGetBlocks(pindexBest, hashRoot);
             // ppcoin: getblocks may not obtain the ancestor block rejected
             // earlier by duplicate-stake check so we ask for it again directly
             if (!IsInitialBlockDownload())
@@ -4316,7 +4556,7 @@ bool CBlock::GetHashProof(uint256& hashProof)
     };
     
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("GetHashProof() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -4473,7 +4713,7 @@ void PrintBlockTree()
     AssertLockHeld(cs_main);
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -4543,6 +4783,321 @@ void PrintBlockTree()
     };
 }
 
+// Pipelined block import:
+//  - a reader thread scans the file for blocks with large sequential reads,
+//  - worker threads deserialise the blocks and run the context free CheckBlock,
+//  - the caller connects the checked blocks in file order.
+// Blocks found before their parent are remembered by file position only and
+// read again once the parent has connected, instead of being held in memory.
+
+static const unsigned int IMPORT_READ_BUFFER_SIZE = 16 * 1024 * 1024;
+static const int64_t IMPORT_MAX_BLOCKS_IN_FLIGHT = 2048;
+static const int64_t IMPORT_REPORT_INTERVAL = 10; // seconds
+
+struct CImportBlock
+{
+    int64_t nSeq;
+    unsigned int nPos; // file offset of the serialised block, after its size
+    std::vector<char> vchData;
+    CBlock block;
+    uint256 hash;
+    int64_t nMaxBlockTime; // GetMaxBlockTime() when the block was queued
+    bool fOk;
+};
+
+class CBlockImportPipeline
+{
+public:
+    CBlockImportPipeline(FILE* fileIn) : file(fileIn)
+    {
+        nSeqRead = 0;
+        nSeqNext = 0;
+        nBytesRead = 0;
+        fReadDone = false;
+        fStop = false;
+    };
+
+    ~CBlockImportPipeline()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            fStop = true;
+        }
+        condRead.notify_all();
+        condCheck.notify_all();
+        threads.interrupt_all();
+        threads.join_all();
+
+        BOOST_FOREACH(CImportBlock* p, qUnchecked)
+            delete p;
+        for (std::map<int64_t, CImportBlock*>::iterator it = mapChecked.begin(); it != mapChecked.end(); ++it)
+            delete it->second;
+    };
+
+    void Start(int nWorkers)
+    {
+        threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadRead, this));
+        for (int i = 0; i < nWorkers; ++i)
+            threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadCheck, this));
+    };
+
+    // Wait for the next block in file order, false when the file is exhausted.
+    bool Next(CImportBlock*& pblockRet)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        for (;;)
+        {
+            std::map<int64_t, CImportBlock*>::iterator it = mapChecked.find(nSeqNext);
+            if (it != mapChecked.end())
+            {
+                pblockRet = it->second;
+                mapChecked.erase(it);
+                nSeqNext++;
+                condRead.notify_one();
+                return true;
+            };
+            if (fReadDone && nSeqNext == nSeqRead)
+                return false;
+            condNext.wait(lock);
+        };
+    };
+
+    bool ReadBlockAt(unsigned int nPos, CBlock& block)
+    {
+        std::vector<char> vchData;
+        {
+            boost::unique_lock<boost::mutex> lock(csFile);
+            unsigned int nSize;
+            if (nPos < sizeof(nSize)
+                || fseek(file, nPos - sizeof(nSize), SEEK_SET) != 0
+                || fread(&nSize, sizeof(nSize), 1, file) != 1
+                || nSize == 0 || nSize > MAX_BLOCK_SIZE)
+                return false;
+            vchData.resize(nSize);
+            if (fread(&vchData[0], 1, nSize, file) != nSize)
+                return false;
+        }
+
+        try {
+            CDataStream ss(vchData, SER_DISK, CLIENT_VERSION);
+            ss >> block;
+        } catch (std::exception &e)
+        {
+            return false;
+        };
+        return true;
+    };
+
+    uint64_t GetBytesRead()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        return nBytesRead;
+    };
+
+private:
+    FILE* file;
+    boost::mutex csFile;
+    boost::thread_group threads;
+
+    boost::mutex cs;
+    boost::condition_variable condRead;  // reader waits for room in the pipeline
+    boost::condition_variable condCheck; // workers wait for unchecked blocks
+    boost::condition_variable condNext;  // consumer waits for the next checked block
+    std::deque<CImportBlock*> qUnchecked;
+    std::map<int64_t, CImportBlock*> mapChecked;
+    int64_t nSeqRead;
+    int64_t nSeqNext;
+    uint64_t nBytesRead;
+    bool fReadDone;
+    bool fStop;
+
+    void ThreadRead()
+    {
+        RenameThread("procurrency-importread");
+
+        try {
+            ReadBlocks();
+        } catch (boost::thread_interrupted)
+        {
+        } catch (std::exception& e)
+        {
+            PrintException(&e, "ThreadImportRead()");
+        };
+
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            fReadDone = true;
+        }
+        condCheck.notify_all();
+        condNext.notify_all();
+    };
+
+    void ReadBlocks()
+    {
+        std::vector<char> vBuf(IMPORT_READ_BUFFER_SIZE);
+        size_t nBegin = 0, nEnd = 0; // unconsumed data is vBuf[nBegin, nEnd)
+        uint64_t nBufPos = 0;        // file offset of vBuf[0]
+        bool fEOF = false;
+
+        for (;;)
+        {
+            // make sure a message start and size are buffered
+            if (nEnd - nBegin < MESSAGE_START_SIZE + sizeof(unsigned int)
+                && !Fill(vBuf, nBegin, nEnd, nBufPos, fEOF, MESSAGE_START_SIZE + sizeof(unsigned int)))
+                break;
+
+            char* pBegin = &vBuf[nBegin];
+            void* pFind = NULL;
+            size_t nScan = nEnd - nBegin - MESSAGE_START_SIZE + 1;
+            while (nScan > 0
+                && (pFind = memchr(pBegin, Params().MessageStart()[0], nScan)) != NULL)
+            {
+                if (memcmp(pFind, Params().MessageStart(), MESSAGE_START_SIZE) == 0)
+                    break;
+                size_t nSkip = ((char*)pFind - pBegin) + 1;
+                pBegin += nSkip;
+                nScan -= nSkip;
+                pFind = NULL;
+            };
+
+            if (!pFind)
+            {
+                // keep a possible partial message start for the next read
+                nBegin = nEnd - (MESSAGE_START_SIZE - 1);
+                if (fEOF)
+                    break;
+                if (!Fill(vBuf, nBegin, nEnd, nBufPos, fEOF, MESSAGE_START_SIZE + sizeof(unsigned int)))
+                    break;
+                continue;
+            };
+
+            nBegin = ((char*)pFind - &vBuf[0]) + MESSAGE_START_SIZE;
+            if (nEnd - nBegin < sizeof(unsigned int)
+                && !Fill(vBuf, nBegin, nEnd, nBufPos, fEOF, sizeof(unsigned int)))
+                break;
+
+            unsigned int nSize;
+            memcpy(&nSize, &vBuf[nBegin], sizeof(nSize));
+            if (nSize == 0 || nSize > MAX_BLOCK_SIZE)
+                continue; // not a block, resume scanning after the message start
+
+            nBegin += sizeof(nSize);
+            if (nEnd - nBegin < nSize
+                && !Fill(vBuf, nBegin, nEnd, nBufPos, fEOF, nSize))
+                break;
+
+            CImportBlock* pblock = new CImportBlock();
+            pblock->nPos = nBufPos + nBegin;
+            pblock->vchData.assign(&vBuf[nBegin], &vBuf[nBegin] + nSize);
+            pblock->fOk = false;
+            nBegin += nSize;
+            {
+                // the workers check without cs_main, the importer moves nBestHeight meanwhile
+                LOCK(cs_main);
+                pblock->nMaxBlockTime = GetMaxBlockTime();
+            }
+
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (!fStop && nSeqRead - nSeqNext >= IMPORT_MAX_BLOCKS_IN_FLIGHT)
+                    condRead.wait(lock);
+                if (fStop)
+                {
+                    delete pblock;
+                    return;
+                };
+                pblock->nSeq = nSeqRead++;
+                nBytesRead += nSize + MESSAGE_START_SIZE + sizeof(nSize);
+                qUnchecked.push_back(pblock);
+            }
+            condCheck.notify_one();
+        };
+    };
+
+    // Compact the buffer and read until at least nNeed bytes are available after nBegin.
+    bool Fill(std::vector<char>& vBuf, size_t& nBegin, size_t& nEnd, uint64_t& nBufPos, bool& fEOF, size_t nNeed)
+    {
+        boost::this_thread::interruption_point();
+
+        if (nBegin > 0)
+        {
+            memmove(&vBuf[0], &vBuf[nBegin], nEnd - nBegin);
+            nBufPos += nBegin;
+            nEnd -= nBegin;
+            nBegin = 0;
+        };
+
+        if (vBuf.size() < nNeed)
+            vBuf.resize(nNeed);
+
+        while (nEnd < nNeed && !fEOF)
+        {
+            boost::unique_lock<boost::mutex> lock(csFile);
+            // ReadBlockAt may have moved the file position
+            if (fseek(file, nBufPos + nEnd, SEEK_SET) != 0)
+                return false;
+            size_t nRead = fread(&vBuf[nEnd], 1, vBuf.size() - nEnd, file);
+            if (nRead == 0)
+                fEOF = true;
+            nEnd += nRead;
+        };
+
+        return nEnd >= nNeed;
+    };
+
+    void ThreadCheck()
+    {
+        RenameThread("procurrency-importcheck");
+
+        for (;;)
+        {
+            CImportBlock* pblock;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (!fStop && qUnchecked.empty() && !fReadDone)
+                    condCheck.wait(lock);
+                if (fStop || qUnchecked.empty())
+                    return;
+                pblock = qUnchecked.front();
+                qUnchecked.pop_front();
+            }
+
+            try {
+                CDataStream ss(pblock->vchData, SER_DISK, CLIENT_VERSION);
+                ss >> pblock->block;
+                pblock->hash = pblock->block.GetHash();
+                pblock->fOk = pblock->block.CheckBlock(true, true, true, pblock->nMaxBlockTime);
+                if (!pblock->fOk)
+                    LogPrintf("LoadExternalBlockFile() : CheckBlock failed %s\n", pblock->hash.ToString().c_str());
+            } catch (std::exception &e)
+            {
+                LogPrintf("LoadExternalBlockFile() : Deserialize error at %u\n", pblock->nPos);
+            };
+            std::vector<char>().swap(pblock->vchData);
+
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                mapChecked[pblock->nSeq] = pblock;
+            }
+            condNext.notify_one();
+        };
+    };
+};
+
+static bool ImportBlock(int nFile, CBlock& block, uint256& hash, unsigned int nBlockPos, bool fChecked)
+{
+    LOCK(cs_main);
+    if (!ProcessBlock(NULL, &block, hash, fChecked))
+        return false;
+
+    uint256 hashProof;
+    if (fReindexing
+        && (!block.GetHashProof(hashProof)
+          ||!block.AddToBlockIndex(nFile, nBlockPos, hashProof)))
+        LogPrintf("LoadExternalBlockFile() : AddToBlockIndex failed %s\n", hash.ToString().c_str());
+    return true;
+}
+
 bool LoadExternalBlockFile(int nFile, FILE* fileIn)
 {
     if (nNodeMode != NT_FULL)
@@ -4554,66 +5109,84 @@ bool LoadExternalBlockFile(int nFile, FILE* fileIn)
     int64_t nStart = GetTimeMillis();
 
     int nLoaded = 0;
+    // Blocks whose parent was not known yet when they were read, by parent hash
+    std::multimap<uint256, unsigned int> mapBlocksUnknownParent;
 
     {
+        int nWorkers = GetArg("-importthreads", boost::thread::hardware_concurrency());
+        nWorkers = std::max(1, std::min(nWorkers, 16));
+
         try {
-            CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
-            unsigned int nPos = 0;
-            while (nPos != (unsigned int)-1 && blkdat.good())
+            CBlockImportPipeline pipeline(fileIn);
+            pipeline.Start(nWorkers);
+
+            int64_t nLastReport = nStart;
+            int nLastLoaded = 0;
+            uint64_t nLastBytes = 0;
+
+            CImportBlock* pitem;
+            while (pipeline.Next(pitem))
             {
                 boost::this_thread::interruption_point();
-                unsigned char pchData[65536];
-                for (;;)
+                std::auto_ptr<CImportBlock> item(pitem);
+
+                if (!item->fOk
+                    || item->hash == Params().HashGenesisBlock())
+                    continue;
+
+                bool fHavePrev;
                 {
-                    boost::this_thread::interruption_point();
-                    fseek(blkdat, nPos, SEEK_SET);
-                    int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-                    if (nRead <= 8)
-                    {
-                        nPos = (unsigned int)-1;
-                        break;
-                    };
+                    LOCK(cs_main);
+                    fHavePrev = mapBlockIndex.count(item->block.hashPrevBlock);
+                }
+                if (!fHavePrev)
+                {
+                    mapBlocksUnknownParent.insert(std::make_pair(item->block.hashPrevBlock, item->nPos));
+                    continue;
+                };
+
+                if (!ImportBlock(nFile, item->block, item->hash, item->nPos, true))
+                    continue;
+                nLoaded++;
 
-                    void* nFind = memchr(pchData, Params().MessageStart()[0], nRead+1-MESSAGE_START_SIZE);
-                    if (nFind)
+                // Connect any blocks that were waiting for this one, reading them back from the file
+                std::deque<uint256> queue;
+                queue.push_back(item->hash);
+                while (!queue.empty() && !mapBlocksUnknownParent.empty())
+                {
+                    uint256 head = queue.front();
+                    queue.pop_front();
+
+                    std::pair<std::multimap<uint256, unsigned int>::iterator, std::multimap<uint256, unsigned int>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+                    for (std::multimap<uint256, unsigned int>::iterator it = range.first; it != range.second; ++it)
                     {
-                        if (memcmp(nFind, Params().MessageStart(), MESSAGE_START_SIZE)==0)
+                        CBlock block;
+                        if (!pipeline.ReadBlockAt(it->second, block))
                         {
-                            nPos += ((unsigned char*)nFind - pchData) + MESSAGE_START_SIZE;
-                            break;
+                            LogPrintf("LoadExternalBlockFile() : Could not re-read block at %u\n", it->second);
+                            continue;
+                        };
+                        uint256 hash = block.GetHash();
+                        if (ImportBlock(nFile, block, hash, it->second, false))
+                        {
+                            nLoaded++;
+                            queue.push_back(hash);
                         };
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
-                    } else
-                    {
-                        nPos += sizeof(pchData) - MESSAGE_START_SIZE + 1;
                     };
+                    mapBlocksUnknownParent.erase(range.first, range.second);
                 };
 
-                if (nPos == (unsigned int)-1)
-                    break;
-
-                fseek(blkdat, nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+                int64_t nNow = GetTimeMillis();
+                if (nNow - nLastReport >= IMPORT_REPORT_INTERVAL * 1000)
                 {
-                    CBlock block;
-                    blkdat >> block;
-                    uint256 hashblock = block.GetHash();
-                    LOCK(cs_main);
-                    if (ProcessBlock(NULL, &block, hashblock))
-                    {
-                        uint256 hashProof;
-                        if (fReindexing
-                            && (!block.GetHashProof(hashProof)
-                              ||!block.AddToBlockIndex(nFile, nPos+sizeof(nSize), hashProof))) // blockPos is after nSize
-                            LogPrintf("LoadExternalBlockFile() : AddToBlockIndex failed %s\n", hashblock.ToString().c_str());
-                        nLoaded++;
-                        nPos += 4 + nSize;
-                        
-                        if (nLoaded % 20000 == 0)
-                            LogPrintf("Loaded %d blocks and counting.\n", nLoaded);
-                    };
+                    uint64_t nBytes = pipeline.GetBytesRead();
+                    double dSeconds = (nNow - nLastReport) / 1000.0;
+                    LogPrintf("Loaded %d blocks and counting, %.1f blocks/s, %.2f MB/s, %u waiting for parent.\n",
+                        nLoaded, (nLoaded - nLastLoaded) / dSeconds, (nBytes - nLastBytes) / dSeconds / (1024 * 1024),
+                        mapBlocksUnknownParent.size());
+                    nLastReport = nNow;
+                    nLastLoaded = nLoaded;
+                    nLastBytes = nBytes;
                 };
             };
         } catch (std::exception &e)
@@ -4622,7 +5195,12 @@ bool LoadExternalBlockFile(int nFile, FILE* fileIn)
                    __PRETTY_FUNCTION__);
         };
     }
-    LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+
+    if (!mapBlocksUnknownParent.empty())
+        LogPrintf("LoadExternalBlockFile() : %u blocks without a known parent were skipped\n", mapBlocksUnknownParent.size());
+
+    int64_t nElapsed = std::max((int64_t)1, GetTimeMillis() - nStart);
+    LogPrintf("Loaded %i blocks from external file in %dms (%.1f blocks/s)\n", nLoaded, nElapsed, nLoaded * 1000.0 / nElapsed);
     return nLoaded > 0;
 }
 
@@ -4823,7 +5401,7 @@ static void ProcessGetData(CNode* pfrom)
             bool send = false;
             CBlockIndex *pBlockIndex;
             
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+            BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
             
             if (mi != mapBlockIndex.end())
             {
@@ -4906,7 +5484,7 @@ static void ProcessGetData(CNode* pfrom)
 
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
                             {
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(pair.second))
                                 {
                                     nBlockBytes += ::GetSerializeSize(block.vtx[pair.first], SER_NETWORK, PROTOCOL_VERSION);
                                     mbElem.vtx.push_back(block.vtx[pair.first]);
@@ -4937,7 +5515,7 @@ static void ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
                             {
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(pair.second))
                                 {
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                                 };
@@ -5053,7 +5631,7 @@ static int ProcessMerkleBlock(CNode* pfrom, CMerkleBlockIncoming& merkleBlock, s
     bool fAlloc = false;
 
     CBlockThinIndex *pBlockThinIndex = NULL;
-    std::map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.find(hashBlock);
+    BlockThinMap::iterator mi = mapBlockThinIndex.find(hashBlock);
 
     if (mi != mapBlockThinIndex.end())
     {
@@ -5572,7 +6150,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (fReachable)
                 vAddrOk.push_back(addr);
         }
-        addrman.Add(vAddrOk, pfrom->addr, 2 * 60 * 60);
+        addrman.QueueAdd(vAddrOk, pfrom->addr, 2 * 60 * 60);
         if (vAddr.size() < 1000)
             pfrom->fGetAddr = false;
         if (pfrom->fOneShot)
@@ -5602,6 +6180,19 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         if (nNodeMode == NT_FULL)
         {
+            // During initial download, block hashes from getblocks batches are queued
+            // and fetched in parallel from all peers by SendMessages.
+            bool fParallelDownload = !fImporting && !fReindexing
+                && IsInitialBlockDownload()
+                && GetBoolArg("-paralleldownload", true);
+            unsigned int nBlockInvs = 0;
+            if (fParallelDownload)
+            {
+                BOOST_FOREACH(const CInv& inv, vInv)
+                    if (inv.type == MSG_BLOCK)
+                        nBlockInvs++;
+            };
+
             CTxDB txdb("r");
             for (uint32_t nInv = 0; nInv < vInv.size(); nInv++)
             {
@@ -5616,6 +6207,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 bool fAlreadyHave = AlreadyHave(txdb, inv);
                 LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
 
+                if (!fAlreadyHave
+                    && fParallelDownload
+                    && inv.type == MSG_BLOCK
+                    && (nBlockInvs > 1 || !lBlocksToDownload.empty()))
+                {
+                    // A lone announcement while the queue is active is the peer's tip,
+                    // it will be reached through the queue.
+                    if (nBlockInvs > 1)
+                        QueueBlockDownload(inv.hash);
+                } else
                 if (!fAlreadyHave) {
                     if (!fImporting)
                         pfrom->AskFor(inv);
@@ -5771,7 +6372,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -5971,12 +6572,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
                 if (ProcessBlock(pfrom, &block, hashBlock))
                     mapAlreadyAskedFor.erase(inv);
+                MarkBlockAsReceived(hashBlock);
 
                 if (block.nDoS)
                     pfrom->Misbehaving(block.nDoS);
-
-                if (fSecMsgEnabled)
-                    SecureMsgScanBlock(block);
             };
         } // cs_main
     }
@@ -6035,9 +6634,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         if (ProcessBlock(pfrom, &block, hashBlock))
             mapAlreadyAskedFor.erase(inv);
+        MarkBlockAsReceived(hashBlock);
         if (block.nDoS) pfrom->Misbehaving(block.nDoS);
-        if (fSecMsgEnabled)
-            SecureMsgScanBlock(block);
     } else
     if (strCommand == "merkleblock")
     {
@@ -6480,6 +7078,7 @@ bool ProcessMessages(CNode* pfrom)
 
         // Process message
         bool fRet = false;
+        int64_t nTimeStart = GetTimeMicros();
         try
         {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
@@ -6511,6 +7110,8 @@ bool ProcessMessages(CNode* pfrom)
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        pfrom->RecordMessageStats(strCommand, nMessageSize, GetTimeMicros() - nTimeStart);
+
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand, nMessageSize);
 
@@ -6648,57 +7249,67 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 		//
 		// Message: inventory
 		//
+		// Blocks are announced as soon as they are queued, tx invs are batched
+		// and flushed on a per-peer Poisson timer so announcement timing leaks
+		// less about origin. Inbound peers share one timer, which makes it
+		// pointless for an attacker to connect many times to observe us.
+		// A peer whose send queue is already full gets no tx invs this round,
+		// they wait in its capped queue until it drains.
 		std::vector<CInv> vInv;
-		std::vector<CInv> vInvWait;
-
 		{
-			LOCK2(pwalletMain->cs_wallet, pto->cs_inventory);
-			vInv.reserve(pto->vInventoryToSend.size());
-			vInvWait.reserve(pto->vInventoryToSend.size());
-			BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
-			{
-				if (pto->setInventoryKnown.count(inv))
-					continue;
+			LOCK(pto->cs_inventory);
 
-				// trickle out tx inv to protect privacy
-				if (inv.type == MSG_TX && !fSendTrickle)
+			int64_t nNowMicros = GetTimeMicros();
+			bool fSendTxTrickle = false;
+			if (pto->nNextInvSend < nNowMicros)
+			{
+				fSendTxTrickle = true;
+				if (pto->fInbound)
 				{
-					// 1/4 of tx invs blast to all immediately
-					static uint256 hashSalt;
-					if (hashSalt == 0)
-						hashSalt = GetRandHash();
-					uint256 hashRand = inv.hash ^ hashSalt;
-					hashRand = Hash(BEGIN(hashRand), END(hashRand));
-					bool fTrickleWait = ((hashRand & 3) != 0);
-
-					// always trickle our own transactions
-					if (!fTrickleWait)
-					{
-						CWalletTx wtx;
-						if (GetTransaction(inv.hash, wtx))
-							if (wtx.fFromMe)
-								fTrickleWait = true;
-					};
+					static int64_t nNextInboundInvSend = 0;
+					if (nNextInboundInvSend < nNowMicros)
+						nNextInboundInvSend = PoissonNextSend(nNowMicros, INVENTORY_BROADCAST_INTERVAL);
+					pto->nNextInvSend = nNextInboundInvSend;
+				} else
+				{
+					pto->nNextInvSend = PoissonNextSend(nNowMicros, INVENTORY_BROADCAST_INTERVAL >> 1);
+				};
+			};
 
-					if (fTrickleWait)
-					{
-						vInvWait.push_back(inv);
-						continue;
-					};
+			if (pto->nSendSize >= SendBufferSize())
+				fSendTxTrickle = false;
+
+			std::deque<CInv> vInvWait;
+			vInv.reserve(std::min(pto->vInventoryToSend.size(), (size_t)MAX_INV_SZ));
+			unsigned int nTxSent = 0;
+			BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
+			{
+				bool fKnown = pto->filterInventoryKnown.contains(inv.hash);
+				if (!fKnown
+					&& inv.type == MSG_TX
+					&& (!fSendTxTrickle || nTxSent >= INVENTORY_BROADCAST_MAX))
+				{
+					vInvWait.push_back(inv);
+					continue;
 				};
 
-				// returns true if wasn't already contained in the set
-				if (pto->setInventoryKnown.insert(inv).second)
+				pto->setInventoryToSend.erase(inv.hash);
+				if (inv.type == MSG_TX)
+					pto->nInventoryTxToSend--;
+				if (fKnown)
+					continue;
+
+				pto->filterInventoryKnown.insert(inv.hash);
+				if (inv.type == MSG_TX)
+					nTxSent++;
+				vInv.push_back(inv);
+				if (vInv.size() >= 1000)
 				{
-					vInv.push_back(inv);
-					if (vInv.size() >= 1000)
-					{
-						pto->PushMessage("inv", vInv);
-						vInv.clear();
-					}
-				}
-			}
-			pto->vInventoryToSend = vInvWait;
+					pto->PushMessage("inv", vInv);
+					vInv.clear();
+				};
+			};
+			pto->vInventoryToSend.swap(vInvWait);
 		}
 		if (!vInv.empty())
 			pto->PushMessage("inv", vInv);
@@ -6832,7 +7443,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 						if (fDebugNet)
 							LogPrintf("Timeout: Re-requesting chunk, starting from %s\n", it->startHash.ToString().c_str());
 
-						std::map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.find(it->startHash);
+						BlockThinMap::iterator mi = mapBlockThinIndex.find(it->startHash);
 
 						if (mi != mapBlockThinIndex.end())
 						{
@@ -6909,6 +7520,39 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 		if (!vGetData.empty())
 			pto->PushMessage("getdata", vGetData);
 
+		//
+		// Parallel block download
+		//
+		if (nNodeMode == NT_FULL
+			&& !lBlocksToDownload.empty()
+			&& pto->nTypeInd == NT_FULL
+			&& !pto->fClient
+			&& !pto->fDisconnect)
+		{
+			PruneBlockDownloadQueue();
+
+			std::vector<CInv> vGetBlocks;
+			FindNextBlocksToDownload(pto, nTimeNow, vGetBlocks);
+			if (!vGetBlocks.empty())
+			{
+				if (fDebugNet)
+					LogPrintf("Requesting %u blocks from peer %d, %u queued\n", vGetBlocks.size(), pto->GetId(), lBlocksToDownload.size());
+				pto->PushMessage("getdata", vGetBlocks);
+			};
+
+			// Extend the queue from its last hash, once per batch received or after a timeout
+			if (!lBlocksToDownload.empty()
+				&& lBlocksToDownload.size() < BLOCK_DOWNLOAD_QUEUE_TARGET
+				&& pto->nChainHeight > nBestHeight + (int)lBlocksToDownload.size()
+				&& (lBlocksToDownload.back().hash != hashLastSkeletonRequest
+					|| nTimeNow - nTimeLastSkeletonRequest > BLOCK_STALLING_TIMEOUT))
+			{
+				hashLastSkeletonRequest = lBlocksToDownload.back().hash;
+				nTimeLastSkeletonRequest = nTimeNow;
+				pto->PushGetBlocks(hashLastSkeletonRequest, uint256(0));
+			};
+		};
+
 		// - If syncing and !get mblk in MBLK_RECEIVE_TIMEOUT send another getblocks to random peer
 		if (nNodeMode == NT_FULL
 			&& nTimeLastMblkRecv > 0
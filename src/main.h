@@ -6,6 +6,7 @@
 #define BITCOIN_MAIN_H
 
 #include "core.h"
+#include "blockmap.h"
 #include "bignum.h"
 #include "sync.h"
 #include "txmempool.h"
@@ -47,6 +48,20 @@ static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 50;
 static const unsigned int MAX_GETHEADERS_SZ = 2000;
 
+/** Number of blocks that can be requested at any given time from a single peer during parallel download. */
+static const unsigned int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Size of the block download window: how far ahead of the connected tip blocks are requested.
+ *  Shrunk at runtime to what -maxorphanblocksmib can hold, see GetBlockDownloadWindow(). */
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Assumed size of a block ahead of the tip until orphans give a better average. */
+static const unsigned int BLOCK_DOWNLOAD_SIZE_GUESS = 64 * 1024;
+/** Keep requesting block hashes (getblocks) while fewer than this many are queued for download. */
+static const unsigned int BLOCK_DOWNLOAD_QUEUE_TARGET = BLOCK_DOWNLOAD_WINDOW * 4;
+/** Seconds after which an unanswered block request is considered stalled and moved to another peer. */
+static const int64_t BLOCK_STALLING_TIMEOUT = 30;
+/** Number of times a block is requested before it is dropped from the download queue. */
+static const int MAX_BLOCK_REQUESTS = 4;
+
 static const unsigned int MAX_MULTI_BLOCK_SIZE = 5120000;    // 5MiB, most likely to hit MAX_MULTI_BLOCK_ELEMNTS first
 static const unsigned int MAX_MULTI_BLOCK_ELEMENTS = 64;     // processing larger blocks is cpu intensive
 static const unsigned int MAX_MULTI_BLOCK_THIN_ELEMENTS = 128;
@@ -81,8 +96,10 @@ inline unsigned int GetTargetSpacingVFork2(int nHeight) { return Params().IsProt
 
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
-extern std::map<uint256, CBlockThinIndex*> mapBlockThinIndex;
+extern BlockMap mapBlockIndex;
+extern BlockThinMap mapBlockThinIndex;
+extern CIndexArena<CBlockIndex> arenaBlockIndex;
+extern CIndexArena<CBlockThinIndex> arenaBlockThinIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeenOrphan;
 extern CBlockIndex* pindexGenesisBlock;
@@ -146,12 +163,23 @@ void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL, bool f
 /** Ask wallets to resend their transactions */
 void ResendWalletTransactions(bool fForce = false);
 
+/** Signals for transaction inputs being spent or released again */
+struct CSpendSignals
+{
+    // fBlock: tx is in a block being connected or disconnected, otherwise it is entering or leaving the memory pool
+    boost::signals2::signal<void (const CTransaction& tx, bool fBlock, bool fSpent)> TransactionInputs;
+};
+
+CSpendSignals& GetSpendSignals();
+
 /** Register with a network node to receive its signals */
 void RegisterNodeSignals(CNodeSignals& nodeSignals);
 /** Unregister a network node */
 void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock, uint256& hash);
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, uint256& hash, bool fCheckedBlock = false);
+/** Latest block time accepted for the next block, cs_main must be held */
+int64_t GetMaxBlockTime();
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 FILE* OpenBlockFile(bool fHeaderFile, unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(bool fHeaderFile, unsigned int& nFileRet, const char* fmode = "ab");
@@ -186,7 +214,7 @@ bool GetTransactionBlockHash(const uint256 &hash, uint256 &hashBlock);
 bool GetKeyImage(CTxDB* ptxdb, ec_point& keyImage, CKeyImageSpent& keyImageSpent, bool& fInMempool);
 bool TxnHashInSystem(CTxDB* ptxdb, uint256& txnHash);
 
-uint256 WantedByOrphan(const CBlock* pblockOrphan);
+uint256 WantedByOrphan(const COrphanBlock* pblockOrphan);
 uint256 WantedByOrphanHeader(const CBlockThin* pblockOrphan);
 const COrphanBlock* AddOrphanBlock(const CBlock* pblock);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
@@ -294,13 +322,19 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+    // memory only, set by UpdateHash() and returned by GetHash() until the next UpdateHash(),
+    // SetNull() or read. Only set on transactions that won't change anymore: block transactions
+    // once the merkle tree is built and transactions entering the memory pool.
+    mutable uint256 hashCached;
+    mutable bool fHashCached;
+
     CTransaction()
     {
         SetNull();
     }
 
     CTransaction(int nVersion, unsigned int nTime, const std::vector<CTxIn>& vin, const std::vector<CTxOut>& vout, unsigned int nLockTime)
-        : nVersion(nVersion), nTime(nTime), vin(vin), vout(vout), nLockTime(nLockTime), nDoS(0)
+        : nVersion(nVersion), nTime(nTime), vin(vin), vout(vout), nLockTime(nLockTime), nDoS(0), fHashCached(false)
     {
     }
 
@@ -312,6 +346,8 @@ public:
         READWRITE(vin);
         READWRITE(vout);
         READWRITE(nLockTime);
+        if (fRead)
+            const_cast<CTransaction*>(this)->fHashCached = false;
     )
 
     void SetNull()
@@ -322,6 +358,7 @@ public:
         vout.clear();
         nLockTime = 0;
         nDoS = 0;  // Denial-of-service prevention
+        fHashCached = false;
     }
 
     bool IsNull() const
@@ -331,9 +368,19 @@ public:
 
     uint256 GetHash() const
     {
+        if (fHashCached)
+            return hashCached;
         return SerializeHash(*this);
     }
 
+    // Hash the transaction and keep the result for GetHash(), the transaction must not be changed afterwards
+    uint256 UpdateHash() const
+    {
+        hashCached = SerializeHash(*this);
+        fHashCached = true;
+        return hashCached;
+    }
+
     bool IsFinal(int nBlockHeight=0, int64_t nBlockTime=0) const
     {
         AssertLockHeld(cs_main);
@@ -879,8 +926,9 @@ public:
     uint256 BuildMerkleTree() const
     {
         vMerkleTree.clear();
+        // rehash, vtx may have changed since the last build, and keep the hashes for the rest of validation
         BOOST_FOREACH(const CTransaction& tx, vtx)
-            vMerkleTree.push_back(tx.GetHash());
+            vMerkleTree.push_back(tx.UpdateHash());
         int j = 0;
         for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
         {
@@ -1014,7 +1062,8 @@ public:
     bool ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions=true);
     bool SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew);
     bool AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const uint256& hashProof);
-    bool CheckBlock(bool fCheckPOW=true, bool fCheckMerkleRoot=true, bool fCheckSig=true) const;
+    // nMaxBlockTime 0 takes GetMaxBlockTime(), callers without cs_main pass one taken under it
+    bool CheckBlock(bool fCheckPOW=true, bool fCheckMerkleRoot=true, bool fCheckSig=true, int64_t nMaxBlockTime=0) const;
     bool AcceptBlock();
     bool SignBlock(CWallet& keystore, int64_t nFees);
     bool CheckBlockSignature() const;
@@ -1800,7 +1849,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1861,7 +1910,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1880,7 +1929,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1896,7 +1945,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1938,7 +1987,7 @@ public:
 
     explicit CBlockThinLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.find(hashBlock);
+        BlockThinMap::iterator mi = mapBlockThinIndex.find(hashBlock);
         if (mi != mapBlockThinIndex.end())
             Set((*mi).second);
     }
@@ -1989,7 +2038,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.find(hash);
+            BlockThinMap::iterator mi = mapBlockThinIndex.find(hash);
             if (mi != mapBlockThinIndex.end())
             {
                 CBlockThinIndex* pindex = (*mi).second;
@@ -2008,7 +2057,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.find(hash);
+            BlockThinMap::iterator mi = mapBlockThinIndex.find(hash);
             if (mi != mapBlockThinIndex.end())
             {
                 CBlockThinIndex* pindex = (*mi).second;
@@ -2024,7 +2073,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.find(hash);
+            BlockThinMap::iterator mi = mapBlockThinIndex.find(hash);
             if (mi != mapBlockThinIndex.end())
             {
                 CBlockThinIndex* pindex = (*mi).second;
@@ -22,12 +22,16 @@
 using namespace std;
 using namespace boost;
 
+// Wakes ThreadCheckDarkSendPool, constructed first as the pool posts to it
+CDarksendScheduler darkSendScheduler;
 // The main object for accessing darksend
 CDarksendPool darkSendPool;
 // A helper object for signing messages from Masternodes
 CDarkSendSigner darkSendSigner;
 // The current darksends in progress on the network
 std::vector<CDarksendQueue> vecDarksendQueue;
+// collaterals of the live queues in vecDarksendQueue
+seencache<COutPoint> seenDarksendQueue(DARKSEND_QUEUE_SEEN_MAX);
 // Keep track of the used Masternodes
 std::vector<CTxIn> vecMasternodesUsed;
 // keep track of the scanning errors I've seen
@@ -134,9 +138,7 @@ void CDarksendPool::ProcessMessageDarksend(CNode* pfrom, std::string& strCommand
                 PrepareDarksendDenominate();
             }
         } else {
-            BOOST_FOREACH(CDarksendQueue q, vecDarksendQueue){
-                if(q.vin == dsq.vin) return;
-            }
+            if(seenDarksendQueue.contains(dsq.vin.prevout, GetTime())) return;
 
             LogPrint("darksend", "dsq last %d last2 %d count %d\n", pmn->nLastDsq, pmn->nLastDsq + mnodeman.size()/5, mnodeman.nDsqCount);
             //don't allow a few nodes to dominate the queuing process
@@ -151,6 +153,9 @@ void CDarksendPool::ProcessMessageDarksend(CNode* pfrom, std::string& strCommand
 
             LogPrint("darksend", "dsq - new Darksend queue object - %s\n", addr.ToString().c_str());
             vecDarksendQueue.push_back(dsq);
+            // local time, dsq.time comes from the peer
+            seenDarksendQueue.insert(dsq.vin.prevout, GetTime() + DARKSEND_QUEUE_TIMEOUT + 1, GetTime());
+            darkSendScheduler.Post(CDarksendScheduler::EVENT_QUEUE);
             dsq.Relay();
             dsq.time = GetTime();
         }
@@ -891,6 +896,37 @@ void CDarksendPool::CheckTimeout(){
     }
 }
 
+int64_t CDarksendPool::GetNextTimeout()
+{
+    int64_t nNow = GetTimeMillis();
+    // nothing pending, look again in a minute
+    int64_t nNext = nNow + 60*1000;
+    if(!fEnableDarksend && !fMasterNode) return nNext;
+
+    // clients check finished and failed sessions right away, see CheckTimeout()
+    if(!fMasterNode && (state == POOL_STATUS_TRANSMISSION || state == POOL_STATUS_ERROR || state == POOL_STATUS_SUCCESS))
+        nNext = nNow + 1000;
+
+    BOOST_FOREACH(const CDarksendQueue& dsq, vecDarksendQueue)
+        nNext = std::min(nNext, (dsq.time + DARKSEND_QUEUE_TIMEOUT + 1) * 1000);
+
+    int addLagTime = 0;
+    if(!fMasterNode) addLagTime = 10000;
+
+    if(state != POOL_STATUS_IDLE) {
+        nNext = std::min(nNext, lastTimeChanged + (DARKSEND_QUEUE_TIMEOUT*1000) + addLagTime);
+        if(state == POOL_STATUS_SIGNING)
+            nNext = std::min(nNext, lastTimeChanged + (DARKSEND_SIGNING_TIMEOUT*1000) + addLagTime);
+    }
+
+    if(state == POOL_STATUS_ACCEPTING_ENTRIES || state == POOL_STATUS_QUEUE){
+        BOOST_FOREACH(const CDarkSendEntry& entry, entries)
+            nNext = std::min(nNext, (entry.addedTime + DARKSEND_QUEUE_TIMEOUT + 1) * 1000);
+    }
+
+    return std::max(nNext, nNow);
+}
+
 //
 // Check for complete queue
 //
@@ -1922,6 +1958,7 @@ bool CDarksendPool::IsCompatibleWithSession(int64_t nDenom, CTransaction txColla
     sessionUsers++;
     lastTimeChanged = GetTimeMillis();
     vecSessionCollateral.push_back(txCollateral);
+    darkSendScheduler.Post(CDarksendScheduler::EVENT_STATE);
 
     return true;
 }
@@ -2257,6 +2294,54 @@ void CDarksendPool::RelayCompletedTransaction(const int sessionID, const bool er
         pnode->PushMessage("dsc", sessionID, error, errorMessage);
 }
 
+void CDarksendScheduler::Schedule(int nTask, int64_t nTime)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    std::map<int, int64_t>::iterator it = mapDue.find(nTask);
+    if(it == mapDue.end() || nTime < it->second)
+        mapDue[nTask] = nTime;
+    cond.notify_one();
+}
+
+void CDarksendScheduler::Post(int nEvent)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    nEvents |= nEvent;
+    cond.notify_one();
+}
+
+void CDarksendScheduler::Wait(std::vector<int>& vTasks, int& nEventsOut)
+{
+    vTasks.clear();
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (true)
+    {
+        int64_t nNow = GetTimeMillis();
+        int64_t nNext = nNow + 60*1000;
+        for (std::map<int, int64_t>::iterator it = mapDue.begin(); it != mapDue.end(); )
+        {
+            if(it->second <= nNow) {
+                vTasks.push_back(it->first);
+                mapDue.erase(it++);
+            } else {
+                nNext = std::min(nNext, it->second);
+                ++it;
+            }
+        }
+
+        if(!vTasks.empty() || nEvents != 0) break;
+
+        cond.timed_wait(lock, boost::posix_time::milliseconds(nNext - nNow));
+    }
+    nEventsOut = nEvents;
+    nEvents = 0;
+}
+
+static void DarksendNotifyBlock()
+{
+    darkSendScheduler.Post(CDarksendScheduler::EVENT_BLOCK);
+}
+
 //TODO: Rename/move to core
 void ThreadCheckDarkSendPool()
 {
@@ -2265,41 +2350,75 @@ void ThreadCheckDarkSendPool()
     // Make this thread recognisable as the wallet flushing thread
     RenameThread("proc-darksend");
 
-    unsigned int c = 0;
+    uiInterface.NotifyBlocksChanged.connect(boost::bind(DarksendNotifyBlock));
+
+    int64_t nNow = GetTimeMillis();
+    darkSendScheduler.Schedule(CDarksendScheduler::TASK_PING, nNow + 1000);
+    darkSendScheduler.Schedule(CDarksendScheduler::TASK_MAINTENANCE, nNow + DARKSEND_MAINTENANCE_SECONDS*1000);
+    darkSendScheduler.Schedule(CDarksendScheduler::TASK_DENOMINATE, nNow + DARKSEND_DENOMINATE_SECONDS*1000);
+    darkSendScheduler.Schedule(CDarksendScheduler::TASK_TIMEOUT, nNow + 1000);
+
+    int64_t nLastDenominate = 0;
+    std::vector<int> vTasks;
+    int nEvents;
 
     while (true)
     {
-        MilliSleep(1000);
-        //LogPrintf("ThreadCheckDarkSendPool::check timeout\n");
+        // sleeps until a task is due or the pool, the network or the chain posts an event
+        darkSendScheduler.Wait(vTasks, nEvents);
+        boost::this_thread::interruption_point();
 
         // try to sync from all available nodes, one step at a time
         //masternodeSync.Process();
 
+        nNow = GetTimeMillis();
 
-        if(darkSendPool.IsBlockchainSynced()) {
-
-            c++;
-
-            // check if we should activate or ping every few minutes,
-            // start right after sync is considered to be done
-            if(c % MASTERNODE_PING_SECONDS == 1) activeMasternode.ManageStatus();
+        if(!darkSendPool.IsBlockchainSynced()) {
+            // nothing runs before sync, look again in a second
+            BOOST_FOREACH(int nTask, vTasks)
+                darkSendScheduler.Schedule(nTask, nNow + 1000);
+            continue;
+        }
 
-            if(c % 60 == 0)
-            {
-                mnodeman.CheckAndRemove();
-                mnodeman.ProcessMasternodeConnections();
-                masternodePayments.CleanPaymentList();
-                CleanTransactionLocksList();
+        BOOST_FOREACH(int nTask, vTasks)
+        {
+            switch(nTask) {
+                case CDarksendScheduler::TASK_PING:
+                    // check if we should activate or ping every few minutes,
+                    // start right after sync is considered to be done
+                    activeMasternode.ManageStatus();
+                    darkSendScheduler.Schedule(nTask, nNow + MASTERNODE_PING_SECONDS*1000);
+                    break;
+                case CDarksendScheduler::TASK_MAINTENANCE:
+                    mnodeman.CheckAndRemove();
+                    mnodeman.ProcessMasternodeConnections();
+                    masternodePayments.CleanPaymentList();
+                    CleanTransactionLocksList();
+
+                    //DumpMasternodes();
+
+                    darkSendScheduler.Schedule(nTask, nNow + DARKSEND_MAINTENANCE_SECONDS*1000);
+                    break;
+                case CDarksendScheduler::TASK_DENOMINATE:
+                    if(darkSendPool.GetState() == POOL_STATUS_IDLE){
+                        nLastDenominate = nNow;
+                        darkSendPool.DoAutomaticDenominating();
+                    }
+                    darkSendScheduler.Schedule(nTask, nNow + DARKSEND_DENOMINATE_SECONDS*1000);
+                    break;
             }
+        }
 
-            //if(c % MASTERNODES_DUMP_SECONDS == 0) DumpMasternodes();
+        if(nEvents & CDarksendScheduler::EVENT_BLOCK)
+            darkSendPool.NewBlock();
 
-            darkSendPool.CheckTimeout();
-            darkSendPool.CheckForCompleteQueue();
+        darkSendPool.CheckTimeout();
+        darkSendPool.CheckForCompleteQueue();
 
-            if(darkSendPool.GetState() == POOL_STATUS_IDLE && c % 15 == 0){
-                darkSendPool.DoAutomaticDenominating();
-            }
-        }
+        // a new queue or block can make mixing possible now, no need to wait for the next round
+        if(nEvents & (CDarksendScheduler::EVENT_QUEUE | CDarksendScheduler::EVENT_BLOCK))
+            darkSendScheduler.Schedule(CDarksendScheduler::TASK_DENOMINATE, std::max(nNow, nLastDenominate + 1000));
+
+        darkSendScheduler.Schedule(CDarksendScheduler::TASK_TIMEOUT, darkSendPool.GetNextTimeout());
     }
 }
@@ -40,15 +40,22 @@ class CActiveMasternode;
 
 #define DARKSEND_QUEUE_TIMEOUT                 30
 #define DARKSEND_SIGNING_TIMEOUT               15
+#define DARKSEND_QUEUE_SEEN_MAX                4096
+#define DARKSEND_DENOMINATE_SECONDS            15 // automatic denomination attempts while idle
+#define DARKSEND_MAINTENANCE_SECONDS           60 // masternode list, payments and lock cleanup
 
 // used for anonymous relaying of inputs/outputs/sigs
 #define DARKSEND_RELAY_IN                 1
 #define DARKSEND_RELAY_OUT                2
 #define DARKSEND_RELAY_SIG                3
 
+class CDarksendScheduler;
+
 extern CDarksendPool darkSendPool;
+extern CDarksendScheduler darkSendScheduler;
 extern CDarkSendSigner darkSendSigner;
 extern std::vector<CDarksendQueue> vecDarksendQueue;
+extern seencache<COutPoint> seenDarksendQueue;
 extern std::string strMasterNodePrivKey;
 extern map<uint256, CDarksendBroadcastTx> mapDarksendBroadcastTxes;
 extern CActiveMasternode activeMasternode;
@@ -250,6 +257,44 @@ public:
     bool VerifyMessage(CPubKey pubkey, std::vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage);
 };
 
+/** Wakes ThreadCheckDarkSendPool when pool work is due
+ *
+ *  Periodic tasks are kept with the time they are next due, events posted from the network and
+ *  the pool (state changes, queue announcements, new blocks) wake the thread right away. The thread
+ *  sleeps until whichever comes first instead of polling every second.
+ */
+class CDarksendScheduler
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    // task and time in milliseconds it is next due
+    std::map<int, int64_t> mapDue;
+    int nEvents;
+
+public:
+    enum Event {
+        EVENT_STATE = (1 << 0),     // pool state or session changed
+        EVENT_QUEUE = (1 << 1),     // new dsq announcement
+        EVENT_BLOCK = (1 << 2)      // chain tip moved
+    };
+
+    enum Task {
+        TASK_PING,                  // active masternode status and ping
+        TASK_MAINTENANCE,           // list, payments and lock cleanup
+        TASK_TIMEOUT,               // earliest session, entry or queue deadline
+        TASK_DENOMINATE             // automatic denomination while idle
+    };
+
+    CDarksendScheduler() : nEvents(0) {}
+
+    // Run task at nTime (milliseconds) at the latest, an earlier due time is kept
+    void Schedule(int nTask, int64_t nTime);
+    void Post(int nEvent);
+    // Block until a task is due or an event is posted, return both and clear them
+    void Wait(std::vector<int>& vTasks, int& nEventsOut);
+};
+
 /** Used to keep track of current status of Darksend pool
  */
 class CDarksendPool
@@ -338,6 +383,13 @@ public:
         SetNull();
     }
 
+    /// Occupancy of the cache of live queue collaterals
+    seencache_stats GetSeenQueueStats()
+    {
+        LOCK(cs_darksend);
+        return seenDarksendQueue.stats();
+    }
+
     /** Process a Darksend message using the Darksend protocol
      * \param pfrom
      * \param strCommand lower case command string; valid values are:
@@ -413,7 +465,9 @@ public:
                 RelayStatus(darkSendPool.sessionID, darkSendPool.GetState(), darkSendPool.GetEntriesCount(), MASTERNODE_RESET);
             }
         }
+        bool fChanged = (state != newState);
         state = newState;
+        if(fChanged) darkSendScheduler.Post(CDarksendScheduler::EVENT_STATE);
     }
 
     /// Get the maximum number of transactions for the pool
@@ -448,6 +502,8 @@ public:
     /// Rarely charge fees to pay miners
     void ChargeRandomFees();
     void CheckTimeout();
+    // Time in milliseconds of the next session, entry or queue timeout
+    int64_t GetNextTimeout();
     void CheckForCompleteQueue();
     /// Check to make sure a signature matches an input in the pool
     bool SignatureValid(const CScript& newSig, const CTxIn& newVin);
@@ -16,7 +16,7 @@ CCriticalSection cs_masternodepayments;
 /** Object for who's going to get paid on which blocks */
 CMasternodePayments masternodePayments;
 // keep track of Masternode votes I've seen
-map<uint256, CMasternodePaymentWinner> mapSeenMasternodeVotes;
+seencache<uint256> seenMasternodeVotes(MASTERNODE_SEEN_VOTES_MAX);
 
 int CMasternodePayments::GetMinMasternodePaymentsProto() {
     return MIN_MASTERNODE_PAYMENT_PROTO;
@@ -53,7 +53,7 @@ void ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDa
         CProCurrencyAddress address2(address1);
 
         uint256 hash = winner.GetHash();
-        if(mapSeenMasternodeVotes.count(hash)) {
+        if(seenMasternodeVotes.contains(hash, GetTime())) {
             if(fDebug) LogPrintf("mnw - seen vote %s Addr %s Height %d bestHeight %d\n", hash.ToString().c_str(), address2.ToString().c_str(), winner.nBlockHeight, pindexBest->nHeight);
             return;
         }
@@ -77,7 +77,7 @@ void ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDa
             return;
         }
 
-        mapSeenMasternodeVotes.insert(make_pair(hash, winner));
+        seenMasternodeVotes.insert(hash, GetTime() + MASTERNODE_SEEN_VOTE_SECONDS, GetTime());
 
         if(masternodePayments.AddWinningMasternode(winner)){
             masternodePayments.Relay(winner);
@@ -186,7 +186,7 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
                 winner.payee = winnerIn.payee;
                 winner.vchSig = winnerIn.vchSig;
 
-                mapSeenMasternodeVotes.insert(make_pair(winnerIn.GetHash(), winnerIn));
+                seenMasternodeVotes.insert(winnerIn.GetHash(), GetTime() + MASTERNODE_SEEN_VOTE_SECONDS, GetTime());
 
                 return true;
             }
@@ -196,7 +196,7 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
     // if it's not in the vector
     if(!foundBlock){
         vWinning.push_back(winnerIn);
-        mapSeenMasternodeVotes.insert(make_pair(winnerIn.GetHash(), winnerIn));
+        seenMasternodeVotes.insert(winnerIn.GetHash(), GetTime() + MASTERNODE_SEEN_VOTE_SECONDS, GetTime());
 
         return true;
     }
@@ -13,6 +13,10 @@
 #include "base58.h"
 #include "main.h"
 #include "masternode.h"
+#include "seencache.h"
+
+#define MASTERNODE_SEEN_VOTES_MAX              32768
+#define MASTERNODE_SEEN_VOTE_SECONDS           (60*60) // votes are only taken for blocks within -10..+20 of the tip
 
 using namespace std;
 
@@ -20,7 +24,8 @@ class CMasternodePayments;
 class CMasternodePaymentWinner;
 
 extern CMasternodePayments masternodePayments;
-extern map<uint256, CMasternodePaymentWinner> mapSeenMasternodeVotes;
+extern CCriticalSection cs_masternodepayments;
+extern seencache<uint256> seenMasternodeVotes;
 
 void ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
@@ -174,10 +174,6 @@ void CMasternode::Check()
 {
     if(ShutdownRequested()) return;
 
-    //TODO: Random segfault with this line removed
-    TRY_LOCK(cs_main, lockRecv);
-    if(!lockRecv) return;
-
     //once spent, stop doing the checks
     if(activeState == MASTERNODE_VIN_SPENT) return;
 
@@ -193,13 +189,27 @@ void CMasternode::Check()
     }
 
     if(!unitTest){
-        CValidationState state;
-        CTransaction tx = CTransaction();
-        CTxOut vout = CTxOut((GetMNCollateral(pindexBest->nHeight)-1)*COIN, darkSendPool.collateralPubKey);
-        tx.vin.push_back(vin);
-        tx.vout.push_back(vout);
-
-	if(!AcceptableInputs(mempool, tx, false, NULL)){
+        // spends are pushed to mnodeman from blocks and the mempool, only a collateral
+        // not seen before needs the full lookup
+        int nCollateral = mnodeman.GetCollateralState(vin.prevout);
+        if(nCollateral == MASTERNODE_COLLATERAL_UNCHECKED){
+            //TODO: Random segfault with this line removed
+            TRY_LOCK(cs_main, lockRecv);
+            if(!lockRecv) return;
+
+            CValidationState state;
+            CTransaction tx = CTransaction();
+            CTxOut vout = CTxOut((GetMNCollateral(pindexBest->nHeight)-1)*COIN, darkSendPool.collateralPubKey);
+            tx.vin.push_back(vin);
+            tx.vout.push_back(vout);
+
+            bool fAcceptable = AcceptableInputs(mempool, tx, false, NULL);
+            mnodeman.SetCollateralChecked(vin.prevout, !fAcceptable);
+            if(!fAcceptable){
+                activeState = MASTERNODE_VIN_SPENT;
+                return;
+            }
+        } else if(nCollateral != 0){
             activeState = MASTERNODE_VIN_SPENT;
             return;
         }
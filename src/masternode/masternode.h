@@ -216,7 +216,7 @@ public:
         lastTimeSeen = 0;
     }
 
-    bool IsEnabled()
+    bool IsEnabled() const
     {
         return isPortOpen && activeState == MASTERNODE_ENABLED;
     }
@@ -233,7 +233,7 @@ public:
         return cacheInputAge+(pindexBest->nHeight-cacheInputAgeBlock);
     }
 
-    std::string Status() {
+    std::string Status() const {
         std::string strStatus = "ACTIVE";
 
         if(activeState == CMasternode::MASTERNODE_ENABLED) strStatus   = "ENABLED";
@@ -7,37 +7,137 @@
 #include "addrman.h"
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem.hpp>
+#include <openssl/rand.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 
 /** Masternode manager */
 CMasternodeMan mnodeman;
 CCriticalSection cs_process_message;
 
-struct CompareValueOnly
+static void MasternodeTransactionInputs(const CTransaction& tx, bool fBlock, bool fSpent)
 {
-    bool operator()(const pair<int64_t, CTxIn>& t1,
-                    const pair<int64_t, CTxIn>& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-struct CompareValueOnlyMN
+    mnodeman.UpdateCollateral(tx, fBlock, fSpent);
+}
+
+// listen for spends from startup, the signal object is created on first use
+static struct CMasternodeSpendHook
 {
-    bool operator()(const pair<int64_t, CMasternode>& t1,
-                    const pair<int64_t, CMasternode>& t2) const
+    CMasternodeSpendHook()
     {
-        return t1.first < t2.first;
+        GetSpendSignals().TransactionInputs.connect(&MasternodeTransactionInputs);
     }
-};
+} masternodeSpendHook;
 
 
 //
 // CMasternodeDB
 //
 
+/** Read-only view of a whole file, memory mapped where the platform allows */
+class CMasternodeFileView
+{
+public:
+    const unsigned char* pbegin;
+    size_t nSize;
+
+    CMasternodeFileView()
+    {
+        pbegin = NULL;
+        nSize = 0;
+#ifndef WIN32
+        pMap = NULL;
+#endif
+    }
+
+    ~CMasternodeFileView()
+    {
+        Close();
+    }
+
+    bool Open(const boost::filesystem::path& path)
+    {
+        Close();
+#ifdef WIN32
+        FILE* file = fopen(path.string().c_str(), "rb");
+        if (!file)
+            return false;
+        fseek(file, 0, SEEK_END);
+        long nLen = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        if (nLen > 0)
+        {
+            vchData.resize(nLen);
+            if (fread(&vchData[0], 1, nLen, file) != (size_t)nLen)
+            {
+                fclose(file);
+                vchData.clear();
+                return false;
+            }
+            pbegin = &vchData[0];
+            nSize = nLen;
+        }
+        fclose(file);
+#else
+        int fd = open(path.string().c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            close(fd);
+            return false;
+        }
+        if (st.st_size > 0)
+        {
+            void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED)
+            {
+                close(fd);
+                return false;
+            }
+            pMap = p;
+            pbegin = (const unsigned char*)p;
+            nSize = st.st_size;
+        }
+        close(fd); // the mapping keeps the file open
+#endif
+        return true;
+    }
+
+    void Close()
+    {
+#ifdef WIN32
+        vchData.clear();
+#else
+        if (pMap)
+            munmap(pMap, nSize);
+        pMap = NULL;
+#endif
+        pbegin = NULL;
+        nSize = 0;
+    }
+
+private:
+#ifdef WIN32
+    std::vector<unsigned char> vchData;
+#else
+    void* pMap;
+#endif
+};
+
+static const unsigned int MN_JOURNAL_HEADER_SIZE = 4 + sizeof(uint256);
+
 CMasternodeDB::CMasternodeDB()
 {
     pathMN = GetDataDir() / "mncache.dat";
+    pathJournal = GetDataDir() / "mnjournal.dat";
     strMagicMessage = "MasternodeCache";
 }
 
@@ -45,6 +145,11 @@ bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
 {
     int64_t nStart = GetTimeMillis();
 
+    // Generate random temporary filename
+    unsigned short randv = 0;
+    RAND_bytes((unsigned char *)&randv, sizeof(randv));
+    std::string tmpfn = strprintf("mncache.dat.%04x", randv);
+
     // serialize addresses, checksum data up to that point, then append csum
     CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
     ssMasternodes << strMagicMessage; // masternode cache file specific magic message
@@ -53,11 +158,12 @@ bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
     uint256 hash = Hash(ssMasternodes.begin(), ssMasternodes.end());
     ssMasternodes << hash;
 
-    // open output file, and associate with CAutoFile
-    FILE *file = fopen(pathMN.string().c_str(), "wb");
+    // open temp output file, and associate with CAutoFile
+    boost::filesystem::path pathTmp = GetDataDir() / tmpfn;
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
     CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathMN.string());
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
 
     // Write and commit header, data
     try {
@@ -69,55 +175,219 @@ bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
     FileCommit(fileout.Get());
     fileout.fclose();
 
+    // a crash from here on leaves either the old snapshot with its journal, or the new one
+    // with a journal that no longer matches and is ignored
+    if (!RenameOver(pathTmp, pathMN))
+        return error("%s : Rename-into-place failed", __func__);
+
+    if (!WriteJournalHeader(hash))
+        return false;
+
     LogPrintf("Written info to mncache.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrintf("  %s\n", mnodemanToSave.ToString());
 
     return true;
 }
 
-CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad)
+bool CMasternodeDB::ReadSnapshotHash(uint256& hash)
 {
-    int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
     FILE *file = fopen(pathMN.string().c_str(), "rb");
-    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
+    if (!file)
+        return false;
+
+    bool fOk = fseek(file, -(long)sizeof(uint256), SEEK_END) == 0
+        && fread((char*)&hash, 1, sizeof(uint256), file) == sizeof(uint256);
+    fclose(file);
+    return fOk;
+}
+
+bool CMasternodeDB::WriteJournalHeader(const uint256& hashSnapshot)
+{
+    unsigned short randv = 0;
+    RAND_bytes((unsigned char *)&randv, sizeof(randv));
+    boost::filesystem::path pathTmp = GetDataDir() / strprintf("mnjournal.dat.%04x", randv);
+
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
+
+    bool fOk = fwrite(Params().MessageStart(), 1, 4, file) == 4
+        && fwrite((const char*)&hashSnapshot, 1, sizeof(uint256), file) == sizeof(uint256);
+    FileCommit(file);
+    fclose(file);
+    if (!fOk)
+        return error("%s : I/O error", __func__);
+
+    if (!RenameOver(pathTmp, pathJournal))
+        return error("%s : Rename-into-place failed", __func__);
+
+    return true;
+}
+
+bool CMasternodeDB::Append(const std::vector<CMasternode>& vChanged, const std::vector<COutPoint>& vRemoved)
+{
+    uint256 hashSnapshot;
+    if (!ReadSnapshotHash(hashSnapshot))
+        return false;
+
+    FILE *file = fopen(pathJournal.string().c_str(), "r+b");
+    if (!file)
+        return false;
+
+    // only extend a journal written for the snapshot on disk
+    unsigned char pchHeader[MN_JOURNAL_HEADER_SIZE];
+    if (fread(pchHeader, 1, sizeof(pchHeader), file) != sizeof(pchHeader)
+        || memcmp(pchHeader, Params().MessageStart(), 4) != 0
+        || memcmp(pchHeader + 4, (const char*)&hashSnapshot, sizeof(uint256)) != 0)
     {
-        error("%s : Failed to open file %s", __func__, pathMN.string());
-        return FileError;
+        fclose(file);
+        return false;
     }
 
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathMN);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
+    fseek(file, 0, SEEK_END);
+    long nJournalSize = ftell(file);
+    long nSnapshotSize = boost::filesystem::file_size(pathMN);
+    if (nJournalSize > std::max(nSnapshotSize, (long)MASTERNODES_JOURNAL_MIN_COMPACT))
+    {
+        fclose(file);
+        return false;
+    }
 
-    // read data and checksum from file
-    try {
-        filein.read((char *)&vchData[0], dataSize);
-        filein >> hashIn;
+    CDataStream ssJournal(SER_DISK, CLIENT_VERSION);
+    BOOST_FOREACH(const CMasternode& mn, vChanged)
+    {
+        CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+        ssRecord << (unsigned char)JOURNAL_ENTRY << mn;
+        ssJournal << (uint32_t)ssRecord.size();
+        ssJournal.write(&ssRecord[0], ssRecord.size());
+        ssJournal << Hash(ssRecord.begin(), ssRecord.end()).Get64();
     }
-    catch (std::exception &e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
+    BOOST_FOREACH(const COutPoint& outpoint, vRemoved)
+    {
+        CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+        ssRecord << (unsigned char)JOURNAL_REMOVE << outpoint;
+        ssJournal << (uint32_t)ssRecord.size();
+        ssJournal.write(&ssRecord[0], ssRecord.size());
+        ssJournal << Hash(ssRecord.begin(), ssRecord.end()).Get64();
     }
-    filein.fclose();
 
-    CDataStream ssMasternodes(vchData, SER_DISK, CLIENT_VERSION);
+    // a torn write here loses only these records, loading stops in front of them
+    bool fOk = fwrite(&ssJournal[0], 1, ssJournal.size(), file) == ssJournal.size();
+    FileCommit(file);
+    fclose(file);
+    if (!fOk)
+        return error("%s : I/O error", __func__);
+
+    LogPrint("masternode", "Appended %u changed and %u removed masternodes to mnjournal.dat\n", vChanged.size(), vRemoved.size());
+    return true;
+}
+
+void CMasternodeDB::ReadJournal(CMasternodeMan& mnodemanToLoad, const uint256& hashSnapshot)
+{
+    CMasternodeFileView view;
+    if (!view.Open(pathJournal))
+        return;
+
+    if (view.nSize < MN_JOURNAL_HEADER_SIZE
+        || memcmp(view.pbegin, Params().MessageStart(), 4) != 0
+        || memcmp(view.pbegin + 4, (const char*)&hashSnapshot, sizeof(uint256)) != 0)
+    {
+        LogPrintf("mnjournal.dat does not extend mncache.dat, ignoring it\n");
+        return;
+    }
+
+    size_t nPos = MN_JOURNAL_HEADER_SIZE;
+    int nRecords = 0;
+    while (nPos < view.nSize)
+    {
+        uint32_t nRecordSize;
+        uint64_t nCheck;
+        if (view.nSize - nPos < sizeof(nRecordSize))
+            break;
+        memcpy(&nRecordSize, view.pbegin + nPos, sizeof(nRecordSize));
+        if (nRecordSize == 0 || view.nSize - nPos - sizeof(nRecordSize) < (size_t)nRecordSize + sizeof(nCheck))
+            break;
+
+        const unsigned char* pRecord = view.pbegin + nPos + sizeof(nRecordSize);
+        memcpy(&nCheck, pRecord + nRecordSize, sizeof(nCheck));
+        if (Hash(pRecord, pRecord + nRecordSize).Get64() != nCheck)
+            break;
+
+        try {
+            CDataStream ssRecord((const char*)pRecord, (const char*)pRecord + nRecordSize, SER_DISK, CLIENT_VERSION);
+            unsigned char nType;
+            ssRecord >> nType;
+            if (nType == JOURNAL_ENTRY)
+            {
+                CMasternode mn;
+                ssRecord >> mn;
+                mnodemanToLoad.ApplyJournalEntry(mn);
+            } else
+            if (nType == JOURNAL_REMOVE)
+            {
+                COutPoint outpoint;
+                ssRecord >> outpoint;
+                mnodemanToLoad.ApplyJournalRemove(outpoint);
+            };
+        }
+        catch (std::exception &e) {
+            error("%s : Deserialize error - %s", __func__, e.what());
+            break;
+        }
+
+        nPos += sizeof(nRecordSize) + nRecordSize + sizeof(nCheck);
+        nRecords++;
+    }
+
+    size_t nFileSize = view.nSize;
+    view.Close();
+
+    // drop a torn tail so appends continue after the last good record
+    if (nPos < nFileSize)
+    {
+        LogPrintf("mnjournal.dat damaged after %d records, truncating\n", nRecords);
+        try {
+            boost::filesystem::resize_file(pathJournal, nPos);
+        }
+        catch (std::exception &e) {
+            error("%s : Truncate failed - %s", __func__, e.what());
+        }
+    }
+
+    LogPrint("masternode", "Replayed %d records from mnjournal.dat\n", nRecords);
+}
+
+CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bool fJournal)
+{
+    int64_t nStart = GetTimeMillis();
+
+    CMasternodeFileView view;
+    if (!view.Open(pathMN))
+    {
+        error("%s : Failed to open file %s", __func__, pathMN.string());
+        return FileError;
+    }
+
+    if (view.nSize < sizeof(uint256))
+    {
+        error("%s : Deserialize or I/O error - file too small", __func__);
+        return HashReadError;
+    }
 
     // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssMasternodes.begin(), ssMasternodes.end());
+    size_t dataSize = view.nSize - sizeof(uint256);
+    uint256 hashIn;
+    memcpy((char*)&hashIn, view.pbegin + dataSize, sizeof(uint256));
+    uint256 hashTmp = Hash(view.pbegin, view.pbegin + dataSize);
     if (hashIn != hashTmp)
     {
         error("%s : Checksum mismatch, data corrupted", __func__);
         return IncorrectHash;
     }
 
+    CDataStream ssMasternodes((const char*)view.pbegin, (const char*)view.pbegin + dataSize, SER_DISK, CLIENT_VERSION);
+    view.Close();
+
     unsigned char pchMsgTmp[4];
     std::string strMagicMessageTmp;
     try {
@@ -151,6 +421,9 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad)
         return IncorrectFormat;
     }
 
+    if (fJournal)
+        ReadJournal(mnodemanToLoad, hashIn);
+
     mnodemanToLoad.CheckAndRemove(); // clean out expired
     LogPrintf("Loaded info from mncache.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrintf("  %s\n", mnodemanToLoad.ToString());
@@ -158,15 +431,43 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad)
     return Ok;
 }
 
+bool LoadMasternodes()
+{
+    CMasternodeDB mndb;
+    CMasternodeDB::ReadResult readResult = mndb.Read(mnodeman);
+    if (readResult == CMasternodeDB::FileError)
+        LogPrintf("Missing masternode list file - mncache.dat, will try to recreate\n");
+    else if (readResult != CMasternodeDB::Ok)
+        LogPrintf("Error reading mncache.dat, the list will be requested from peers\n");
+
+    // loaded state is what's on disk, nothing to journal yet
+    std::vector<CMasternode> vChanged;
+    std::vector<COutPoint> vRemoved;
+    mnodeman.PopJournalChanges(vChanged, vRemoved);
+
+    return readResult == CMasternodeDB::Ok;
+}
+
 void DumpMasternodes()
 {
     int64_t nStart = GetTimeMillis();
 
     CMasternodeDB mndb;
+
+    // changes since the last dump go to the journal while it extends the snapshot on disk
+    std::vector<CMasternode> vChanged;
+    std::vector<COutPoint> vRemoved;
+    if (mnodeman.PopJournalChanges(vChanged, vRemoved)
+        && ((vChanged.empty() && vRemoved.empty()) || mndb.Append(vChanged, vRemoved)))
+    {
+        LogPrint("masternode", "Masternode journal dump finished  %dms\n", GetTimeMillis() - nStart);
+        return;
+    }
+
     CMasternodeMan tempMnodeman;
 
     LogPrintf("Verifying mncache.dat format...\n");
-    CMasternodeDB::ReadResult readResult = mndb.Read(tempMnodeman);
+    CMasternodeDB::ReadResult readResult = mndb.Read(tempMnodeman, false);
     // there was an error and it was not an error on file openning => do not proceed
     if (readResult == CMasternodeDB::FileError)
         LogPrintf("Missing masternode list file - mncache.dat, will try to recreate\n");
@@ -178,17 +479,86 @@ void DumpMasternodes()
         else
         {
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
+            mnodeman.ResetJournal();
             return;
         }
     }
     LogPrintf("Writting info to mncache.dat...\n");
-    mndb.Write(mnodeman);
+    if (!mndb.Write(mnodeman))
+        mnodeman.ResetJournal(); // popped changes are only on disk once a snapshot succeeds
 
     LogPrintf("Masternode dump finished  %dms\n", GetTimeMillis() - nStart);
 }
 
-CMasternodeMan::CMasternodeMan() {
+CMasternodeMan::CMasternodeMan() :
+    mAskedUsForMasternodeList(MASTERNODES_ASKED_LIST_MAX),
+    mWeAskedForMasternodeList(MASTERNODES_ASKED_LIST_MAX),
+    mWeAskedForMasternodeListEntry(MASTERNODES_ASKED_ENTRY_MAX)
+{
     nDsqCount = 0;
+    nListVersion = 0;
+    nNextScoreTable = 0;
+    nSnapshotVersion = -1;
+    nSnapshotTime = 0;
+    fJournalReset = true;
+}
+
+// remove the entry of one masternode from a multimap index
+template <typename K>
+static void EraseIndexEntry(std::multimap<K, CMasternode*>& mapIndex, const K& key, const CMasternode* pmn)
+{
+    typedef typename std::multimap<K, CMasternode*>::iterator index_iterator;
+    std::pair<index_iterator, index_iterator> range = mapIndex.equal_range(key);
+    for(index_iterator it = range.first; it != range.second; ++it)
+    {
+        if(it->second == pmn)
+        {
+            mapIndex.erase(it);
+            return;
+        }
+    }
+}
+
+void CMasternodeMan::Index(std::list<CMasternode>::iterator it)
+{
+    AssertLockHeld(cs);
+
+    CMasternode* pmn = &(*it);
+    mapByOutpoint[pmn->vin.prevout] = it;
+    mapByPubKey.insert(make_pair(pmn->pubkey2, pmn));
+    mapByAddr.insert(make_pair(pmn->addr, pmn));
+}
+
+void CMasternodeMan::Unindex(std::list<CMasternode>::iterator it)
+{
+    AssertLockHeld(cs);
+
+    CMasternode* pmn = &(*it);
+    std::map<COutPoint, std::list<CMasternode>::iterator>::iterator mi = mapByOutpoint.find(pmn->vin.prevout);
+    if(mi != mapByOutpoint.end() && mi->second == it)
+        mapByOutpoint.erase(mi);
+    EraseIndexEntry(mapByPubKey, pmn->pubkey2, pmn);
+    EraseIndexEntry(mapByAddr, pmn->addr, pmn);
+}
+
+void CMasternodeMan::Load(const std::vector<CMasternode>& vMasternodes)
+{
+    AssertLockHeld(cs);
+
+    listMasternodes.clear();
+    mapByOutpoint.clear();
+    mapByPubKey.clear();
+    mapByAddr.clear();
+
+    BOOST_FOREACH(const CMasternode& mn, vMasternodes)
+    {
+        // older caches could hold the same collateral twice, keep the first
+        if(mapByOutpoint.count(mn.vin.prevout)) continue;
+        listMasternodes.push_back(mn);
+        Index(--listMasternodes.end());
+    }
+    nListVersion++;
+    fJournalReset = true;
 }
 
 bool CMasternodeMan::Add(CMasternode &mn)
@@ -200,7 +570,10 @@ bool CMasternodeMan::Add(CMasternode &mn)
     if (pmn == NULL)
     {
         LogPrint("masternode", "CMasternodeMan: Adding new masternode %s - %i now\n", mn.addr.ToString().c_str(), size() + 1);
-        vMasternodes.push_back(mn);
+        listMasternodes.push_back(mn);
+        Index(--listMasternodes.end());
+        setJournalDirty.insert(mn.vin.prevout);
+        nListVersion++;
         return true;
     }
 
@@ -209,27 +582,30 @@ bool CMasternodeMan::Add(CMasternode &mn)
 
 void CMasternodeMan::AskForMN(CNode* pnode, CTxIn &vin)
 {
-    std::map<COutPoint, int64_t>::iterator i = mWeAskedForMasternodeListEntry.find(vin.prevout);
-    if (i != mWeAskedForMasternodeListEntry.end())
-    {
-        int64_t t = (*i).second;
-        if (GetTime() < t) return; // we've asked recently
-    }
+    if (mWeAskedForMasternodeListEntry.contains(vin.prevout, GetTime())) return; // we've asked recently
 
     // ask for the mnb info once from the node that sent mnp
 
     LogPrintf("CMasternodeMan::AskForMN - Asking node for missing entry, vin: %s\n", vin.ToString());
     pnode->PushMessage("dseg", vin);
     int64_t askAgain = GetTime() + MASTERNODE_MIN_DSEEP_SECONDS;
-    mWeAskedForMasternodeListEntry[vin.prevout] = askAgain;
+    mWeAskedForMasternodeListEntry.insert(vin.prevout, askAgain, GetTime());
 }
 
 void CMasternodeMan::Check()
 {
     LOCK(cs);
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes)
+    BOOST_FOREACH(CMasternode& mn, listMasternodes)
+    {
+        int prevState = mn.activeState;
         mn.Check();
+        if(mn.activeState != prevState)
+        {
+            setJournalDirty.insert(mn.vin.prevout);
+            nListVersion++;
+        }
+    }
 }
 
 void CMasternodeMan::CheckAndRemove()
@@ -239,56 +615,105 @@ void CMasternodeMan::CheckAndRemove()
     Check();
 
     //remove inactive
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while(it != vMasternodes.end()){
+    std::list<CMasternode>::iterator it = listMasternodes.begin();
+    while(it != listMasternodes.end()){
         if((*it).activeState == CMasternode::MASTERNODE_REMOVE || (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT || (*it).protocolVersion < nMasternodeMinProtocol){
             LogPrint("masternode", "CMasternodeMan: Removing inactive masternode %s - %i now\n", (*it).addr.ToString().c_str(), size() - 1);
-            it = vMasternodes.erase(it);
+            ForgetCollateral((*it).vin.prevout);
+            Unindex(it);
+            setJournalDirty.insert((*it).vin.prevout);
+            it = listMasternodes.erase(it);
+            nListVersion++;
         } else {
             ++it;
         }
     }
 
-    // check who's asked for the masternode list
-    map<CNetAddr, int64_t>::iterator it1 = mAskedUsForMasternodeList.begin();
-    while(it1 != mAskedUsForMasternodeList.end()){
-        if((*it1).second < GetTime()) {
-            mAskedUsForMasternodeList.erase(it1++);
-        } else {
-            ++it1;
-        }
-    }
-
-    // check who we asked for the masternode list
-    it1 = mWeAskedForMasternodeList.begin();
-    while(it1 != mWeAskedForMasternodeList.end()){
-        if((*it1).second < GetTime()){
-            mWeAskedForMasternodeList.erase(it1++);
-        } else {
-            ++it1;
-        }
-    }
-
-    // check which masternodes we've asked for
-    map<COutPoint, int64_t>::iterator it2 = mWeAskedForMasternodeListEntry.begin();
-    while(it2 != mWeAskedForMasternodeListEntry.end()){
-        if((*it2).second < GetTime()){
-            mWeAskedForMasternodeListEntry.erase(it2++);
-        } else {
-            ++it2;
-        }
-    }
-
+    // drop expired requests, the caches are bounded either way
+    int64_t nNow = GetTime();
+    mAskedUsForMasternodeList.expire(nNow);
+    mWeAskedForMasternodeList.expire(nNow);
+    mWeAskedForMasternodeListEntry.expire(nNow);
 }
 
 void CMasternodeMan::Clear()
 {
     LOCK(cs);
-    vMasternodes.clear();
+    listMasternodes.clear();
+    mapByOutpoint.clear();
+    mapByPubKey.clear();
+    mapByAddr.clear();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
     nDsqCount = 0;
+    nListVersion++;
+    setJournalDirty.clear();
+    fJournalReset = true;
+
+    {
+        LOCK(cs_collateral);
+        mapCollateral.clear();
+    }
+}
+
+int CMasternodeMan::GetCollateralState(const COutPoint& outpoint)
+{
+    LOCK(cs_collateral);
+
+    std::map<COutPoint, int>::iterator it = mapCollateral.find(outpoint);
+    if (it == mapCollateral.end())
+    {
+        // start tracking, events from now on are applied
+        mapCollateral[outpoint] = MASTERNODE_COLLATERAL_UNCHECKED;
+        return MASTERNODE_COLLATERAL_UNCHECKED;
+    }
+    return it->second;
+}
+
+void CMasternodeMan::SetCollateralChecked(const COutPoint& outpoint, bool fSpent)
+{
+    LOCK(cs_collateral);
+
+    std::map<COutPoint, int>::iterator it = mapCollateral.find(outpoint);
+    if (it == mapCollateral.end())
+        return;
+
+    // an event seen since the lookup began is newer than its result
+    if (it->second == MASTERNODE_COLLATERAL_UNCHECKED)
+        it->second = fSpent ? MASTERNODE_COLLATERAL_SPENT_BLOCK : 0;
+    else
+        it->second &= ~MASTERNODE_COLLATERAL_UNCHECKED;
+}
+
+void CMasternodeMan::UpdateCollateral(const CTransaction& tx, bool fBlock, bool fSpent)
+{
+    LOCK(cs_collateral);
+
+    if (mapCollateral.empty())
+        return;
+
+    int nFlag = fBlock ? MASTERNODE_COLLATERAL_SPENT_BLOCK : MASTERNODE_COLLATERAL_SPENT_POOL;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        std::map<COutPoint, int>::iterator it = mapCollateral.find(txin.prevout);
+        if (it == mapCollateral.end())
+            continue;
+
+        if (fSpent)
+            it->second |= nFlag;
+        else
+            it->second &= ~nFlag;
+
+        LogPrint("masternode", "CMasternodeMan: Collateral %s %s by %s\n", txin.prevout.ToString(),
+            fSpent ? "spent" : "released", fBlock ? "block" : "mempool");
+    }
+}
+
+void CMasternodeMan::ForgetCollateral(const COutPoint& outpoint)
+{
+    LOCK(cs_collateral);
+    mapCollateral.erase(outpoint);
 }
 
 int CMasternodeMan::CountEnabled(int protocolVersion)
@@ -296,7 +721,7 @@ int CMasternodeMan::CountEnabled(int protocolVersion)
     int i = 0;
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH(CMasternode& mn, listMasternodes) {
         mn.Check();
         if(mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
@@ -309,7 +734,7 @@ int CMasternodeMan::CountMasternodesAboveProtocol(int protocolVersion)
 {
     int i = 0;
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH(CMasternode& mn, listMasternodes) {
         mn.Check();
         if(mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
@@ -322,29 +747,22 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
 {
     LOCK(cs);
 
-    std::map<CNetAddr, int64_t>::iterator it = mWeAskedForMasternodeList.find(pnode->addr);
-    if (it != mWeAskedForMasternodeList.end())
-    {
-        if (GetTime() < (*it).second) {
-            LogPrintf("dseg - we already asked %s for the list; skipping...\n", pnode->addr.ToString());
-            return;
-        }
+    if (mWeAskedForMasternodeList.contains(pnode->addr, GetTime())) {
+        LogPrintf("dseg - we already asked %s for the list; skipping...\n", pnode->addr.ToString());
+        return;
     }
     pnode->PushMessage("dseg", CTxIn());
     int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
-    mWeAskedForMasternodeList[pnode->addr] = askAgain;
+    mWeAskedForMasternodeList.insert(pnode->addr, askAgain, GetTime());
 }
 
 CMasternode *CMasternodeMan::Find(const CTxIn &vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes)
-    {
-        if(mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
-    return NULL;
+    std::map<COutPoint, std::list<CMasternode>::iterator>::iterator it = mapByOutpoint.find(vin.prevout);
+    if(it == mapByOutpoint.end()) return NULL;
+    return &(*it->second);
 }
 
 CMasternode* CMasternodeMan::FindOldestNotInVec(const std::vector<CTxIn> &vVins, int nMinimumAge)
@@ -353,21 +771,18 @@ CMasternode* CMasternodeMan::FindOldestNotInVec(const std::vector<CTxIn> &vVins,
 
     CMasternode *pOldestMasternode = NULL;
 
-    BOOST_FOREACH(CMasternode &mn, vMasternodes)
+    std::set<COutPoint> setExclude;
+    BOOST_FOREACH(const CTxIn& vin, vVins)
+        setExclude.insert(vin.prevout);
+
+    BOOST_FOREACH(CMasternode &mn, listMasternodes)
     {   
         mn.Check();
         if(!mn.IsEnabled()) continue;
 
         if(mn.GetMasternodeInputAge() < nMinimumAge) continue;
 
-        bool found = false;
-        BOOST_FOREACH(const CTxIn& vin, vVins)
-            if(mn.vin.prevout == vin.prevout)
-            {   
-                found = true;
-                break;
-            }
-        if(found) continue;
+        if(setExclude.count(mn.vin.prevout)) continue;
 
         if(pOldestMasternode == NULL || pOldestMasternode->SecondsSincePayment() < mn.SecondsSincePayment())
         {
@@ -384,19 +799,27 @@ CMasternode *CMasternodeMan::FindRandom()
 
     if(size() == 0) return NULL;
 
-    return &vMasternodes[GetRandInt(vMasternodes.size())];
+    std::list<CMasternode>::iterator it = listMasternodes.begin();
+    std::advance(it, GetRandInt(size()));
+    return &(*it);
 }
 
 CMasternode *CMasternodeMan::Find(const CPubKey &pubKeyMasternode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes)
-    {
-        if(mn.pubkey2 == pubKeyMasternode)
-            return &mn;
-    }
-    return NULL;
+    std::multimap<CPubKey, CMasternode*>::iterator it = mapByPubKey.find(pubKeyMasternode);
+    if(it == mapByPubKey.end()) return NULL;
+    return it->second;
+}
+
+CMasternode *CMasternodeMan::Find(const CService &addr)
+{
+    LOCK(cs);
+
+    std::multimap<CService, CMasternode*>::iterator it = mapByAddr.find(addr);
+    if(it == mapByAddr.end()) return NULL;
+    return it->second;
 }
 
 CMasternode *CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn> &vecToExclude, int protocolVersion)
@@ -411,18 +834,14 @@ CMasternode *CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn> &vecToExclude
 
     int rand = GetRandInt(nCountEnabled - vecToExclude.size());
     LogPrintf("CMasternodeMan::FindRandomNotInVec - rand %d\n", rand);
-    bool found;
 
-    BOOST_FOREACH(CMasternode &mn, vMasternodes) {
+    std::set<COutPoint> setExclude;
+    BOOST_FOREACH(CTxIn &usedVin, vecToExclude)
+        setExclude.insert(usedVin.prevout);
+
+    BOOST_FOREACH(CMasternode &mn, listMasternodes) {
         if(mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
-        found = false;
-        BOOST_FOREACH(CTxIn &usedVin, vecToExclude) {
-            if(mn.vin.prevout == usedVin.prevout) {
-                found = true;
-                break;
-            }
-        }
-        if(found) continue;
+        if(setExclude.count(mn.vin.prevout)) continue;
         if(--rand < 1) {
             return &mn;
         }
@@ -431,136 +850,152 @@ CMasternode *CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn> &vecToExclude
     return NULL;
 }
 
-CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
+// best score first, equal scores ordered by collateral
+struct CompareScoreMN
+{
+    bool operator()(const pair<unsigned int, CMasternode*>& t1,
+                    const pair<unsigned int, CMasternode*>& t2) const
+    {
+        if(t1.first != t2.first) return t1.first > t2.first;
+        return t1.second->vin.prevout < t2.second->vin.prevout;
+    }
+};
+
+const CMasternodeScoreTable* CMasternodeMan::GetScoreTable(int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    unsigned int score = 0;
-    CMasternode* winner = NULL;
+    AssertLockHeld(cs);
 
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
-        mn.Check();
-        if(mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
+    if(pindexBest == NULL) return NULL;
+    if(nBlockHeight == 0) nBlockHeight = pindexBest->nHeight;
 
-        // calculate the score for each masternode
-        uint256 n = mn.CalculateScore(mod, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
+    uint256 hashBlock = 0;
+    bool fKnownBlock = GetBlockHash(hashBlock, nBlockHeight);
+    uint256 hashBest = pindexBest->GetBlockHash();
 
-        // determine the winner
-        if(n2 > score){
-            score = n2;
-            winner = &mn;
+    CMasternodeScoreTable* pTable = NULL;
+    BOOST_FOREACH(CMasternodeScoreTable& table, vScoreTables)
+    {
+        if(table.nBlockHeight == nBlockHeight && table.minProtocol == minProtocol && table.fOnlyActive == fOnlyActive)
+        {
+            pTable = &table;
+            break;
         }
     }
 
-    return winner;
-}
+    if(pTable != NULL
+        && pTable->hashBlock == hashBlock
+        && pTable->hashBest == hashBest
+        && pTable->nListVersion == nListVersion
+        && GetTime() - pTable->nTimeBuilt < MASTERNODES_SCORE_CACHE_SECONDS)
+        return pTable;
 
-int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
-{
-    std::vector<pair<unsigned int, CTxIn> > vecMasternodeScores;
+    if(pTable == NULL)
+    {
+        if(vScoreTables.size() < MASTERNODES_SCORE_TABLES)
+        {
+            vScoreTables.push_back(CMasternodeScoreTable());
+            pTable = &vScoreTables.back();
+        } else
+        {
+            pTable = &vScoreTables[nNextScoreTable];
+            nNextScoreTable = (nNextScoreTable + 1) % MASTERNODES_SCORE_TABLES;
+        }
+    }
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if(!GetBlockHash(hash, nBlockHeight)) return -1;
+    // states are checked once per table, changes bump the list version before it is recorded
+    if(fOnlyActive) Check();
+
+    pTable->nBlockHeight = nBlockHeight;
+    pTable->minProtocol = minProtocol;
+    pTable->fOnlyActive = fOnlyActive;
+    pTable->hashBlock = hashBlock;
+    pTable->hashBest = hashBest;
+    pTable->nListVersion = nListVersion;
+    pTable->nTimeBuilt = GetTime();
+    pTable->vScores.clear();
+    pTable->mapRank.clear();
 
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+    // unknown block, nobody ranks
+    if(!fKnownBlock) return pTable;
 
+    BOOST_FOREACH(CMasternode& mn, listMasternodes)
+    {
         if(mn.protocolVersion < minProtocol) continue;
-        if(fOnlyActive) {
-            mn.Check();
-            if(!mn.IsEnabled()) continue;
-        }
+        if(fOnlyActive && !mn.IsEnabled()) continue;
 
         uint256 n = mn.CalculateScore(1, nBlockHeight);
         unsigned int n2 = 0;
         memcpy(&n2, &n, sizeof(n2));
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
+        pTable->vScores.push_back(make_pair(n2, &mn));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly());
+    sort(pTable->vScores.begin(), pTable->vScores.end(), CompareScoreMN());
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, CTxIn)& s, vecMasternodeScores){
-        rank++;
-        if(s.second == vin) {
-            return rank;
-        }
-    }
+    for(unsigned int i = 0; i < pTable->vScores.size(); i++)
+        pTable->mapRank[pTable->vScores[i].second->vin.prevout] = i + 1;
 
-    return -1;
+    return pTable;
 }
 
-std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
+CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<unsigned int, CMasternode> > vecMasternodeScores;
-    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
-
-    //make sure we know about this block
-    uint256 hash = 0;
-    if(!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
+    LOCK(cs);
 
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+    const CMasternodeScoreTable* pTable = GetScoreTable(nBlockHeight, minProtocol, true);
+    if(pTable == NULL || pTable->vScores.empty()) return NULL;
 
-        mn.Check();
+    // a zero score never wins
+    if(pTable->vScores[0].first == 0) return NULL;
 
-        if(mn.protocolVersion < minProtocol) continue;
-        if(!mn.IsEnabled()) {
-            continue;
-        }
+    return pTable->vScores[0].second;
+}
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
+int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
+    LOCK(cs);
 
-        vecMasternodeScores.push_back(make_pair(n2, mn));
-    }
+    //make sure we know about this block
+    uint256 hash = 0;
+    if(!GetBlockHash(hash, nBlockHeight)) return -1;
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnlyMN());
+    const CMasternodeScoreTable* pTable = GetScoreTable(nBlockHeight, minProtocol, fOnlyActive);
+    if(pTable == NULL) return -1;
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, CMasternode)& s, vecMasternodeScores){
-        rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
-    }
+    std::map<COutPoint, int>::const_iterator it = pTable->mapRank.find(vin.prevout);
+    if(it == pTable->mapRank.end()) return -1;
 
-    return vecMasternodeRanks;
+    return it->second;
 }
 
-CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<unsigned int, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
 
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
 
-        if(mn.protocolVersion < minProtocol) continue;
-        if(fOnlyActive) {
-            mn.Check();
-            if(!mn.IsEnabled()) continue;
-        }
+    //make sure we know about this block
+    uint256 hash = 0;
+    if(!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
+    const CMasternodeScoreTable* pTable = GetScoreTable(nBlockHeight, minProtocol, true);
+    if(pTable == NULL) return vecMasternodeRanks;
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
+    vecMasternodeRanks.reserve(pTable->vScores.size());
+    for(unsigned int i = 0; i < pTable->vScores.size(); i++)
+        vecMasternodeRanks.push_back(make_pair((int)i + 1, *pTable->vScores[i].second));
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly());
+    return vecMasternodeRanks;
+}
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, CTxIn)& s, vecMasternodeScores){
-        rank++;
-        if(rank == nRank) {
-            return Find(s.second);
-        }
-    }
+CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
+    LOCK(cs);
 
-    return NULL;
+    const CMasternodeScoreTable* pTable = GetScoreTable(nBlockHeight, minProtocol, fOnlyActive);
+    if(pTable == NULL || nRank < 1 || nRank > (int)pTable->vScores.size()) return NULL;
+
+    return pTable->vScores[nRank - 1].second;
 }
 
 void CMasternodeMan::ProcessMasternodeConnections()
@@ -673,6 +1108,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             //   after that they just need to match
             if(count == -1 && pmn->pubkey == pubkey && !pmn->UpdatedWithin(MASTERNODE_MIN_DSEE_SECONDS)){
                 pmn->UpdateLastSeen();
+                setJournalDirty.insert(vin.prevout);
 
                 if(pmn->sigTime < sigTime){ //take the newest entry
                     if (!CheckNode((CAddress)addr)){
@@ -682,14 +1118,19 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                         addrman.Add(CAddress(addr), pfrom->addr, 2*60*60); // use this as a peer
                     }
                     LogPrintf("dsee - Got updated entry for %s\n", addr.ToString().c_str());
+                    // key and address are indexed
+                    std::list<CMasternode>::iterator itMn = mapByOutpoint.find(vin.prevout)->second;
+                    Unindex(itMn);
                     pmn->pubkey2 = pubkey2;
                     pmn->sigTime = sigTime;
                     pmn->sig = vchSig;
                     pmn->protocolVersion = protocolVersion;
                     pmn->addr = addr;
+                    Index(itMn);
                     pmn->rewardAddress = rewardAddress;
                     pmn->rewardPercentage = rewardPercentage;                    
                     pmn->Check();
+                    nListVersion++;
                     if(pmn->IsEnabled())
                         mnodeman.RelayMasternodeEntry(vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, rewardAddress, rewardPercentage);
                 }
@@ -735,7 +1176,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             // should be at least not earlier than block when 10000 TansferCoin tx got MASTERNODE_MIN_CONFIRMATIONS
             uint256 hashBlock = 0;
             GetTransaction(vin.prevout.hash, tx, hashBlock);
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
            if (mi != mapBlockIndex.end() && (*mi).second)
             {
                 CBlockIndex* pMNIndex = (*mi).second; // block for 10000 TansferCoin tx -> 1 confirmation
@@ -766,6 +1207,10 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             }          
 
             this->Add(mn);
+
+            // inputs were just found unspent, spend events keep it current from here
+            GetCollateralState(vin.prevout);
+            SetCollateralChecked(vin.prevout, false);
             
             // if it matches our masternodeprivkey, then we've been remotely activated
             if(pubkey2 == activeMasternode.pubKeyMasternode && protocolVersion == PROTOCOL_VERSION){
@@ -828,9 +1273,11 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                 }
 
                 pmn->lastDseep = sigTime;
+                setJournalDirty.insert(vin.prevout);
 
                 if(!pmn->UpdatedWithin(MASTERNODE_MIN_DSEEP_SECONDS))
                 {
+                    nListVersion++;
                     if(stop) pmn->Disable();
                     else
                     {
@@ -846,19 +1293,14 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
         LogPrint("masternode", "dseep - Couldn't find masternode entry %s\n", vin.ToString().c_str());
 
-        std::map<COutPoint, int64_t>::iterator i = mWeAskedForMasternodeListEntry.find(vin.prevout);
-        if (i != mWeAskedForMasternodeListEntry.end())
-        {
-            int64_t t = (*i).second;
-            if (GetTime() < t) return; // we've asked recently
-        }
+        if (mWeAskedForMasternodeListEntry.contains(vin.prevout, GetTime())) return; // we've asked recently
 
         // ask for the dsee info once from the node that sent dseep
 
         LogPrintf("dseep - Asking source node for missing entry %s\n", vin.ToString().c_str());
         pfrom->PushMessage("dseg", vin);
         int64_t askAgain = GetTime()+ MASTERNODE_MIN_DSEEP_SECONDS;
-        mWeAskedForMasternodeListEntry[vin.prevout] = askAgain;
+        mWeAskedForMasternodeListEntry.insert(vin.prevout, askAgain, GetTime());
 
     } else if (strCommand == "mvote") { //Masternode Vote
 
@@ -884,6 +1326,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
                 pmn->nVote = nVote;
                 pmn->lastVote = GetAdjustedTime();
+                setJournalDirty.insert(vin.prevout);
 
                 //send to all peers
                 LOCK(cs_vNodes);
@@ -903,26 +1346,21 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             //local network
             if(!pfrom->addr.IsRFC1918() && Params().NetworkID() == CChainParams::MAIN)
             {
-                std::map<CNetAddr, int64_t>::iterator i = mAskedUsForMasternodeList.find(pfrom->addr);
-                if (i != mAskedUsForMasternodeList.end())
-                {
-                    int64_t t = (*i).second;
-                    if (GetTime() < t) {
-                        Misbehaving(pfrom->GetId(), 34);
-                        LogPrintf("dseg - peer already asked me for the list\n");
-                        return;
-                    }
+                if (mAskedUsForMasternodeList.contains(pfrom->addr, GetTime())) {
+                    Misbehaving(pfrom->GetId(), 34);
+                    LogPrintf("dseg - peer already asked me for the list\n");
+                    return;
                 }
 
                 int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
-                mAskedUsForMasternodeList[pfrom->addr] = askAgain;
+                mAskedUsForMasternodeList.insert(pfrom->addr, askAgain, GetTime());
             }
         } //else, asking for a specific node which is ok
 
         int count = this->size();
         int i = 0;
 
-        BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+        BOOST_FOREACH(CMasternode& mn, listMasternodes) {
 
             if(mn.addr.IsRFC1918()) continue; //local network
 
@@ -964,21 +1402,122 @@ void CMasternodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
 
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while(it != vMasternodes.end()){
-        if((*it).vin == vin){
-            LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).addr.ToString().c_str(), size() - 1);
-            vMasternodes.erase(it);
-            break;
-        }
+    std::map<COutPoint, std::list<CMasternode>::iterator>::iterator mi = mapByOutpoint.find(vin.prevout);
+    if(mi == mapByOutpoint.end() || mi->second->vin != vin) return;
+
+    std::list<CMasternode>::iterator it = mi->second;
+    LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).addr.ToString().c_str(), size() - 1);
+    ForgetCollateral((*it).vin.prevout);
+    Unindex(it);
+    setJournalDirty.insert(vin.prevout);
+    listMasternodes.erase(it);
+    nListVersion++;
+}
+
+bool CMasternodeMan::PopJournalChanges(std::vector<CMasternode>& vChanged, std::vector<COutPoint>& vRemoved)
+{
+    LOCK(cs);
+
+    BOOST_FOREACH(const COutPoint& outpoint, setJournalDirty)
+    {
+        std::map<COutPoint, std::list<CMasternode>::iterator>::iterator it = mapByOutpoint.find(outpoint);
+        if(it != mapByOutpoint.end())
+            vChanged.push_back(*it->second);
+        else
+            vRemoved.push_back(outpoint);
+    }
+    setJournalDirty.clear();
+
+    bool fIncremental = !fJournalReset;
+    fJournalReset = false;
+    return fIncremental;
+}
+
+void CMasternodeMan::ResetJournal()
+{
+    LOCK(cs);
+    fJournalReset = true;
+}
+
+void CMasternodeMan::ApplyJournalEntry(const CMasternode& mn)
+{
+    LOCK(cs);
+
+    std::map<COutPoint, std::list<CMasternode>::iterator>::iterator mi = mapByOutpoint.find(mn.vin.prevout);
+    if(mi == mapByOutpoint.end())
+    {
+        listMasternodes.push_back(mn);
+        Index(--listMasternodes.end());
+    } else
+    {
+        std::list<CMasternode>::iterator it = mi->second;
+        Unindex(it);
+        *it = mn;
+        Index(it);
+    }
+    nListVersion++;
+}
+
+void CMasternodeMan::ApplyJournalRemove(const COutPoint& outpoint)
+{
+    LOCK(cs);
+
+    std::map<COutPoint, std::list<CMasternode>::iterator>::iterator mi = mapByOutpoint.find(outpoint);
+    if(mi == mapByOutpoint.end()) return;
+
+    std::list<CMasternode>::iterator it = mi->second;
+    Unindex(it);
+    listMasternodes.erase(it);
+    nListVersion++;
+}
+
+void CMasternodeMan::LoadAsked(const mapAddrTime& mapAskedUs, const mapAddrTime& mapWeAsked, const mapOutpointTime& mapWeAskedEntry)
+{
+    AssertLockHeld(cs);
+
+    int64_t nNow = GetTime();
+    mAskedUsForMasternodeList.clear();
+    mWeAskedForMasternodeList.clear();
+    mWeAskedForMasternodeListEntry.clear();
+
+    for(mapAddrTime::const_iterator it = mapAskedUs.begin(); it != mapAskedUs.end(); ++it)
+        if(it->second > nNow) mAskedUsForMasternodeList.insert(it->first, it->second, nNow);
+    for(mapAddrTime::const_iterator it = mapWeAsked.begin(); it != mapWeAsked.end(); ++it)
+        if(it->second > nNow) mWeAskedForMasternodeList.insert(it->first, it->second, nNow);
+    for(mapOutpointTime::const_iterator it = mapWeAskedEntry.begin(); it != mapWeAskedEntry.end(); ++it)
+        if(it->second > nNow) mWeAskedForMasternodeListEntry.insert(it->first, it->second, nNow);
+}
+
+void CMasternodeMan::GetSeenCacheStats(std::map<std::string, seencache_stats>& mapStats)
+{
+    LOCK(cs);
+
+    mapStats["askedUsForList"] = mAskedUsForMasternodeList.stats();
+    mapStats["weAskedForList"] = mWeAskedForMasternodeList.stats();
+    mapStats["weAskedForEntry"] = mWeAskedForMasternodeListEntry.stats();
+}
+
+boost::shared_ptr<const std::vector<CMasternode> > CMasternodeMan::GetFullMasternodeVector()
+{
+    LOCK(cs);
+
+    Check();
+
+    // last seen times change without a version bump, so snapshots are also refreshed by age
+    if(!pSnapshot || nSnapshotVersion != nListVersion || GetTime() - nSnapshotTime >= MASTERNODES_SNAPSHOT_SECONDS)
+    {
+        pSnapshot.reset(new std::vector<CMasternode>(listMasternodes.begin(), listMasternodes.end()));
+        nSnapshotVersion = nListVersion;
+        nSnapshotTime = GetTime();
     }
+    return pSnapshot;
 }
 
 std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
 
-    info << "masternodes: " << (int)vMasternodes.size() <<
+    info << "masternodes: " << (int)mapByOutpoint.size() <<
             ", peers who asked us for masternode list: " << (int)mAskedUsForMasternodeList.size() <<
             ", peers we asked for masternode list: " << (int)mWeAskedForMasternodeList.size() <<
             ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() <<
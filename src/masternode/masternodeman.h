@@ -16,9 +16,25 @@
 #include "base58.h"
 #include "main.h"
 #include "masternode.h"
+#include "seencache.h"
+
+#include <list>
+
+#include <boost/shared_ptr.hpp>
 
 #define MASTERNODES_DUMP_SECONDS               (15*60)
 #define MASTERNODES_DSEG_SECONDS               (3*60*60)
+#define MASTERNODES_SCORE_TABLES               8
+#define MASTERNODES_SCORE_CACHE_SECONDS        (1*60)
+#define MASTERNODES_SNAPSHOT_SECONDS           10
+#define MASTERNODES_ASKED_LIST_MAX             4096  // peers remembered for dseg rate limits
+#define MASTERNODES_ASKED_ENTRY_MAX            16384 // collaterals remembered for single entry requests
+#define MASTERNODES_JOURNAL_MIN_COMPACT        (256*1024) // journal is folded into mncache.dat beyond this and the snapshot size
+
+// collateral spend state, 0 while unspent
+#define MASTERNODE_COLLATERAL_UNCHECKED        (1 << 0) // not seen yet, Check() looks it up once
+#define MASTERNODE_COLLATERAL_SPENT_BLOCK      (1 << 1)
+#define MASTERNODE_COLLATERAL_SPENT_POOL       (1 << 2)
 
 using namespace std;
 
@@ -29,14 +45,31 @@ extern CMasternodeMan mnodeman;
 extern void Misbehaving(NodeId nodeid, int howmuch);
 
 void DumpMasternodes();
-
-/** Access to the MN database (mncache.dat) */
+bool LoadMasternodes();
+
+/** Access to the MN database (mncache.dat)
+ *
+ *  mncache.dat holds a full snapshot of the list, mnjournal.dat the entries changed and removed since.
+ *  The journal starts with the network magic and the checksum of the snapshot it extends, followed by
+ *  records of [size][type + payload][checksum]. Loading replays the records up to the first incomplete
+ *  or damaged one and cuts the journal there, a journal left over from an older snapshot is ignored.
+ */
 class CMasternodeDB
 {
 private:
     boost::filesystem::path pathMN;
+    boost::filesystem::path pathJournal;
     std::string strMagicMessage;
+
+    bool ReadSnapshotHash(uint256& hash);
+    bool WriteJournalHeader(const uint256& hashSnapshot);
+    void ReadJournal(CMasternodeMan& mnodemanToLoad, const uint256& hashSnapshot);
 public:
+    enum JournalRecord {
+        JOURNAL_ENTRY = 1,      // entry added or updated, full masternode follows
+        JOURNAL_REMOVE = 2      // collateral outpoint follows
+    };
+
     enum ReadResult {
         Ok,
        FileError,
@@ -49,7 +82,39 @@ public:
 
     CMasternodeDB();
     bool Write(const CMasternodeMan &mnodemanToSave);
-    ReadResult Read(CMasternodeMan& mnodemanToLoad);
+    ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fJournal = true);
+    // append changes to the journal, false if it doesn't extend the current snapshot or is due for compaction
+    bool Append(const std::vector<CMasternode>& vChanged, const std::vector<COutPoint>& vRemoved);
+};
+
+/** Scores of the masternodes for one block height, best first.
+ *  Entries point into listMasternodes, so a table is only good for the list version it was built on.
+ */
+class CMasternodeScoreTable
+{
+public:
+    int64_t nBlockHeight;
+    int minProtocol;
+    bool fOnlyActive;
+    uint256 hashBlock;      // block the scores are drawn from
+    uint256 hashBest;       // chain tip when built, states are checked against it
+    int64_t nListVersion;
+    int64_t nTimeBuilt;
+
+    // score and entry in listMasternodes, rank is position + 1
+    std::vector<pair<unsigned int, CMasternode*> > vScores;
+    std::map<COutPoint, int> mapRank;
+
+    CMasternodeScoreTable()
+    {
+        nBlockHeight = -1;
+        minProtocol = 0;
+        fOnlyActive = true;
+        hashBlock = 0;
+        hashBest = 0;
+        nListVersion = -1;
+        nTimeBuilt = 0;
+    }
 };
 
 class CMasternodeMan
@@ -58,14 +123,50 @@ private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
 
-    // map to hold all MNs
-    std::vector<CMasternode> vMasternodes;
-    // who's asked for the masternode list and the last time
-    std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
-    // who we asked for the masternode list and the last time
-    std::map<CNetAddr, int64_t> mWeAskedForMasternodeList;
-    // which masternodes we've asked for
-    std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
+    // list to hold all MNs, entries don't move so pointers to them stay valid until removed
+    std::list<CMasternode> listMasternodes;
+    // indexes into listMasternodes, the outpoint index keeps list iterators so entries can be erased without a scan
+    std::map<COutPoint, std::list<CMasternode>::iterator> mapByOutpoint;
+    std::multimap<CPubKey, CMasternode*> mapByPubKey;
+    std::multimap<CService, CMasternode*> mapByAddr;
+    // who's asked for the masternode list and until when they may not ask again
+    seencache<CNetAddr> mAskedUsForMasternodeList;
+    // who we asked for the masternode list and until when we won't ask again
+    seencache<CNetAddr> mWeAskedForMasternodeList;
+    // which masternodes we've asked for and until when
+    seencache<COutPoint> mWeAskedForMasternodeListEntry;
+
+    // bumped when masternodes are added, removed or change state, invalidates the score tables
+    int64_t nListVersion;
+    // score tables of the heights asked for recently
+    std::vector<CMasternodeScoreTable> vScoreTables;
+    unsigned int nNextScoreTable;
+
+    const CMasternodeScoreTable* GetScoreTable(int64_t nBlockHeight, int minProtocol, bool fOnlyActive);
+
+    // read-only copy of the list handed to callers, shared until the list changes
+    boost::shared_ptr<const std::vector<CMasternode> > pSnapshot;
+    int64_t nSnapshotVersion;
+    int64_t nSnapshotTime;
+
+    void Index(std::list<CMasternode>::iterator it);
+    void Unindex(std::list<CMasternode>::iterator it);
+    void Load(const std::vector<CMasternode>& vMasternodes);
+    typedef std::map<CNetAddr, int64_t> mapAddrTime;
+    typedef std::map<COutPoint, int64_t> mapOutpointTime;
+    void LoadAsked(const mapAddrTime& mapAskedUs, const mapAddrTime& mapWeAsked, const mapOutpointTime& mapWeAskedEntry);
+
+    // collaterals changed since the last dump, they go to the journal
+    std::set<COutPoint> setJournalDirty;
+    // list replaced as a whole, the next dump writes a full snapshot
+    bool fJournalReset;
+
+    // spend state of the collateral outpoints, kept current by block and memory pool events.
+    // cs_collateral is always taken last, nothing is called while holding it
+    mutable CCriticalSection cs_collateral;
+    std::map<COutPoint, int> mapCollateral;
+
+    void ForgetCollateral(const COutPoint& outpoint);
 
 public:
     // keep track of dsq count to prevent masternodes from gaming darksend queue
@@ -80,10 +181,28 @@ public:
                 LOCK(cs);
                 unsigned char nVersion = 0;
                 READWRITE(nVersion);
+                std::vector<CMasternode> vMasternodes;
+                if (!fRead)
+                    vMasternodes.assign(listMasternodes.begin(), listMasternodes.end());
                 READWRITE(vMasternodes);
-                READWRITE(mAskedUsForMasternodeList);
-                READWRITE(mWeAskedForMasternodeList);
-                READWRITE(mWeAskedForMasternodeListEntry);
+                if (fRead)
+                    const_cast<CMasternodeMan*>(this)->Load(vMasternodes);
+
+                // the caches are stored as maps of key and expiry time
+                mapAddrTime mapAskedUs;
+                mapAddrTime mapWeAsked;
+                mapOutpointTime mapWeAskedEntry;
+                if (!fRead)
+                {
+                    mAskedUsForMasternodeList.get(mapAskedUs);
+                    mWeAskedForMasternodeList.get(mapWeAsked);
+                    mWeAskedForMasternodeListEntry.get(mapWeAskedEntry);
+                }
+                READWRITE(mapAskedUs);
+                READWRITE(mapWeAsked);
+                READWRITE(mapWeAskedEntry);
+                if (fRead)
+                    const_cast<CMasternodeMan*>(this)->LoadAsked(mapAskedUs, mapWeAsked, mapWeAskedEntry);
                 READWRITE(nDsqCount);
         }
     )
@@ -106,6 +225,13 @@ public:
     // Clear masternode vector
     void Clear();
 
+    // Spend state of a collateral, MASTERNODE_COLLATERAL_*
+    int GetCollateralState(const COutPoint& outpoint);
+    // Record the result of a full lookup for an unchecked collateral
+    void SetCollateralChecked(const COutPoint& outpoint, bool fSpent);
+    // Called for the inputs of transactions entering or leaving blocks and the memory pool
+    void UpdateCollateral(const CTransaction& tx, bool fBlock, bool fSpent);
+
     int CountEnabled(int protocolVersion = -1);
 
     int CountMasternodesAboveProtocol(int protocolVersion);
@@ -115,6 +241,7 @@ public:
     // Find an entry
     CMasternode* Find(const CTxIn& vin);
     CMasternode* Find(const CPubKey& pubKeyMasternode);
+    CMasternode* Find(const CService& addr);
 
     //Find an entry thta do not match every entry provided vector
     CMasternode* FindOldestNotInVec(const std::vector<CTxIn> &vVins, int nMinimumAge);
@@ -128,7 +255,8 @@ public:
     // Get the current winner for this block
     CMasternode* GetCurrentMasterNode(int mod=1, int64_t nBlockHeight=0, int minProtocol=0);
 
-    std::vector<CMasternode> GetFullMasternodeVector() { Check(); return vMasternodes; }
+    // Checked copy of all entries, shared between callers until the list changes
+    boost::shared_ptr<const std::vector<CMasternode> > GetFullMasternodeVector();
 
     std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol=0);
     int GetMasternodeRank(const CTxIn &vin, int64_t nBlockHeight, int minProtocol=0, bool fOnlyActive=true);
@@ -139,10 +267,13 @@ public:
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
     // Return the number of (unique) masternodes
-    int size() { return vMasternodes.size(); }
+    int size() { return mapByOutpoint.size(); }
 
     std::string ToString() const;
 
+    // Occupancy of the request caches, by name
+    void GetSeenCacheStats(std::map<std::string, seencache_stats>& mapStats);
+
     //
     // Relay Masternode Messages
     //
@@ -152,6 +283,14 @@ public:
 
     void Remove(CTxIn vin);
 
+    // Entries changed and collaterals removed since the last call, false if a full dump is needed instead
+    bool PopJournalChanges(std::vector<CMasternode>& vChanged, std::vector<COutPoint>& vRemoved);
+    // Make the next dump a full snapshot
+    void ResetJournal();
+    // Replay journal records on load
+    void ApplyJournalEntry(const CMasternode& mn);
+    void ApplyJournalRemove(const COutPoint& outpoint);
+
 };
 
 #endif
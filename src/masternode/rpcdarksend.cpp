@@ -136,7 +136,7 @@ Value masternode(const Array& params, bool fHelp)
     if (fHelp  ||
         (strCommand != "count" && strCommand != "current" && strCommand != "debug" && strCommand != "genkey" && strCommand != "enforce" && strCommand != "list" && strCommand != "list-conf"
         	&& strCommand != "start" && strCommand != "start-alias" && strCommand != "start-many" && strCommand != "status" && strCommand != "stop" && strCommand != "stop-alias"
-                && strCommand != "stop-many" && strCommand != "winners" && strCommand != "connect" && strCommand != "outputs" && strCommand != "vote-many" && strCommand != "vote"))
+                && strCommand != "stop-many" && strCommand != "winners" && strCommand != "connect" && strCommand != "outputs" && strCommand != "vote-many" && strCommand != "vote" && strCommand != "caches"))
         throw runtime_error(
                 "masternode \"command\"... ( \"passphrase\" )\n"
                 "Set of commands to execute masternode related actions\n"
@@ -144,6 +144,7 @@ Value masternode(const Array& params, bool fHelp)
                 "1. \"command\"        (string or set of strings, required) The command to execute\n"
                 "2. \"passphrase\"     (string, optional) The wallet passphrase\n"
                 "\nAvailable commands:\n"
+                "  caches       - Print occupancy of the seen message and request caches\n"
                 "  count        - Print number of all known masternodes (optional: 'enabled', 'both')\n"
                 "  current      - Print info on current masternode winner\n"
                 "  debug        - Print masternode status\n"
@@ -479,6 +480,33 @@ Value masternode(const Array& params, bool fHelp)
 		return returnObj;
     }
 
+    if (strCommand == "caches")
+    {
+        std::map<std::string, seencache_stats> mapStats;
+        mnodeman.GetSeenCacheStats(mapStats);
+        {
+            LOCK(cs_masternodepayments);
+            mapStats["masternodeVotes"] = seenMasternodeVotes.stats();
+        }
+        mapStats["darksendQueue"] = darkSendPool.GetSeenQueueStats();
+
+        Object obj;
+        size_t nTotalBytes = 0;
+        for(std::map<std::string, seencache_stats>::iterator it = mapStats.begin(); it != mapStats.end(); ++it)
+        {
+            Object objCache;
+            objCache.push_back(Pair("entries",      (uint64_t)it->second.nEntries));
+            objCache.push_back(Pair("capacity",     (uint64_t)it->second.nMaxEntries));
+            objCache.push_back(Pair("bytes",        (uint64_t)it->second.nBytes));
+            objCache.push_back(Pair("evicted",      it->second.nEvicted));
+            objCache.push_back(Pair("expired",      it->second.nExpired));
+            obj.push_back(Pair(it->first, objCache));
+            nTotalBytes += it->second.nBytes;
+        }
+        obj.push_back(Pair("totalbytes", (uint64_t)nTotalBytes));
+        return obj;
+    }
+
     if (strCommand == "debug")
     {
         if(activeMasternode.status == MASTERNODE_REMOTELY_ENABLED) return "masternode started remotely";
@@ -796,8 +824,8 @@ Value masternodelist(const Array& params, bool fHelp)
             obj.push_back(Pair(strVin,       s.first));
         }
     } else {
-        std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
-        BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+        boost::shared_ptr<const std::vector<CMasternode> > pMasternodes = mnodeman.GetFullMasternodeVector();
+        BOOST_FOREACH(const CMasternode& mn, *pMasternodes) {
             std::string strVin = mn.vin.prevout.ToStringShort();
             if (strMode == "activeseconds") {
                 if(strFilter !="" && strVin.find(strFilter) == string::npos) continue;
@@ -25,6 +25,8 @@
 
 #include <boost/filesystem.hpp>
 
+#include <math.h>
+
 // Dump addresses to peers.dat every 15 minutes (900s)
 #define DUMP_ADDRESSES_INTERVAL 900
 
@@ -375,6 +377,8 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+CCriticalSection CNode::cs_totalMsgStats;
+netmsgstats_t CNode::mapTotalRecvMsgStats;
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -796,6 +800,12 @@ void SocketSendData(CNode *pnode)
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
+{
+    // -1/2^48 scales the 48 random bits into (0, 1]
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
+}
+
 static list<CNode*> vNodesDisconnected;
 
 void ThreadSocketHandler()
@@ -1267,6 +1277,8 @@ void DumpAddresses()
 {
     int64_t nStart = GetTimeMillis();
 
+    addrman.FlushPending();
+
     CAddrDB adb;
     adb.Write(addrman);
 
@@ -1913,3 +1925,38 @@ uint64_t CNode::GetTotalBytesSent()
     LOCK(cs_totalBytesSent);
     return nTotalBytesSent;
 }
+
+CNetMsgStats& MessageStatsEntry(netmsgstats_t& mapStats, const std::string& strCommand)
+{
+    // Peers choose the command string, don't let them grow the map without bound
+    netmsgstats_t::iterator it = mapStats.find(strCommand);
+    if (it != mapStats.end())
+        return it->second;
+    if (mapStats.size() >= MAX_NET_MSG_STATS_COMMANDS)
+        return mapStats[NET_MSG_STATS_OTHER];
+    return mapStats[strCommand];
+}
+
+void CNode::RecordMessageStats(const std::string& strCommand, unsigned int nSize, int64_t nMicros)
+{
+    {
+        LOCK(cs_msgstats);
+        MessageStatsEntry(mapRecvMsgStats, strCommand).Add(nSize, nMicros);
+    }
+    {
+        LOCK(cs_totalMsgStats);
+        MessageStatsEntry(mapTotalRecvMsgStats, strCommand).Add(nSize, nMicros);
+    }
+}
+
+void CNode::GetMessageStats(netmsgstats_t& mapStats)
+{
+    LOCK(cs_msgstats);
+    mapStats = mapRecvMsgStats;
+}
+
+void CNode::GetTotalMessageStats(netmsgstats_t& mapStats)
+{
+    LOCK(cs_totalMsgStats);
+    mapStats = mapTotalRecvMsgStats;
+}
@@ -51,6 +51,16 @@ static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
+/** Average delay between trickled inventory transmissions in seconds.
+ *  Blocks are announced immediately, outbound peers flush twice as often. */
+static const unsigned int INVENTORY_BROADCAST_INTERVAL = 5;
+/** Maximum number of tx inventory items announced to a peer per flush. */
+static const unsigned int INVENTORY_BROADCAST_MAX = 7 * INVENTORY_BROADCAST_INTERVAL;
+/** Maximum number of tx inventory items waiting for a peer, the oldest are dropped past it. */
+static const unsigned int INVENTORY_TX_TO_SEND_MAX = 1000;
+/** Number of recent inventory items remembered per peer, and the false positive rate used. */
+static const unsigned int INVENTORY_KNOWN_FILTER_SIZE = 10000;
+static const double INVENTORY_KNOWN_FILTER_FPRATE = 0.00001;
 
 /** -upnp default */
 #ifdef USE_UPNP
@@ -76,6 +86,9 @@ void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
 
+/** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
+
 // Signals for message handling
 struct CNodeSignals
 {
@@ -266,6 +279,53 @@ public:
 
 typedef std::map<CNetAddr, int64_t> banmap_t;
 
+/** Maximum number of distinct commands tracked per node, the rest are counted under NET_MSG_STATS_OTHER */
+static const unsigned int MAX_NET_MSG_STATS_COMMANDS = 64;
+static const char NET_MSG_STATS_OTHER[] = "*other*";
+
+/** Counters for one message command: count, payload bytes and processing time */
+class CNetMsgStats
+{
+public:
+    // Processing time histogram, decade buckets: <10us, <100us, <1ms, <10ms, <100ms, <1s, <10s, >=10s
+    static const int NUM_TIME_BUCKETS = 8;
+
+    uint64_t nCount;
+    uint64_t nBytes;
+    int64_t nTimeTotal; // microseconds
+    int64_t nTimeMax;   // microseconds
+    uint64_t vTimeBuckets[NUM_TIME_BUCKETS];
+
+    CNetMsgStats()
+    {
+        nCount = 0;
+        nBytes = 0;
+        nTimeTotal = 0;
+        nTimeMax = 0;
+        for (int i = 0; i < NUM_TIME_BUCKETS; ++i)
+            vTimeBuckets[i] = 0;
+    };
+
+    void Add(unsigned int nSize, int64_t nMicros)
+    {
+        nCount++;
+        nBytes += nSize;
+        nTimeTotal += nMicros;
+        if (nMicros > nTimeMax)
+            nTimeMax = nMicros;
+
+        int i = 0;
+        for (int64_t nLimit = 10; i < NUM_TIME_BUCKETS - 1 && nMicros >= nLimit; nLimit *= 10)
+            i++;
+        vTimeBuckets[i]++;
+    };
+};
+
+typedef std::map<std::string, CNetMsgStats> netmsgstats_t;
+
+/** Counters for strCommand in mapStats, NET_MSG_STATS_OTHER once MAX_NET_MSG_STATS_COMMANDS are tracked */
+CNetMsgStats& MessageStatsEntry(netmsgstats_t& mapStats, const std::string& strCommand);
+
 class SecMsgNode
 {
 public:
@@ -275,6 +335,7 @@ public:
         lastMatched     = 0;
         ignoreUntil     = 0;
         nWakeCounter    = 0;
+        nFeatures       = 0;
         fEnabled        = false;
     };
     
@@ -285,7 +346,10 @@ public:
     int64_t                     lastMatched;
     int64_t                     ignoreUntil;
     uint32_t                    nWakeCounter;
+    uint32_t                    nFeatures;      // SMSG_FEATURE_* announced by peer in smsgFeatures
     bool                        fEnabled;
+    std::set<int64_t>           setIbltExpected; // buckets announced to the peer, it may answer each with one smsgIblt
+    std::map<int64_t, uint32_t> mapIbltSent;    // cells of the smsgIblt sent per bucket, a smsgIbltRetry must ask for more
     
 };
 
@@ -369,8 +433,11 @@ public:
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
-    std::vector<CInv> vInventoryToSend;
+    CRollingBloomFilter filterInventoryKnown;
+    std::deque<CInv> vInventoryToSend;
+    std::set<uint256> setInventoryToSend;   // hashes in vInventoryToSend
+    unsigned int nInventoryTxToSend;        // MSG_TX items in vInventoryToSend
+    int64_t nNextInvSend;
     CCriticalSection cs_inventory;
 	std::set<uint256> setAskFor;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -391,7 +458,12 @@ public:
     CCriticalSection cs_filter;
     CBloomFilter* pfilter;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+    // Received message counters by command
+    netmsgstats_t mapRecvMsgStats;
+    CCriticalSection cs_msgstats;
+
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false)
+        : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000), filterInventoryKnown(INVENTORY_KNOWN_FILTER_SIZE, INVENTORY_KNOWN_FILTER_FPRATE)
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -426,7 +498,8 @@ public:
 		fStartSync = false;
         fGetAddr = false;
         nMisbehavior = 0;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
+        nNextInvSend = 0;
+        nInventoryTxToSend = 0;
         pfilter = NULL;
         nPingNonceSent = 0;
         nPingUsecStart = 0;
@@ -458,6 +531,8 @@ private:
     static CCriticalSection cs_totalBytesSent;
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
+    static CCriticalSection cs_totalMsgStats;
+    static netmsgstats_t mapTotalRecvMsgStats;
 
     CNode(const CNode&);
     void operator=(const CNode&);
@@ -523,7 +598,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -531,8 +606,24 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
-                vInventoryToSend.push_back(inv);
+            if (filterInventoryKnown.contains(inv.hash)
+                || !setInventoryToSend.insert(inv.hash).second)
+                return;
+            vInventoryToSend.push_back(inv);
+
+            // a peer that can't keep up misses the oldest tx announcements instead of growing the queue
+            if (inv.type == MSG_TX && ++nInventoryTxToSend > INVENTORY_TX_TO_SEND_MAX)
+            {
+                for (std::deque<CInv>::iterator it = vInventoryToSend.begin(); it != vInventoryToSend.end(); ++it)
+                {
+                    if (it->type != MSG_TX)
+                        continue;
+                    setInventoryToSend.erase(it->hash);
+                    vInventoryToSend.erase(it);
+                    nInventoryTxToSend--;
+                    break;
+                }
+            }
         }
     }
 
@@ -889,6 +980,11 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    // Message processing stats, per node and since startup
+    void RecordMessageStats(const std::string& strCommand, unsigned int nSize, int64_t nMicros);
+    void GetMessageStats(netmsgstats_t& mapStats);
+    static void GetTotalMessageStats(netmsgstats_t& mapStats);
 };
 
 class CTransaction;
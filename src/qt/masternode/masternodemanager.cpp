@@ -150,9 +150,9 @@ void MasternodeManager::updateNodeList()
     ui->tableWidgetMasternodes->setSortingEnabled(false);
     ui->tableWidgetMasternodes->clearContents();
     ui->tableWidgetMasternodes->setRowCount(0);
-    std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
+    boost::shared_ptr<const std::vector<CMasternode> > pMasternodes = mnodeman.GetFullMasternodeVector();
     
-    BOOST_FOREACH(CMasternode& mn, vMasternodes)
+    BOOST_FOREACH(const CMasternode& mn, *pMasternodes)
     {
 
         // populate list
@@ -298,7 +298,7 @@ void MasternodeManager::on_UpdateButton_clicked()
         std::string strRewardAddress = mne.getRewardAddress();
         std::string strRewardPercentage = mne.getRewardPercentage();
 
-        std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
+        boost::shared_ptr<const std::vector<CMasternode> > pMasternodes = mnodeman.GetFullMasternodeVector();
         if (errorMessage == ""){
             updateAdrenalineNode(QString::fromStdString(mne.getAlias()), QString::fromStdString(mne.getIp()), QString::fromStdString(mne.getPrivKey()), QString::fromStdString(mne.getTxHash()),
                 QString::fromStdString(mne.getOutputIndex()), QString::fromStdString(strRewardAddress), QString::fromStdString(strRewardPercentage), QString::fromStdString("Not in the masternode list."));
@@ -308,7 +308,7 @@ void MasternodeManager::on_UpdateButton_clicked()
                 QString::fromStdString(mne.getOutputIndex()), QString::fromStdString(strRewardAddress), QString::fromStdString(strRewardPercentage), QString::fromStdString(errorMessage));
         }
 
-        BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+        BOOST_FOREACH(const CMasternode& mn, *pMasternodes) {
             if (mn.addr.ToString().c_str() == mne.getIp()){
                 updateAdrenalineNode(QString::fromStdString(mne.getAlias()), QString::fromStdString(mne.getIp()), QString::fromStdString(mne.getPrivKey()), QString::fromStdString(mne.getTxHash()),
                 QString::fromStdString(mne.getOutputIndex()), QString::fromStdString(strRewardAddress), QString::fromStdString(strRewardPercentage), QString::fromStdString("Masternode is Running."));
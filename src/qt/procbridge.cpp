@@ -1091,7 +1091,7 @@ QVariantMap UIProcBridge::findBlock(QString searchID)
         
         // -- look for a block or transaction
         //    Note: only finds transactions in the block chain
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
         if (mi != mapBlockIndex.end()
             || (GetTransactionBlockHash(hash, hashBlock)
                 && (mi = mapBlockIndex.find(hashBlock)) != mapBlockIndex.end()))
@@ -1138,7 +1138,7 @@ QVariantMap UIProcBridge::blockDetails(QString blkHash)
     CBlockIndex* blkIndex;
     CBlock block;
     
-    std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi == mapBlockIndex.end())
     {
         blockDetail.insert("error_msg", "Block not found.");
@@ -1219,7 +1219,7 @@ QVariantMap UIProcBridge::listTransactionsForBlock(QString blkHash)
     CBlockIndex* selectedBlkIndex;
     CBlock block;
 
-    std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi == mapBlockIndex.end())
     {
         blkTransactions.insert("error_msg", "Block not found.");
@@ -1266,7 +1266,7 @@ QVariantMap UIProcBridge::txnDetails(QString blkHash, QString txnHash)
     CBlockIndex* selectedBlkIndex;
     CBlock block;
 
-    std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi == mapBlockIndex.end())
     {
         txnDetail.insert("error_msg", "Block not found.");
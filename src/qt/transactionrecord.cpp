@@ -385,7 +385,7 @@ void TransactionRecord::updateStatus(const CWalletTx &wtx)
     if (nNodeMode == NT_FULL)
     {
         CBlockIndex* pindex = NULL;
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(wtx.hashBlock);
         if (mi != mapBlockIndex.end())
         {
             pindex = (*mi).second;
@@ -394,7 +394,7 @@ void TransactionRecord::updateStatus(const CWalletTx &wtx)
     } else
     {
         CBlockThinIndex* pindex = NULL;
-        std::map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.find(wtx.hashBlock);
+        BlockThinMap::iterator mi = mapBlockThinIndex.find(wtx.hashBlock);
         if (mi != mapBlockThinIndex.end())
         {
             pindex = (*mi).second;
@@ -440,7 +440,7 @@ Value getblockbynumber(const Array& params, bool fHelp)
         
         
         CBlockThin block;
-        std::map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.find(hashBestChain);
+        BlockThinMap::iterator mi = mapBlockThinIndex.find(hashBestChain);
         if (mi != mapBlockThinIndex.end())
         {
             CBlockThinIndex* pblockindex = mi->second;
@@ -657,7 +657,7 @@ Value rewindchain(const Array& params, bool fHelp)
         uint256 hashblock = block.GetHash();
         LogPrintf("hashblock %s .\n", hashblock.ToString().c_str());
         
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashblock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashblock);
         if (mi != mapBlockIndex.end() && (*mi).second)
         {
             LogPrintf("block is in main chain.\n");
@@ -684,7 +684,7 @@ Value rewindchain(const Array& params, bool fHelp)
                 mi->second->pprev->pnext = NULL;
             };
             
-            delete mi->second;
+            arenaBlockIndex.Delete(mi->second);
             mapBlockIndex.erase(mi);
         };
 
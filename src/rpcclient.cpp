@@ -109,6 +109,11 @@ static const CRPCConvertParam vRPCConvertParams[] =
 {
     { "stop", 0 },
     { "getaddednodeinfo", 0 },
+    { "getnetmsgstats", 0 },
+    { "smsginbox", 1 },
+    { "smsginbox", 2 },
+    { "smsgoutbox", 1 },
+    { "smsgoutbox", 2 },
     { "sendtoaddress", 1 },
     { "settxfee", 0 },
     { "getreceivedbyaddress", 1 },
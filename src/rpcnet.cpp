@@ -309,6 +309,71 @@ Value getnettotals(const Array& params, bool fHelp)
 }
 
 
+static Object MessageStatsToJSON(const netmsgstats_t& mapStats)
+{
+    static const char* pszBuckets[CNetMsgStats::NUM_TIME_BUCKETS] =
+        {"<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", "<10s", ">=10s"};
+
+    Object result;
+    for (netmsgstats_t::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it)
+    {
+        const CNetMsgStats& stats = it->second;
+        Object obj;
+        obj.push_back(Pair("count", (uint64_t)stats.nCount));
+        obj.push_back(Pair("bytes", (uint64_t)stats.nBytes));
+        obj.push_back(Pair("timetotal", stats.nTimeTotal));
+        obj.push_back(Pair("timeavg", stats.nCount ? stats.nTimeTotal / (int64_t)stats.nCount : 0));
+        obj.push_back(Pair("timemax", stats.nTimeMax));
+
+        Object hist;
+        for (int i = 0; i < CNetMsgStats::NUM_TIME_BUCKETS; ++i)
+            hist.push_back(Pair(pszBuckets[i], (uint64_t)stats.vTimeBuckets[i]));
+        obj.push_back(Pair("timehist", hist));
+
+        result.push_back(Pair(it->first, obj));
+    };
+    return result;
+}
+
+Value getnetmsgstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getnetmsgstats [peers=true]\n"
+            "Returns per command statistics of received network messages, in total since startup\n"
+            "and for each connected peer if [peers] is true.\n"
+            "For every command: message count, payload bytes, and processing time\n"
+            "(total, average and max in microseconds, with a histogram of decade buckets).");
+
+    bool fPeers = params.size() > 0 ? params[0].get_bool() : true;
+
+    netmsgstats_t mapStats;
+    CNode::GetTotalMessageStats(mapStats);
+
+    Object result;
+    result.push_back(Pair("total", MessageStatsToJSON(mapStats)));
+
+    if (fPeers)
+    {
+        Array peers;
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            pnode->GetMessageStats(mapStats);
+
+            Object obj;
+            obj.push_back(Pair("id", pnode->GetId()));
+            obj.push_back(Pair("addr", pnode->addrName));
+            obj.push_back(Pair("commands", MessageStatsToJSON(mapStats)));
+            peers.push_back(obj);
+        };
+        result.push_back(Pair("peers", peers));
+    };
+
+    return result;
+}
+
+
 static Array GetNetworksInfo()
 {
     Array networks;
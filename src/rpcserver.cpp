@@ -280,6 +280,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getaddednodeinfo",       &getaddednodeinfo,       true,      true,      false },
     { "ping",                   &ping,                   true,      false,     false },
     { "getnettotals",           &getnettotals,           true,      true,      false },
+    { "getnetmsgstats",         &getnetmsgstats,         true,      true,      false },
     { "getdifficulty",          &getdifficulty,          true,      false,     false },
     { "getinfo",                &getinfo,                true,      false,     false },
     { "getsubsidy",             &getsubsidy,             true,      true,      false },
@@ -387,6 +388,7 @@ static const CRPCCommand vRPCCommands[] =
     { "smsginbox",              &smsginbox,              false,     false,     false },
     { "smsgoutbox",             &smsgoutbox,             false,     false,     false },
     { "smsgbuckets",            &smsgbuckets,            false,     false,     false },
+    { "smsgpowstats",           &smsgpowstats,           false,     false,     false },
     
     
     { "thinscanmerkleblocks",   &thinscanmerkleblocks,   false,     false,     false },
@@ -100,6 +100,9 @@ Value smsgoptions(const Array& params, bool fHelp)
         result.push_back(Pair("option", std::string("scanIncoming = ") + (smsgOptions.fScanIncoming ? "true" : "false")));
         if (fDescriptions)
             result.push_back(Pair("scanIncoming", "Scan incoming blocks for public keys."));
+        result.push_back(Pair("option", std::string("tagRecipient = ") + (smsgOptions.fTagRecipient ? "true" : "false")));
+        if (fDescriptions)
+            result.push_back(Pair("tagRecipient", "Add a short recipient tag to sent messages, so receivers need fewer trial decryptions."));
         
         result.push_back(Pair("result", "Success."));
     } else
@@ -154,6 +157,18 @@ Value smsgoptions(const Array& params, bool fHelp)
             };
             result.push_back(Pair("set option", std::string("scanIncoming = ") + (smsgOptions.fScanIncoming ? "true" : "false")));
         } else
+        if (optname == "tagrecipient")
+        {
+            if (GetStringBool(value, fValue))
+            {
+                smsgOptions.fTagRecipient = fValue;
+            } else
+            {
+                result.push_back(Pair("result", "Unknown value."));
+                return result;
+            };
+            result.push_back(Pair("set option", std::string("tagRecipient = ") + (smsgOptions.fTagRecipient ? "true" : "false")));
+        } else
         {
             result.push_back(Pair("result", "Option not found."));
             return result;
@@ -372,7 +387,7 @@ Value smsgscanchain(const Array& params, bool fHelp)
     if (fHelp || params.size() != 0)
         throw std::runtime_error(
             "smsgscanchain \n"
-            "Look for public keys in the block chain.");
+            "Look for public keys in the block chain, resuming after the last block scanned.");
     
     if (!fSecMsgEnabled)
         throw std::runtime_error("Secure messaging is disabled.");
@@ -587,10 +602,13 @@ Value smsgsendanon(const Array& params, bool fHelp)
 
 Value smsginbox(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() > 1) // defaults to read
+    if (fHelp || params.size() > 3) // defaults to read
         throw std::runtime_error(
-            "smsginbox [all|unread|clear]\n" 
-            "Decrypt and display all received messages.\n"
+            "smsginbox [all|unread|clear|count] [limit] [skip]\n" 
+            "Decrypt and display received messages, newest first.\n"
+            "limit: show at most this many messages, 0 for all.\n"
+            "skip: leave out this many of the newest messages.\n"
+            "count: show the number of messages and unread messages.\n"
             "Warning: clear will delete all messages.");
     
     if (!fSecMsgEnabled)
@@ -605,6 +623,8 @@ Value smsginbox(const Array& params, bool fHelp)
         mode = params[0].get_str();
     };
     
+    uint32_t nLimit = params.size() > 1 ? params[1].get_int() : 0;
+    uint32_t nSkip = params.size() > 2 ? params[2].get_int() : 0;
     
     Object result;
     
@@ -641,6 +661,11 @@ Value smsginbox(const Array& params, bool fHelp)
             
             result.push_back(Pair("result", strprintf("Deleted %u messages.", nMessages)));
         } else
+        if (mode == "count")
+        {
+            result.push_back(Pair("messages", (int)dbInbox.CountSmesg(sPrefix, false)));
+            result.push_back(Pair("unread", (int)dbInbox.CountSmesg(sPrefix, true)));
+        } else
         if (mode == "all"
             || mode == "unread")
         {
@@ -651,13 +676,12 @@ Value smsginbox(const Array& params, bool fHelp)
             
             dbInbox.TxnBegin();
             
-            leveldb::Iterator* it = dbInbox.pdb->NewIterator(leveldb::ReadOptions());
-            while (dbInbox.NextSmesg(it, sPrefix, chKey, smsgStored))
+            // -- the cursor reads committed data, marking messages read below doesn't move it
+            SecMsgCursor cursor(dbInbox, sPrefix, fCheckReadStatus);
+            cursor.Skip(nSkip);
+            while ((nLimit == 0 || nMessages < nLimit)
+                && cursor.Next(chKey, smsgStored))
             {
-                if (fCheckReadStatus
-                    && !(smsgStored.status & SMSG_MASK_UNREAD))
-                    continue;
-                
                 uint32_t nPayload = smsgStored.vchMessage.size() - SMSG_HDR_LEN;
                 if (SecureMsgDecrypt(false, smsgStored.sAddrTo, &smsgStored.vchMessage[0], &smsgStored.vchMessage[SMSG_HDR_LEN], nPayload, msg) == 0)
                 {
@@ -681,7 +705,6 @@ Value smsginbox(const Array& params, bool fHelp)
                 };
                 nMessages++;
             };
-            delete it;
             dbInbox.TxnCommit();
             
             result.push_back(Pair("result", strprintf("%u messages shown.", nMessages)));
@@ -689,7 +712,7 @@ Value smsginbox(const Array& params, bool fHelp)
         } else
         {
             result.push_back(Pair("result", "Unknown Mode."));
-            result.push_back(Pair("expected", "[all|unread|clear]."));
+            result.push_back(Pair("expected", "[all|unread|clear|count]."));
         };
     }
     
@@ -698,10 +721,13 @@ Value smsginbox(const Array& params, bool fHelp)
 
 Value smsgoutbox(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() > 1) // defaults to read
+    if (fHelp || params.size() > 3) // defaults to read
         throw std::runtime_error(
-            "smsgoutbox [all|clear]\n" 
-            "Decrypt and display all sent messages.\n"
+            "smsgoutbox [all|clear|count] [limit] [skip]\n" 
+            "Decrypt and display sent messages, newest first.\n"
+            "limit: show at most this many messages, 0 for all.\n"
+            "skip: leave out this many of the newest messages.\n"
+            "count: show the number of sent messages.\n"
             "Warning: clear will delete all sent messages.");
     
     if (!fSecMsgEnabled)
@@ -716,6 +742,8 @@ Value smsgoutbox(const Array& params, bool fHelp)
         mode = params[0].get_str();
     }
     
+    uint32_t nLimit = params.size() > 1 ? params[1].get_int() : 0;
+    uint32_t nSkip = params.size() > 2 ? params[2].get_int() : 0;
     
     Object result;
     
@@ -750,12 +778,18 @@ Value smsgoutbox(const Array& params, bool fHelp)
             
             result.push_back(Pair("result", strprintf("Deleted %u messages.", nMessages)));
         } else
+        if (mode == "count")
+        {
+            result.push_back(Pair("messages", (int)dbOutbox.CountSmesg(sPrefix, false)));
+        } else
         if (mode == "all")
         {
             SecMsgStored smsgStored;
             MessageData msg;
-            leveldb::Iterator* it = dbOutbox.pdb->NewIterator(leveldb::ReadOptions());
-            while (dbOutbox.NextSmesg(it, sPrefix, chKey, smsgStored))
+            SecMsgCursor cursor(dbOutbox, sPrefix);
+            cursor.Skip(nSkip);
+            while ((nLimit == 0 || nMessages < nLimit)
+                && cursor.Next(chKey, smsgStored))
             {
                 uint32_t nPayload = smsgStored.vchMessage.size() - SMSG_HDR_LEN;
                 
@@ -774,13 +808,12 @@ Value smsgoutbox(const Array& params, bool fHelp)
                 };
                 nMessages++;
             };
-            delete it;
             
             result.push_back(Pair("result", strprintf("%u sent messages shown.", nMessages)));
         } else
         {
             result.push_back(Pair("result", "Unknown Mode."));
-            result.push_back(Pair("expected", "[all|clear]."));
+            result.push_back(Pair("expected", "[all|clear|count]."));
         };
     }
     
@@ -822,7 +855,6 @@ Value smsgbuckets(const Array& params, bool fHelp)
                 std::set<SecMsgToken>& tokenSet = it->second.setTokens;
                 
                 std::string sBucket = boost::lexical_cast<std::string>(it->first);
-                std::string sFile = sBucket + "_01.dat";
                 
                 std::string sHash = boost::lexical_cast<std::string>(it->second.hash);
                 
@@ -835,33 +867,12 @@ Value smsgbuckets(const Array& params, bool fHelp)
                 objM.push_back(Pair("no. messages", strprintf("%u", tokenSet.size())));
                 objM.push_back(Pair("hash", sHash));
                 objM.push_back(Pair("last changed", getTimeString(it->second.timeChanged, cbuf, sizeof(cbuf))));
-                
-                boost::filesystem::path fullPath = GetDataDir() / "smsgStore" / sFile;
-
-
-                if (!boost::filesystem::exists(fullPath))
-                {
-                    // -- If there is a file for an empty bucket something is wrong.
-                    if (tokenSet.size() == 0)
-                        objM.push_back(Pair("file size", "Empty bucket."));
-                    else
-                        objM.push_back(Pair("file size, error", "File not found."));
-                } else
-                {
-                    try {
-                        
-                        uint64_t nFBytes = 0;
-                        nFBytes = boost::filesystem::file_size(fullPath);
-                        nBytes += nFBytes;
-                        objM.push_back(Pair("file size", bytesReadable(nFBytes)));
-                    } catch (const boost::filesystem::filesystem_error& ex)
-                    {
-                        objM.push_back(Pair("file size, error", ex.what()));
-                    };
-                };
+                objM.push_back(Pair("segment", boost::lexical_cast<std::string>(SecMsgStoreLog::SegmentTime(it->first))));
                 
                 result.push_back(Pair("bucket", objM));
             };
+            
+            nBytes = smsgStoreLog.GetTotalSize();
         }; // LOCK(cs_smsg);
         
         
@@ -879,22 +890,7 @@ Value smsgbuckets(const Array& params, bool fHelp)
     {
         {
             LOCK(cs_smsg);
-            std::map<int64_t, SecMsgBucket>::iterator it;
-            it = smsgBuckets.begin();
-            
-            for (it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
-            {
-                std::string sFile = boost::lexical_cast<std::string>(it->first) + "_01.dat";
-                
-                try {
-                    boost::filesystem::path fullPath = GetDataDir() / "smsgStore" / sFile;
-                    boost::filesystem::remove(fullPath);
-                } catch (const boost::filesystem::filesystem_error& ex)
-                {
-                    //objM.push_back(Pair("file size, error", ex.what()));
-                    LogPrintf("Error removing bucket file %s.\n", ex.what());
-                };
-            };
+            smsgStoreLog.Clear();
             smsgBuckets.clear();
         }; // LOCK(cs_smsg);
         
@@ -909,3 +905,41 @@ Value smsgbuckets(const Array& params, bool fHelp)
 
     return result;
 };
+
+Value smsgpowstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw std::runtime_error(
+            "smsgpowstats\n"
+            "Show the proof of work queue depth and throughput.");
+
+    if (!fSecMsgEnabled)
+        throw std::runtime_error("Secure messaging is disabled.");
+
+    SecMsgPowStats stats;
+    {
+        LOCK(cs_smsgPow);
+        stats = smsgPowStats;
+    }
+
+    int nQueued = SecureMsgCountQueued();
+    int64_t nAvgMs = stats.nMessages ? stats.nTimeTotal / stats.nMessages : 0;
+
+    Object result;
+    result.push_back(Pair("threads", SecureMsgPowThreads()));
+    result.push_back(Pair("queued", nQueued));
+    result.push_back(Pair("messages", (uint64_t)stats.nMessages));
+    result.push_back(Pair("failed", (uint64_t)stats.nFailed));
+    result.push_back(Pair("hashes", (uint64_t)stats.nHashes));
+    result.push_back(Pair("hashespersec", stats.nTimeTotal ? (double)stats.nHashes * 1000.0 / stats.nTimeTotal : 0.0));
+    result.push_back(Pair("avgms", nAvgMs));
+    result.push_back(Pair("maxms", stats.nTimeMax));
+    result.push_back(Pair("backlogsecs", nQueued > 0 ? nQueued * nAvgMs / 1000 : 0));
+    if (stats.nTimeLast)
+    {
+        char cbuf[256];
+        result.push_back(Pair("lastfinished", getTimeString(stats.nTimeLast, cbuf, sizeof(cbuf))));
+    };
+
+    return result;
+}
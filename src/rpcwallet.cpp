@@ -68,7 +68,7 @@ void WalletTxToJSON(const CWalletTx& wtx, Object& entry)
             nTime = mapBlockIndex[wtx.hashBlock]->nTime;
         } else
         {
-            std::map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.find(wtx.hashBlock);
+            BlockThinMap::iterator mi = mapBlockThinIndex.find(wtx.hashBlock);
             if (mi != mapBlockThinIndex.end())
                 nTime = (*mi).second->nTime;
         };
@@ -156,6 +156,8 @@ Value getinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("blocks",        (int)nBestHeight));
     if (nNodeMode == NT_THIN)
         obj.push_back(Pair("filteredblocks",   (int)nHeightFilteredNeeded));
+    else
+        obj.push_back(Pair("blockcheck",    GetBlockVerifyStatus()));
 
     obj.push_back(Pair("timeoffset",    (int64_t)GetTimeOffset()));
 
@@ -1635,7 +1637,7 @@ Value gettransaction(const Array& params, bool fHelp)
             } else
             {
                 entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-                std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+                BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
                 if (mi != mapBlockIndex.end() && (*mi).second)
                 {
                     CBlockIndex* pindex = (*mi).second;
@@ -0,0 +1,284 @@
+// Copyright (c) 2017-2019 The ProCurrency developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SEENCACHE_H
+#define BITCOIN_SEENCACHE_H
+
+#include "serialize.h"
+#include "util.h"
+
+#include <map>
+#include <vector>
+
+#include <stdint.h>
+
+/** Occupancy of a seencache */
+struct seencache_stats
+{
+    size_t nEntries;
+    size_t nMaxEntries;
+    size_t nBytes;          // slot table, allocated once and never grown
+    uint64_t nEvicted;      // dropped while still live to make room
+    uint64_t nExpired;      // dropped after their expiry time
+};
+
+/** Stream that folds a serialized key into a salted 32-bit hash, multiply and shift mixing as in BlockHasher */
+class seencache_hasher
+{
+private:
+    uint64_t h;
+    uint64_t w;
+    unsigned int n;
+
+    void mix()
+    {
+        h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+        w = 0;
+        n = 0;
+    }
+
+public:
+    int nType;
+    int nVersion;
+
+    seencache_hasher(uint64_t nSalt) : h(nSalt), w(0), n(0), nType(SER_GETHASH), nVersion(0) {}
+
+    seencache_hasher& write(const char *pch, size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            w |= (uint64_t)(unsigned char)pch[i] << (8 * n);
+            if (++n == 8)
+                mix();
+        }
+        return (*this);
+    }
+
+    // invalidates the object
+    uint32_t GetHash()
+    {
+        if (n > 0)
+            mix();
+        h = (h ^ (h >> 32)) * 0xC2B2AE3D27D4EB4FULL;
+        return (uint32_t)(h ^ (h >> 32));
+    }
+
+    template<typename T>
+    seencache_hasher& operator<<(const T& obj)
+    {
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+/** Set of recently seen keys, each kept until its own expiry time, that never holds more than N keys.
+ *
+ *  Keys live in a fixed table sized at construction, found by a per instance salted hash with linear
+ *  probing. When full, an insert takes the slot of the first key under the clock hand that has expired
+ *  or was not looked up since the hand last passed it.
+ */
+template <typename K> class seencache
+{
+public:
+    typedef K key_type;
+    typedef size_t size_type;
+
+protected:
+    struct slot
+    {
+        K key;
+        int64_t nExpire;
+        uint32_t nHash;
+        bool fUsed;
+        bool fRef;
+
+        slot() : nExpire(0), nHash(0), fUsed(false), fRef(false) {}
+    };
+
+    std::vector<slot> vSlots;
+    size_type nMask;
+    size_type nSize;
+    size_type nMaxSize;
+    size_type nHand;
+    uint64_t nSalt;
+    uint64_t nEvicted;
+    uint64_t nExpired;
+
+    uint32_t hash(const key_type& k) const
+    {
+        seencache_hasher ss(nSalt);
+        ss << k;
+        return ss.GetHash();
+    }
+
+    size_type find_slot(const key_type& k, uint32_t nHash) const
+    {
+        for (size_type i = nHash & nMask; vSlots[i].fUsed; i = (i + 1) & nMask)
+            if (vSlots[i].nHash == nHash && vSlots[i].key == k)
+                return i;
+        return vSlots.size();
+    }
+
+    // backward shift, so probe sequences never cross a hole
+    void remove_slot(size_type i)
+    {
+        size_type j = i;
+        while (true)
+        {
+            vSlots[i].fUsed = false;
+            while (true)
+            {
+                j = (j + 1) & nMask;
+                if (!vSlots[j].fUsed)
+                {
+                    nSize--;
+                    return;
+                }
+                size_type nHome = vSlots[j].nHash & nMask;
+                if (i <= j ? (i < nHome && nHome <= j) : (i < nHome || nHome <= j))
+                    continue;
+                break;
+            }
+            vSlots[i] = vSlots[j];
+            i = j;
+        }
+    }
+
+    void evict(int64_t nNow)
+    {
+        while (true)
+        {
+            nHand = (nHand + 1) & nMask;
+            slot& s = vSlots[nHand];
+            if (!s.fUsed)
+                continue;
+            if (s.nExpire <= nNow)
+            {
+                nExpired++;
+                remove_slot(nHand);
+                return;
+            }
+            if (s.fRef)
+            {
+                s.fRef = false;
+                continue;
+            }
+            nEvicted++;
+            remove_slot(nHand);
+            return;
+        }
+    }
+
+public:
+    seencache(size_type nMaxSizeIn)
+    {
+        // keep the table at most 3/4 full
+        size_type nTable = 4;
+        while (nTable < nMaxSizeIn + nMaxSizeIn / 3 + 1)
+            nTable <<= 1;
+        vSlots.resize(nTable);
+        nMask = nTable - 1;
+        nSize = 0;
+        nMaxSize = nMaxSizeIn > 0 ? nMaxSizeIn : 1;
+        nHand = 0;
+        nSalt = GetRand(std::numeric_limits<uint64_t>::max());
+        nEvicted = 0;
+        nExpired = 0;
+    }
+
+    size_type size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+    size_type max_size() const { return nMaxSize; }
+
+    void clear()
+    {
+        for (size_type i = 0; i < vSlots.size(); i++)
+            vSlots[i].fUsed = false;
+        nSize = 0;
+    }
+
+    /** True if k was inserted and its expiry time is still ahead of nNow */
+    bool contains(const key_type& k, int64_t nNow)
+    {
+        size_type i = find_slot(k, hash(k));
+        if (i == vSlots.size())
+            return false;
+        if (vSlots[i].nExpire <= nNow)
+        {
+            nExpired++;
+            remove_slot(i);
+            return false;
+        }
+        vSlots[i].fRef = true;
+        return true;
+    }
+
+    /** Add k, or move its expiry time to nExpire if already present */
+    void insert(const key_type& k, int64_t nExpire, int64_t nNow)
+    {
+        uint32_t nHash = hash(k);
+        size_type i = find_slot(k, nHash);
+        if (i != vSlots.size())
+        {
+            vSlots[i].nExpire = nExpire;
+            vSlots[i].fRef = true;
+            return;
+        }
+
+        if (nSize >= nMaxSize)
+            evict(nNow);
+
+        for (i = nHash & nMask; vSlots[i].fUsed; i = (i + 1) & nMask);
+        slot& s = vSlots[i];
+        s.key = k;
+        s.nExpire = nExpire;
+        s.nHash = nHash;
+        s.fUsed = true;
+        s.fRef = false;
+        nSize++;
+    }
+
+    void erase(const key_type& k)
+    {
+        size_type i = find_slot(k, hash(k));
+        if (i != vSlots.size())
+            remove_slot(i);
+    }
+
+    /** Drop every key expired at nNow */
+    void expire(int64_t nNow)
+    {
+        for (size_type i = 0; i < vSlots.size(); )
+        {
+            // a removal shifts the next key into slot i
+            if (vSlots[i].fUsed && vSlots[i].nExpire <= nNow)
+            {
+                nExpired++;
+                remove_slot(i);
+            } else
+                i++;
+        }
+    }
+
+    /** Live keys and their expiry times, for serialization */
+    void get(std::map<key_type, int64_t>& mapOut) const
+    {
+        for (size_type i = 0; i < vSlots.size(); i++)
+            if (vSlots[i].fUsed)
+                mapOut[vSlots[i].key] = vSlots[i].nExpire;
+    }
+
+    seencache_stats stats() const
+    {
+        seencache_stats s;
+        s.nEntries = nSize;
+        s.nMaxEntries = nMaxSize;
+        s.nBytes = vSlots.size() * sizeof(slot);
+        s.nEvicted = nEvicted;
+        s.nExpired = nExpired;
+        return s;
+    }
+};
+
+#endif
@@ -35,6 +35,7 @@ Notes:
 #include <stdint.h>
 #include <time.h>
 #include <map>
+#include <limits>
 #include <stdexcept>
 #include <sstream>
 #include <errno.h>
@@ -47,6 +48,7 @@ Notes:
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
 
+#include <boost/atomic.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/algorithm/string/replace.hpp>
@@ -77,12 +79,28 @@ std::vector<SecMsgAddress>      smsgAddresses;
 SecMsgOptions                   smsgOptions;
 
 
+SecMsgPowStats                  smsgPowStats;
+SecMsgStoreLog                  smsgStoreLog;
+SecMsgKeyFilter                 smsgKeyFilter;          // guarded by cs_smsgDB
+SecMsgTimerWheel                smsgTimers(GetTime());  // guarded by cs_smsg
+
+
 CCriticalSection cs_smsg;
 CCriticalSection cs_smsgDB;
 CCriticalSection cs_smsgThreads;
+CCriticalSection cs_smsgPow;
 
 leveldb::DB *smsgDB = NULL;
 
+// -- entries in the "it", "iu" and "st" indexes, counted once and then kept current by
+//    committed SecMsgDB writes. Guarded by cs_smsgDB.
+enum { SMSG_INDEX_INBOX = 0, SMSG_INDEX_UNREAD = 1, SMSG_INDEX_OUTBOX = 2 };
+static uint32_t smsgIndexCount[3];
+static bool fSmsgIndexCounted = false;
+
+// -- index version that could not be built, not tried again until restart
+static uint32_t nSmsgIndexFailed = 0;
+
 
 namespace fs = boost::filesystem;
 
@@ -105,6 +123,26 @@ bool SecMsgCrypter::SetKey(const uint8_t* chNewKey, uint8_t* chNewIV)
 };
 
 bool SecMsgCrypter::Encrypt(uint8_t* chPlaintext, uint32_t nPlain, std::vector<uint8_t> &vchCiphertext)
+{
+    EVP_CIPHER_CTX* pctx = EVP_CIPHER_CTX_new();
+    if (!pctx)
+        return false;
+    bool fOk = Encrypt(pctx, chPlaintext, nPlain, vchCiphertext);
+    EVP_CIPHER_CTX_free(pctx);
+    return fOk;
+};
+
+bool SecMsgCrypter::Decrypt(uint8_t* chCiphertext, uint32_t nCipher, std::vector<uint8_t>& vchPlaintext)
+{
+    EVP_CIPHER_CTX* pctx = EVP_CIPHER_CTX_new();
+    if (!pctx)
+        return false;
+    bool fOk = Decrypt(pctx, chCiphertext, nCipher, vchPlaintext);
+    EVP_CIPHER_CTX_free(pctx);
+    return fOk;
+};
+
+bool SecMsgCrypter::Encrypt(EVP_CIPHER_CTX* pctx, uint8_t* chPlaintext, uint32_t nPlain, std::vector<uint8_t> &vchCiphertext)
 {
     if (!fKeySet)
         return false;
@@ -113,17 +151,14 @@ bool SecMsgCrypter::Encrypt(uint8_t* chPlaintext, uint32_t nPlain, std::vector<u
     int nLen = nPlain;
 
     int nCLen = nLen + AES_BLOCK_SIZE, nFLen = 0;
-    vchCiphertext = std::vector<uint8_t> (nCLen);
-
-    EVP_CIPHER_CTX ctx;
+    vchCiphertext.resize(nCLen);
 
     bool fOk = true;
 
-    EVP_CIPHER_CTX_init(&ctx);
-    if (fOk) fOk = EVP_EncryptInit_ex(&ctx, EVP_aes_256_cbc(), NULL, &chKey[0], &chIV[0]);
-    if (fOk) fOk = EVP_EncryptUpdate(&ctx, &vchCiphertext[0], &nCLen, chPlaintext, nLen);
-    if (fOk) fOk = EVP_EncryptFinal_ex(&ctx, (&vchCiphertext[0])+nCLen, &nFLen);
-    EVP_CIPHER_CTX_cleanup(&ctx);
+    // -- re-keying a context used before with the same cipher doesn't allocate
+    if (fOk) fOk = EVP_EncryptInit_ex(pctx, EVP_aes_256_cbc(), NULL, &chKey[0], &chIV[0]);
+    if (fOk) fOk = EVP_EncryptUpdate(pctx, &vchCiphertext[0], &nCLen, chPlaintext, nLen);
+    if (fOk) fOk = EVP_EncryptFinal_ex(pctx, (&vchCiphertext[0])+nCLen, &nFLen);
 
     if (!fOk)
         return false;
@@ -133,7 +168,7 @@ bool SecMsgCrypter::Encrypt(uint8_t* chPlaintext, uint32_t nPlain, std::vector<u
     return true;
 };
 
-bool SecMsgCrypter::Decrypt(uint8_t* chCiphertext, uint32_t nCipher, std::vector<uint8_t>& vchPlaintext)
+bool SecMsgCrypter::Decrypt(EVP_CIPHER_CTX* pctx, uint8_t* chCiphertext, uint32_t nCipher, std::vector<uint8_t>& vchPlaintext)
 {
     if (!fKeySet)
         return false;
@@ -143,15 +178,11 @@ bool SecMsgCrypter::Decrypt(uint8_t* chCiphertext, uint32_t nCipher, std::vector
 
     vchPlaintext.resize(nCipher);
 
-    EVP_CIPHER_CTX ctx;
-
     bool fOk = true;
 
-    EVP_CIPHER_CTX_init(&ctx);
-    if (fOk) fOk = EVP_DecryptInit_ex(&ctx, EVP_aes_256_cbc(), NULL, &chKey[0], &chIV[0]);
-    if (fOk) fOk = EVP_DecryptUpdate(&ctx, &vchPlaintext[0], &nPLen, &chCiphertext[0], nCipher);
-    if (fOk) fOk = EVP_DecryptFinal_ex(&ctx, (&vchPlaintext[0])+nPLen, &nFLen);
-    EVP_CIPHER_CTX_cleanup(&ctx);
+    if (fOk) fOk = EVP_DecryptInit_ex(pctx, EVP_aes_256_cbc(), NULL, &chKey[0], &chIV[0]);
+    if (fOk) fOk = EVP_DecryptUpdate(pctx, &vchPlaintext[0], &nPLen, &chCiphertext[0], nCipher);
+    if (fOk) fOk = EVP_DecryptFinal_ex(pctx, (&vchPlaintext[0])+nPLen, &nFLen);
 
     if (!fOk)
         return false;
@@ -161,6 +192,158 @@ bool SecMsgCrypter::Decrypt(uint8_t* chCiphertext, uint32_t nCipher, std::vector
     return true;
 };
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+// -- OpenSSL before 1.1 has no allocating constructor for HMAC_CTX
+static HMAC_CTX* HMAC_CTX_new()
+{
+    HMAC_CTX* pctx = (HMAC_CTX*) OPENSSL_malloc(sizeof(HMAC_CTX));
+    if (pctx)
+        HMAC_CTX_init(pctx);
+    return pctx;
+};
+
+static void HMAC_CTX_free(HMAC_CTX* pctx)
+{
+    if (!pctx)
+        return;
+    HMAC_CTX_cleanup(pctx);
+    OPENSSL_free(pctx);
+};
+#endif
+
+static boost::thread_specific_ptr<SecMsgCryptoContext> smsgCryptoContext;
+
+SecMsgCryptoContext::SecMsgCryptoContext()
+{
+    cipher = EVP_CIPHER_CTX_new();
+    hmac = HMAC_CTX_new();
+    if (!cipher || !hmac)
+        throw std::runtime_error("SecMsgCryptoContext : could not allocate OpenSSL contexts");
+
+    nGrowths = 0;
+
+    // -- room for the largest message, ciphertext adds at most one block
+    uint32_t nMaxPayload = SMSG_PL_HDR_LEN + SMSG_MAX_MSG_WORST;
+    vchLz4State.resize(LZ4_sizeofState());
+    vchCompressed.reserve(SMSG_MAX_MSG_WORST);
+    vchPayload.reserve(nMaxPayload);
+    vchCiphertext.reserve(nMaxPayload + AES_BLOCK_SIZE);
+    vchSignature.reserve(65);
+};
+
+SecMsgCryptoContext::~SecMsgCryptoContext()
+{
+    EVP_CIPHER_CTX_free(cipher);
+    HMAC_CTX_free(hmac);
+};
+
+SecMsgCryptoContext& SecMsgCryptoContext::Get()
+{
+    // -- thread_specific_ptr deletes the context when the thread ends
+    if (!smsgCryptoContext.get())
+        smsgCryptoContext.reset(new SecMsgCryptoContext());
+    return *smsgCryptoContext;
+};
+
+void SecMsgCryptoContext::Resize(std::vector<uint8_t>& vch, uint32_t nSize)
+{
+    if (vch.capacity() < nSize)
+        nGrowths++;
+    vch.resize(nSize);
+};
+
+void SecMsgCryptoContext::Wipe(std::vector<uint8_t>& vch)
+{
+    // -- shrinking resizes leave earlier, longer plaintexts in the capacity
+    vch.resize(vch.capacity());
+    if (!vch.empty())
+        OPENSSL_cleanse(&vch[0], vch.size());
+    vch.clear();
+};
+
+// Wipes the plaintext buffers of a context when leaving scope
+class SecMsgWipeOnExit
+{
+public:
+    SecMsgWipeOnExit(SecMsgCryptoContext& ctxIn) : ctx(ctxIn) {};
+    ~SecMsgWipeOnExit()
+    {
+        ctx.Wipe(ctx.vchPayload);
+        ctx.Wipe(ctx.vchCompressed);
+    };
+private:
+    SecMsgCryptoContext& ctx;
+};
+
+SecMsgTimerWheel::SecMsgTimerWheel(int64_t nStart)
+{
+    nCurrent = nStart;
+    nTimers = 0;
+};
+
+void SecMsgTimerWheel::Place(const SecMsgTimer& timer)
+{
+    int64_t nDelta = timer.nDue - nCurrent;
+    if (nDelta < 0)
+    {
+        // -- already due, fires with the current slot
+        vSlots[0][nCurrent & (SMSG_WHEEL_SLOTS - 1)].push_back(timer);
+        return;
+    };
+
+    for (uint32_t nLevel = 0; nLevel < SMSG_WHEEL_LEVELS; ++nLevel)
+    {
+        if (nDelta < ((int64_t)1 << (SMSG_WHEEL_BITS * (nLevel + 1))))
+        {
+            vSlots[nLevel][(timer.nDue >> (SMSG_WHEEL_BITS * nLevel)) & (SMSG_WHEEL_SLOTS - 1)].push_back(timer);
+            return;
+        };
+    };
+
+    vOverflow.push_back(timer);
+};
+
+void SecMsgTimerWheel::Cascade(uint32_t nLevel)
+{
+    // -- spread the slot of nLevel that starts now over the levels below
+    std::vector<SecMsgTimer> vMove;
+    if (nLevel < SMSG_WHEEL_LEVELS)
+        vMove.swap(vSlots[nLevel][(nCurrent >> (SMSG_WHEEL_BITS * nLevel)) & (SMSG_WHEEL_SLOTS - 1)]);
+    else
+        vMove.swap(vOverflow);
+
+    for (std::vector<SecMsgTimer>::iterator it = vMove.begin(); it != vMove.end(); ++it)
+        Place(*it);
+};
+
+void SecMsgTimerWheel::Add(int64_t nDue, int nType, int64_t nKey)
+{
+    Place(SecMsgTimer(nDue, nType, nKey));
+    nTimers++;
+};
+
+void SecMsgTimerWheel::Advance(int64_t now, std::vector<SecMsgTimer>& vDue)
+{
+    for (; nCurrent <= now; ++nCurrent)
+    {
+        // -- when a level wraps, pull down the next slot of the level above
+        for (uint32_t nLevel = 1; nLevel <= SMSG_WHEEL_LEVELS; ++nLevel)
+        {
+            if ((nCurrent & (((int64_t)1 << (SMSG_WHEEL_BITS * nLevel)) - 1)) != 0)
+                break;
+            Cascade(nLevel);
+        };
+
+        std::vector<SecMsgTimer>& vSlot = vSlots[0][nCurrent & (SMSG_WHEEL_SLOTS - 1)];
+        if (vSlot.empty())
+            continue;
+
+        nTimers -= vSlot.size();
+        vDue.insert(vDue.end(), vSlot.begin(), vSlot.end());
+        vSlot.clear();
+    };
+};
+
 void SecMsgBucket::hashBucket()
 {
     if (fDebugSmsg)
@@ -193,6 +376,207 @@ void SecMsgBucket::hashBucket()
         LogPrintf("Hashed %u messages, hash %u\n", setTokens.size(), hash_new);
 };
 
+static void SecureMsgTokenKey(const SecMsgToken& token, uint8_t* key)
+{
+    memcpy(key, &token.timestamp, 8);
+    memcpy(key+8, token.sample, 8);
+};
+
+bool SecMsgIbltCell::IsEmpty() const
+{
+    if (count != 0 || hashSum != 0)
+        return false;
+    for (int i = 0; i < 16; ++i)
+        if (keySum[i] != 0)
+            return false;
+    return true;
+};
+
+bool SecMsgIbltCell::IsPure() const
+{
+    return (count == 1 || count == -1)
+        && hashSum == XXH32(keySum, 16, 0);
+};
+
+SecMsgIblt::SecMsgIblt(uint32_t nCells)
+{
+    // -- round up so each sub table gets the same number of cells
+    nCells = ((nCells + SMSG_IBLT_HASHES - 1) / SMSG_IBLT_HASHES) * SMSG_IBLT_HASHES;
+    vCells.resize(nCells);
+};
+
+uint32_t SecMsgIblt::CellsFor(uint32_t nDiff)
+{
+    /*
+        Peeling succeeds with high probability once there are ~1.3 cells per
+        difference for 3 hashes, small tables need more headroom.
+    */
+    uint64_t nCells = 2 * ((uint64_t)nDiff + SMSG_IBLT_SLACK);
+    nCells = ((nCells + SMSG_IBLT_HASHES - 1) / SMSG_IBLT_HASHES) * SMSG_IBLT_HASHES;
+
+    if (nCells < SMSG_IBLT_MIN_CELLS)
+        return SMSG_IBLT_MIN_CELLS;
+    if (nCells > SMSG_IBLT_MAX_CELLS)
+        return SMSG_IBLT_MAX_CELLS;
+    return nCells;
+};
+
+uint32_t SecMsgIblt::RetryCells(uint32_t nCells, uint32_t nTokens)
+{
+    // -- size of the next table to ask for after a failed decode, 0 when sending all tokens is cheaper
+    uint64_t nNext = (uint64_t)nCells * SMSG_IBLT_GROWTH;
+    if (nNext > SMSG_IBLT_MAX_CELLS
+        || nNext * SMSG_IBLT_CELL_LEN >= (uint64_t)nTokens * 16)
+        return 0;
+    return nNext;
+};
+
+void SecMsgIblt::Update(const uint8_t* key, int32_t nDelta)
+{
+    uint32_t nSub = vCells.size() / SMSG_IBLT_HASHES;
+    uint32_t hashKey = XXH32(key, 16, 0);
+
+    for (uint32_t i = 0; i < SMSG_IBLT_HASHES; ++i)
+    {
+        SecMsgIbltCell& cell = vCells[i * nSub + XXH32(key, 16, i + 1) % nSub];
+        cell.count += nDelta;
+        cell.hashSum ^= hashKey;
+        for (int k = 0; k < 16; ++k)
+            cell.keySum[k] ^= key[k];
+    };
+};
+
+void SecMsgIblt::Insert(const SecMsgToken& token)
+{
+    uint8_t key[16];
+    SecureMsgTokenKey(token, key);
+    Update(key, 1);
+};
+
+void SecMsgIblt::Subtract(const SecMsgIblt& other)
+{
+    // -- caller must ensure both tables have the same size
+    for (uint32_t i = 0; i < vCells.size() && i < other.vCells.size(); ++i)
+    {
+        SecMsgIbltCell& cell = vCells[i];
+        const SecMsgIbltCell& cellOther = other.vCells[i];
+        cell.count -= cellOther.count;
+        cell.hashSum ^= cellOther.hashSum;
+        for (int k = 0; k < 16; ++k)
+            cell.keySum[k] ^= cellOther.keySum[k];
+    };
+};
+
+bool SecMsgIblt::Decode(std::vector<SecMsgToken>& vOurs, std::vector<SecMsgToken>& vTheirs) const
+{
+    /*
+        Peel pure cells off a copy of the table.
+        After Subtract, tokens only in this table have count 1 (vOurs),
+        tokens only in the subtracted table have count -1 (vTheirs).
+    */
+    vOurs.clear();
+    vTheirs.clear();
+
+    SecMsgIblt iblt(*this);
+    std::vector<uint32_t> vPure;
+
+    for (uint32_t i = 0; i < iblt.vCells.size(); ++i)
+        if (iblt.vCells[i].IsPure())
+            vPure.push_back(i);
+
+    while (!vPure.empty())
+    {
+        uint32_t n = vPure.back();
+        vPure.pop_back();
+
+        SecMsgIbltCell& cell = iblt.vCells[n];
+        if (!cell.IsPure())
+            continue; // changed since queued
+
+        uint8_t key[16];
+        memcpy(key, cell.keySum, 16);
+        int32_t nCount = cell.count;
+
+        SecMsgToken token;
+        memcpy(&token.timestamp, key, 8);
+        memcpy(token.sample, key+8, 8);
+        token.offset = 0;
+
+        if (nCount == 1)
+            vOurs.push_back(token);
+        else
+            vTheirs.push_back(token);
+
+        if (vOurs.size() + vTheirs.size() > vCells.size())
+            return false; // can't hold more differences than cells, table is corrupt
+
+        iblt.Update(key, -nCount);
+
+        uint32_t nSub = iblt.vCells.size() / SMSG_IBLT_HASHES;
+        for (uint32_t i = 0; i < SMSG_IBLT_HASHES; ++i)
+        {
+            uint32_t c = i * nSub + XXH32(key, 16, i + 1) % nSub;
+            if (iblt.vCells[c].IsPure())
+                vPure.push_back(c);
+        };
+    };
+
+    for (uint32_t i = 0; i < iblt.vCells.size(); ++i)
+        if (!iblt.vCells[i].IsEmpty())
+            return false;
+
+    return true;
+};
+
+void SecMsgIblt::Serialize(std::vector<uint8_t>& vchData) const
+{
+    uint32_t nOfs = vchData.size();
+    vchData.resize(nOfs + SerializedSize());
+
+    uint8_t* p = &vchData[nOfs];
+    for (uint32_t i = 0; i < vCells.size(); ++i, p += SMSG_IBLT_CELL_LEN)
+    {
+        memcpy(p, &vCells[i].count, 4);
+        memcpy(p+4, vCells[i].keySum, 16);
+        memcpy(p+20, &vCells[i].hashSum, 4);
+    };
+};
+
+bool SecMsgIblt::Deserialize(const uint8_t* p, uint32_t nBytes, uint32_t nCellsIn)
+{
+    if (nCellsIn < SMSG_IBLT_MIN_CELLS
+        || nCellsIn > SMSG_IBLT_MAX_CELLS
+        || nCellsIn % SMSG_IBLT_HASHES != 0
+        || nBytes < nCellsIn * SMSG_IBLT_CELL_LEN)
+        return false;
+
+    vCells.resize(nCellsIn);
+    for (uint32_t i = 0; i < nCellsIn; ++i, p += SMSG_IBLT_CELL_LEN)
+    {
+        memcpy(&vCells[i].count, p, 4);
+        memcpy(vCells[i].keySum, p+4, 16);
+        memcpy(&vCells[i].hashSum, p+20, 4);
+    };
+
+    return true;
+};
+
+static void SecureMsgPushFeatures(CNode* pnode)
+{
+    // -- older nodes drop unknown smsg commands, so they never see smsgIblt
+    std::vector<uint8_t> vchData(4);
+    uint32_t nFeatures = SMSG_FEATURE_RECON;
+    memcpy(&vchData[0], &nFeatures, 4);
+    pnode->PushMessage("smsgFeatures", vchData);
+};
+
+static void SecureMsgAppendToken(std::vector<uint8_t>& vchData, const SecMsgToken& token)
+{
+    uint32_t nd = vchData.size();
+    vchData.resize(nd + 16);
+    memcpy(&vchData[nd], &token.timestamp, 8);
+    memcpy(&vchData[nd+8], token.sample, 8);
+};
 
 bool SecMsgDB::Open(const char* pszMode)
 {
@@ -225,6 +609,27 @@ bool SecMsgDB::Open(const char* pszMode)
     };
 
     pdb = smsgDB;
+    fSmsgIndexCounted = false;
+
+    // -- dbs written by older versions have no time index
+    std::string strValue;
+    uint32_t nVersion = 0;
+    if (pdb->Get(leveldb::ReadOptions(), "vi", &strValue).ok()
+        && strValue.size() == 4)
+        memcpy(&nVersion, strValue.data(), 4);
+
+    if (nVersion != SMSG_DB_INDEX_VERSION)
+    {
+        if (nSmsgIndexFailed == SMSG_DB_INDEX_VERSION)
+        {
+            LogPrintf("SecMsgDB::open() - Index build failed before, not retrying until restart.\n");
+        } else
+        if (!BuildIndexes())
+        {
+            LogPrintf("SecMsgDB::open() - Could not build indexes.\n");
+            nSmsgIndexFailed = SMSG_DB_INDEX_VERSION;
+        };
+    };
 
     return true;
 };
@@ -290,6 +695,7 @@ bool SecMsgDB::TxnBegin()
     if (activeBatch)
         return true;
     activeBatch = new leveldb::WriteBatch();
+    fCountChanges = fSmsgIndexCounted;
     return true;
 };
 
@@ -307,9 +713,11 @@ bool SecMsgDB::TxnCommit()
     if (!status.ok())
     {
         LogPrintf("SecMsgDB batch commit failure: %s\n", status.ToString().c_str());
+        fSmsgIndexCounted = false;
         return false;
     };
 
+    ApplyCountChanges();
     return true;
 };
 
@@ -317,6 +725,8 @@ bool SecMsgDB::TxnAbort()
 {
     delete activeBatch;
     activeBatch = NULL;
+    fIndexChanged = false;
+    memset(nCountDelta, 0, sizeof(nCountDelta));
     return true;
 };
 
@@ -422,6 +832,50 @@ bool SecMsgDB::ExistsPK(CKeyID& addr)
     return s.IsNotFound() == false;
 };
 
+void SecMsgDB::WritePK(leveldb::WriteBatch* batch, CKeyID& addr, CPubKey& pubkey)
+{
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey.reserve(sizeof(addr) + 2);
+    ssKey << 'p';
+    ssKey << 'k';
+    ssKey << addr;
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue.reserve(sizeof(pubkey));
+    ssValue << pubkey;
+
+    batch->Put(ssKey.str(), ssValue.str());
+};
+
+bool SecMsgDB::ReadScanTip(int& nHeight, uint256& hashBlock)
+{
+    // -- last block harvested for public keys, the chain is scanned up to it without gaps
+    if (!pdb)
+        return false;
+
+    std::string strValue;
+    if (!pdb->Get(leveldb::ReadOptions(), "ht", &strValue).ok())
+        return false;
+
+    try {
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> nHeight;
+        ssValue >> hashBlock;
+    } catch (std::exception& e) {
+        LogPrintf("SecMsgDB::ReadScanTip() unserialize threw: %s.\n", e.what());
+        return false;
+    }
+
+    return true;
+};
+
+void SecMsgDB::WriteScanTip(leveldb::WriteBatch* batch, int nHeight, const uint256& hashBlock)
+{
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << nHeight;
+    ssValue << hashBlock;
+    batch->Put("ht", ssValue.str());
+};
+
 
 bool SecMsgDB::NextSmesg(leveldb::Iterator* it, std::string& prefix, uint8_t* chKey, SecMsgStored& smsgStored)
 {
@@ -523,21 +977,30 @@ bool SecMsgDB::WriteSmesg(uint8_t* chKey, SecMsgStored& smsgStored)
     CDataStream ssValue(SER_DISK, CLIENT_VERSION);
     ssValue << smsgStored;
 
+    // -- record and index entries are written together
+    if (!activeBatch)
+        fCountChanges = fSmsgIndexCounted;
+    CountIndexChange(chKey, smsgStored.status & SMSG_MASK_UNREAD, false);
+
+    leveldb::WriteBatch batch;
+    leveldb::WriteBatch* pbatch = activeBatch ? activeBatch : &batch;
+    pbatch->Put(ssKey.str(), ssValue.str());
+    IndexSmesg(pbatch, chKey, smsgStored.status & SMSG_MASK_UNREAD, false);
+
     if (activeBatch)
-    {
-        activeBatch->Put(ssKey.str(), ssValue.str());
         return true;
-    };
 
     leveldb::WriteOptions writeOptions;
     writeOptions.sync = true;
-    leveldb::Status s = pdb->Put(writeOptions, ssKey.str(), ssValue.str());
+    leveldb::Status s = pdb->Write(writeOptions, &batch);
     if (!s.ok())
     {
         LogPrintf("SecMsgDB write failed: %s\n", s.ToString().c_str());
+        fSmsgIndexCounted = false;
         return false;
     };
 
+    ApplyCountChanges();
     return true;
 };
 
@@ -569,95 +1032,974 @@ bool SecMsgDB::EraseSmesg(uint8_t* chKey)
     CDataStream ssKey(SER_DISK, CLIENT_VERSION);
     ssKey.write((const char*)chKey, 18);
 
+    if (!activeBatch)
+        fCountChanges = fSmsgIndexCounted;
+    CountIndexChange(chKey, false, true);
+
+    leveldb::WriteBatch batch;
+    leveldb::WriteBatch* pbatch = activeBatch ? activeBatch : &batch;
+    pbatch->Delete(ssKey.str());
+    IndexSmesg(pbatch, chKey, false, true);
+
     if (activeBatch)
-    {
-        activeBatch->Delete(ssKey.str());
         return true;
-    };
 
     leveldb::WriteOptions writeOptions;
     writeOptions.sync = true;
-    leveldb::Status s = pdb->Delete(writeOptions, ssKey.str());
+    leveldb::Status s = pdb->Write(writeOptions, &batch);
 
     if (s.ok() || s.IsNotFound())
+    {
+        ApplyCountChanges();
         return true;
+    };
     LogPrintf("SecMsgDB erase failed: %s\n", s.ToString().c_str());
+    fSmsgIndexCounted = false;
     return false;
 };
 
-void ThreadSecureMsg()
+static std::string SecureMsgIndexKey(const char* pszIndex, const uint8_t* chKey)
 {
-    // -- bucket management thread
-    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    /*
+        index prefix 2, message timestamp 8 big endian so keys sort by time, record key 18
+        The value is empty, the record is read through the embedded key.
+    */
+    std::string strKey(28, '\0');
+    int64_t timestamp;
+    memcpy(&timestamp, &chKey[2], 8);
+
+    memcpy(&strKey[0], pszIndex, 2);
+    for (int i = 0; i < 8; ++i)
+        strKey[2+i] = (char)((uint64_t)timestamp >> (56 - 8 * i));
+    memcpy(&strKey[10], chKey, 18);
+    return strKey;
+};
 
-    uint32_t nLoop = 0;
-    std::vector<std::pair<int64_t, NodeId> > vTimedOutLocks;
-    while (fSecMsgEnabled)
+void SecMsgDB::IndexSmesg(leveldb::WriteBatch* batch, uint8_t* chKey, bool fUnread, bool fErase)
+{
+    /*
+        "it" all inbox messages, "iu" unread inbox messages, "st" all outbox messages.
+        Deleting keys that don't exist is harmless.
+    */
+    if (memcmp(chKey, "im", 2) == 0)
     {
-        nLoop++;
-        int64_t now = GetTime();
+        if (fErase)
+            batch->Delete(SecureMsgIndexKey("it", chKey));
+        else
+            batch->Put(SecureMsgIndexKey("it", chKey), "");
 
-        if (fDebugSmsg && nLoop % SMSG_THREAD_LOG_GAP == 0) // log every SMSG_THREAD_LOG_GAP instance, is useful source of timestamps
-            LogPrintf("SecureMsgThread %d \n", now);
+        if (fUnread && !fErase)
+            batch->Put(SecureMsgIndexKey("iu", chKey), "");
+        else
+            batch->Delete(SecureMsgIndexKey("iu", chKey));
+    } else
+    if (memcmp(chKey, "sm", 2) == 0)
+    {
+        if (fErase)
+            batch->Delete(SecureMsgIndexKey("st", chKey));
+        else
+            batch->Put(SecureMsgIndexKey("st", chKey), "");
+    };
+};
 
-        vTimedOutLocks.resize(0);
+int SecMsgDB::IndexDelta(const std::string& strKey, bool fPresent)
+{
+    // -- change in entries when strKey is made present or absent, pending writes included
+    std::string unused;
+    bool fExists, fDeleted = false;
+    CDataStream ssKey(strKey.data(), strKey.data() + strKey.size(), SER_DISK, CLIENT_VERSION);
+    if (activeBatch && ScanBatch(ssKey, &unused, &fDeleted))
+        fExists = !fDeleted;
+    else
+        fExists = pdb->Get(leveldb::ReadOptions(), strKey, &unused).ok();
 
-        int64_t cutoffTime = now - SMSG_RETENTION;
-        {
-            LOCK(cs_smsg);
-            for (std::map<int64_t, SecMsgBucket>::iterator it(smsgBuckets.begin()); it != smsgBuckets.end(); )
-            {
-                //if (fDebugSmsg)
-                //    LogPrintf("Checking bucket %d, size %u \n", it->first, it->second.setTokens.size());
+    return (fPresent ? 1 : 0) - (fExists ? 1 : 0);
+};
 
-                if (it->first < cutoffTime)
-                {
-                    if (fDebugSmsg)
-                        LogPrintf("Removing bucket %d \n", it->first);
+void SecMsgDB::CountIndexChange(uint8_t* chKey, bool fUnread, bool fErase)
+{
+    // -- call before the index entries for chKey are written
+    fIndexChanged = true;
+    if (!fCountChanges)
+        return;
 
-                    std::string fileName = boost::lexical_cast<std::string>(it->first);
+    if (memcmp(chKey, "im", 2) == 0)
+    {
+        nCountDelta[SMSG_INDEX_INBOX] += IndexDelta(SecureMsgIndexKey("it", chKey), !fErase);
+        nCountDelta[SMSG_INDEX_UNREAD] += IndexDelta(SecureMsgIndexKey("iu", chKey), fUnread && !fErase);
+    } else
+    if (memcmp(chKey, "sm", 2) == 0)
+    {
+        nCountDelta[SMSG_INDEX_OUTBOX] += IndexDelta(SecureMsgIndexKey("st", chKey), !fErase);
+    };
+};
 
-                    fs::path fullPath = GetDataDir() / "smsgStore" / (fileName + "_01.dat");
-                    if (fs::exists(fullPath))
-                    {
-                        try { fs::remove(fullPath);
-                        } catch (const fs::filesystem_error& ex)
-                        {
-                            LogPrintf("Error removing bucket file %s.\n", ex.what());
-                        };
-                    } else
-                    {
-                        LogPrintf("Path %s does not exist \n", fullPath.string().c_str());
-                    };
+void SecMsgDB::ApplyCountChanges()
+{
+    // -- called once the writes are committed
+    if (fIndexChanged)
+    {
+        if (fCountChanges && fSmsgIndexCounted)
+        {
+            for (int k = 0; k < 3; ++k)
+                smsgIndexCount[k] += nCountDelta[k];
+        } else
+        {
+            // -- counted while these writes were pending, count again
+            fSmsgIndexCounted = false;
+        };
+    };
+
+    fIndexChanged = false;
+    memset(nCountDelta, 0, sizeof(nCountDelta));
+};
+
+bool SecMsgDB::BuildIndexes()
+{
+    if (!pdb)
+        return false;
+
+    fSmsgIndexCounted = false;
+
+    LogPrintf("SecMsgDB: Building inbox and outbox indexes.\n");
+    int64_t nStart = GetTimeMillis();
+    uint32_t nMessages = 0;
+
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = true;
+    leveldb::WriteBatch batch;
+
+    // -- drop entries left by an older index version
+    const char* aIndexes[] = {"it", "iu", "st"};
+    for (int k = 0; k < 3; ++k)
+    {
+        leveldb::Iterator* it = pdb->NewIterator(leveldb::ReadOptions());
+        for (it->Seek(aIndexes[k]); it->Valid() && it->key().starts_with(aIndexes[k]); it->Next())
+            batch.Delete(it->key());
+        delete it;
+    };
+
+    const char* aPrefixes[] = {"im", "sm"};
+    uint8_t chKey[18];
+    SecMsgStored smsgStored;
+    for (int k = 0; k < 2; ++k)
+    {
+        std::string sPrefix(aPrefixes[k]);
+        leveldb::Iterator* it = pdb->NewIterator(leveldb::ReadOptions());
+        while (NextSmesg(it, sPrefix, chKey, smsgStored))
+        {
+            IndexSmesg(&batch, chKey, smsgStored.status & SMSG_MASK_UNREAD, false);
+            nMessages++;
+        };
+        delete it;
+    };
+
+    std::string strVersion(4, '\0');
+    uint32_t nVersion = SMSG_DB_INDEX_VERSION;
+    memcpy(&strVersion[0], &nVersion, 4);
+    batch.Put("vi", strVersion);
+
+    leveldb::Status s = pdb->Write(writeOptions, &batch);
+    if (!s.ok())
+    {
+        LogPrintf("SecMsgDB::BuildIndexes() write failed: %s\n", s.ToString().c_str());
+        return false;
+    };
+
+    LogPrintf("SecMsgDB: Indexed %u messages in %d ms.\n", nMessages, GetTimeMillis() - nStart);
+    return true;
+};
+
+uint32_t SecMsgDB::CountSmesg(const std::string& prefix, bool fUnreadOnly)
+{
+    // -- caller holds cs_smsgDB. The indexes are walked once, later writes keep the counts
+    int nIndex;
+    if (prefix == "im")
+        nIndex = fUnreadOnly ? SMSG_INDEX_UNREAD : SMSG_INDEX_INBOX;
+    else
+    if (prefix == "sm" && !fUnreadOnly)
+        nIndex = SMSG_INDEX_OUTBOX;
+    else
+        return 0;
+
+    if (!fSmsgIndexCounted)
+    {
+        // -- walks index keys only, no records are read
+        SecMsgCursor cursorInbox(*this, "im", false);
+        SecMsgCursor cursorUnread(*this, "im", true);
+        SecMsgCursor cursorOutbox(*this, "sm", false);
+        smsgIndexCount[SMSG_INDEX_INBOX] = cursorInbox.Skip(std::numeric_limits<uint32_t>::max());
+        smsgIndexCount[SMSG_INDEX_UNREAD] = cursorUnread.Skip(std::numeric_limits<uint32_t>::max());
+        smsgIndexCount[SMSG_INDEX_OUTBOX] = cursorOutbox.Skip(std::numeric_limits<uint32_t>::max());
+        fSmsgIndexCounted = true;
+    };
+
+    return smsgIndexCount[nIndex];
+};
+
+SecMsgCursor::SecMsgCursor(SecMsgDB& dbIn, const std::string& prefix, bool fUnreadOnly) : db(dbIn)
+{
+    it = NULL;
+    fStarted = false;
+
+    if (prefix == "im")
+        sIndex = fUnreadOnly ? "iu" : "it";
+    else
+    if (prefix == "sm" && !fUnreadOnly) // outbox messages are never unread
+        sIndex = "st";
+
+    if (db.pdb && !sIndex.empty())
+        it = db.pdb->NewIterator(leveldb::ReadOptions());
+};
+
+SecMsgCursor::~SecMsgCursor()
+{
+    if (it)
+        delete it;
+};
+
+bool SecMsgCursor::NextKey(uint8_t* chKey)
+{
+    if (!it)
+        return false;
+
+    if (!fStarted)
+    {
+        // -- position on the newest entry, the last key with the index prefix
+        fStarted = true;
+        it->Seek(sIndex + std::string(9, '\xff'));
+        if (it->Valid())
+            it->Prev();
+        else
+            it->SeekToLast();
+    } else
+    {
+        it->Prev();
+    };
+
+    if (!(it->Valid()
+        && it->key().size() == 28
+        && it->key().starts_with(sIndex)))
+        return false;
+
+    memcpy(chKey, it->key().data() + 10, 18);
+    return true;
+};
+
+uint32_t SecMsgCursor::Skip(uint32_t n)
+{
+    uint8_t chKey[18];
+    uint32_t nSkipped = 0;
+    while (nSkipped < n && NextKey(chKey))
+        nSkipped++;
+    return nSkipped;
+};
+
+bool SecMsgCursor::Next(uint8_t* chKey, SecMsgStored& smsgStored)
+{
+    while (NextKey(chKey))
+    {
+        if (db.ReadSmesg(chKey, smsgStored))
+            return true;
+        LogPrintf("SecMsgCursor: index entry without record, skipping.\n");
+    };
+    return false;
+};
+
+bool SecMsgInboxBatch::Add(uint8_t* chKey, SecMsgStored& smsgStored, bool fNotify)
+{
+    // -- caller holds cs_smsgDB, returns false if the message is already in the inbox
+    std::string strKey((const char*)chKey, 18);
+
+    if (!fOpen)
+    {
+        if (!db.Open("cw"))
+            return false;
+        fOpen = true;
+    };
+
+    if (setKeys.count(strKey))
+        return false;
+
+    // -- check committed data without scanning the pending batch
+    SecMsgDB dbRead;
+    if (!dbRead.Open("cw")
+        || dbRead.ExistsSmesg(chKey))
+        return false;
+
+    db.TxnBegin();
+    if (!db.WriteSmesg(chKey, smsgStored))
+        return false;
+
+    setKeys.insert(strKey);
+    if (fNotify)
+        vNotify.push_back(smsgStored);
+    nPending++;
+    return true;
+};
+
+bool SecMsgInboxBatch::Commit()
+{
+    if (nPending < 1)
+        return true;
+
+    LOCK(cs_smsgDB);
+    bool fSuccess = db.TxnCommit();
+
+    if (fDebugSmsg)
+        LogPrintf("SecMsgInboxBatch: Committed %u messages.\n", nPending);
+
+    if (fSuccess)
+    {
+        for (std::vector<SecMsgStored>::iterator it = vNotify.begin(); it != vNotify.end(); ++it)
+            NotifySecMsgInboxChanged(*it);
+    };
+
+    nPending = 0;
+    setKeys.clear();
+    vNotify.clear();
+    return fSuccess;
+};
+
+void SecMsgKeyFilter::Init(uint32_t nBits)
+{
+    // -- nBits must be a power of 2
+    vBits.assign(std::max(nBits / 64, (uint32_t)1), 0);
+    nKeys = 0;
+};
+
+void SecMsgKeyFilter::Clear()
+{
+    std::vector<uint64_t>().swap(vBits);
+    nKeys = 0;
+};
+
+void SecMsgKeyFilter::Insert(const CKeyID& id)
+{
+    if (vBits.empty())
+        return;
+
+    uint32_t nMask = vBits.size() * 64 - 1;
+    const uint8_t *p = id.begin();
+    for (uint32_t i = 0; i < SMSG_KEY_FILTER_PROBES; ++i)
+    {
+        uint32_t n;
+        memcpy(&n, p + i * 4, 4);
+        n &= nMask;
+        vBits[n >> 6] |= (uint64_t)1 << (n & 63);
+    };
+    nKeys++;
+};
+
+bool SecMsgKeyFilter::MayContain(const CKeyID& id) const
+{
+    if (vBits.empty())
+        return true;
+
+    uint32_t nMask = vBits.size() * 64 - 1;
+    const uint8_t *p = id.begin();
+    for (uint32_t i = 0; i < SMSG_KEY_FILTER_PROBES; ++i)
+    {
+        uint32_t n;
+        memcpy(&n, p + i * 4, 4);
+        n &= nMask;
+        if (!(vBits[n >> 6] & ((uint64_t)1 << (n & 63))))
+            return false;
+    };
+    return true;
+};
+
+static fs::path SecureMsgSegmentPath(int64_t segment, const char *pszExt)
+{
+    return GetDataDir() / "smsgStore" / (boost::lexical_cast<std::string>(segment) + pszExt);
+};
+
+static bool SecureMsgReadAt(FILE *fp, int64_t ofs, uint8_t *pData, size_t nLen)
+{
+    // -- positional read, doesn't disturb the append position of fp
+#ifndef WIN32
+    int fd = fileno(fp);
+    while (nLen > 0)
+    {
+        ssize_t nRead = pread(fd, pData, nLen, ofs);
+        if (nRead < 0 && errno == EINTR)
+            continue;
+        if (nRead <= 0)
+            return false;
+        pData += nRead;
+        ofs += nRead;
+        nLen -= nRead;
+    };
+    return true;
+#else
+    if (fseek(fp, ofs, SEEK_SET) != 0)
+        return false;
+    return fread(pData, sizeof(uint8_t), nLen, fp) == nLen;
+#endif
+};
+
+SecMsgSegment* SecMsgStoreLog::OpenSegment(int64_t segment, bool fCreate)
+{
+    std::map<int64_t, SecMsgSegment>::iterator mi = mapSegments.find(segment);
+    if (mi != mapSegments.end())
+        return &mi->second;
+
+    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
+    fs::path pathLog = SecureMsgSegmentPath(segment, ".log");
+    fs::path pathIdx = SecureMsgSegmentPath(segment, ".idx");
+
+    if (!fCreate && !fs::exists(pathLog))
+        return NULL;
+
+    try {
+        fs::create_directory(pathSmsgDir);
+    } catch (const fs::filesystem_error& ex)
+    {
+        LogPrintf("Failed to create directory %s - %s.\n", pathSmsgDir.string().c_str(), ex.what());
+        return NULL;
+    };
+
+    SecMsgSegment seg;
+    errno = 0;
+    if (!(seg.fpLog = fopen(pathLog.string().c_str(), "a+b")))
+    {
+        LogPrintf("Error opening file: %s\nPath %s\n", strerror(errno), pathLog.string().c_str());
+        return NULL;
+    };
+
+    if (!(seg.fpIdx = fopen(pathIdx.string().c_str(), "a+b")))
+    {
+        LogPrintf("Error opening file: %s\nPath %s\n", strerror(errno), pathIdx.string().c_str());
+        fclose(seg.fpLog);
+        return NULL;
+    };
+
+    // -- on windows ftell will always return 0 after fopen(ab), call fseek to set.
+    if (fseek(seg.fpLog, 0, SEEK_END) != 0)
+    {
+        LogPrintf("fseek failed: %s.\n", strerror(errno));
+        fclose(seg.fpLog);
+        fclose(seg.fpIdx);
+        return NULL;
+    };
+    seg.nSize = ftell(seg.fpLog);
+
+    return &(mapSegments[segment] = seg);
+};
+
+int SecMsgStoreLog::Append(int64_t bucket, const uint8_t *pHeader, const uint8_t *pPayload, uint32_t nPayload, int64_t& ofs)
+{
+    SecMsgSegment *pseg = OpenSegment(SegmentTime(bucket), true);
+    if (!pseg)
+        return 1;
+
+    const SecureMessage *psmsg = (const SecureMessage*) pHeader;
+
+    ofs = pseg->nSize;
+
+    // -- log first, a log record without an index entry is recovered in LoadSegment
+    if (fwrite(pHeader,  sizeof(uint8_t), SMSG_HDR_LEN, pseg->fpLog) != (size_t)SMSG_HDR_LEN
+     || fwrite(pPayload, sizeof(uint8_t),     nPayload, pseg->fpLog) != nPayload
+     || fflush(pseg->fpLog) != 0)
+    {
+        // -- don't leave a partial record in front of the next one
+        int nErr = errno;
+        Close();
+        try {
+            fs::resize_file(SecureMsgSegmentPath(SegmentTime(bucket), ".log"), ofs);
+        } catch (const fs::filesystem_error& ex)
+        {
+            LogPrintf("Could not truncate segment - %s.\n", ex.what());
+        };
+        return errorN(1, "fwrite failed: %s.", strerror(nErr));
+    };
+    pseg->nSize += SMSG_HDR_LEN + nPayload;
+
+    SecMsgIndexEntry entry;
+    entry.timestamp = psmsg->timestamp;
+    memset(entry.sample, 0, 8);
+    if (nPayload >= 8)
+        memcpy(entry.sample, pPayload, 8);
+    entry.offset = ofs;
+    entry.nPayload = nPayload;
+
+    if (fwrite(&entry, sizeof(entry), 1, pseg->fpIdx) != 1
+     || fflush(pseg->fpIdx) != 0)
+        LogPrintf("SecMsgStoreLog: index write failed: %s.\n", strerror(errno));
+
+    return 0;
+};
+
+int SecMsgStoreLog::Read(int64_t bucket, int64_t ofs, std::vector<uint8_t>& vchData)
+{
+    SecMsgSegment *pseg = OpenSegment(SegmentTime(bucket), false);
+    if (!pseg)
+        return errorN(1, "%s: No log segment for bucket %d.", __func__, bucket);
+
+    if (ofs + (int64_t)SMSG_HDR_LEN > pseg->nSize)
+        return errorN(1, "%s: Offset %d past end of segment.", __func__, ofs);
+
+    SecureMessage smsg;
+    if (!SecureMsgReadAt(pseg->fpLog, ofs, &smsg.hash[0], SMSG_HDR_LEN))
+        return errorN(1, "%s: Read header failed: %s.", __func__, strerror(errno));
+
+    if (ofs + (int64_t)SMSG_HDR_LEN + smsg.nPayload > pseg->nSize)
+        return errorN(1, "%s: Payload of %u bytes past end of segment.", __func__, smsg.nPayload);
+
+    try {
+        vchData.resize(SMSG_HDR_LEN + smsg.nPayload);
+    } catch (std::exception& e) {
+        return errorN(1, "%s: Could not resize vchData, %u, %s.", __func__, SMSG_HDR_LEN + smsg.nPayload, e.what());
+    };
+
+    memcpy(&vchData[0], &smsg.hash[0], SMSG_HDR_LEN);
+    if (smsg.nPayload > 0
+        && !SecureMsgReadAt(pseg->fpLog, ofs + SMSG_HDR_LEN, &vchData[SMSG_HDR_LEN], smsg.nPayload))
+        return errorN(1, "%s: Read data failed: %s. Wanted %u bytes.", __func__, strerror(errno), smsg.nPayload);
+
+    return 0;
+};
+
+int SecMsgStoreLog::LoadSegment(int64_t segment, std::map<int64_t, SecMsgBucket>& buckets, int64_t cutoffTime, uint32_t& nMessages)
+{
+    SecMsgSegment *pseg = OpenSegment(segment, false);
+    if (!pseg)
+        return 1;
+
+    // -- read the whole index, entries must be in log order and inside the log
+    std::vector<SecMsgIndexEntry> vEntries;
+    if (fseek(pseg->fpIdx, 0, SEEK_END) == 0)
+    {
+        long nIdxSize = ftell(pseg->fpIdx);
+        vEntries.resize(nIdxSize / sizeof(SecMsgIndexEntry));
+        if (vEntries.size() > 0
+            && !SecureMsgReadAt(pseg->fpIdx, 0, (uint8_t*)&vEntries[0], vEntries.size() * sizeof(SecMsgIndexEntry)))
+        {
+            LogPrintf("SecMsgStoreLog: could not read index of segment %d, rebuilding.\n", segment);
+            vEntries.clear();
+        };
+    };
+
+    int64_t nIndexed = 0;
+    size_t nValid = 0;
+    for (; nValid < vEntries.size(); ++nValid)
+    {
+        const SecMsgIndexEntry &entry = vEntries[nValid];
+        if (entry.offset != nIndexed
+            || entry.offset + (int64_t)SMSG_HDR_LEN + entry.nPayload > pseg->nSize)
+            break;
+        nIndexed = entry.offset + SMSG_HDR_LEN + entry.nPayload;
+    };
+
+    bool fRewriteIdx = nValid != vEntries.size();
+    vEntries.resize(nValid);
+
+    // -- messages appended after the last index write, read their headers from the log
+    while (nIndexed + (int64_t)SMSG_HDR_LEN <= pseg->nSize)
+    {
+        SecureMessage smsg;
+        SecMsgIndexEntry entry;
+        if (!SecureMsgReadAt(pseg->fpLog, nIndexed, &smsg.hash[0], SMSG_HDR_LEN)
+            || nIndexed + (int64_t)SMSG_HDR_LEN + smsg.nPayload > pseg->nSize)
+            break;
+        memset(entry.sample, 0, 8);
+        if (smsg.nPayload >= 8
+            && !SecureMsgReadAt(pseg->fpLog, nIndexed + SMSG_HDR_LEN, entry.sample, 8))
+            break;
+        entry.timestamp = smsg.timestamp;
+        entry.offset = nIndexed;
+        entry.nPayload = smsg.nPayload;
+        vEntries.push_back(entry);
+        nIndexed += SMSG_HDR_LEN + smsg.nPayload;
+        fRewriteIdx = true;
+    };
+
+    if (nIndexed != pseg->nSize)
+    {
+        // -- torn write at the end of the log, cut it so the next append starts on a record boundary
+        LogPrintf("SecMsgStoreLog: truncating segment %d from %d to %d bytes.\n", segment, pseg->nSize, nIndexed);
+        Close();
+        try {
+            fs::resize_file(SecureMsgSegmentPath(segment, ".log"), nIndexed);
+        } catch (const fs::filesystem_error& ex)
+        {
+            return errorN(1, "%s: Could not truncate segment %d - %s.", __func__, segment, ex.what());
+        };
+        if (!(pseg = OpenSegment(segment, false)))
+            return 1;
+    };
+
+    if (fRewriteIdx)
+    {
+        fs::path pathIdx = SecureMsgSegmentPath(segment, ".idx");
+        fclose(pseg->fpIdx);
+        if (!(pseg->fpIdx = fopen(pathIdx.string().c_str(), "w+b"))
+            || (vEntries.size() > 0 && fwrite(&vEntries[0], sizeof(SecMsgIndexEntry), vEntries.size(), pseg->fpIdx) != vEntries.size())
+            || fflush(pseg->fpIdx) != 0)
+        {
+            if (pseg->fpIdx)
+                fclose(pseg->fpIdx);
+            mapSegments.erase(segment);
+            return errorN(1, "%s: Could not rewrite index of segment %d.", __func__, segment);
+        };
+    };
+
+    for (std::vector<SecMsgIndexEntry>::iterator it = vEntries.begin(); it != vEntries.end(); ++it)
+    {
+        if (it->nPayload < 8)
+            continue;
+
+        int64_t bucket = it->timestamp - (it->timestamp % SMSG_BUCKET_LEN);
+        if (bucket < cutoffTime)
+            continue;
+
+        SecMsgToken token;
+        token.timestamp = it->timestamp;
+        memcpy(token.sample, it->sample, 8);
+        token.offset = it->offset;
+        if (buckets[bucket].setTokens.insert(token).second)
+            nMessages++;
+    };
+
+    return 0;
+};
+
+int SecMsgStoreLog::ImportLegacyFile(const fs::path& path, int64_t bucket, std::map<int64_t, SecMsgBucket>& buckets)
+{
+    // -- move the messages of a bucket file written by an older version into the log
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(path.string().c_str(), "rb")))
+        return errorN(1, "%s: Error opening file: %s.", __func__, strerror(errno));
+
+    SecureMessage smsg;
+    std::vector<uint8_t> vchData;
+    std::set<SecMsgToken>& tokenSet = buckets[bucket].setTokens;
+    int rv = 0;
+    for (;;)
+    {
+        if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
+            break;
+
+        try { vchData.resize(smsg.nPayload); } catch (std::exception& e)
+        {
+            rv = errorN(1, "%s: Could not resize vchData, %u, %s.", __func__, smsg.nPayload, e.what());
+            break;
+        };
+
+        if (smsg.nPayload > 0
+            && fread(&vchData[0], sizeof(uint8_t), smsg.nPayload, fp) != smsg.nPayload)
+            break;
+
+        if (smsg.nPayload < 8)
+            continue;
+
+        SecMsgToken token(smsg.timestamp, &vchData[0], smsg.nPayload, 0);
+        if (tokenSet.count(token))
+            continue;
+
+        if (Append(bucket, &smsg.hash[0], &vchData[0], smsg.nPayload, token.offset) != 0)
+        {
+            rv = 1;
+            break;
+        };
+        tokenSet.insert(token);
+    };
+    fclose(fp);
+
+    if (rv == 0)
+    {
+        try { fs::remove(path);
+        } catch (const fs::filesystem_error& ex)
+        {
+            LogPrintf("Error removing bucket file %s.\n", ex.what());
+        };
+    };
+
+    return rv;
+};
+
+int SecMsgStoreLog::Load(std::map<int64_t, SecMsgBucket>& buckets, int64_t cutoffTime)
+{
+    /*
+        Rebuild the bucket token sets from the segment indexes.
+        Bucket files of older versions (<bucket>_01.dat) are moved into the log.
+    */
+
+    Close();
+
+    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
+    if (!fs::exists(pathSmsgDir)
+        || !fs::is_directory(pathSmsgDir))
+    {
+        LogPrintf("Message store directory does not exist.\n");
+        return 0; // not an error
+    };
+
+    std::set<int64_t> setSegments;
+    std::map<int64_t, fs::path> mapLegacy;
+
+    fs::directory_iterator itend;
+    for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
+    {
+        if (!fs::is_regular_file(itd->status()))
+            continue;
+
+        std::string fileType = (*itd).path().extension().string();
+        std::string fileName = (*itd).path().filename().string();
+        std::string stem = (*itd).path().stem().string();
+
+        int64_t fileTime;
+        try {
+            fileTime = boost::lexical_cast<int64_t>(stem.substr(0, stem.find_first_of("_")));
+        } catch (boost::bad_lexical_cast&)
+        {
+            continue;
+        };
 
-                    // -- look for a wl file, it stores incoming messages when wallet is locked
-                    fullPath = GetDataDir() / "smsgStore" / (fileName + "_01_wl.dat");
-                    if (fs::exists(fullPath))
-                    {
-                        try { fs::remove(fullPath);
-                        } catch (const fs::filesystem_error& ex)
-                        {
-                            LogPrintf("Error removing wallet locked file %s.\n", ex.what());
-                        };
-                    };
+        if (fileType.compare(".log") == 0)
+        {
+            setSegments.insert(fileTime);
+        } else
+        if (fileType.compare(".dat") == 0
+            && !boost::algorithm::ends_with(fileName, "_wl.dat"))
+        {
+            if (fileTime < cutoffTime)
+            {
+                LogPrintf("Dropping file %s, expired.\n", fileName.c_str());
+                try { fs::remove((*itd).path());
+                } catch (const fs::filesystem_error& ex)
+                {
+                    LogPrintf("Error removing bucket file %s, %s.\n", fileName.c_str(), ex.what());
+                };
+                continue;
+            };
+            mapLegacy[fileTime] = (*itd).path();
+        };
+    };
 
-                    smsgBuckets.erase(it++);
-                } else
+    uint32_t nMessages = 0;
+    for (std::set<int64_t>::iterator it = setSegments.begin(); it != setSegments.end(); ++it)
+    {
+        if (*it + SMSG_SEGMENT_LEN <= cutoffTime)
+            continue; // removed by Expire below
+
+        if (LoadSegment(*it, buckets, cutoffTime, nMessages) != 0)
+            LogPrintf("SecMsgStoreLog: could not load segment %d.\n", *it);
+    };
+
+    for (std::map<int64_t, fs::path>::iterator it = mapLegacy.begin(); it != mapLegacy.end(); ++it)
+    {
+        size_t nBefore = buckets[it->first].setTokens.size();
+        if (ImportLegacyFile(it->second, it->first, buckets) != 0)
+            LogPrintf("SecMsgStoreLog: could not import %s.\n", it->second.string().c_str());
+        nMessages += buckets[it->first].setTokens.size() - nBefore;
+    };
+
+    Expire(cutoffTime);
+
+    if (fDebugSmsg)
+        LogPrintf("SecMsgStoreLog: loaded %u messages from %u segments, %u legacy files.\n", nMessages, setSegments.size(), mapLegacy.size());
+
+    return 0;
+};
+
+int SecMsgStoreLog::Expire(int64_t cutoffTime)
+{
+    // -- drop segments whose newest bucket is older than cutoffTime
+    int nRemoved = 0;
+    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
+    if (!fs::exists(pathSmsgDir))
+        return 0;
+
+    fs::directory_iterator itend;
+    for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
+    {
+        if (!fs::is_regular_file(itd->status()))
+            continue;
+
+        std::string fileType = (*itd).path().extension().string();
+        if (fileType.compare(".log") != 0
+            && fileType.compare(".idx") != 0)
+            continue;
+
+        int64_t segment;
+        try {
+            segment = boost::lexical_cast<int64_t>((*itd).path().stem().string());
+        } catch (boost::bad_lexical_cast&)
+        {
+            continue;
+        };
+
+        if (segment + SMSG_SEGMENT_LEN > cutoffTime)
+            continue;
+
+        std::map<int64_t, SecMsgSegment>::iterator mi = mapSegments.find(segment);
+        if (mi != mapSegments.end())
+        {
+            fclose(mi->second.fpLog);
+            fclose(mi->second.fpIdx);
+            mapSegments.erase(mi);
+        };
+
+        if (fDebugSmsg)
+            LogPrintf("Removing segment file %s.\n", (*itd).path().filename().string().c_str());
+
+        try { fs::remove((*itd).path());
+        } catch (const fs::filesystem_error& ex)
+        {
+            LogPrintf("Error removing segment file %s.\n", ex.what());
+            continue;
+        };
+        nRemoved++;
+    };
+
+    return nRemoved;
+};
+
+int SecMsgStoreLog::Clear()
+{
+    Close();
+
+    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
+    if (!fs::exists(pathSmsgDir))
+        return 0;
+
+    fs::directory_iterator itend;
+    for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
+    {
+        std::string fileType = (*itd).path().extension().string();
+        if (fileType.compare(".log") != 0
+            && fileType.compare(".idx") != 0)
+            continue;
+
+        try { fs::remove((*itd).path());
+        } catch (const fs::filesystem_error& ex)
+        {
+            LogPrintf("Error removing segment file %s.\n", ex.what());
+        };
+    };
+
+    return 0;
+};
+
+void SecMsgStoreLog::Close()
+{
+    for (std::map<int64_t, SecMsgSegment>::iterator it = mapSegments.begin(); it != mapSegments.end(); ++it)
+    {
+        if (it->second.fpLog)
+            fclose(it->second.fpLog);
+        if (it->second.fpIdx)
+            fclose(it->second.fpIdx);
+    };
+    mapSegments.clear();
+};
+
+int64_t SecMsgStoreLog::GetTotalSize()
+{
+    int64_t nTotal = 0;
+    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
+    if (!fs::exists(pathSmsgDir))
+        return 0;
+
+    fs::directory_iterator itend;
+    for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
+    {
+        if (!fs::is_regular_file(itd->status())
+            || (*itd).path().extension().string().compare(".log") != 0)
+            continue;
+        try {
+            nTotal += fs::file_size((*itd).path());
+        } catch (const fs::filesystem_error& ex)
+        {
+            LogPrintf("Error reading segment size %s.\n", ex.what());
+        };
+    };
+    return nTotal;
+};
+
+static void SecureMsgLockBucket(SecMsgBucket& bkt, int64_t bucketTime, NodeId nPeerId)
+{
+    // -- lock the bucket for at most SMSG_LOCK_TIMEOUT seconds, waiting on data from nPeerId
+    AssertLockHeld(cs_smsg);
+
+    bkt.nLockCount  = 1;
+    bkt.nLockPeerId = nPeerId;
+    bkt.nLockUntil  = GetTime() + SMSG_LOCK_TIMEOUT;
+    smsgTimers.Add(bkt.nLockUntil, SMSG_TIMER_BUCKET_LOCK, bucketTime);
+};
+
+void ThreadSecureMsg()
+{
+    // -- bucket management thread
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+
+    uint32_t nLoop = 0;
+    std::vector<std::pair<int64_t, NodeId> > vTimedOutLocks;
+    std::vector<SecMsgTimer> vDue;
+    while (fSecMsgEnabled)
+    {
+        nLoop++;
+        int64_t now = GetTime();
+
+        if (fDebugSmsg && nLoop % (SMSG_THREAD_LOG_GAP * SMSG_THREAD_DELAY) == 0) // log every SMSG_THREAD_LOG_GAP * SMSG_THREAD_DELAY seconds, is useful source of timestamps
+            LogPrintf("SecureMsgThread %d \n", now);
+
+        vTimedOutLocks.resize(0);
+        vDue.resize(0);
+
+        int64_t cutoffTime = now - SMSG_RETENTION;
+        {
+            LOCK(cs_smsg);
+
+            // -- only the timers due are touched
+            smsgTimers.Advance(now, vDue);
+            for (std::vector<SecMsgTimer>::iterator it(vDue.begin()); it != vDue.end(); ++it)
+            {
+                if (it->nType != SMSG_TIMER_BUCKET_LOCK)
+                    continue;
+
+                std::map<int64_t, SecMsgBucket>::iterator itb = smsgBuckets.find(it->nKey);
+                if (itb == smsgBuckets.end()
+                    || itb->second.nLockCount == 0
+                    || itb->second.nLockUntil > now) // released, or locked again since
+                    continue;
+
+                vTimedOutLocks.push_back(std::make_pair(itb->first, itb->second.nLockPeerId)); // cs_vNodes
+
+                itb->second.nLockCount = 0;
+                itb->second.nLockPeerId = 0;
+            };
+
+            // -- buckets are ordered by time, stop at the first one still in retention
+            bool fRemovedBucket = false;
+            std::map<int64_t, SecMsgBucket>::iterator it;
+            while ((it = smsgBuckets.begin()) != smsgBuckets.end()
+                && it->first < cutoffTime)
+            {
+                if (fDebugSmsg)
+                    LogPrintf("Removing bucket %d \n", it->first);
+
+                std::string fileName = boost::lexical_cast<std::string>(it->first);
+
+                // -- look for a wl file, it stores incoming messages when wallet is locked
+                fs::path fullPath = GetDataDir() / "smsgStore" / (fileName + "_01_wl.dat");
+                if (fs::exists(fullPath))
                 {
-                    if (it->second.nLockCount > 0) // -- tick down nLockCount, so will eventually expire if peer never sends data
+                    try { fs::remove(fullPath);
+                    } catch (const fs::filesystem_error& ex)
                     {
-                        it->second.nLockCount--;
-
-                        if (it->second.nLockCount == 0)     // lock timed out
-                        {
-                            vTimedOutLocks.push_back(std::make_pair(it->first, it->second.nLockPeerId)); // cs_vNodes
+                        LogPrintf("Error removing wallet locked file %s.\n", ex.what());
+                    };
+                };
 
-                            it->second.nLockPeerId = 0;
-                        }; // if (it->second.nLockCount == 0)
-                    }; // ! if (it->first < cutoffTime)
-                    ++it;
-                }
+                smsgBuckets.erase(it);
+                fRemovedBucket = true;
             };
+
+            // -- segments are dropped whole, once their last bucket expired
+            if (fRemovedBucket)
+                smsgStoreLog.Expire(cutoffTime);
         } // cs_smsg
 
         for (std::vector<std::pair<int64_t, NodeId> >::iterator it(vTimedOutLocks.begin()); it != vTimedOutLocks.end(); it++)
@@ -699,10 +2041,30 @@ void ThreadSecureMsg()
                 LogPrintf("procurrency-smsg thread: ignoring - looked peer %d, status on search %u\n", nPeerId, fExists);
         };
 
-        MilliSleep(SMSG_THREAD_DELAY * 1000); //  // check every SMSG_THREAD_DELAY seconds
+        MilliSleep(1000); // nothing is walked unless due, so waking each second is cheap
     };
 };
 
+int SecureMsgCountQueued()
+{
+    // -- number of messages in the outbox queue waiting for proof of work
+    int nQueued = 0;
+    std::string sPrefix("qm");
+    uint8_t chKey[18];
+
+    LOCK(cs_smsgDB);
+    SecMsgDB dbOutbox;
+    if (!dbOutbox.Open("cr+"))
+        return -1;
+
+    leveldb::Iterator* it = dbOutbox.pdb->NewIterator(leveldb::ReadOptions());
+    while (dbOutbox.NextSmesgKey(it, sPrefix, chKey))
+        nQueued++;
+    delete it;
+
+    return nQueued;
+};
+
 void ThreadSecureMsgPow()
 {
     // -- proof of work thread
@@ -752,176 +2114,69 @@ void ThreadSecureMsgPow()
             // -- message is removed here, no matter what
             {
                 LOCK(cs_smsgDB);
-                dbOutbox.EraseSmesg(chKey);
-            }
-            if (rv != 0)
-            {
-                LogPrintf("SecMsgPow: Could not get proof of work hash, message removed.\n");
-                continue;
-            };
-
-            // -- add to message store
-            {
-                LOCK(cs_smsg);
-                if (SecureMsgStore(pHeader, pPayload, psmsg->nPayload, true) != 0)
-                {
-                    LogPrintf("SecMsgPow: Could not place message in buckets, message removed.\n");
-                    continue;
-                };
-            }
-
-            // -- test if message was sent to self
-            if (SecureMsgScanMessage(pHeader, pPayload, psmsg->nPayload, true) != 0)
-            {
-                // message recipient is not this node (or failed)
-            };
-        };
-
-        delete it;
-
-        // -- shutdown thread waits 5 seconds, this should be less
-        MilliSleep(2000); // seconds
-    };
-};
-
-int SecureMsgBuildBucketSet()
-{
-    /*
-        Build the bucket set by scanning the files in the smsgStore dir.
-
-        smsgBuckets should be empty
-    */
-
-    if (fDebugSmsg)
-        LogPrintf("SecureMsgBuildBucketSet()\n");
-
-    int64_t  now            = GetTime();
-    uint32_t nFiles         = 0;
-    uint32_t nMessages      = 0;
-
-    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
-    fs::directory_iterator itend;
-
-
-    if (!fs::exists(pathSmsgDir)
-        || !fs::is_directory(pathSmsgDir))
-    {
-        LogPrintf("Message store directory does not exist.\n");
-        return 0; // not an error
-    }
-
-
-    for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
-    {
-        if (!fs::is_regular_file(itd->status()))
-            continue;
-
-        std::string fileType = (*itd).path().extension().string();
-
-        if (fileType.compare(".dat") != 0)
-            continue;
-
-        std::string fileName = (*itd).path().filename().string();
-
-        if (fDebugSmsg)
-            LogPrintf("Processing file: %s.\n", fileName.c_str());
-
-        nFiles++;
-
-        // TODO files must be split if > 2GB
-        // time_noFile.dat
-        size_t sep = fileName.find_first_of("_");
-        if (sep == std::string::npos)
-            continue;
-
-        std::string stime = fileName.substr(0, sep);
-
-        int64_t fileTime = boost::lexical_cast<int64_t>(stime);
-
-        if (fileTime < now - SMSG_RETENTION)
-        {
-            LogPrintf("Dropping file %s, expired.\n", fileName.c_str());
-            try {
-                fs::remove((*itd).path());
-            } catch (const fs::filesystem_error& ex)
-            {
-                LogPrintf("Error removing bucket file %s, %s.\n", fileName.c_str(), ex.what());
-            };
-            continue;
-        };
-
-        if (boost::algorithm::ends_with(fileName, "_wl.dat"))
-        {
-            if (fDebugSmsg)
-                LogPrintf("Skipping wallet locked file: %s.\n", fileName.c_str());
-            continue;
-        };
-
-        size_t nTokenSetSize = 0;
-        SecureMessage smsg;
-        {
-            LOCK(cs_smsg);
-
-            std::set<SecMsgToken>& tokenSet = smsgBuckets[fileTime].setTokens;
-
-            FILE *fp;
-
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
+                dbOutbox.EraseSmesg(chKey);
+            }
+            if (rv != 0)
             {
-                LogPrintf("Error opening file: %s\n", strerror(errno));
+                LogPrintf("SecMsgPow: Could not get proof of work hash, message removed.\n");
                 continue;
             };
 
-            for (;;)
+            // -- add to message store
             {
-                long int ofs = ftell(fp);
-                SecMsgToken token;
-                token.offset = ofs;
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
+                LOCK(cs_smsg);
+                if (SecureMsgStore(pHeader, pPayload, psmsg->nPayload, true) != 0)
                 {
-                    if (errno != 0)
-                    {
-                        LogPrintf("fread header failed: %s\n", strerror(errno));
-                    } else
-                    {
-                        //LogPrintf("End of file.\n");
-                    };
-                    break;
+                    LogPrintf("SecMsgPow: Could not place message in buckets, message removed.\n");
+                    continue;
                 };
-                token.timestamp = smsg.timestamp;
+            }
 
-                if (smsg.nPayload < 8)
-                    continue;
+            // -- test if message was sent to self
+            if (SecureMsgScanMessage(pHeader, pPayload, psmsg->nPayload, true) != 0)
+            {
+                // message recipient is not this node (or failed)
+            };
+        };
 
-                if (fread(token.sample, sizeof(uint8_t), 8, fp) != 8)
-                {
-                    LogPrintf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
+        delete it;
 
-                if (fseek(fp, smsg.nPayload-8, SEEK_CUR) != 0)
-                {
-                    LogPrintf("fseek, strerror: %s.\n", strerror(errno));
-                    break;
-                };
+        // -- shutdown thread waits 5 seconds, this should be less
+        MilliSleep(2000); // seconds
+    };
+};
 
-                tokenSet.insert(token);
-            };
+int SecureMsgBuildBucketSet()
+{
+    /*
+        Build the bucket set from the message store index, payloads are not read.
 
-            fclose(fp);
+        smsgBuckets should be empty
+    */
 
-            smsgBuckets[fileTime].hashBucket();
+    if (fDebugSmsg)
+        LogPrintf("SecureMsgBuildBucketSet()\n");
 
-            nTokenSetSize = tokenSet.size();
-        } // LOCK(cs_smsg);
+    int64_t  mStart         = GetTimeMillis();
+    uint32_t nMessages      = 0;
 
-        nMessages += nTokenSetSize;
-        if (fDebugSmsg)
-            LogPrintf("Bucket %d contains %u messages.\n", fileTime, nTokenSetSize);
-    };
+    {
+        LOCK(cs_smsg);
+
+        if (smsgStoreLog.Load(smsgBuckets, GetTime() - SMSG_RETENTION) != 0)
+            return 1;
+
+        for (std::map<int64_t, SecMsgBucket>::iterator it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
+        {
+            it->second.hashBucket();
+            nMessages += it->second.setTokens.size();
+
+            if (fDebugSmsg)
+                LogPrintf("Bucket %d contains %u messages.\n", it->first, it->second.setTokens.size());
+        };
+    } // LOCK(cs_smsg);
 
-    LogPrintf("Processed %u files, loaded %u buckets containing %u messages.\n", nFiles, smsgBuckets.size(), nMessages);
+    LogPrintf("Loaded %u buckets containing %u messages, took %d ms.\n", smsgBuckets.size(), nMessages, GetTimeMillis() - mStart);
 
     return 0;
 };
@@ -1040,6 +2295,10 @@ int SecureMsgReadIni()
         {
             smsgOptions.fScanIncoming = (strcmp(pValue, "true") == 0) ? true : false;
         } else
+        if (strcmp(pName, "tagRecipient") == 0)
+        {
+            smsgOptions.fTagRecipient = (strcmp(pValue, "true") == 0) ? true : false;
+        } else
         if (strcmp(pName, "key") == 0)
         {
             int rv = sscanf(pValue, "%64[^|]|%d|%d", cAddress, &addrRecv, &addrRecvAnon);
@@ -1090,7 +2349,8 @@ int SecureMsgWriteIni()
 
     if (fprintf(fp, "newAddressRecv=%s\n", smsgOptions.fNewAddressRecv ? "true" : "false") < 0
         || fprintf(fp, "newAddressAnon=%s\n", smsgOptions.fNewAddressAnon ? "true" : "false") < 0
-        || fprintf(fp, "scanIncoming=%s\n", smsgOptions.fScanIncoming ? "true" : "false") < 0)
+        || fprintf(fp, "scanIncoming=%s\n", smsgOptions.fScanIncoming ? "true" : "false") < 0
+        || fprintf(fp, "tagRecipient=%s\n", smsgOptions.fTagRecipient ? "true" : "false") < 0)
     {
         LogPrintf("fprintf error: %s\n", strerror(errno));
         fclose(fp);
@@ -1128,6 +2388,56 @@ int SecureMsgWriteIni()
 };
 
 
+static bool SecureMsgLoadKeyFilter(SecMsgDB& addrpkdb)
+{
+    // -- fill the filter from the pubkey db once, every write after keeps it in step
+    AssertLockHeld(cs_smsgDB);
+
+    if (smsgKeyFilter.IsLoaded())
+        return true;
+
+    int64_t nStart = GetTimeMillis();
+    smsgKeyFilter.Init(SMSG_KEY_FILTER_BITS);
+
+    leveldb::Iterator* it = addrpkdb.pdb->NewIterator(leveldb::ReadOptions());
+    for (it->Seek("pk"); it->Valid(); it->Next())
+    {
+        leveldb::Slice key = it->key();
+        if (key.size() < 2 || key[0] != 'p' || key[1] != 'k')
+            break;
+        if (key.size() != 2 + sizeof(CKeyID))
+            continue;
+
+        CKeyID keyId;
+        memcpy(keyId.begin(), key.data() + 2, sizeof(CKeyID));
+        smsgKeyFilter.Insert(keyId);
+    };
+    bool fSuccess = it->status().ok();
+    delete it;
+
+    if (!fSuccess)
+    {
+        LogPrintf("SecureMsgLoadKeyFilter() iterator failed.\n");
+        smsgKeyFilter.Clear();
+        return false;
+    };
+
+    LogPrintf("Loaded %u public key ids into the filter in %d ms.\n", smsgKeyFilter.nKeys, GetTimeMillis() - nStart);
+    return true;
+};
+
+static bool SecureMsgReadScanTip(int& nHeight, uint256& hashBlock)
+{
+    LOCK(cs_smsgDB);
+
+    SecMsgDB addrpkdb;
+    if (!addrpkdb.Open("cw"))
+        return false;
+
+    SecureMsgLoadKeyFilter(addrpkdb);
+    return addrpkdb.ReadScanTip(nHeight, hashBlock);
+};
+
 /** called from AppInit2() in init.cpp */
 bool SecureMsgStart(bool fDontStart, bool fScanChain)
 {
@@ -1156,7 +2466,11 @@ bool SecureMsgStart(bool fDontStart, bool fScanChain)
             LogPrintf("Loaded addresses from SMSG.ini\n");
     }
 
-    if (fScanChain)
+    // -- once a chain scan has run, catch up on the blocks connected while smsg was off
+    int nTipHeight;
+    uint256 hashTip;
+    if (SecureMsgReadScanTip(nTipHeight, hashTip)
+        || fScanChain)
     {
         SecureMsgScanBlockChain();
     };
@@ -1190,6 +2504,11 @@ bool SecureMsgShutdown()
     threadGroupSmsg.interrupt_all();
     threadGroupSmsg.join_all();
 
+    {
+        LOCK(cs_smsg);
+        smsgStoreLog.Close();
+    }
+
     if (smsgDB)
     {
         LOCK(cs_smsgDB);
@@ -1255,6 +2574,7 @@ bool SecureMsgEnable()
         {
             pnode->PushMessage("smsgPing");
             pnode->PushMessage("smsgPong"); // Send pong as have missed initial ping sent by peer when it connected
+            SecureMsgPushFeatures(pnode);
         };
     } // cs_vNodes
     LogPrintf("Secure messaging enabled.\n");
@@ -1286,6 +2606,7 @@ bool SecureMsgDisable()
         };
         smsgBuckets.clear();
         smsgAddresses.clear();
+        smsgStoreLog.Close();
     } // cs_smsg
 
     // -- tell each smsg enabled peer that this node is disabling
@@ -1347,6 +2668,15 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
         + smsgPing
         + smsgPong
         + smsgMatch
+        + smsgFeatures = bitfield of SMSG_FEATURE_*, sent with smsgPong
+        + smsgIblt =
+            Sent instead of smsgShow to peers announcing SMSG_FEATURE_RECON.
+            (1) subtract own table for the bucket, decode the difference.
+            (2) send smsgHave with only the tokens the peer is missing,
+                send smsgWant for the tokens this node is missing.
+            (3) if decoding fails, send smsgIbltRetry asking for a larger table,
+                or smsgHave with all tokens as for smsgShow once that is cheaper.
+        + smsgIbltRetry = resend smsgIblt for the bucket with the requested size.
 
     */
 
@@ -1367,6 +2697,7 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
         };
 
         int64_t now = GetTime();
+        bool fRecon;
 
         {
             LOCK(pfrom->smsgData.cs_smsg_net);
@@ -1377,6 +2708,7 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
                     LogPrintf("Node is ignoring peer %d until %d.\n", pfrom->id, pfrom->smsgData.ignoreUntil);
                 return false;
             };
+            fRecon = pfrom->smsgData.nFeatures & SMSG_FEATURE_RECON;
         }
 
         uint32_t nBuckets       = smsgBuckets.size();
@@ -1406,6 +2738,7 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
         vchDataOut.reserve(4 + 8 * nInvBuckets); // reserve max possible size
         vchDataOut.resize(4);
         uint32_t nShowBuckets = 0;
+        uint32_t nReconBuckets = 0;     // buckets sent as smsgIblt
 
 
         uint8_t *p = &vchData[4];
@@ -1449,6 +2782,7 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
                 LogPrintf("peer bucket %d %u %u.\n", time, ncontent, hash);
                 LogPrintf("this bucket %d %u %u.\n", time, smsgBuckets[time].setTokens.size(), smsgBuckets[time].hash);
             };
+            std::vector<uint8_t> vchIblt;
             {
             LOCK(cs_smsg);
                 if (smsgBuckets[time].nLockCount > 0)
@@ -1459,106 +2793,331 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
                     continue;
                 };
 
+                std::set<SecMsgToken>& tokenSet = smsgBuckets[time].setTokens;
+
                 // -- if this node has more than the peer node, peer node will pull from this
                 //    if then peer node has more this node will pull fom peer
-                if (smsgBuckets[time].setTokens.size() < ncontent
-                    || (smsgBuckets[time].setTokens.size() == ncontent
+                if (tokenSet.size() < ncontent
+                    || (tokenSet.size() == ncontent
                         && smsgBuckets[time].hash != hash)) // if same amount in buckets check hash
                 {
-                    if (fDebugSmsg)
-                        LogPrintf("Requesting contents of bucket %d.\n", time);
+                    uint32_t nDiff = ncontent > tokenSet.size() ? ncontent - tokenSet.size() : 0;
+                    SecMsgIblt iblt(SecMsgIblt::CellsFor(nDiff));
+
+                    // -- the table is only worth sending if it's smaller than the token list it replaces
+                    if (fRecon
+                        && tokenSet.size() > 0
+                        && iblt.SerializedSize() < ncontent * 16)
+                    {
+                        if (fDebugSmsg)
+                            LogPrintf("Reconciling bucket %d, %u cells.\n", time, iblt.vCells.size());
+
+                        std::set<SecMsgToken>::iterator it;
+                        for (it = tokenSet.begin(); it != tokenSet.end(); ++it)
+                            iblt.Insert(*it);
+
+                        uint32_t nCells = iblt.vCells.size();
+                        vchIblt.resize(12);
+                        memcpy(&vchIblt[0], &time, 8);
+                        memcpy(&vchIblt[8], &nCells, 4);
+                        iblt.Serialize(vchIblt);
+                    } else
+                    {
+                        if (fDebugSmsg)
+                            LogPrintf("Requesting contents of bucket %d.\n", time);
 
-                    uint32_t sz = vchDataOut.size();
-                    vchDataOut.resize(sz + 8);
-                    memcpy(&vchDataOut[sz], &time, 8);
+                        uint32_t sz = vchDataOut.size();
+                        vchDataOut.resize(sz + 8);
+                        memcpy(&vchDataOut[sz], &time, 8);
 
-                    nShowBuckets++;
+                        nShowBuckets++;
+                    };
                 };
             } // LOCK(cs_smsg);
+
+            if (vchIblt.size() > 0)
+            {
+                {
+                    LOCK(pfrom->smsgData.cs_smsg_net);
+                    memcpy(&pfrom->smsgData.mapIbltSent[time], &vchIblt[8], 4);
+                }
+                pfrom->PushMessage("smsgIblt", vchIblt);
+                nReconBuckets++;
+            };
+        };
+
+        // TODO: should include hash?
+        memcpy(&vchDataOut[0], &nShowBuckets, 4);
+        if (vchDataOut.size() > 4)
+        {
+            pfrom->PushMessage("smsgShow", vchDataOut);
+        } else
+        if (nLocked < 1 && nReconBuckets < 1) // Don't report buckets as matched if any are locked or being reconciled
+        {
+            // -- peer has no buckets we want, don't send them again until something changes
+            //    peer will still request buckets from this node if needed (< ncontent)
+            vchDataOut.resize(8);
+            memcpy(&vchDataOut[0], &now, 8);
+            pfrom->PushMessage("smsgMatch", vchDataOut);
+            if (fDebugSmsg)
+                LogPrintf("Sending smsgMatch, no locked buckets, time= %d.\n", now);
+        } else
+        if (nLocked >= 1)
+        {
+            if (fDebugSmsg)
+                LogPrintf("%u buckets were locked, time= %d.\n", nLocked, now);
+        };
+
+    } else
+    if (strCommand == "smsgShow")
+    {
+        std::vector<uint8_t> vchData;
+        vRecv >> vchData;
+
+        if (vchData.size() < 4)
+            return false;
+
+        uint32_t nBuckets;
+        memcpy(&nBuckets, &vchData[0], 4);
+
+        if (vchData.size() < 4 + nBuckets * 8)
+            return false;
+
+        if (fDebugSmsg)
+            LogPrintf("smsgShow: peer wants to see content of %u buckets.\n", nBuckets);
+
+        std::map<int64_t, SecMsgBucket>::iterator itb;
+        std::set<SecMsgToken>::iterator it;
+
+        std::vector<uint8_t> vchDataOut;
+        int64_t time;
+        uint8_t* pIn = &vchData[4];
+        for (uint32_t i = 0; i < nBuckets; ++i, pIn += 8)
+        {
+            memcpy(&time, pIn, 8);
+
+            {
+                LOCK(cs_smsg);
+                itb = smsgBuckets.find(time);
+                if (itb == smsgBuckets.end())
+                {
+                    if (fDebugSmsg)
+                        LogPrintf("Don't have bucket %d.\n", time);
+                    continue;
+                };
+
+                std::set<SecMsgToken>& tokenSet = (*itb).second.setTokens;
+
+                try { vchDataOut.resize(8 + 16 * tokenSet.size()); } catch (std::exception& e)
+                {
+                    LogPrintf("vchDataOut.resize %u threw: %s.\n", 8 + 16 * tokenSet.size(), e.what());
+                    continue;
+                };
+                memcpy(&vchDataOut[0], &time, 8);
+
+                uint8_t* p = &vchDataOut[8];
+                for (it = tokenSet.begin(); it != tokenSet.end(); ++it)
+                {
+                    memcpy(p, &it->timestamp, 8);
+                    memcpy(p+8, &it->sample, 8);
+
+                    p += 16;
+                };
+            }
+            pfrom->PushMessage("smsgHave", vchDataOut);
         };
 
-        // TODO: should include hash?
-        memcpy(&vchDataOut[0], &nShowBuckets, 4);
-        if (vchDataOut.size() > 4)
-        {
-            pfrom->PushMessage("smsgShow", vchDataOut);
-        } else
-        if (nLocked < 1) // Don't report buckets as matched if any are locked
-        {
-            // -- peer has no buckets we want, don't send them again until something changes
-            //    peer will still request buckets from this node if needed (< ncontent)
-            vchDataOut.resize(8);
-            memcpy(&vchDataOut[0], &now, 8);
-            pfrom->PushMessage("smsgMatch", vchDataOut);
-            if (fDebugSmsg)
-                LogPrintf("Sending smsgMatch, no locked buckets, time= %d.\n", now);
-        } else
-        if (nLocked >= 1)
+
+    } else
+    if (strCommand == "smsgIblt")
+    {
+        // -- peer sent its table for a bucket, reply with the tokens it's missing
+        std::vector<uint8_t> vchData;
+        vRecv >> vchData;
+
+        if (vchData.size() < 12)
+        {
+            pfrom->Misbehaving(1);
+            return false;
+        };
+
+        int64_t time;
+        uint32_t nCells;
+        memcpy(&time, &vchData[0], 8);
+        memcpy(&nCells, &vchData[8], 4);
+
+        // -- each table means a full pass over the bucket, only accept one per bucket
+        //    announced in smsgInv or asked for with smsgIbltRetry
+        {
+            LOCK(pfrom->smsgData.cs_smsg_net);
+
+            if (GetTime() < pfrom->smsgData.ignoreUntil)
+            {
+                if (fDebugSmsg)
+                    LogPrintf("Node is ignoring peer %d until %d.\n", pfrom->id, pfrom->smsgData.ignoreUntil);
+                return false;
+            };
+            if (!pfrom->smsgData.setIbltExpected.erase(time))
+            {
+                if (fDebugSmsg)
+                    LogPrintf("smsgIblt, bucket %d was not announced to peer %d.\n", time, pfrom->id);
+                return false;
+            };
+        }
+
+        SecMsgIblt ibltPeer(0);
+        if (!ibltPeer.Deserialize(&vchData[12], vchData.size() - 12, nCells))
+        {
+            LogPrintf("smsgIblt, invalid table %u cells, %u bytes.\n", nCells, vchData.size());
+            pfrom->Misbehaving(1);
+            return false;
+        };
+
+        std::vector<uint8_t> vchHave;
+        std::vector<uint8_t> vchWant;
+        uint32_t nRetryCells = 0;
+
+        {
+            LOCK(cs_smsg);
+            std::map<int64_t, SecMsgBucket>::iterator itb = smsgBuckets.find(time);
+            if (itb == smsgBuckets.end())
+            {
+                if (fDebugSmsg)
+                    LogPrintf("Don't have bucket %d.\n", time);
+                return false;
+            };
+
+            SecMsgBucket& bkt = itb->second;
+            std::set<SecMsgToken>::iterator it;
+
+            SecMsgIblt iblt(nCells);
+            for (it = bkt.setTokens.begin(); it != bkt.setTokens.end(); ++it)
+                iblt.Insert(*it);
+            iblt.Subtract(ibltPeer);
+
+            std::vector<SecMsgToken> vOurs, vTheirs;
+            vchHave.resize(8);
+            memcpy(&vchHave[0], &time, 8);
+
+            if (iblt.Decode(vOurs, vTheirs))
+            {
+                if (fDebugSmsg)
+                    LogPrintf("Reconciled bucket %d, peer is missing %u, this node is missing %u.\n", time, vOurs.size(), vTheirs.size());
+
+                for (uint32_t i = 0; i < vOurs.size(); ++i)
+                    SecureMsgAppendToken(vchHave, vOurs[i]);
+
+                if (vTheirs.size() > 0
+                    && bkt.nLockCount < 1)
+                {
+                    vchWant.resize(8);
+                    memcpy(&vchWant[0], &time, 8);
+                    for (uint32_t i = 0; i < vTheirs.size(); ++i)
+                        SecureMsgAppendToken(vchWant, vTheirs[i]);
+
+                    SecureMsgLockBucket(bkt, time, pfrom->id);
+                };
+            } else
+            if ((nRetryCells = SecMsgIblt::RetryCells(nCells, bkt.setTokens.size())) > 0)
+            {
+                if (fDebugSmsg)
+                    LogPrintf("Could not decode table for bucket %d, asking for %u cells.\n", time, nRetryCells);
+            } else
+            {
+                if (fDebugSmsg)
+                    LogPrintf("Could not decode table for bucket %d, sending all %u tokens.\n", time, bkt.setTokens.size());
+
+                for (it = bkt.setTokens.begin(); it != bkt.setTokens.end(); ++it)
+                    SecureMsgAppendToken(vchHave, *it);
+            };
+        } // LOCK(cs_smsg);
+
+        if (nRetryCells > 0)
         {
-            if (fDebugSmsg)
-                LogPrintf("%u buckets were locked, time= %d.\n", nLocked, now);
+            {
+                LOCK(pfrom->smsgData.cs_smsg_net);
+                pfrom->smsgData.setIbltExpected.insert(time);
+            }
+            std::vector<uint8_t> vchRetry(12);
+            memcpy(&vchRetry[0], &time, 8);
+            memcpy(&vchRetry[8], &nRetryCells, 4);
+            pfrom->PushMessage("smsgIbltRetry", vchRetry);
+            return true;
         };
 
+        // -- always reply, an empty smsgHave tells the peer the bucket is done
+        pfrom->PushMessage("smsgHave", vchHave);
+        if (vchWant.size() > 8)
+            pfrom->PushMessage("smsgWant", vchWant);
     } else
-    if (strCommand == "smsgShow")
+    if (strCommand == "smsgIbltRetry")
     {
+        // -- peer could not decode the table sent for a bucket, resend a larger one
         std::vector<uint8_t> vchData;
         vRecv >> vchData;
 
-        if (vchData.size() < 4)
+        if (vchData.size() < 12)
+        {
+            pfrom->Misbehaving(1);
             return false;
+        };
 
-        uint32_t nBuckets;
-        memcpy(&nBuckets, &vchData[0], 4);
+        int64_t time;
+        uint32_t nCells;
+        memcpy(&time, &vchData[0], 8);
+        memcpy(&nCells, &vchData[8], 4);
 
-        if (vchData.size() < 4 + nBuckets * 8)
+        if (nCells < SMSG_IBLT_MIN_CELLS
+            || nCells > SMSG_IBLT_MAX_CELLS
+            || nCells % SMSG_IBLT_HASHES != 0)
+        {
+            LogPrintf("smsgIbltRetry, invalid size %u cells.\n", nCells);
+            pfrom->Misbehaving(1);
             return false;
+        };
 
-        if (fDebugSmsg)
-            LogPrintf("smsgShow: peer wants to see content of %u buckets.\n", nBuckets);
-
-        std::map<int64_t, SecMsgBucket>::iterator itb;
-        std::set<SecMsgToken>::iterator it;
-
-        std::vector<uint8_t> vchDataOut;
-        int64_t time;
-        uint8_t* pIn = &vchData[4];
-        for (uint32_t i = 0; i < nBuckets; ++i, pIn += 8)
+        // -- only resend a table this node sent before, and only a larger one
         {
-            memcpy(&time, pIn, 8);
+            LOCK(pfrom->smsgData.cs_smsg_net);
 
+            if (GetTime() < pfrom->smsgData.ignoreUntil)
             {
-                LOCK(cs_smsg);
-                itb = smsgBuckets.find(time);
-                if (itb == smsgBuckets.end())
-                {
-                    if (fDebugSmsg)
-                        LogPrintf("Don't have bucket %d.\n", time);
-                    continue;
-                };
-
-                std::set<SecMsgToken>& tokenSet = (*itb).second.setTokens;
+                if (fDebugSmsg)
+                    LogPrintf("Node is ignoring peer %d until %d.\n", pfrom->id, pfrom->smsgData.ignoreUntil);
+                return false;
+            };
 
-                try { vchDataOut.resize(8 + 16 * tokenSet.size()); } catch (std::exception& e)
-                {
-                    LogPrintf("vchDataOut.resize %u threw: %s.\n", 8 + 16 * tokenSet.size(), e.what());
-                    continue;
-                };
-                memcpy(&vchDataOut[0], &time, 8);
+            std::map<int64_t, uint32_t>::iterator its = pfrom->smsgData.mapIbltSent.find(time);
+            if (its == pfrom->smsgData.mapIbltSent.end()
+                || nCells <= its->second
+                || nCells > its->second * SMSG_IBLT_GROWTH)
+            {
+                if (fDebugSmsg)
+                    LogPrintf("smsgIbltRetry, no table of fewer cells than %u sent to peer %d for bucket %d.\n", nCells, pfrom->id, time);
+                return false;
+            };
+            its->second = nCells;
+        }
 
-                uint8_t* p = &vchDataOut[8];
-                for (it = tokenSet.begin(); it != tokenSet.end(); ++it)
-                {
-                    memcpy(p, &it->timestamp, 8);
-                    memcpy(p+8, &it->sample, 8);
+        std::vector<uint8_t> vchIblt;
+        {
+            LOCK(cs_smsg);
+            std::map<int64_t, SecMsgBucket>::iterator itb = smsgBuckets.find(time);
+            if (itb == smsgBuckets.end())
+                return false;
 
-                    p += 16;
-                };
-            }
-            pfrom->PushMessage("smsgHave", vchDataOut);
-        };
+            SecMsgIblt iblt(nCells);
+            std::set<SecMsgToken>::iterator it;
+            for (it = itb->second.setTokens.begin(); it != itb->second.setTokens.end(); ++it)
+                iblt.Insert(*it);
 
+            vchIblt.resize(12);
+            memcpy(&vchIblt[0], &time, 8);
+            memcpy(&vchIblt[8], &nCells, 4);
+            iblt.Serialize(vchIblt);
+        } // LOCK(cs_smsg);
 
+        pfrom->PushMessage("smsgIblt", vchIblt);
     } else
     if (strCommand == "smsgHave")
     {
@@ -1574,6 +3133,11 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
         int64_t time;
         memcpy(&time, &vchData[0], 8);
 
+        {
+            LOCK(pfrom->smsgData.cs_smsg_net);
+            pfrom->smsgData.mapIbltSent.erase(time);
+        }
+
         // -- Check time valid:
         int64_t now = GetTime();
         if (time < now - SMSG_RETENTION)
@@ -1644,8 +3208,7 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
             };
             {
                 LOCK(cs_smsg);
-                smsgBuckets[time].nLockCount   = 3; // lock this bucket for at most 3 * SMSG_THREAD_DELAY seconds, unset when peer sends smsgMsg
-                smsgBuckets[time].nLockPeerId  = pfrom->id;
+                SecureMsgLockBucket(smsgBuckets[time], time, pfrom->id); // unset when peer sends smsgMsg
             }
             pfrom->PushMessage("smsgWant", vchDataOut);
         };
@@ -1786,6 +3349,7 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
     {
         // -- smsgPing is the initial message, send reply
         pfrom->PushMessage("smsgPong");
+        SecureMsgPushFeatures(pfrom);
     } else
     if (strCommand == "smsgPong")
     {
@@ -1798,6 +3362,28 @@ bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRe
         }
 
     } else
+    if (strCommand == "smsgFeatures")
+    {
+        std::vector<uint8_t> vchData;
+        vRecv >> vchData;
+
+        if (vchData.size() < 4)
+        {
+            pfrom->Misbehaving(1);
+            return false;
+        };
+
+        uint32_t nFeatures;
+        memcpy(&nFeatures, &vchData[0], 4);
+
+        {
+            LOCK(pfrom->smsgData.cs_smsg_net);
+            pfrom->smsgData.nFeatures = nFeatures;
+        }
+
+        if (fDebugSmsg)
+            LogPrintf("Peer %d secure messaging features %x.\n", pfrom->id, nFeatures);
+    } else
     if (strCommand == "smsgDisabled")
     {
         // -- peer has disabled secure messaging.
@@ -1960,6 +3546,7 @@ bool SecureMsgSendData(CNode* pto, bool fSendTrickle)
 
                 p += 16;
                 nBucketsShown++;
+                pto->smsgData.setIbltExpected.insert(it->first);
                 //if (fDebug)
                 //    LogPrintf("Sending bucket %d, size %d \n", it->first, it->second.size());
             };
@@ -1975,6 +3562,15 @@ bool SecureMsgSendData(CNode* pto, bool fSendTrickle)
         };
     } // cs_smsg
 
+    {
+        // -- forget exchanges for expired buckets
+        std::set<int64_t>& setExpected = pto->smsgData.setIbltExpected;
+        int64_t nExpired = now - SMSG_RETENTION;
+        setExpected.erase(setExpected.begin(), setExpected.lower_bound(nExpired));
+        std::map<int64_t, uint32_t>& mapSent = pto->smsgData.mapIbltSent;
+        mapSent.erase(mapSent.begin(), mapSent.lower_bound(nExpired));
+    };
+
     pto->smsgData.lastSeen = now;
     pto->smsgData.lastMatched = now; //bug fix smsg 3
 
@@ -2017,6 +3613,7 @@ static int SecureMsgInsertAddress(CKeyID& hashKey, CPubKey& pubKey, SecMsgDB& ad
         LogPrintf("Write pair failed.\n");
         return 1;
     };
+    smsgKeyFilter.Insert(hashKey);
 
     return 0;
 };
@@ -2037,16 +3634,16 @@ int SecureMsgInsertAddress(CKeyID& hashKey, CPubKey& pubKey)
 };
 
 
-static bool ScanBlock(CBlock& block, CTxDB& txdb, SecMsgDB& addrpkdb,
-    uint32_t& nTransactions, uint32_t& nElements, uint32_t& nPubkeys, uint32_t& nDuplicates)
+static void ExtractPublicKeys(const CBlock& block, std::vector<CPubKey>& vKeys,
+    uint32_t& nTransactions, uint32_t& nElements)
 {
-    AssertLockHeld(cs_smsgDB);
+    // -- touches no shared state, safe to run on several blocks at once
 
     valtype vch;
     opcodetype opcode;
 
     // -- only scan inputs of standard txns and coinstakes
-    BOOST_FOREACH(CTransaction& tx, block.vtx)
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
     {
         // - harvest public keys from coinstake txns
         if (tx.IsCoinStake())
@@ -2069,12 +3666,7 @@ static bool ScanBlock(CBlock& block, CTxDB& txdb, SecMsgDB& addrpkdb,
                         continue;
                     };
 
-                    CKeyID addrKey = pubKey.GetID();
-                    switch (SecureMsgInsertAddress(addrKey, pubKey, addrpkdb))
-                    {
-                        case 0: nPubkeys++; break;      // added key
-                        case 4: nDuplicates++; break;   // duplicate key
-                    }
+                    vKeys.push_back(pubKey);
                     break;
                 };
             };
@@ -2088,12 +3680,10 @@ static bool ScanBlock(CBlock& block, CTxDB& txdb, SecMsgDB& addrpkdb,
                     && tx.vin[i].IsAnonInput())
                     continue; // skip anon inputs
 
-                CScript *script = &tx.vin[i].scriptSig;
+                const CScript *script = &tx.vin[i].scriptSig;
                 CScript::const_iterator pc = script->begin();
                 CScript::const_iterator pend = script->end();
 
-                CKey key;
-
                 while (pc < pend)
                 {
                     if (!script->GetOp(pc, opcode, vch))
@@ -2110,36 +3700,63 @@ static bool ScanBlock(CBlock& block, CTxDB& txdb, SecMsgDB& addrpkdb,
                             continue;
                         };
 
-                        CKeyID addrKey = pubKey.GetID();
-                        switch (SecureMsgInsertAddress(addrKey, pubKey, addrpkdb))
-                        {
-                            case 0: nPubkeys++; break;      // added key
-                            case 4: nDuplicates++; break;   // duplicate key
-                        }
+                        vKeys.push_back(pubKey);
                         break;
                     };
-
-                    //LogPrintf("opcode %d, %s, value %s.\n", opcode, GetOpName(opcode), ValueString(vch).c_str());
                 };
                 nElements++;
             };
         };
         nTransactions++;
+    };
+};
+
+static void SecureMsgInsertKeys(SecMsgDB& addrpkdb, leveldb::WriteBatch& batch, std::set<CKeyID>& setPending,
+    const std::vector<CPubKey>& vKeys, uint32_t& nPubkeys, uint32_t& nDuplicates)
+{
+    // -- the db is only read for keys the filter may already hold
+    AssertLockHeld(cs_smsgDB);
 
-        if (nTransactions % 10000 == 0) // for ScanChainForPublicKeys
+    for (std::vector<CPubKey>::const_iterator it = vKeys.begin(); it != vKeys.end(); ++it)
+    {
+        CKeyID addrKey = it->GetID();
+        if (smsgKeyFilter.MayContain(addrKey)
+            && (setPending.count(addrKey) || addrpkdb.ExistsPK(addrKey)))
         {
-            LogPrintf("Scanning transaction no. %u.\n", nTransactions);
+            nDuplicates++;
+            continue;
         };
+
+        CPubKey pubKey = *it;
+        addrpkdb.WritePK(&batch, addrKey, pubKey);
+        smsgKeyFilter.Insert(addrKey);
+        setPending.insert(addrKey);
+        nPubkeys++;
+    };
+};
+
+static bool SecureMsgCommitKeys(SecMsgDB& addrpkdb, leveldb::WriteBatch& batch)
+{
+    // -- keys that fail to commit stay in the filter, costing a lookup when seen again
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = true;
+    leveldb::Status s = addrpkdb.pdb->Write(writeOptions, &batch);
+    if (!s.ok())
+    {
+        LogPrintf("SecureMsgCommitKeys() write failure: %s\n", s.ToString().c_str());
+        return false;
     };
+
     return true;
 };
 
 
-bool SecureMsgScanBlock(CBlock& block)
+bool SecureMsgScanBlock(CBlock& block, CBlockIndex* pindex)
 {
-    // - scan block for public key addresses
+    // - scan block for public key addresses, called as each block is connected
 
-    if (!smsgOptions.fScanIncoming)
+    if (!fSecMsgEnabled
+        || !smsgOptions.fScanIncoming)
         return true;
 
     if (fDebugSmsg)
@@ -2150,19 +3767,34 @@ bool SecureMsgScanBlock(CBlock& block)
     uint32_t nPubkeys       = 0;
     uint32_t nDuplicates    = 0;
 
+    std::vector<CPubKey> vKeys;
+    ExtractPublicKeys(block, vKeys, nTransactions, nElements);
+
     {
         LOCK(cs_smsgDB);
-        CTxDB txdb("r");
 
         SecMsgDB addrpkdb;
-        if (!addrpkdb.Open("cw")
-            || !addrpkdb.TxnBegin())
+        if (!addrpkdb.Open("cw"))
             return false;
 
-        ScanBlock(block, txdb, addrpkdb,
-            nTransactions, nElements, nPubkeys, nDuplicates);
+        SecureMsgLoadKeyFilter(addrpkdb);
 
-        addrpkdb.TxnCommit();
+        leveldb::WriteBatch batch;
+        std::set<CKeyID> setPending;
+        SecureMsgInsertKeys(addrpkdb, batch, setPending, vKeys, nPubkeys, nDuplicates);
+
+        // -- extend the scanned range only if this block follows on from it
+        int nTipHeight;
+        uint256 hashTip;
+        bool fExtend = pindex && pindex->pprev
+            && addrpkdb.ReadScanTip(nTipHeight, hashTip)
+            && hashTip == pindex->pprev->GetBlockHash();
+        if (fExtend)
+            addrpkdb.WriteScanTip(&batch, pindex->nHeight, pindex->GetBlockHash());
+
+        if ((nPubkeys > 0 || fExtend)
+            && !SecureMsgCommitKeys(addrpkdb, batch))
+            return false;
     } // cs_smsgDB
 
     if (fDebugSmsg)
@@ -2171,6 +3803,70 @@ bool SecureMsgScanBlock(CBlock& block)
     return true;
 };
 
+bool SecureMsgDisconnectBlock(CBlockIndex* pindex)
+{
+    // - step the scanned range back when its last block is disconnected,
+    //   so the blocks connected in its place extend it again
+
+    if (!fSecMsgEnabled
+        || !smsgOptions.fScanIncoming
+        || !pindex
+        || !pindex->pprev)
+        return true;
+
+    LOCK(cs_smsgDB);
+
+    SecMsgDB addrpkdb;
+    if (!addrpkdb.Open("cw"))
+        return false;
+
+    int nTipHeight;
+    uint256 hashTip;
+    if (!addrpkdb.ReadScanTip(nTipHeight, hashTip)
+        || hashTip != pindex->GetBlockHash())
+        return true;
+
+    if (fDebugSmsg)
+        LogPrintf("SecureMsgDisconnectBlock() scan tip back to %d.\n", pindex->pprev->nHeight);
+
+    // -- keys harvested from the block stay, they are valid whichever chain wins
+    leveldb::WriteBatch batch;
+    addrpkdb.WriteScanTip(&batch, pindex->pprev->nHeight, pindex->pprev->GetBlockHash());
+    return SecureMsgCommitKeys(addrpkdb, batch);
+};
+
+class SecMsgScanRange
+{
+public:
+    SecMsgScanRange()
+    {
+        nTransactions = 0;
+        nElements = 0;
+        nReadErrors = 0;
+    };
+
+    std::vector<CPubKey> vKeys;
+    uint32_t nTransactions;
+    uint32_t nElements;
+    uint32_t nReadErrors;
+};
+
+static void ScanBlockRange(const std::vector<CBlockIndex*>* pvIndex, size_t nBegin, size_t nEnd, SecMsgScanRange* pRange)
+{
+    // -- takes no locks, the caller holds cs_main for the whole scan
+    for (size_t i = nBegin; i < nEnd; ++i)
+    {
+        CBlock block;
+        if (!block.ReadFromDisk((*pvIndex)[i], true))
+        {
+            pRange->nReadErrors++;
+            continue;
+        };
+
+        ExtractPublicKeys(block, pRange->vKeys, pRange->nTransactions, pRange->nElements);
+    };
+};
+
 bool ScanChainForPublicKeys(CBlockIndex* pindexStart)
 {
     LogPrintf("Scanning block chain for public keys.\n");
@@ -2182,40 +3878,83 @@ bool ScanChainForPublicKeys(CBlockIndex* pindexStart)
     // -- public keys are in txin.scriptSig
     //    matching addresses are in scriptPubKey of txin's referenced output
 
+    // -- blocks are read and parsed by several threads a chunk at a time, the keys
+    //    are then written in chain order along with the scan tip, so an interrupted
+    //    scan picks up after the last chunk committed.
+
+    uint32_t nThreads = std::min(std::max(boost::thread::hardware_concurrency(), 1u), SMSG_SCAN_MAX_THREADS);
+
     uint32_t nBlocks        = 0;
     uint32_t nTransactions  = 0;
     uint32_t nInputs        = 0;
     uint32_t nPubkeys       = 0;
     uint32_t nDuplicates    = 0;
+    uint32_t nReadErrors    = 0;
+
+    std::vector<CBlockIndex*> vChunk;
+    vChunk.reserve(SMSG_SCAN_CHUNK);
 
+    CBlockIndex* pindex = pindexStart;
+    while (pindex)
     {
-        LOCK(cs_smsgDB);
+        vChunk.clear();
+        for (; pindex && vChunk.size() < SMSG_SCAN_CHUNK; pindex = pindex->pnext)
+            vChunk.push_back(pindex);
 
-        CTxDB txdb("r");
+        std::vector<SecMsgScanRange> vRanges(nThreads);
+        size_t nPerThread = (vChunk.size() + nThreads - 1) / nThreads;
 
-        SecMsgDB addrpkdb;
-        if (!addrpkdb.Open("cw")
-            || !addrpkdb.TxnBegin())
-            return false;
+        boost::thread_group threadGroup;
+        for (uint32_t i = 0; i < nThreads; ++i)
+        {
+            size_t nBegin = i * nPerThread;
+            size_t nEnd = std::min(nBegin + nPerThread, vChunk.size());
+            if (nBegin >= nEnd)
+                break;
+            threadGroup.create_thread(boost::bind(&ScanBlockRange, &vChunk, nBegin, nEnd, &vRanges[i]));
+        };
+        threadGroup.join_all();
 
-        CBlockIndex* pindex = pindexStart;
-        while (pindex)
         {
-            nBlocks++;
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
+            LOCK(cs_smsgDB);
 
-            ScanBlock(block, txdb, addrpkdb,
-                nTransactions, nInputs, nPubkeys, nDuplicates);
+            SecMsgDB addrpkdb;
+            if (!addrpkdb.Open("cw"))
+                return false;
 
-            pindex = pindex->pnext;
-        };
+            SecureMsgLoadKeyFilter(addrpkdb);
 
-        addrpkdb.TxnCommit();
-    } // cs_smsgDB
+            leveldb::WriteBatch batch;
+            std::set<CKeyID> setPending;
+            for (std::vector<SecMsgScanRange>::iterator it = vRanges.begin(); it != vRanges.end(); ++it)
+            {
+                SecureMsgInsertKeys(addrpkdb, batch, setPending, it->vKeys, nPubkeys, nDuplicates);
+                nTransactions += it->nTransactions;
+                nInputs += it->nElements;
+                nReadErrors += it->nReadErrors;
+            };
+
+            addrpkdb.WriteScanTip(&batch, vChunk.back()->nHeight, vChunk.back()->GetBlockHash());
+            if (!SecureMsgCommitKeys(addrpkdb, batch))
+                return false;
+        } // cs_smsgDB
+
+        nBlocks += vChunk.size();
+
+        if (fDebugSmsg)
+            LogPrintf("Scanned to height %d, %u transactions.\n", vChunk.back()->nHeight, nTransactions);
+
+        if (ShutdownRequested())
+        {
+            LogPrintf("Public key scan interrupted at height %d.\n", vChunk.back()->nHeight);
+            break;
+        };
+    };
 
-    LogPrintf("Scanned %u blocks, %u transactions, %u inputs\n", nBlocks, nTransactions, nInputs);
+    LogPrintf("Scanned %u blocks, %u transactions, %u inputs with %u threads\n", nBlocks, nTransactions, nInputs, nThreads);
     LogPrintf("Found %u public keys, %u duplicates.\n", nPubkeys, nDuplicates);
+    if (nReadErrors > 0)
+        LogPrintf("Could not read %u blocks.\n", nReadErrors);
     LogPrintf("Took %d ms\n", GetTimeMillis() - nStart);
 
     return true;
@@ -2233,6 +3972,28 @@ bool SecureMsgScanBlockChain()
             return false;
         };
 
+        // -- resume after the last block scanned, stepping back to the main chain if it was reorganised away
+        int nTipHeight;
+        uint256 hashTip;
+        if (SecureMsgReadScanTip(nTipHeight, hashTip))
+        {
+            BlockMap::iterator mi = mapBlockIndex.find(hashTip);
+            if (mi != mapBlockIndex.end())
+            {
+                CBlockIndex *pindex = mi->second;
+                while (pindex && !pindex->IsInMainChain())
+                    pindex = pindex->pprev;
+
+                if (pindex)
+                    pindexScan = pindex->pnext;
+            };
+
+            if (pindexScan == NULL)
+            {
+                LogPrintf("Public keys are harvested up to height %d.\n", nTipHeight);
+                return true;
+            };
+        };
 
         try { // -- in try to catch errors opening db,
             if (!ScanChainForPublicKeys(pindexScan))
@@ -2248,151 +4009,55 @@ bool SecureMsgScanBlockChain()
         return false;
     };
 
-    return true;
-};
-
-bool SecureMsgScanBuckets()
-{
-    if (fDebugSmsg)
-        LogPrintf("SecureMsgScanBuckets()\n");
-
-    if (!fSecMsgEnabled
-        || pwalletMain->IsLocked())
-        return false;
-
-    int64_t  mStart         = GetTimeMillis();
-    int64_t  now            = GetTime();
-    uint32_t nFiles         = 0;
-    uint32_t nMessages      = 0;
-    uint32_t nFoundMessages = 0;
-
-    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
-    fs::directory_iterator itend;
-
-    if (!fs::exists(pathSmsgDir)
-        || !fs::is_directory(pathSmsgDir))
-    {
-        LogPrintf("Message store directory does not exist.\n");
-        return 0; // not an error
-    };
-
-    SecureMessage smsg;
-    std::vector<uint8_t> vchData;
-
-    for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
-    {
-        if (!fs::is_regular_file(itd->status()))
-            continue;
-
-        std::string fileType = (*itd).path().extension().string();
-
-        if (fileType.compare(".dat") != 0)
-            continue;
-
-        std::string fileName = (*itd).path().filename().string();
-
-
-        if (fDebugSmsg)
-            LogPrintf("Processing file: %s.\n", fileName.c_str());
-
-        nFiles++;
-
-        // TODO files must be split if > 2GB
-        // time_noFile.dat
-        size_t sep = fileName.find_first_of("_");
-        if (sep == std::string::npos)
-            continue;
-
-        std::string stime = fileName.substr(0, sep);
+    return true;
+};
 
-        int64_t fileTime = boost::lexical_cast<int64_t>(stime);
+bool SecureMsgScanBuckets()
+{
+    if (fDebugSmsg)
+        LogPrintf("SecureMsgScanBuckets()\n");
 
-        if (fileTime < now - SMSG_RETENTION)
-        {
-            LogPrintf("Dropping file %s, expired.\n", fileName.c_str());
-            try {
-                fs::remove((*itd).path());
-            } catch (const fs::filesystem_error& ex)
-            {
-                LogPrintf("Error removing bucket file %s, %s.\n", fileName.c_str(), ex.what());
-            };
-            continue;
-        };
+    if (!fSecMsgEnabled
+        || pwalletMain->IsLocked())
+        return false;
 
-        if (boost::algorithm::ends_with(fileName, "_wl.dat"))
-        {
-            if (fDebugSmsg)
-                LogPrintf("Skipping wallet locked file: %s.\n", fileName.c_str());
-            continue;
-        };
+    int64_t  mStart         = GetTimeMillis();
+    uint32_t nBuckets       = 0;
+    uint32_t nMessages      = 0;
+    uint32_t nFoundMessages = 0;
+
+    std::vector<uint8_t> vchData;
+    SecMsgInboxBatch inboxBatch;
 
+    {
+        LOCK(cs_smsg);
+        for (std::map<int64_t, SecMsgBucket>::iterator it = smsgBuckets.begin(); it != smsgBuckets.end(); ++it)
         {
-            LOCK(cs_smsg);
-            FILE *fp;
-            errno = 0;
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
-            {
-                LogPrintf("Error opening file: %s\n", strerror(errno));
-                continue;
-            };
+            nBuckets++;
 
-            for (;;)
+            std::set<SecMsgToken>& tokenSet = it->second.setTokens;
+            for (std::set<SecMsgToken>::iterator itt = tokenSet.begin(); itt != tokenSet.end(); ++itt)
             {
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        LogPrintf("fread header failed: %s\n", strerror(errno));
-                    } else
-                    {
-                        //LogPrintf("End of file.\n");
-                    };
-                    break;
-                };
-
-                try { vchData.resize(smsg.nPayload); } catch (std::exception& e)
-                {
-                    LogPrintf("SecureMsgWalletUnlocked(): Could not resize vchData, %u, %s\n", smsg.nPayload, e.what());
-                    fclose(fp);
-                    return 1;
-                };
+                if (smsgStoreLog.Read(it->first, itt->offset, vchData) != 0)
+                    continue;
 
-                if (fread(&vchData[0], sizeof(uint8_t), smsg.nPayload, fp) != smsg.nPayload)
-                {
-                    LogPrintf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
+                uint32_t nPayload = vchData.size() - SMSG_HDR_LEN;
 
                 // -- don't report to gui,
-                int rv = SecureMsgScanMessage(&smsg.hash[0], &vchData[0], smsg.nPayload, false);
-
-                if (rv == 0)
-                {
+                if (SecureMsgScanMessage(&vchData[0], &vchData[SMSG_HDR_LEN], nPayload, false, &inboxBatch) == 0)
                     nFoundMessages++;
-                } else
-                if (rv != 0)
-                {
-                    // SecureMsgScanMessage failed
-                };
+
+                if (inboxBatch.nPending >= SMSG_DB_BATCH_MAX)
+                    inboxBatch.Commit();
 
                 nMessages++;
             };
+        };
+    } // cs_smsg
 
-            fclose(fp);
-
-            // -- remove wl file when scanned
-            try {
-                fs::remove((*itd).path());
-            } catch (const boost::filesystem::filesystem_error& ex)
-            {
-                LogPrintf("Error removing wl file %s - %s\n", fileName.c_str(), ex.what());
-                return 1;
-            };
-        } // cs_smsg
-    };
+    inboxBatch.Commit();
 
-    LogPrintf("Processed %u files, scanned %u messages, received %u messages.\n", nFiles, nMessages, nFoundMessages);
+    LogPrintf("Processed %u buckets, scanned %u messages, received %u messages.\n", nBuckets, nMessages, nFoundMessages);
     LogPrintf("Took %d ms\n", GetTimeMillis() - mStart);
 
     return true;
@@ -2432,6 +4097,7 @@ int SecureMsgWalletUnlocked()
 
     SecureMessage smsg;
     std::vector<uint8_t> vchData;
+    SecMsgInboxBatch inboxBatch;
 
     for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
     {
@@ -2510,7 +4176,10 @@ int SecureMsgWalletUnlocked()
                 };
 
                 // -- don't report to gui,
-                int rv = SecureMsgScanMessage(&smsg.hash[0], &vchData[0], smsg.nPayload, false);
+                int rv = SecureMsgScanMessage(&smsg.hash[0], &vchData[0], smsg.nPayload, false, &inboxBatch);
+
+                if (inboxBatch.nPending >= SMSG_DB_BATCH_MAX)
+                    inboxBatch.Commit();
 
                 if (rv == 0)
                 {
@@ -2526,6 +4195,10 @@ int SecureMsgWalletUnlocked()
 
             fclose(fp);
 
+            // -- messages must be in the db before the file goes
+            if (!inboxBatch.Commit())
+                continue;
+
             // -- remove wl file when scanned
             try {
                 fs::remove((*itd).path());
@@ -2590,7 +4263,26 @@ int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeTy
     return 0;
 };
 
-int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool reportToGui)
+uint8_t SecureMsgRecipientTag(const CKeyID& ckidDest, const uint8_t *pCpkR)
+{
+    /*  One byte hint of the recipient, carried in version[1].
+
+        Mixed with the ephemeral key R, so tags of different messages to the same address are unrelated.
+        Anyone who knows an address can still test a message against it, so the tag is kept short:
+        it narrows the trial decrypts down to ~1/254 of the addresses and reveals no more than that.
+    */
+
+    uint8_t sha256Hash[32];
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, ckidDest.begin(), 20);
+    SHA256_Update(&ctx, pCpkR, 33);
+    SHA256_Final(sha256Hash, &ctx);
+
+    return SMSG_TAG_MIN + sha256Hash[0] % (256 - SMSG_TAG_MIN);
+};
+
+int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool reportToGui, SecMsgInboxBatch *pBatch)
 {
     /*
     Check if message belongs to this node.
@@ -2599,6 +4291,8 @@ int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload,
     if !reportToGui don't fire NotifySecMsgInboxChanged
      - loads messages received when wallet locked in bulk.
 
+    if pBatch is set the inbox write is added to it, the caller commits.
+
     returns
         0 success,
         1 error
@@ -2625,11 +4319,25 @@ int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload,
     MessageData msg; // placeholder
     bool fOwnMessage = false;
 
+    // -- tagged messages only need a trial decrypt with the addresses whose tag matches,
+    //    legacy messages are tried with every address.
+    SecureMessage* psmsgTag = (SecureMessage*) pHeader;
+    bool fTagged = psmsgTag->version[1] >= SMSG_TAG_MIN;
+
     for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
     {
         if (!it->fReceiveEnabled)
             continue;
 
+        if (fTagged)
+        {
+            if (!it->fKeyId)
+                it->fKeyId = CBitcoinAddress(it->sAddress).GetKeyID(it->keyId);
+            if (it->fKeyId
+                && SecureMsgRecipientTag(it->keyId, psmsgTag->cpkR) != psmsgTag->version[1])
+                continue;
+        };
+
         CBitcoinAddress coinAddress(it->sAddress);
         addressTo = coinAddress.ToString();
 
@@ -2684,6 +4392,15 @@ int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload,
         memcpy(&smsgInbox.vchMessage[0], pHeader, SMSG_HDR_LEN);
         memcpy(&smsgInbox.vchMessage[SMSG_HDR_LEN], pPayload, nPayload);
 
+        if (pBatch)
+        {
+            LOCK(cs_smsgDB);
+            if (pBatch->Add(chKey, smsgInbox, reportToGui))
+                LogPrintf("SecureMsg saved to inbox, received with %s.\n", addressTo.c_str());
+            else
+            if (fDebugSmsg)
+                LogPrintf("Message already exists in inbox db.\n");
+        } else
         {
             LOCK(cs_smsgDB);
             SecMsgDB dbInbox;
@@ -2857,62 +4574,9 @@ int SecureMsgRetrieve(SecMsgToken &token, std::vector<uint8_t>& vchData)
 
     // -- has cs_smsg lock from SecureMsgReceiveData
 
-    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
-
-    //LogPrintf("token.offset %d.\n", token.offset); // DEBUG
     int64_t bucket = token.timestamp - (token.timestamp % SMSG_BUCKET_LEN);
-    std::string fileName = boost::lexical_cast<std::string>(bucket) + "_01.dat";
-    fs::path fullpath = pathSmsgDir / fileName;
-
-    //LogPrintf("bucket %d.\n", bucket);
-    //LogPrintf("bucket d %d.\n", bucket);
-    //LogPrintf("fileName %s.\n", fileName.c_str());
-
-    FILE *fp;
-    errno = 0;
-    if (!(fp = fopen(fullpath.string().c_str(), "rb")))
-    {
-        LogPrintf("Error opening file: %s\nPath %s\n", strerror(errno), fullpath.string().c_str());
-        return 1;
-    };
-
-    errno = 0;
-    if (fseek(fp, token.offset, SEEK_SET) != 0)
-    {
-        LogPrintf("fseek, strerror: %s.\n", strerror(errno));
-        fclose(fp);
-        return 1;
-    };
-
-    SecureMessage smsg;
-    errno = 0;
-    if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-    {
-        LogPrintf("fread header failed: %s\n", strerror(errno));
-        fclose(fp);
-        return 1;
-    };
-
-    try {
-        vchData.resize(SMSG_HDR_LEN + smsg.nPayload);
-    } catch (std::exception& e) {
-        LogPrintf("SecureMsgRetrieve(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + smsg.nPayload, e.what());
-        return 1;
-    };
-
-    memcpy(&vchData[0], &smsg.hash[0], SMSG_HDR_LEN);
-    errno = 0;
-    if (fread(&vchData[SMSG_HDR_LEN], sizeof(uint8_t), smsg.nPayload, fp) != smsg.nPayload)
-    {
-        LogPrintf("fread data failed: %s. Wanted %u bytes.\n", strerror(errno), smsg.nPayload);
-        fclose(fp);
-        return 1;
-    };
-
-
-    fclose(fp);
 
-    return 0;
+    return smsgStoreLog.Read(bucket, token.offset, vchData);
 };
 
 int SecureMsgReceive(CNode* pfrom, std::vector<uint8_t>& vchData)
@@ -2969,6 +4633,7 @@ int SecureMsgReceive(CNode* pfrom, std::vector<uint8_t>& vchData)
     };
 
     uint32_t n = 12;
+    SecMsgInboxBatch inboxBatch; // one synced write for the whole bunch
 
     for (uint32_t i = 0; i < nBunch; ++i)
     {
@@ -3003,7 +4668,7 @@ int SecureMsgReceive(CNode* pfrom, std::vector<uint8_t>& vchData)
                 break; // continue?
             };
 
-            if (SecureMsgScanMessage(&vchData[n], &vchData[n + SMSG_HDR_LEN], psmsg->nPayload, true) != 0)
+            if (SecureMsgScanMessage(&vchData[n], &vchData[n + SMSG_HDR_LEN], psmsg->nPayload, true, &inboxBatch) != 0)
             {
                 // message recipient is not this node (or failed)
             };
@@ -3012,6 +4677,8 @@ int SecureMsgReceive(CNode* pfrom, std::vector<uint8_t>& vchData)
         n += SMSG_HDR_LEN + psmsg->nPayload;
     };
 
+    inboxBatch.Commit();
+
     {
         LOCK(cs_smsg);
         // -- if messages have been added, bucket must exist now
@@ -3115,16 +4782,6 @@ int SecureMsgStore(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool
     SecureMessage* psmsg = (SecureMessage*) pHeader;
 
 
-    long int ofs;
-    fs::path pathSmsgDir;
-    try {
-        pathSmsgDir = GetDataDir() / "smsgStore";
-        fs::create_directory(pathSmsgDir);
-    } catch (const boost::filesystem::filesystem_error& ex)
-    {
-        return errorN(1, "Failed to create directory %s - %s.", pathSmsgDir.string().c_str(), ex.what());
-    };
-
     int64_t now = GetTime();
     if (psmsg->timestamp > now + SMSG_TIME_LEEWAY)
     {
@@ -3171,33 +4828,8 @@ int SecureMsgStore(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool
         return 1;
     };
 
-    std::string fileName = boost::lexical_cast<std::string>(bucket) + "_01.dat";
-    fs::path fullpath = pathSmsgDir / fileName;
-
-    FILE *fp;
-    errno = 0;
-    if (!(fp = fopen(fullpath.string().c_str(), "ab")))
-    {
-        return errorN(1, "fopen failed: %s.", strerror(errno));
-    };
-
-    // -- on windows ftell will always return 0 after fopen(ab), call fseek to set.
-    errno = 0;
-    if (fseek(fp, 0, SEEK_END) != 0)
-        return errorN(1, "fseek failed: %s.", strerror(errno));
-
-    ofs = ftell(fp);
-
-    if (fwrite(pHeader,  sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN
-     || fwrite(pPayload, sizeof(uint8_t),     nPayload, fp) != nPayload)
-    {
-        fclose(fp);
-        return errorN(1, "fwrite failed: %s.", strerror(errno));
-    };
-
-    fclose(fp);
-
-    token.offset = ofs;
+    if (smsgStoreLog.Append(bucket, pHeader, pPayload, nPayload, token.offset) != 0)
+        return 1;
 
     //LogPrintf("token.offset: %d\n", token.offset); // DEBUG
     tokenSet.insert(token);
@@ -3216,6 +4848,121 @@ int SecureMsgStore(SecureMessage& smsg, bool fUpdateBucket)
     return SecureMsgStore(&smsg.hash[0], smsg.pPayload, smsg.nPayload, fUpdateBucket);
 };
 
+// -- offset of the nonce in the hashed part of the header (the header without the 4 byte hash)
+static const size_t SMSG_POW_NONCE_OFS = offsetof(SecureMessage, nonce) - 4;
+
+class SecMsgPowHasher
+{
+// -- HMAC-SHA256 of the hashed header + payload + payload, keyed with the nonce repeated over 32 bytes.
+//    Gives the same result as HMAC_Init_ex/HMAC_Update/HMAC_Final, without setting up an EVP context for every
+//    nonce. The key is the nonce, so only the zero padded half of the ipad/opad blocks is constant.
+private:
+    uint8_t ipad[64];
+    uint8_t opad[64];
+public:
+    SecMsgPowHasher()
+    {
+        memset(&ipad[32], 0x36, 32);
+        memset(&opad[32], 0x5c, 32);
+    };
+
+    void Hash(const uint8_t *pHashed, const uint8_t *pPayload, uint32_t nPayload, uint8_t *sha256Hash)
+    {
+        const uint8_t *pNonce = pHashed + SMSG_POW_NONCE_OFS;
+        for (int i = 0; i < 32; ++i)
+        {
+            ipad[i] = pNonce[i & 3] ^ 0x36;
+            opad[i] = pNonce[i & 3] ^ 0x5c;
+        };
+
+        uint8_t innerHash[32];
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, ipad, 64);
+        SHA256_Update(&ctx, pHashed, SMSG_HDR_LEN-4);
+        SHA256_Update(&ctx, pPayload, nPayload);
+        SHA256_Update(&ctx, pPayload, nPayload);
+        SHA256_Final(innerHash, &ctx);
+
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, opad, 64);
+        SHA256_Update(&ctx, innerHash, 32);
+        SHA256_Final(sha256Hash, &ctx);
+    };
+};
+
+static inline bool SecureMsgPowMatch(const uint8_t *sha256Hash)
+{
+    return sha256Hash[31] == 0
+        && sha256Hash[30] == 0
+        && (~(sha256Hash[29]) & ((1<<0) | (1<<1) | (1<<2)));
+};
+
+class SecMsgPowJob
+{
+// -- nonce search shared by the threads of one SecureMsgSetHash call
+public:
+    SecMsgPowJob(const uint8_t *pHeaderIn, const uint8_t *pPayloadIn, uint32_t nPayloadIn)
+        : pHeader(pHeaderIn), pPayload(pPayloadIn), nPayload(nPayloadIn), fFound(false), nHashes(0), nonce(0) {};
+
+    const uint8_t *pHeader;
+    const uint8_t *pPayload;
+    uint32_t nPayload;
+
+    boost::atomic<bool> fFound;
+    boost::atomic<uint64_t> nHashes;
+
+    boost::mutex mtx;       // guards nonce and sha256Hash
+    uint32_t nonce;
+    uint8_t sha256Hash[32];
+};
+
+static void SecureMsgPowWorker(SecMsgPowJob *job, uint32_t nFirst, uint32_t nStride)
+{
+    // -- each thread hashes its own copy of the header, stepping the nonce by nStride from nFirst
+    uint8_t vchHashed[SMSG_HDR_LEN-4];
+    memcpy(vchHashed, job->pHeader+4, SMSG_HDR_LEN-4);
+
+    SecMsgPowHasher hasher;
+    uint8_t sha256Hash[32];
+    uint64_t nTried = 0;
+
+    for (uint64_t n = nFirst; n <= 4294967295U; n += nStride)
+    {
+        if ((nTried & 0xff) == 0
+            && (job->fFound || !fSecMsgEnabled))
+            break;
+
+        uint32_t nonce = (uint32_t) n;
+        memcpy(&vchHashed[SMSG_POW_NONCE_OFS], &nonce, 4);
+        hasher.Hash(vchHashed, job->pPayload, job->nPayload, sha256Hash);
+        nTried++;
+
+        if (SecureMsgPowMatch(sha256Hash))
+        {
+            // -- keep the lowest nonce if several threads match at once
+            boost::mutex::scoped_lock lock(job->mtx);
+            if (!job->fFound || nonce < job->nonce)
+            {
+                job->nonce = nonce;
+                memcpy(job->sha256Hash, sha256Hash, 32);
+            };
+            job->fFound = true;
+            break;
+        };
+    };
+
+    job->nHashes += nTried;
+};
+
+int SecureMsgPowThreads()
+{
+    int nThreads = GetArg("-smsgpowthreads", boost::thread::hardware_concurrency());
+    if (nThreads < 1)
+        nThreads = 1;
+    return nThreads;
+};
+
 int SecureMsgValidate(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
 {
     /*
@@ -3235,7 +4982,6 @@ int SecureMsgValidate(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
     if (nPayload > SMSG_MAX_MSG_WORST)
         return 5;
 
-    uint8_t civ[32];
     uint8_t sha256Hash[32];
     int rv = 2; // invalid
 
@@ -3245,42 +4991,22 @@ int SecureMsgValidate(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
     if (fDebugSmsg)
         LogPrintf("SecureMsgValidate() nonce %u.\n", nonce);
 
-    for (int i = 0; i < 32; i+=4)
-        memcpy(civ+i, &nonce, 4);
+    SecMsgPowHasher hasher;
+    hasher.Hash(pHeader+4, pPayload, nPayload, sha256Hash);
 
-    HMAC_CTX ctx;
-    HMAC_CTX_init(&ctx);
-
-    uint32_t nBytes;
-    if (!HMAC_Init_ex(&ctx, &civ[0], 32, EVP_sha256(), NULL)
-        || !HMAC_Update(&ctx, (uint8_t*) pHeader+4, SMSG_HDR_LEN-4)
-        || !HMAC_Update(&ctx, (uint8_t*) pPayload, nPayload)
-        || !HMAC_Update(&ctx, pPayload, nPayload)
-        || !HMAC_Final(&ctx, sha256Hash, &nBytes)
-        || nBytes != 32)
+    if (SecureMsgPowMatch(sha256Hash))
     {
         if (fDebugSmsg)
-            LogPrintf("HMAC error.\n");
-        rv = 1; // error
-    } else
-    {
-        if (sha256Hash[31] == 0
-            && sha256Hash[30] == 0
-            && (~(sha256Hash[29]) & ((1<<0) | (1<<1) | (1<<2)) ))
-        {
-            if (fDebugSmsg)
-                LogPrintf("Hash Valid.\n");
-            rv = 0; // smsg is valid
-        };
+            LogPrintf("Hash Valid.\n");
+        rv = 0; // smsg is valid
+    };
 
-        if (procx::memcmp_nta(psmsg->hash, sha256Hash, 4) != 0)
-        {
-             if (fDebugSmsg)
-                LogPrintf("Checksum mismatch.\n");
-            rv = 3; // checksum mismatch
-        }
+    if (procx::memcmp_nta(psmsg->hash, sha256Hash, 4) != 0)
+    {
+         if (fDebugSmsg)
+            LogPrintf("Checksum mismatch.\n");
+        rv = 3; // checksum mismatch
     }
-    HMAC_CTX_cleanup(&ctx);
 
     return rv;
 };
@@ -3290,6 +5016,7 @@ int SecureMsgSetHash(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
     /*  proof of work and checksum
 
         May run in a thread, if shutdown detected, return.
+        The nonce space is split over SecureMsgPowThreads() threads.
 
         returns:
             0 success
@@ -3300,75 +5027,37 @@ int SecureMsgSetHash(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
 
     SecureMessage* psmsg = (SecureMessage*) pHeader;
 
-    int64_t nStart = GetTimeMillis();
-    uint8_t civ[32];
-    uint8_t sha256Hash[32];
-
-    bool found = false;
-    HMAC_CTX ctx;
-    HMAC_CTX_init(&ctx);
-
-    uint32_t nonce = 0;
-
-    //CBigNum bnTarget(2);
-    //bnTarget = bnTarget.pow(256 - 40);
-
-    // -- break for HMAC_CTX_cleanup
-    for (;;)
-    {
-        if (!fSecMsgEnabled)
-           break;
-
-        //psmsg->timestamp = GetTime();
-        //memcpy(&psmsg->timestamp, &now, 8);
-        memcpy(&psmsg->nonce[0], &nonce, 4);
-
-        for (int i = 0; i < 32; i+=4)
-            memcpy(civ+i, &nonce, 4);
-
-        uint32_t nBytes;
-        if (!HMAC_Init_ex(&ctx, &civ[0], 32, EVP_sha256(), NULL)
-            || !HMAC_Update(&ctx, (uint8_t*) pHeader+4, SMSG_HDR_LEN-4)
-            || !HMAC_Update(&ctx, (uint8_t*) pPayload, nPayload)
-            || !HMAC_Update(&ctx, pPayload, nPayload)
-            || !HMAC_Final(&ctx, sha256Hash, &nBytes)
-            //|| !HMAC_Final(&ctx, &vchHash[0], &nBytes)
-            || nBytes != 32)
-            break;
-
-        /*
-        if (CBigNum(vchHash) <= bnTarget)
-        {
-            found = true;
-            if (fDebugSmsg)
-                LogPrintf("Match %u\n", nonce);
-            break;
-        };
-        */
-
-        if (sha256Hash[31] == 0
-            && sha256Hash[30] == 0
-            && (~(sha256Hash[29]) & ((1<<0) | (1<<1) | (1<<2)) ))
-        //    && sha256Hash[29] == 0)
-        {
-            found = true;
-            //if (fDebugSmsg)
-            //    LogPrintf("Match %u\n", nonce);
-            break;
-        }
+    int64_t nStart = GetTimeMillis();
 
-        //if (nonce >= UINT32_MAX)
-        if (nonce >= 4294967295U)
-        {
-            if (fDebugSmsg)
-                LogPrintf("No match %u\n", nonce);
-            break;
-            //return 1;
-        }
-        nonce++;
+    SecMsgPowJob job(pHeader, pPayload, nPayload);
+
+    int nThreads = SecureMsgPowThreads();
+    if (nThreads == 1)
+    {
+        SecureMsgPowWorker(&job, 0, 1);
+    } else
+    {
+        boost::thread_group threadGroupPow;
+        for (int i = 0; i < nThreads; ++i)
+            threadGroupPow.create_thread(boost::bind(&SecureMsgPowWorker, &job, i, nThreads));
+        threadGroupPow.join_all();
     };
 
-    HMAC_CTX_cleanup(&ctx);
+    int64_t nTime = GetTimeMillis() - nStart;
+    {
+        LOCK(cs_smsgPow);
+        smsgPowStats.nHashes += job.nHashes;
+        smsgPowStats.nTimeTotal += nTime;
+        if (fSecMsgEnabled)
+        {
+            if (job.fFound)
+                smsgPowStats.nMessages++;
+            else
+                smsgPowStats.nFailed++;
+            smsgPowStats.nTimeMax = std::max(smsgPowStats.nTimeMax, nTime);
+            smsgPowStats.nTimeLast = GetTime();
+        };
+    }
 
     if (!fSecMsgEnabled)
     {
@@ -3377,68 +5066,41 @@ int SecureMsgSetHash(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
         return 2;
     };
 
-    if (!found)
+    if (!job.fFound)
     {
         if (fDebugSmsg)
-            LogPrintf("SecureMsgSetHash() failed, took %d ms, nonce %u\n", GetTimeMillis() - nStart, nonce);
+            LogPrintf("SecureMsgSetHash() failed, took %d ms, %u hashes\n", nTime, (uint64_t)job.nHashes);
         return 1;
     };
 
-    memcpy(psmsg->hash, sha256Hash, 4);
-    //memcpy(psmsg->hash, &vchHash[0], 4);
+    memcpy(&psmsg->nonce[0], &job.nonce, 4);
+    memcpy(psmsg->hash, job.sha256Hash, 4);
 
     if (fDebugSmsg)
-        LogPrintf("SecureMsgSetHash() took %d ms, nonce %u\n", GetTimeMillis() - nStart, nonce);
+        LogPrintf("SecureMsgSetHash() took %d ms, nonce %u, %d threads\n", nTime, job.nonce, nThreads);
 
     return 0;
 };
 
-int SecureMsgEncrypt(SecureMessage &smsg, const std::string &addressFrom, const std::string &addressTo, const std::string &message)
+static int SecureMsgBuildPayload(SecMsgCryptoContext &ctx, const std::string &addressFrom, const std::string &message)
 {
-    /* Create a secure message
-
-        Using similar method to bitmessage.
-        If bitmessage is secure this should be too.
-        https://bitmessage.org/wiki/Encryption
-
-        Some differences:
-        bitmessage seems to use curve sect283r1
-        *coin addresses use secp256k1
-
-        returns
-            2       message is too long.
-            3       addressFrom is invalid.
-            4       addressTo is invalid.
-            5       Could not get public key for addressTo.
-            6       ECDH_compute_key failed
-            7       Could not get private key for addressFrom.
-            8       Could not allocate memory.
-            9       Could not compress message data.
-            10      Could not generate MAC.
-            11      Encrypt failed.
+    /* Build the plaintext payload into ctx.vchPayload.
+       Sender, signature and compressed message are the same for every recipient.
+       returns error codes as SecureMsgEncrypt
     */
 
-    if (fDebugSmsg)
-        LogPrintf("SecureMsgEncrypt(%s, %s, ...)\n", addressFrom.c_str(), addressTo.c_str());
-
     bool fSendAnonymous = (addressFrom.compare("anon") == 0);
 
-
     if (message.size() > (fSendAnonymous ? SMSG_MAX_AMSG_BYTES : SMSG_MAX_MSG_BYTES))
     {
         return errorN(2, "%s: Message is too long, %u.", __func__, message.size());
     };
 
-    smsg.version[0] = 1;
-    smsg.version[1] = 1;
-    smsg.timestamp = GetTime();
-
     CBitcoinAddress coinAddrFrom;
     CKeyID ckidFrom;
     CKey keyFrom;
 
-
-    if(!fSendAnonymous)
+    if (!fSendAnonymous)
     {
         if (!coinAddrFrom.SetString(addressFrom))
         {
@@ -3451,6 +5113,78 @@ int SecureMsgEncrypt(SecureMessage &smsg, const std::string &addressFrom, const
         };
     };
 
+    uint8_t *pMsgData;
+    uint32_t lenMsgData;
+
+    uint32_t lenMsg = message.size();
+    if (lenMsg > 128)
+    {
+        // -- only compress if over 128 bytes
+        int worstCase = LZ4_compressBound(message.size());
+        ctx.Resize(ctx.vchCompressed, worstCase);
+
+        int lenComp = LZ4_compress_limitedOutput_withState(&ctx.vchLz4State[0], (char*)message.c_str(), (char*)&ctx.vchCompressed[0], lenMsg, worstCase);
+        if (lenComp < 1)
+        {
+            return errorN(9, "%s: Could not compress message data.", __func__);
+        };
+
+        pMsgData = &ctx.vchCompressed[0];
+        lenMsgData = lenComp;
+
+    } else
+    {
+        // -- no compression
+        pMsgData = (uint8_t*)message.c_str();
+        lenMsgData = lenMsg;
+    };
+
+    std::vector<uint8_t> &vchPayload = ctx.vchPayload;
+    if (fSendAnonymous)
+    {
+        ctx.Resize(vchPayload, 9 + lenMsgData);
+
+        memcpy(&vchPayload[9], pMsgData, lenMsgData);
+
+        vchPayload[0] = 250; // id as anonymous message
+        // -- next 4 bytes are unused - there to ensure encrypted payload always > 8 bytes
+        memset(&vchPayload[1], 0, 4);
+        memcpy(&vchPayload[5], &lenMsg, 4); // length of uncompressed plain text
+    } else
+    {
+        ctx.Resize(vchPayload, SMSG_PL_HDR_LEN + lenMsgData);
+
+        memcpy(&vchPayload[SMSG_PL_HDR_LEN], pMsgData, lenMsgData);
+        // -- compact signature proves ownership of from address and allows the public key to be recovered, recipient can always reply.
+        if (!pwalletMain->GetKey(ckidFrom, keyFrom))
+        {
+            return errorN(7, "%s: Could not get private key for addressFrom.", __func__);
+        };
+
+        // -- sign the plaintext
+        ctx.Resize(ctx.vchSignature, 65);
+        keyFrom.SignCompact(Hash(message.begin(), message.end()), ctx.vchSignature);
+
+        // -- Save some bytes by sending address raw
+        vchPayload[0] = (static_cast<CBitcoinAddress_B*>(&coinAddrFrom))->getVersion(); // vchPayload[0] = coinAddrDest.nVersion;
+        memcpy(&vchPayload[1], (static_cast<CKeyID_B*>(&ckidFrom))->GetPPN(), 20); // memcpy(&vchPayload[1], ckidDest.pn, 20);
+
+        memcpy(&vchPayload[1+20], &ctx.vchSignature[0], 65);
+        memcpy(&vchPayload[1+20+65], &lenMsg, 4); // length of uncompressed plain text
+    };
+
+    return 0;
+};
+
+static int SecureMsgEncryptPayload(SecMsgCryptoContext &ctx, SecureMessage &smsg, const std::string &addressTo)
+{
+    /* Encrypt ctx.vchPayload for addressTo into smsg.
+       returns error codes as SecureMsgEncrypt
+    */
+
+    smsg.version[0] = 1;
+    smsg.version[1] = SMSG_TAG_NONE;
+    smsg.timestamp = GetTime();
 
     CBitcoinAddress coinAddrDest;
     CKeyID ckidDest;
@@ -3495,19 +5229,13 @@ int SecureMsgEncrypt(SecureMessage &smsg, const std::string &addressFrom, const
         return errorN(4, "%s: Could not set pubkey for K: %s.", __func__, HexStr(cpkDestK).c_str());
     };
 
-    std::vector<uint8_t> vchP;
-    vchP.resize(32);
+    uint8_t chP[32];
     EC_KEY *pkeyr = ecKeyR.GetECKey();
     EC_KEY *pkeyK = ecKeyK.GetECKey();
 
-    // always seems to be 32, worth checking?
-    //int field_size = EC_GROUP_get_degree(EC_KEY_get0_group(pkeyr));
-    //int secret_len = (field_size+7)/8;
-    //LogPrintf("secret_len %d.\n", secret_len);
-
     // -- ECDH_compute_key returns the same P if fed compressed or uncompressed public keys
     ECDH_set_method(pkeyr, ECDH_OpenSSL());
-    int lenP = ECDH_compute_key(&vchP[0], 32, EC_KEY_get0_public_key(pkeyK), pkeyr, NULL);
+    int lenP = ECDH_compute_key(chP, 32, EC_KEY_get0_public_key(pkeyK), pkeyr, NULL);
 
     if (lenP != 32)
     {
@@ -3523,96 +5251,27 @@ int SecureMsgEncrypt(SecureMessage &smsg, const std::string &addressFrom, const
 
     memcpy(smsg.cpkR, cpkR.begin(), 33);
 
+    if (smsgOptions.fTagRecipient)
+        smsg.version[1] = SecureMsgRecipientTag(ckidDest, smsg.cpkR);
+
 
     // -- Use public key P and calculate the SHA512 hash H.
     //    The first 32 bytes of H are called key_e and the last 32 bytes are called key_m.
-    std::vector<uint8_t> vchHashed;
-    vchHashed.resize(64); // 512
-    SHA512(&vchP[0], vchP.size(), (uint8_t*)&vchHashed[0]);
-    std::vector<uint8_t> key_e(&vchHashed[0], &vchHashed[0]+32);
-    std::vector<uint8_t> key_m(&vchHashed[32], &vchHashed[32]+32);
-
-
-    std::vector<uint8_t> vchPayload;
-    std::vector<uint8_t> vchCompressed;
-    uint8_t *pMsgData;
-    uint32_t lenMsgData;
-
-    uint32_t lenMsg = message.size();
-    if (lenMsg > 128)
-    {
-        // -- only compress if over 128 bytes
-        int worstCase = LZ4_compressBound(message.size());
-        try { vchCompressed.resize(worstCase); } catch (std::exception& e)
-        {
-            return errorN(8, "%s: vchCompressed.resize %u threw: %s.", __func__, worstCase, e.what());
-        };
-
-        int lenComp = LZ4_compress((char*)message.c_str(), (char*)&vchCompressed[0], lenMsg);
-        if (lenComp < 1)
-        {
-            return errorN(9, "%s: Could not compress message data.", __func__);
-        };
-
-        pMsgData = &vchCompressed[0];
-        lenMsgData = lenComp;
-
-    } else
-    {
-        // -- no compression
-        pMsgData = (uint8_t*)message.c_str();
-        lenMsgData = lenMsg;
-    };
-
-    if (fSendAnonymous)
-    {
-        try { vchPayload.resize(9 + lenMsgData); } catch (std::exception& e)
-        {
-            return errorN(8, "%s: vchPayload.resize %u threw: %s.", __func__, 9 + lenMsgData, e.what());
-        };
-
-        memcpy(&vchPayload[9], pMsgData, lenMsgData);
-
-        vchPayload[0] = 250; // id as anonymous message
-        // -- next 4 bytes are unused - there to ensure encrypted payload always > 8 bytes
-        memcpy(&vchPayload[5], &lenMsg, 4); // length of uncompressed plain text
-    } else
-    {
-        try { vchPayload.resize(SMSG_PL_HDR_LEN + lenMsgData); } catch (std::exception& e)
-        {
-            return errorN(8, "%s: vchPayload.resize %u threw: %s.", __func__, SMSG_PL_HDR_LEN + lenMsgData, e.what());
-        };
-
-        memcpy(&vchPayload[SMSG_PL_HDR_LEN], pMsgData, lenMsgData);
-        // -- compact signature proves ownership of from address and allows the public key to be recovered, recipient can always reply.
-        if (!pwalletMain->GetKey(ckidFrom, keyFrom))
-        {
-            return errorN(7, "%s: Could not get private key for addressFrom.", __func__);
-        };
-
-        // -- sign the plaintext
-        std::vector<uint8_t> vchSignature;
-        vchSignature.resize(65);
-        keyFrom.SignCompact(Hash(message.begin(), message.end()), vchSignature);
-
-        // -- Save some bytes by sending address raw
-        vchPayload[0] = (static_cast<CBitcoinAddress_B*>(&coinAddrFrom))->getVersion(); // vchPayload[0] = coinAddrDest.nVersion;
-        memcpy(&vchPayload[1], (static_cast<CKeyID_B*>(&ckidFrom))->GetPPN(), 20); // memcpy(&vchPayload[1], ckidDest.pn, 20);
-
-        memcpy(&vchPayload[1+20], &vchSignature[0], vchSignature.size());
-        memcpy(&vchPayload[1+20+65], &lenMsg, 4); // length of uncompressed plain text
-    };
+    uint8_t chHashed[64];
+    SHA512(chP, 32, chHashed);
+    uint8_t *key_e = &chHashed[0];
+    uint8_t *key_m = &chHashed[32];
 
 
     SecMsgCrypter crypter;
     crypter.SetKey(key_e, smsg.iv);
-    std::vector<uint8_t> vchCiphertext;
 
-    if (!crypter.Encrypt(&vchPayload[0], vchPayload.size(), vchCiphertext))
+    if (!crypter.Encrypt(ctx.cipher, &ctx.vchPayload[0], ctx.vchPayload.size(), ctx.vchCiphertext))
     {
         return errorN(11, "%s: crypter.Encrypt failed.", __func__);
     };
 
+    std::vector<uint8_t> &vchCiphertext = ctx.vchCiphertext;
     try { smsg.pPayload = new uint8_t[vchCiphertext.size()]; } catch (std::exception& e)
     {
         return errorN(8, "%s: Could not allocate pPayload, exception: %s.", __func__, e.what());
@@ -3626,17 +5285,16 @@ int SecureMsgEncrypt(SecureMessage &smsg, const std::string &addressFrom, const
     //    Message authentication code, (hash of timestamp + destination + payload)
     bool fHmacOk = true;
     uint32_t nBytes = 32;
-    HMAC_CTX ctx;
-    HMAC_CTX_init(&ctx);
 
-    if (!HMAC_Init_ex(&ctx, &key_m[0], 32, EVP_sha256(), NULL)
-        || !HMAC_Update(&ctx, (uint8_t*) &smsg.timestamp, sizeof(smsg.timestamp))
-        || !HMAC_Update(&ctx, &vchCiphertext[0], vchCiphertext.size())
-        || !HMAC_Final(&ctx, smsg.mac, &nBytes)
+    if (!HMAC_Init_ex(ctx.hmac, key_m, 32, EVP_sha256(), NULL)
+        || !HMAC_Update(ctx.hmac, (uint8_t*) &smsg.timestamp, sizeof(smsg.timestamp))
+        || !HMAC_Update(ctx.hmac, &vchCiphertext[0], vchCiphertext.size())
+        || !HMAC_Final(ctx.hmac, smsg.mac, &nBytes)
         || nBytes != 32)
         fHmacOk = false;
 
-    HMAC_CTX_cleanup(&ctx);
+    memset(chP, 0, sizeof(chP));
+    memset(chHashed, 0, sizeof(chHashed));
 
     if (!fHmacOk)
     {
@@ -3646,6 +5304,76 @@ int SecureMsgEncrypt(SecureMessage &smsg, const std::string &addressFrom, const
     return 0;
 };
 
+int SecureMsgEncrypt(SecureMessage &smsg, const std::string &addressFrom, const std::string &addressTo, const std::string &message)
+{
+    /* Create a secure message
+
+        Using similar method to bitmessage.
+        If bitmessage is secure this should be too.
+        https://bitmessage.org/wiki/Encryption
+
+        Some differences:
+        bitmessage seems to use curve sect283r1
+        *coin addresses use secp256k1
+
+        returns
+            2       message is too long.
+            3       addressFrom is invalid.
+            4       addressTo is invalid.
+            5       Could not get public key for addressTo.
+            6       ECDH_compute_key failed
+            7       Could not get private key for addressFrom.
+            8       Could not allocate memory.
+            9       Could not compress message data.
+            10      Could not generate MAC.
+            11      Encrypt failed.
+    */
+
+    if (fDebugSmsg)
+        LogPrintf("SecureMsgEncrypt(%s, %s, ...)\n", addressFrom.c_str(), addressTo.c_str());
+
+    SecMsgCryptoContext &ctx = SecMsgCryptoContext::Get();
+    SecMsgWipeOnExit wipe(ctx);
+
+    int rv;
+    if ((rv = SecureMsgBuildPayload(ctx, addressFrom, message)) != 0)
+        return rv;
+
+    return SecureMsgEncryptPayload(ctx, smsg, addressTo);
+};
+
+int SecureMsgEncryptBatch(std::vector<SecureMessage*> &vpsmsg, const std::string &addressFrom, const std::vector<std::string> &vAddressTo, const std::string &message, std::vector<int> &vResult)
+{
+    /* Encrypt one message for many recipients.
+       The payload is compressed and signed once, each recipient gets its own key pair, ciphertext and MAC.
+
+       vpsmsg must hold a SecureMessage for each address in vAddressTo.
+       returns
+            0       payload built, per recipient codes of SecureMsgEncrypt are in vResult.
+            1       vpsmsg and vAddressTo differ in size.
+            other   error building the payload, as SecureMsgEncrypt.
+    */
+
+    if (fDebugSmsg)
+        LogPrintf("SecureMsgEncryptBatch(%s, %u recipients)\n", addressFrom.c_str(), vAddressTo.size());
+
+    if (vpsmsg.size() != vAddressTo.size())
+        return errorN(1, "%s: %u messages for %u recipients.", __func__, vpsmsg.size(), vAddressTo.size());
+
+    SecMsgCryptoContext &ctx = SecMsgCryptoContext::Get();
+    SecMsgWipeOnExit wipe(ctx);
+
+    int rv;
+    if ((rv = SecureMsgBuildPayload(ctx, addressFrom, message)) != 0)
+        return rv;
+
+    vResult.resize(vAddressTo.size());
+    for (uint32_t i = 0; i < vAddressTo.size(); ++i)
+        vResult[i] = SecureMsgEncryptPayload(ctx, *vpsmsg[i], vAddressTo[i]);
+
+    return 0;
+};
+
 int SecureMsgSend(std::string &addressFrom, std::string &addressTo, std::string &message, std::string &sError)
 {
     /* Encrypt secure message, and place it on the network
@@ -3674,10 +5402,43 @@ int SecureMsgSend(std::string &addressFrom, std::string &addressTo, std::string
         return 1;
     };
 
+    //  -- for outbox create a copy encrypted for owned address
+    //     if the wallet is encrypted private key needed to decrypt will be unavailable
+    std::string addressOutbox = "None";
+    CBitcoinAddress coinAddrOutbox;
+
+    BOOST_FOREACH(const PAIRTYPE(CTxDestination, std::string)& entry, pwalletMain->mapAddressBook)
+    {
+        // -- get first owned address
+        if (!IsDestMine(*pwalletMain, entry.first))
+            continue;
+
+        const CBitcoinAddress& address = entry.first;
+
+        addressOutbox = address.ToString();
+        if (!coinAddrOutbox.SetString(addressOutbox)) // test valid
+            continue;
+        break;
+    };
+
+    // -- recipient and outbox copies share one compressed and signed payload
     int rv;
     SecureMessage smsg;
+    SecureMessage smsgForOutbox;
+    std::vector<SecureMessage*> vpsmsg;
+    std::vector<std::string> vAddressTo;
+    std::vector<int> vResult;
 
-    if ((rv = SecureMsgEncrypt(smsg, addressFrom, addressTo, message)) != 0)
+    vpsmsg.push_back(&smsg);
+    vAddressTo.push_back(addressTo);
+    if (addressOutbox != "None")
+    {
+        vpsmsg.push_back(&smsgForOutbox);
+        vAddressTo.push_back(addressOutbox);
+    };
+
+    if ((rv = SecureMsgEncryptBatch(vpsmsg, addressFrom, vAddressTo, message, vResult)) != 0
+        || (rv = vResult[0]) != 0)
     {
         LogPrintf("SecureMsgSend(), encrypt for recipient failed.\n");
 
@@ -3734,39 +5495,15 @@ int SecureMsgSend(std::string &addressFrom, std::string &addressTo, std::string
 
     // TODO: only update outbox when proof of work thread is done.
 
-    //  -- for outbox create a copy encrypted for owned address
-    //     if the wallet is encrypted private key needed to decrypt will be unavailable
-
-    if (fDebugSmsg)
-        LogPrintf("Encrypting message for outbox.\n");
-
-    std::string addressOutbox = "None";
-    CBitcoinAddress coinAddrOutbox;
-
-    BOOST_FOREACH(const PAIRTYPE(CTxDestination, std::string)& entry, pwalletMain->mapAddressBook)
-    {
-        // -- get first owned address
-        if (!IsDestMine(*pwalletMain, entry.first))
-            continue;
-
-        const CBitcoinAddress& address = entry.first;
-
-        addressOutbox = address.ToString();
-        if (!coinAddrOutbox.SetString(addressOutbox)) // test valid
-            continue;
-        break;
-    };
-
     if (addressOutbox == "None")
     {
         LogPrintf("Warning: SecureMsgSend() could not find an address to encrypt outbox message with.\n");
     } else
     {
         if (fDebugSmsg)
-            LogPrintf("Encrypting a copy for outbox, using address %s\n", addressOutbox.c_str());
+            LogPrintf("Encrypted a copy for outbox, using address %s\n", addressOutbox.c_str());
 
-        SecureMessage smsgForOutbox;
-        if ((rv = SecureMsgEncrypt(smsgForOutbox, addressFrom, addressOutbox, message)) != 0)
+        if ((rv = vResult[1]) != 0)
         {
             LogPrintf("SecureMsgSend(), encrypt for outbox failed, %d.\n", rv);
         } else
@@ -3885,13 +5622,12 @@ int SecureMsgDecrypt(bool fTestOnly, std::string &address, uint8_t *pHeader, uin
     ecKeyDest.SetSecretBytes(keyDest.begin());
 
     // -- Do an EC point multiply with private key k and public key R. This gives you public key P.
-    std::vector<uint8_t> vchP;
-    vchP.resize(32);
+    uint8_t chP[32];
     EC_KEY* pkeyk = ecKeyDest.GetECKey();
     EC_KEY* pkeyR = ecKeyR.GetECKey();
 
     ECDH_set_method(pkeyk, ECDH_OpenSSL());
-    int lenPdec = ECDH_compute_key(&vchP[0], 32, EC_KEY_get0_public_key(pkeyR), pkeyk, NULL);
+    int lenPdec = ECDH_compute_key(chP, 32, EC_KEY_get0_public_key(pkeyR), pkeyk, NULL);
 
     if (lenPdec != 32)
     {
@@ -3901,29 +5637,26 @@ int SecureMsgDecrypt(bool fTestOnly, std::string &address, uint8_t *pHeader, uin
 
     // -- Use public key P to calculate the SHA512 hash H.
     //    The first 32 bytes of H are called key_e and the last 32 bytes are called key_m.
-    std::vector<uint8_t> vchHashedDec;
-    vchHashedDec.resize(64);    // 512 bits
-    SHA512(&vchP[0], vchP.size(), (uint8_t*)&vchHashedDec[0]);
-    std::vector<uint8_t> key_e(&vchHashedDec[0], &vchHashedDec[0]+32);
-    std::vector<uint8_t> key_m(&vchHashedDec[32], &vchHashedDec[32]+32);
+    uint8_t chHashedDec[64];    // 512 bits
+    SHA512(chP, 32, chHashedDec);
+    memset(chP, 0, sizeof(chP));
+    uint8_t *key_e = &chHashedDec[0];
+    uint8_t *key_m = &chHashedDec[32];
 
+    SecMsgCryptoContext &ctx = SecMsgCryptoContext::Get();
 
     // -- Message authentication code, (hash of timestamp + destination + payload)
     uint8_t MAC[32];
     bool fHmacOk = true;
     uint32_t nBytes = 32;
-    HMAC_CTX ctx;
-    HMAC_CTX_init(&ctx);
 
-    if (!HMAC_Init_ex(&ctx, &key_m[0], 32, EVP_sha256(), NULL)
-        || !HMAC_Update(&ctx, (uint8_t*) &psmsg->timestamp, sizeof(psmsg->timestamp))
-        || !HMAC_Update(&ctx, pPayload, nPayload)
-        || !HMAC_Final(&ctx, MAC, &nBytes)
+    if (!HMAC_Init_ex(ctx.hmac, key_m, 32, EVP_sha256(), NULL)
+        || !HMAC_Update(ctx.hmac, (uint8_t*) &psmsg->timestamp, sizeof(psmsg->timestamp))
+        || !HMAC_Update(ctx.hmac, pPayload, nPayload)
+        || !HMAC_Final(ctx.hmac, MAC, &nBytes)
         || nBytes != 32)
         fHmacOk = false;
 
-    HMAC_CTX_cleanup(&ctx);
-
     if (!fHmacOk)
     {
         return errorN(1, "%s: Could not generate MAC.", __func__);
@@ -3942,8 +5675,10 @@ int SecureMsgDecrypt(bool fTestOnly, std::string &address, uint8_t *pHeader, uin
 
     SecMsgCrypter crypter;
     crypter.SetKey(key_e, psmsg->iv);
-    std::vector<uint8_t> vchPayload;
-    if (!crypter.Decrypt(pPayload, nPayload, vchPayload))
+    memset(chHashedDec, 0, sizeof(chHashedDec));
+    SecMsgWipeOnExit wipe(ctx);
+    std::vector<uint8_t> &vchPayload = ctx.vchPayload;
+    if (!crypter.Decrypt(ctx.cipher, pPayload, nPayload, vchPayload))
     {
         return errorN(1, "%s: Decrypt failed.", __func__);
     };
@@ -3996,12 +5731,8 @@ int SecureMsgDecrypt(bool fTestOnly, std::string &address, uint8_t *pHeader, uin
         msg.sFromAddress = "anon";
     } else
     {
-        std::vector<uint8_t> vchUint160;
-        vchUint160.resize(20);
-
-        memcpy(&vchUint160[0], &vchPayload[1], 20);
-
-        uint160 ui160(vchUint160);
+        uint160 ui160;
+        memcpy(ui160.begin(), &vchPayload[1], 20);
         CKeyID ckidFrom(ui160);
 
         CBitcoinAddress coinAddrFrom;
@@ -4011,8 +5742,8 @@ int SecureMsgDecrypt(bool fTestOnly, std::string &address, uint8_t *pHeader, uin
             return errorN(1, "%s: From Address is invalid.", __func__);
         };
 
-        std::vector<uint8_t> vchSig;
-        vchSig.resize(65);
+        std::vector<uint8_t> &vchSig = ctx.vchSignature;
+        ctx.Resize(vchSig, 65);
 
         memcpy(&vchSig[0], &vchPayload[1+20], 65);
 
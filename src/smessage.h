@@ -17,18 +17,38 @@
 #endif
 #include "lz4/lz4.h"
 
+// -- OpenSSL contexts are only held by pointer here, see smessage.cpp
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+typedef struct hmac_ctx_st HMAC_CTX;
+
 const unsigned int SMSG_HDR_LEN        = 104;               // length of unencrypted header, 4 + 2 + 1 + 8 + 16 + 33 + 32 + 4 +4
 const unsigned int SMSG_PL_HDR_LEN     = 1+20+65+4;         // length of encrypted header in payload
 
+const unsigned int SMSG_TAG_NONE       = 1;                 // version[1] of messages without a recipient tag
+const unsigned int SMSG_TAG_MIN        = 2;                 // version[1] >= SMSG_TAG_MIN is a recipient tag
+
 const unsigned int SMSG_BUCKET_LEN     = 60 * 10;           // in seconds
+const unsigned int SMSG_SEGMENT_LEN    = 60 * 60 * 6;       // in seconds, buckets stored together in one log segment
 const unsigned int SMSG_RETENTION      = 60 * 60 * 48;      // in seconds
 const unsigned int SMSG_SEND_DELAY     = 2;                 // in seconds, SecureMsgSendData will delay this long between firing
 const unsigned int SMSG_THREAD_DELAY   = 30;
 const unsigned int SMSG_THREAD_LOG_GAP = 6;
+const unsigned int SMSG_LOCK_TIMEOUT   = 3 * SMSG_THREAD_DELAY; // in seconds, a bucket locked for a peer is released after this long
+
+const unsigned int SMSG_WHEEL_BITS     = 6;                 // 64 slots per timer wheel level
+const unsigned int SMSG_WHEEL_SLOTS    = 1 << SMSG_WHEEL_BITS;
+const unsigned int SMSG_WHEEL_LEVELS   = 4;                 // 1s slots on the first level, 2^24s covered before the overflow list
 
 const unsigned int SMSG_TIME_LEEWAY    = 60;
 const unsigned int SMSG_TIME_IGNORE    = 90;                // seconds that a peer is ignored for if they fail to deliver messages for a smsgWant
 
+const unsigned int SMSG_IBLT_CELL_LEN  = 4 + 16 + 4;        // count, token key sum, key hash sum
+const unsigned int SMSG_IBLT_HASHES    = 3;                 // cells per token, one in each sub table
+const unsigned int SMSG_IBLT_MIN_CELLS = 8 * SMSG_IBLT_HASHES;
+const unsigned int SMSG_IBLT_MAX_CELLS = 1024 * SMSG_IBLT_HASHES;
+const unsigned int SMSG_IBLT_SLACK     = 8;                 // expected differences added to the bucket count difference
+const unsigned int SMSG_IBLT_GROWTH    = 4;                 // table size multiplier when a peer asks for a retry
+
 
 const unsigned int SMSG_MAX_MSG_BYTES  = 4096;              // the user input part
 const unsigned int SMSG_MAX_AMSG_BYTES = 512;               // the user input part (ANON)
@@ -38,6 +58,16 @@ const unsigned int SMSG_MAX_MSG_WORST = LZ4_COMPRESSBOUND(SMSG_MAX_MSG_BYTES+SMS
 
 #define SMSG_MASK_UNREAD            (1 << 0)
 
+const unsigned int SMSG_DB_INDEX_VERSION = 1;               // bump to rebuild the inbox/outbox time indexes on open
+const unsigned int SMSG_DB_BATCH_MAX     = 500;             // messages written per synced batch when scanning in bulk
+
+const unsigned int SMSG_SCAN_CHUNK       = 2000;            // blocks read per round of a chain scan, keys are committed after each round
+const unsigned int SMSG_SCAN_MAX_THREADS = 8;
+const unsigned int SMSG_KEY_FILTER_BITS  = 1 << 26;         // 8MB, under 0.5% false positives at 5M harvested keys
+const unsigned int SMSG_KEY_FILTER_PROBES = 4;
+
+#define SMSG_FEATURE_RECON          (1 << 0)    // peer understands smsgIblt
+
 extern bool fSecMsgEnabled;
 
 class SecMsgStored;
@@ -61,6 +91,7 @@ extern SecMsgOptions                    smsgOptions;
 
 extern CCriticalSection cs_smsg;            // all except inbox and outbox
 extern CCriticalSection cs_smsgDB;
+extern CCriticalSection cs_smsgPow;         // smsgPowStats
 
 #pragma pack(push, 1)
 class SecureMessage
@@ -145,6 +176,7 @@ public:
         hash            = 0;
         nLockCount      = 0;
         nLockPeerId     = 0;
+        nLockUntil      = 0;
     };
     ~SecMsgBucket() {};
 
@@ -152,12 +184,167 @@ public:
 
     int64_t               timeChanged;
     uint32_t              hash;           // token set should get ordered the same on each node
-    uint32_t              nLockCount;     // set when smsgWant first sent, unset at end of smsgMsg, ticks down in ThreadSecureMsg()
+    uint32_t              nLockCount;     // set when smsgWant first sent, unset at end of smsgMsg or by the lock timer
     NodeId                nLockPeerId;    // id of peer that bucket is locked for
+    int64_t               nLockUntil;     // lock timers due before this are stale
     std::set<SecMsgToken> setTokens;
 
 };
 
+enum SecMsgTimerType
+{
+    SMSG_TIMER_BUCKET_LOCK = 1,     // nKey is the bucket time
+};
+
+class SecMsgTimer
+{
+public:
+    SecMsgTimer() {};
+    SecMsgTimer(int64_t nDueIn, int nTypeIn, int64_t nKeyIn)
+    {
+        nDue  = nDueIn;
+        nType = nTypeIn;
+        nKey  = nKeyIn;
+    };
+
+    int64_t nDue;
+    int     nType;
+    int64_t nKey;
+};
+
+// Hierarchical timing wheel, a slot on level n spans SMSG_WHEEL_SLOTS^n seconds.
+// Timers further out wait on the coarser levels and cascade down as they come
+// near, so Advance only touches the slots passed over and the timers due.
+// Cancelled timers are not removed, the owner ignores them when they fire.
+class SecMsgTimerWheel
+{
+public:
+    SecMsgTimerWheel(int64_t nStart);
+
+    void Add(int64_t nDue, int nType, int64_t nKey);
+    void Advance(int64_t now, std::vector<SecMsgTimer>& vDue);
+
+    size_t size() const {return nTimers;};
+
+private:
+    void Place(const SecMsgTimer& timer);
+    void Cascade(uint32_t nLevel);
+
+    int64_t nCurrent;       // next second to be processed
+    size_t nTimers;
+    std::vector<SecMsgTimer> vSlots[SMSG_WHEEL_LEVELS][SMSG_WHEEL_SLOTS];
+    std::vector<SecMsgTimer> vOverflow;
+};
+
+class SecMsgIbltCell
+{
+public:
+    SecMsgIbltCell()
+    {
+        count   = 0;
+        hashSum = 0;
+        memset(keySum, 0, 16);
+    };
+
+    bool IsEmpty() const;
+    bool IsPure() const;
+
+    int32_t  count;
+    uint8_t  keySum[16];     // xor of token timestamp and sample
+    uint32_t hashSum;        // xor of XXH32 of the keys
+};
+
+// Invertible bloom lookup table over the tokens of a bucket.
+// Peers subtract tables and decode only the tokens that differ.
+class SecMsgIblt
+{
+public:
+    SecMsgIblt(uint32_t nCells = SMSG_IBLT_MIN_CELLS);
+
+    static uint32_t CellsFor(uint32_t nDiff);
+    static uint32_t RetryCells(uint32_t nCells, uint32_t nTokens);
+
+    void Insert(const SecMsgToken& token);
+    void Subtract(const SecMsgIblt& other);
+    bool Decode(std::vector<SecMsgToken>& vOurs, std::vector<SecMsgToken>& vTheirs) const;
+
+    void Serialize(std::vector<uint8_t>& vchData) const;
+    bool Deserialize(const uint8_t* p, uint32_t nBytes, uint32_t nCellsIn);
+
+    uint32_t SerializedSize() const { return vCells.size() * SMSG_IBLT_CELL_LEN; };
+
+    std::vector<SecMsgIbltCell> vCells;
+
+private:
+    void Update(const uint8_t* key, int32_t nDelta);
+};
+
+#pragma pack(push, 1)
+class SecMsgIndexEntry
+{
+// -- Record in a segment index file, one per message in the segment log
+public:
+    int64_t  timestamp;
+    uint8_t  sample[8];
+    int64_t  offset;         // of the message header in the segment log
+    uint32_t nPayload;
+};
+#pragma pack(pop)
+
+class SecMsgSegment
+{
+public:
+    SecMsgSegment()
+    {
+        fpLog = NULL;
+        fpIdx = NULL;
+        nSize = 0;
+    };
+
+    FILE*    fpLog;
+    FILE*    fpIdx;
+    int64_t  nSize;          // bytes in the log
+};
+
+class SecMsgStoreLog
+{
+/*  Append-only message store.
+
+    Messages are appended to log segments, each holding SMSG_SEGMENT_LEN seconds worth of buckets.
+    Next to each <segment>.log is a <segment>.idx with a SecMsgIndexEntry per message, so the
+    bucket token sets can be rebuilt at startup without reading payloads.
+    Expired segments are dropped whole.
+
+    Guarded by cs_smsg.
+*/
+public:
+    SecMsgStoreLog() {};
+    ~SecMsgStoreLog() { Close(); };
+
+    static int64_t SegmentTime(int64_t bucket)
+    {
+        return bucket - (bucket % SMSG_SEGMENT_LEN);
+    };
+
+    int Load(std::map<int64_t, SecMsgBucket>& buckets, int64_t cutoffTime);
+    int Append(int64_t bucket, const uint8_t *pHeader, const uint8_t *pPayload, uint32_t nPayload, int64_t& ofs);
+    int Read(int64_t bucket, int64_t ofs, std::vector<uint8_t>& vchData);
+    int Expire(int64_t cutoffTime);
+    int Clear();
+    void Close();
+
+    int64_t GetTotalSize();
+
+private:
+    SecMsgSegment* OpenSegment(int64_t segment, bool fCreate);
+    int LoadSegment(int64_t segment, std::map<int64_t, SecMsgBucket>& buckets, int64_t cutoffTime, uint32_t& nMessages);
+    int ImportLegacyFile(const boost::filesystem::path& path, int64_t bucket, std::map<int64_t, SecMsgBucket>& buckets);
+
+    std::map<int64_t, SecMsgSegment> mapSegments;
+};
+
+extern SecMsgStoreLog smsgStoreLog;
+
 // -- get at the data
 class CBitcoinAddress_B : public CBitcoinAddress
 {
@@ -183,17 +370,20 @@ public:
 class SecMsgAddress
 {
 public:
-    SecMsgAddress() {};
+    SecMsgAddress() : fKeyId(false) {};
     SecMsgAddress(std::string sAddr, bool receiveOn, bool receiveAnon)
     {
         sAddress        = sAddr;
         fReceiveEnabled = receiveOn;
         fReceiveAnon    = receiveAnon;
+        fKeyId          = CBitcoinAddress(sAddr).GetKeyID(keyId);
     };
 
     std::string sAddress;
     bool        fReceiveEnabled;
     bool        fReceiveAnon;
+    CKeyID      keyId;          // memory only, decoded sAddress
+    bool        fKeyId;
 
     IMPLEMENT_SERIALIZE
     (
@@ -213,13 +403,39 @@ public:
         fNewAddressRecv = true;
         fNewAddressAnon = true;
         fScanIncoming   = true;
+        fTagRecipient   = true;
     }
 
     bool fNewAddressRecv;
     bool fNewAddressAnon;
     bool fScanIncoming;
+    bool fTagRecipient;
 };
 
+// Secure Message proof of work statistics, guarded by cs_smsgPow
+class SecMsgPowStats
+{
+public:
+    SecMsgPowStats()
+    {
+        nMessages   = 0;
+        nFailed     = 0;
+        nHashes     = 0;
+        nTimeTotal  = 0;
+        nTimeMax    = 0;
+        nTimeLast   = 0;
+    };
+
+    uint64_t nMessages;     // messages given a valid nonce
+    uint64_t nFailed;       // messages where the nonce space ran out
+    uint64_t nHashes;       // nonces tried
+    int64_t  nTimeTotal;    // ms spent searching
+    int64_t  nTimeMax;      // longest search, ms
+    int64_t  nTimeLast;     // time the last search finished
+};
+
+extern SecMsgPowStats smsgPowStats;
+
 // Secure Message Crypter
 class SecMsgCrypter
 {
@@ -258,6 +474,34 @@ public:
     bool SetKey(const uint8_t* chNewKey, uint8_t* chNewIV);
     bool Encrypt(uint8_t* chPlaintext,  uint32_t nPlain,  std::vector<uint8_t> &vchCiphertext);
     bool Decrypt(uint8_t* chCiphertext, uint32_t nCipher, std::vector<uint8_t>& vchPlaintext);
+
+    // -- reuse an initialised context, output vectors keep their capacity
+    bool Encrypt(EVP_CIPHER_CTX* pctx, uint8_t* chPlaintext,  uint32_t nPlain,  std::vector<uint8_t> &vchCiphertext);
+    bool Decrypt(EVP_CIPHER_CTX* pctx, uint8_t* chCiphertext, uint32_t nCipher, std::vector<uint8_t>& vchPlaintext);
+};
+
+// Secure Message per thread encryption context.
+// Buffers are sized for the largest message up front and keep their capacity,
+// so SecureMsgEncrypt and SecureMsgDecrypt don't allocate them per message.
+class SecMsgCryptoContext
+{
+public:
+    SecMsgCryptoContext();
+    ~SecMsgCryptoContext();
+
+    static SecMsgCryptoContext& Get();     // context of the calling thread
+
+    void Resize(std::vector<uint8_t>& vch, uint32_t nSize);
+    void Wipe(std::vector<uint8_t>& vch);   // clear vch and the plaintext left in its capacity
+
+    EVP_CIPHER_CTX*       cipher;
+    HMAC_CTX*             hmac;
+    std::vector<uint8_t>  vchLz4State;
+    std::vector<uint8_t>  vchCompressed;
+    std::vector<uint8_t>  vchPayload;       // plaintext payload
+    std::vector<uint8_t>  vchCiphertext;
+    std::vector<uint8_t>  vchSignature;
+    uint64_t              nGrowths;         // times a buffer had to grow past its reserve
 };
 
 // Secure Message storage
@@ -288,6 +532,9 @@ public:
     SecMsgDB()
     {
         activeBatch = NULL;
+        fCountChanges = false;
+        fIndexChanged = false;
+        memset(nCountDelta, 0, sizeof(nCountDelta));
     };
 
     ~SecMsgDB()
@@ -308,6 +555,10 @@ public:
     bool ReadPK(CKeyID& addr, CPubKey& pubkey);
     bool WritePK(CKeyID& addr, CPubKey& pubkey);
     bool ExistsPK(CKeyID& addr);
+    void WritePK(leveldb::WriteBatch* batch, CKeyID& addr, CPubKey& pubkey);
+
+    bool ReadScanTip(int& nHeight, uint256& hashBlock);
+    void WriteScanTip(leveldb::WriteBatch* batch, int nHeight, const uint256& hashBlock);
 
     bool NextSmesg(leveldb::Iterator* it, std::string& prefix, uint8_t* vchKey, SecMsgStored& smsgStored);
     bool NextSmesgKey(leveldb::Iterator* it, std::string& prefix, uint8_t* vchKey);
@@ -316,9 +567,94 @@ public:
     bool ExistsSmesg(uint8_t* chKey);
     bool EraseSmesg(uint8_t* chKey);
 
+    uint32_t CountSmesg(const std::string& prefix, bool fUnreadOnly);
+    bool BuildIndexes();
+
     leveldb::DB *pdb;       // points to the global instance
     leveldb::WriteBatch *activeBatch;
 
+private:
+    void IndexSmesg(leveldb::WriteBatch* batch, uint8_t* chKey, bool fUnread, bool fErase);
+    int IndexDelta(const std::string& strKey, bool fPresent);
+    void CountIndexChange(uint8_t* chKey, bool fUnread, bool fErase);
+    void ApplyCountChanges();
+
+    // changes to the index counts by writes not yet committed, see smsgIndexCount
+    bool fCountChanges;     // the counts were valid when the pending writes started
+    bool fIndexChanged;     // pending writes touch the indexes
+    int32_t nCountDelta[3];
+};
+
+// Walks the inbox ("im") or outbox ("sm") newest first through the time index,
+// only the records returned by Next are read and unserialised.
+// Sees committed data only, not the active batch of a SecMsgDB.
+class SecMsgCursor
+{
+public:
+    SecMsgCursor(SecMsgDB& db, const std::string& prefix, bool fUnreadOnly = false);
+    ~SecMsgCursor();
+
+    uint32_t Skip(uint32_t n);
+    bool NextKey(uint8_t* chKey);
+    bool Next(uint8_t* chKey, SecMsgStored& smsgStored);
+
+private:
+    SecMsgDB& db;
+    leveldb::Iterator* it;
+    std::string sIndex;     // prefix of the index walked, empty if prefix has no index
+    bool fStarted;
+};
+
+// Inbox writes for a burst of received messages, committed as one synced batch.
+// Notifications for the gui are held until the messages are in the db.
+class SecMsgInboxBatch
+{
+public:
+    SecMsgInboxBatch()
+    {
+        fOpen = false;
+        nPending = 0;
+    };
+
+    ~SecMsgInboxBatch()
+    {
+        Commit();
+    };
+
+    bool Add(uint8_t* chKey, SecMsgStored& smsgStored, bool fNotify);
+    bool Commit();
+
+    uint32_t nPending;
+
+private:
+    SecMsgDB db;
+    bool fOpen;
+    std::set<std::string> setKeys;
+    std::vector<SecMsgStored> vNotify;
+};
+
+// Bloom filter over the key ids in the pubkey db, harvesting only looks up
+// keys the filter may contain.  Key ids are hashes already, probes are taken
+// straight from their words.
+class SecMsgKeyFilter
+{
+public:
+    SecMsgKeyFilter()
+    {
+        nKeys = 0;
+    };
+
+    void Init(uint32_t nBits);
+    void Clear();
+    bool IsLoaded() const {return !vBits.empty();};
+
+    void Insert(const CKeyID& id);
+    bool MayContain(const CKeyID& id) const;
+
+    uint32_t nKeys;
+
+private:
+    std::vector<uint64_t> vBits;
 };
 
 int SecureMsgBuildBucketSet();
@@ -336,7 +672,8 @@ bool SecureMsgDisable();
 bool SecureMsgReceiveData(CNode* pfrom, std::string strCommand, CDataStream& vRecv);
 bool SecureMsgSendData(CNode* pto, bool fSendTrickle);
 
-bool SecureMsgScanBlock(CBlock& block);
+bool SecureMsgScanBlock(CBlock& block, CBlockIndex* pindex);
+bool SecureMsgDisconnectBlock(CBlockIndex* pindex);
 bool ScanChainForPublicKeys(CBlockIndex* pindexStart);
 bool SecureMsgScanBlockChain();
 bool SecureMsgScanBuckets();
@@ -344,7 +681,8 @@ bool SecureMsgScanBuckets();
 int SecureMsgWalletUnlocked();
 int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeType mode);
 
-int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool reportToGui);
+uint8_t SecureMsgRecipientTag(const CKeyID& ckidDest, const uint8_t *pCpkR);
+int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool reportToGui, SecMsgInboxBatch *pBatch = NULL);
 
 int SecureMsgGetStoredKey(CKeyID& ckid, CPubKey& cpkOut);
 int SecureMsgGetLocalKey(CKeyID& ckid, CPubKey& cpkOut);
@@ -364,8 +702,11 @@ int SecureMsgSend(std::string &addressFrom, std::string &addressTo, std::string
 
 int SecureMsgValidate(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload);
 int SecureMsgSetHash (uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload);
+int SecureMsgPowThreads();
+int SecureMsgCountQueued();
 
 int SecureMsgEncrypt(SecureMessage &smsg, const std::string &addressFrom, const std::string &addressTo, const std::string &message);
+int SecureMsgEncryptBatch(std::vector<SecureMessage*> &vpsmsg, const std::string &addressFrom, const std::vector<std::string> &vAddressTo, const std::string &message, std::vector<int> &vResult);
 
 int SecureMsgDecrypt(bool fTestOnly, std::string &address, uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, MessageData &msg);
 int SecureMsgDecrypt(bool fTestOnly, std::string &address, SecureMessage &smsg, MessageData &msg);
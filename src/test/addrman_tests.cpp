@@ -0,0 +1,162 @@
+#include <boost/test/unit_test.hpp>
+
+#include "addrman.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+#include <vector>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+static CAddress MakeAddress(unsigned int n)
+{
+    // spread over many /16 groups, starting at 5.0.0.0
+    struct in_addr ip;
+    ip.s_addr = htonl(0x05000000 + n * 7919);
+    CAddress addr(CService(CNetAddr(ip), 7333));
+    addr.nTime = GetAdjustedTime() - 60 * 60;
+    return addr;
+}
+
+BOOST_AUTO_TEST_CASE(addrman_select)
+{
+    CAddrMan addrman;
+
+    BOOST_CHECK(!addrman.Select().IsValid());
+    BOOST_CHECK(addrman.GetAddr().empty());
+
+    CNetAddr source(MakeAddress(1000000));
+    CAddress addr1 = MakeAddress(1);
+    BOOST_CHECK(addrman.Add(addr1, source));
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+
+    // a single "new" entry is the only possible choice
+    CAddress addrSelected = addrman.Select(100);
+    BOOST_CHECK(addrSelected == addr1);
+
+    // promote to "tried", Select must see it without waiting for the snapshot interval
+    addrman.Good(addr1);
+    addrSelected = addrman.Select(0);
+    BOOST_CHECK(addrSelected == addr1);
+}
+
+class CAddrManTest : public CAddrMan
+{
+public:
+    boost::shared_ptr<const CAddrManSnapshot> Snapshot() { return GetSnapshot(); }
+};
+
+BOOST_AUTO_TEST_CASE(addrman_snapshot_times)
+{
+    CAddrManTest addrman;
+    CNetAddr source(MakeAddress(1000000));
+    CAddress addr1 = MakeAddress(1);
+    BOOST_CHECK(addrman.Add(addr1, source));
+
+    int64_t nNow = GetAdjustedTime();
+    boost::shared_ptr<const CAddrManSnapshot> snapshot = addrman.Snapshot();
+    double fChance = snapshot->Get(0).GetChance(nNow);
+
+    // attempts are written into the snapshot in place, it is not rebuilt
+    addrman.Attempt(addr1);
+    BOOST_CHECK(addrman.Snapshot() == snapshot);
+    BOOST_CHECK(snapshot->Get(0).GetChance(nNow) < fChance);
+
+    // a promotion to "tried" rebuilds it
+    addrman.Good(addr1);
+    BOOST_CHECK(addrman.Snapshot() != snapshot);
+    snapshot = addrman.Snapshot();
+    BOOST_CHECK_EQUAL(snapshot->vvTried.size(), 1U);
+
+    addrman.Attempt(addr1);
+    BOOST_CHECK(addrman.Snapshot() == snapshot);
+}
+
+BOOST_AUTO_TEST_CASE(addrman_queueadd)
+{
+    CAddrMan addrman;
+    CNetAddr source(MakeAddress(1000000));
+
+    vector<CAddress> vAddr;
+    for (unsigned int i = 0; i < 100; i++)
+        vAddr.push_back(MakeAddress(i));
+
+    // below the batch size, nothing is applied yet
+    BOOST_CHECK(addrman.QueueAdd(vAddr, source));
+    BOOST_CHECK_EQUAL(addrman.size(), 0);
+
+    addrman.FlushPending();
+    BOOST_CHECK_EQUAL(addrman.size(), 100);
+
+    // getaddr returns at most ADDRMAN_GETADDR_MAX_PCT percent, all of them known
+    vector<CAddress> vGot = addrman.GetAddr();
+    BOOST_CHECK_EQUAL(vGot.size(), (size_t)(ADDRMAN_GETADDR_MAX_PCT * 100 / 100));
+    set<CService> setAddr(vAddr.begin(), vAddr.end());
+    BOOST_FOREACH(const CAddress& addr, vGot)
+        BOOST_CHECK(setAddr.count(addr));
+}
+
+static void SelectLoop(CAddrMan* paddrman, int* pnSelected, int* pnValid)
+{
+    while (true)
+    {
+        boost::this_thread::interruption_point();
+        if (paddrman->Select(50).IsValid())
+            (*pnValid)++;
+        (*pnSelected)++;
+    };
+}
+
+BOOST_AUTO_TEST_CASE(addrman_bench_concurrent)
+{
+    CAddrMan addrman;
+    CNetAddr source(MakeAddress(1000000));
+
+    // seed some entries so the readers have something to return
+    vector<CAddress> vAddr;
+    for (unsigned int i = 0; i < 1000; i++)
+        vAddr.push_back(MakeAddress(i));
+    addrman.Add(vAddr, source);
+
+    static const int nThreads = 4;
+    int nSelected[nThreads] = {0};
+    int nValid[nThreads] = {0};
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&SelectLoop, &addrman, &nSelected[i], &nValid[i]));
+
+    // 100k inserts from many sources, in batches the size of an addr message
+    int64_t nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < 100000; i += 1000)
+    {
+        vAddr.clear();
+        for (unsigned int j = i; j < i + 1000; j++)
+            vAddr.push_back(MakeAddress(j));
+        addrman.QueueAdd(vAddr, CNetAddr(MakeAddress(2000000 + i)));
+    };
+    addrman.FlushPending();
+    int64_t nInsert = GetTimeMicros() - nStart;
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+
+    int nTotalSelected = 0, nTotalValid = 0;
+    for (int i = 0; i < nThreads; i++)
+    {
+        nTotalSelected += nSelected[i];
+        nTotalValid += nValid[i];
+    };
+
+    BOOST_TEST_MESSAGE("addrman: 100000 inserts in " << nInsert / 1000 << "ms, "
+        << nTotalSelected << " concurrent selects by " << nThreads << " threads, "
+        << addrman.size() << " addresses kept");
+
+    BOOST_CHECK(addrman.size() > 1000);
+    BOOST_CHECK_EQUAL(nTotalValid, nTotalSelected);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
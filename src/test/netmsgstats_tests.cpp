@@ -0,0 +1,73 @@
+#include <boost/test/unit_test.hpp>
+
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(netmsgstats_tests)
+
+BOOST_AUTO_TEST_CASE(netmsgstats_counts)
+{
+    netmsgstats_t mapStats;
+    MessageStatsEntry(mapStats, "inv").Add(100, 5);
+    MessageStatsEntry(mapStats, "inv").Add(300, 25);
+    MessageStatsEntry(mapStats, "block").Add(50000, 2000);
+
+    BOOST_CHECK_EQUAL(mapStats.size(), 2U);
+
+    const CNetMsgStats& inv = mapStats["inv"];
+    BOOST_CHECK_EQUAL(inv.nCount, 2U);
+    BOOST_CHECK_EQUAL(inv.nBytes, 400U);
+    BOOST_CHECK_EQUAL(inv.nTimeTotal, 30);
+    BOOST_CHECK_EQUAL(inv.nTimeMax, 25);
+    BOOST_CHECK_EQUAL(inv.vTimeBuckets[0], 1U);
+    BOOST_CHECK_EQUAL(inv.vTimeBuckets[1], 1U);
+
+    const CNetMsgStats& block = mapStats["block"];
+    BOOST_CHECK_EQUAL(block.nCount, 1U);
+    BOOST_CHECK_EQUAL(block.nBytes, 50000U);
+    BOOST_CHECK_EQUAL(block.nTimeMax, 2000);
+    BOOST_CHECK_EQUAL(block.vTimeBuckets[3], 1U);
+}
+
+BOOST_AUTO_TEST_CASE(netmsgstats_buckets)
+{
+    // each decade bucket holds [10^i, 10^(i+1)) microseconds, the first starts at 0 and the last has no end
+    int64_t vTimes[] = {0, 9, 10, 99, 100, 999, 1000, 9999, 10000, 99999,
+                        100000, 999999, 1000000, 9999999, 10000000, 3600000000LL};
+    int vBuckets[] = {0, 0, 1, 1, 2, 2, 3, 3, 4, 4,
+                      5, 5, 6, 6, 7, 7};
+
+    for (unsigned int i = 0; i < sizeof(vTimes) / sizeof(vTimes[0]); i++)
+    {
+        CNetMsgStats stats;
+        stats.Add(1, vTimes[i]);
+        for (int j = 0; j < CNetMsgStats::NUM_TIME_BUCKETS; j++)
+            BOOST_CHECK_MESSAGE(stats.vTimeBuckets[j] == (j == vBuckets[i] ? 1U : 0U),
+                strprintf("time %d bucket %d", vTimes[i], j));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(netmsgstats_command_limit)
+{
+    netmsgstats_t mapStats;
+    for (unsigned int i = 0; i < MAX_NET_MSG_STATS_COMMANDS; i++)
+        MessageStatsEntry(mapStats, strprintf("cmd%u", i)).Add(10, 1);
+    BOOST_CHECK_EQUAL(mapStats.size(), (size_t)MAX_NET_MSG_STATS_COMMANDS);
+
+    // new commands past the limit share one entry, known ones keep their own
+    MessageStatsEntry(mapStats, "new1").Add(20, 1);
+    MessageStatsEntry(mapStats, "new2").Add(30, 1);
+    MessageStatsEntry(mapStats, "cmd0").Add(40, 1);
+
+    BOOST_CHECK_EQUAL(mapStats.size(), (size_t)MAX_NET_MSG_STATS_COMMANDS + 1);
+    BOOST_CHECK(!mapStats.count("new1"));
+    BOOST_CHECK(!mapStats.count("new2"));
+    BOOST_CHECK_EQUAL(mapStats[NET_MSG_STATS_OTHER].nCount, 2U);
+    BOOST_CHECK_EQUAL(mapStats[NET_MSG_STATS_OTHER].nBytes, 50U);
+    BOOST_CHECK_EQUAL(mapStats["cmd0"].nCount, 2U);
+    BOOST_CHECK_EQUAL(mapStats["cmd0"].nBytes, 50U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
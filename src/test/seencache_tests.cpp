@@ -0,0 +1,78 @@
+#include <boost/test/unit_test.hpp>
+
+#include "seencache.h"
+#include "uint256.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(seencache_tests)
+
+BOOST_AUTO_TEST_CASE(seencache_expiry)
+{
+    seencache<uint256> cache(100);
+
+    uint256 a = 1, b = 2;
+    cache.insert(a, 1000, 0);
+    cache.insert(b, 2000, 0);
+    BOOST_CHECK_EQUAL(cache.size(), 2U);
+
+    BOOST_CHECK(cache.contains(a, 999));
+    BOOST_CHECK(!cache.contains(a, 1000));
+    BOOST_CHECK_EQUAL(cache.size(), 1U);
+
+    // reinsert moves the expiry
+    cache.insert(b, 3000, 1000);
+    BOOST_CHECK(cache.contains(b, 2500));
+
+    cache.insert(a, 4000, 1000);
+    cache.expire(3000);
+    BOOST_CHECK_EQUAL(cache.size(), 1U);
+    BOOST_CHECK(cache.contains(a, 3000));
+    BOOST_CHECK_EQUAL(cache.stats().nExpired, 2U);
+
+    cache.erase(a);
+    BOOST_CHECK(cache.empty());
+}
+
+BOOST_AUTO_TEST_CASE(seencache_bounded)
+{
+    const unsigned int nMax = 1000;
+    seencache<uint256> cache(nMax);
+    size_t nBytes = cache.stats().nBytes;
+
+    // a key looked up between inserts survives the clock hand
+    uint256 hot = 12345678;
+    cache.insert(hot, 1 << 30, 0);
+
+    for (unsigned int i = 0; i < 20 * nMax; i++)
+    {
+        cache.insert(uint256(i + 1), 1 << 30, 0);
+        BOOST_CHECK(cache.contains(hot, 0));
+        BOOST_CHECK(cache.size() <= nMax);
+    }
+
+    BOOST_CHECK_EQUAL(cache.size(), nMax);
+    BOOST_CHECK_EQUAL(cache.stats().nBytes, nBytes);
+    BOOST_CHECK(cache.stats().nEvicted >= 19 * nMax);
+
+    // everything still in the table is found again after all the shifting
+    std::map<uint256, int64_t> mapLive;
+    cache.get(mapLive);
+    BOOST_CHECK_EQUAL(mapLive.size(), nMax);
+    for (std::map<uint256, int64_t>::iterator it = mapLive.begin(); it != mapLive.end(); ++it)
+        BOOST_CHECK(cache.contains(it->first, 0));
+
+    // an expired key is taken before live keys that were looked up
+    seencache<uint256> cache2(10);
+    for (unsigned int i = 0; i < 10; i++)
+        cache2.insert(uint256(i + 1), i == 5 ? 50 : 1000, 0);
+    for (unsigned int i = 0; i < 10; i++)
+        if (i != 5)
+            BOOST_CHECK(cache2.contains(uint256(i + 1), 100));
+    cache2.insert(uint256(100), 1000, 100);
+    BOOST_CHECK(!cache2.contains(uint256(6), 0));
+    BOOST_CHECK_EQUAL(cache2.stats().nEvicted, 0U);
+    BOOST_CHECK_EQUAL(cache2.stats().nExpired, 1U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
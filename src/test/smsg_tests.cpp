@@ -5,6 +5,10 @@
 #include "smessage.h"
 #include "init.h" // for pwalletMain
 
+#include <openssl/hmac.h>
+
+#include <boost/lexical_cast.hpp>
+
 // test_procurrency --log_level=all  --run_test=smsg_tests
 
 BOOST_AUTO_TEST_SUITE(smsg_tests)
@@ -79,4 +83,560 @@ BOOST_AUTO_TEST_CASE(smsg_test)
     fSecMsgEnabled = false;
 }
 
+static void StoreTestMessage(int64_t timestamp, uint32_t nPayload, std::vector<uint8_t>& vchMessage)
+{
+    vchMessage.resize(SMSG_HDR_LEN + nPayload);
+    GetRandBytes(&vchMessage[0], vchMessage.size());
+    SecureMessage *psmsg = (SecureMessage*) &vchMessage[0];
+    psmsg->timestamp = timestamp;
+    psmsg->nPayload = nPayload;
+}
+
+BOOST_AUTO_TEST_CASE(smsg_store_log)
+{
+    SecMsgStoreLog store;
+    std::map<int64_t, SecMsgBucket> buckets;
+    BOOST_CHECK(store.Clear() == 0);
+
+    int64_t now = GetTime();
+    int64_t cutoffTime = now - SMSG_RETENTION;
+
+    // -- spread over several buckets and segments
+    std::vector<std::vector<uint8_t> > vMessages(40);
+    std::vector<int64_t> vOffsets(vMessages.size());
+    for (size_t i = 0; i < vMessages.size(); ++i)
+    {
+        int64_t timestamp = now - i * (SMSG_RETENTION / vMessages.size());
+        StoreTestMessage(timestamp, 100 + i, vMessages[i]);
+        int64_t bucket = timestamp - (timestamp % SMSG_BUCKET_LEN);
+        BOOST_CHECK(store.Append(bucket, &vMessages[i][0], &vMessages[i][SMSG_HDR_LEN], 100 + i, vOffsets[i]) == 0);
+    };
+
+    // -- reload from the index files
+    BOOST_CHECK(store.Load(buckets, cutoffTime) == 0);
+    size_t nLoaded = 0;
+    for (std::map<int64_t, SecMsgBucket>::iterator it = buckets.begin(); it != buckets.end(); ++it)
+        nLoaded += it->second.setTokens.size();
+    BOOST_CHECK_EQUAL(nLoaded, vMessages.size());
+
+    std::vector<uint8_t> vchData;
+    for (size_t i = 0; i < vMessages.size(); ++i)
+    {
+        SecureMessage *psmsg = (SecureMessage*) &vMessages[i][0];
+        int64_t bucket = psmsg->timestamp - (psmsg->timestamp % SMSG_BUCKET_LEN);
+        BOOST_CHECK(store.Read(bucket, vOffsets[i], vchData) == 0);
+        BOOST_CHECK(vchData == vMessages[i]);
+    };
+
+    // -- a torn write and a lost index are repaired on load
+    int64_t segment = SecMsgStoreLog::SegmentTime(now - (now % SMSG_BUCKET_LEN));
+    std::string sSegment = boost::lexical_cast<std::string>(segment);
+    store.Close();
+    FILE *fp = fopen((GetDataDir() / "smsgStore" / (sSegment + ".log")).string().c_str(), "ab");
+    BOOST_REQUIRE(fp);
+    fwrite(&vMessages[0][0], 1, SMSG_HDR_LEN / 2, fp);
+    fclose(fp);
+    boost::filesystem::remove(GetDataDir() / "smsgStore" / (sSegment + ".idx"));
+
+    buckets.clear();
+    BOOST_CHECK(store.Load(buckets, cutoffTime) == 0);
+    nLoaded = 0;
+    for (std::map<int64_t, SecMsgBucket>::iterator it = buckets.begin(); it != buckets.end(); ++it)
+        nLoaded += it->second.setTokens.size();
+    BOOST_CHECK_EQUAL(nLoaded, vMessages.size());
+
+    // -- appends continue on a record boundary
+    std::vector<uint8_t> vchNew;
+    int64_t ofsNew;
+    StoreTestMessage(now, 64, vchNew);
+    BOOST_CHECK(store.Append(now - (now % SMSG_BUCKET_LEN), &vchNew[0], &vchNew[SMSG_HDR_LEN], 64, ofsNew) == 0);
+    BOOST_CHECK(store.Read(now - (now % SMSG_BUCKET_LEN), ofsNew, vchData) == 0);
+    BOOST_CHECK(vchData == vchNew);
+
+    // -- expiring everything drops all segments
+    BOOST_CHECK(store.Expire(now + SMSG_RETENTION + SMSG_SEGMENT_LEN) > 0);
+    BOOST_CHECK_EQUAL(store.GetTotalSize(), 0);
+    store.Clear();
+}
+
+BOOST_AUTO_TEST_CASE(smsg_recipient_tag)
+{
+    CKey keyDest;
+    keyDest.MakeNewKey(true);
+    CKeyID ckidDest = keyDest.GetPubKey().GetID();
+
+    // -- same R gives the same tag, always inside the tag range
+    std::set<uint8_t> setTags;
+    for (int i = 0; i < 64; i++)
+    {
+        CKey keyR;
+        keyR.MakeNewKey(true);
+        CPubKey cpkR = keyR.GetPubKey();
+        uint8_t nTag = SecureMsgRecipientTag(ckidDest, cpkR.begin());
+        BOOST_CHECK(nTag >= SMSG_TAG_MIN);
+        BOOST_CHECK(nTag == SecureMsgRecipientTag(ckidDest, cpkR.begin()));
+        setTags.insert(nTag);
+    };
+
+    // -- tags to one address change with R
+    BOOST_CHECK(setTags.size() > 1);
+}
+
+BOOST_AUTO_TEST_CASE(smsg_pow_threads)
+{
+    fSecMsgEnabled = true;
+
+    std::vector<uint8_t> vchMessage(SMSG_HDR_LEN + 300);
+    GetRandBytes(&vchMessage[0], vchMessage.size());
+    uint8_t *pHeader = &vchMessage[0];
+    uint8_t *pPayload = &vchMessage[SMSG_HDR_LEN];
+    SecureMessage *psmsg = (SecureMessage*) pHeader;
+    psmsg->version[0] = 1;
+    uint32_t nPayload = vchMessage.size() - SMSG_HDR_LEN;
+
+    int rv;
+    for (int nThreads = 1; nThreads <= 4; nThreads *= 2)
+    {
+        mapArgs["-smsgpowthreads"] = boost::lexical_cast<std::string>(nThreads);
+        memset(psmsg->nonce, 0, 4);
+
+        int64_t nStart = GetTimeMillis();
+        BOOST_CHECK_MESSAGE(0 == (rv = SecureMsgSetHash(pHeader, pPayload, nPayload)), "SecureMsgSetHash " << rv);
+        BOOST_TEST_MESSAGE("smsg pow: " << nThreads << " threads, " << GetTimeMillis() - nStart << " ms");
+
+        BOOST_CHECK_MESSAGE(0 == (rv = SecureMsgValidate(pHeader, pPayload, nPayload)), "SecureMsgValidate " << rv);
+
+        // -- must match the OpenSSL HMAC used by older nodes
+        uint8_t civ[32];
+        for (int i = 0; i < 32; i+=4)
+            memcpy(civ+i, psmsg->nonce, 4);
+        std::vector<uint8_t> vchData(pHeader+4, pHeader+SMSG_HDR_LEN);
+        vchData.insert(vchData.end(), pPayload, pPayload+nPayload);
+        vchData.insert(vchData.end(), pPayload, pPayload+nPayload);
+        uint8_t sha256Hash[32];
+        uint32_t nBytes;
+        HMAC(EVP_sha256(), civ, 32, &vchData[0], vchData.size(), sha256Hash, &nBytes);
+        BOOST_CHECK(nBytes == 32 && memcmp(psmsg->hash, sha256Hash, 4) == 0);
+    };
+
+    mapArgs.erase("-smsgpowthreads");
+    fSecMsgEnabled = false;
+}
+
+static SecMsgToken RandomToken(int64_t timestamp)
+{
+    SecMsgToken token;
+    token.timestamp = timestamp;
+    GetRandBytes(token.sample, 8);
+    token.offset = 0;
+    return token;
+}
+
+BOOST_AUTO_TEST_CASE(smsg_iblt)
+{
+    int64_t now = GetTime();
+    std::set<SecMsgToken> setCommon, setOurs, setTheirs;
+    for (int i = 0; i < 2000; i++)
+        setCommon.insert(RandomToken(now + i));
+    for (int i = 0; i < 10; i++)
+        setOurs.insert(RandomToken(now + i));
+    for (int i = 0; i < 7; i++)
+        setTheirs.insert(RandomToken(now + i));
+
+    uint32_t nCells = SecMsgIblt::CellsFor(setOurs.size() + setTheirs.size());
+    SecMsgIblt ibltOurs(nCells), ibltTheirs(nCells);
+    std::set<SecMsgToken>::iterator it;
+    for (it = setCommon.begin(); it != setCommon.end(); ++it)
+    {
+        ibltOurs.Insert(*it);
+        ibltTheirs.Insert(*it);
+    };
+    for (it = setOurs.begin(); it != setOurs.end(); ++it)
+        ibltOurs.Insert(*it);
+    for (it = setTheirs.begin(); it != setTheirs.end(); ++it)
+        ibltTheirs.Insert(*it);
+
+    // -- table survives the wire format
+    std::vector<uint8_t> vchData;
+    ibltTheirs.Serialize(vchData);
+    BOOST_CHECK(vchData.size() == nCells * SMSG_IBLT_CELL_LEN);
+    SecMsgIblt ibltPeer(0);
+    BOOST_CHECK(ibltPeer.Deserialize(&vchData[0], vchData.size(), nCells));
+    BOOST_CHECK(!ibltPeer.Deserialize(&vchData[0], vchData.size() - 1, nCells));
+    BOOST_CHECK(!ibltPeer.Deserialize(&vchData[0], vchData.size(), nCells - 1));
+
+    ibltOurs.Subtract(ibltPeer);
+    std::vector<SecMsgToken> vOurs, vTheirs;
+    BOOST_CHECK(ibltOurs.Decode(vOurs, vTheirs));
+    BOOST_CHECK(std::set<SecMsgToken>(vOurs.begin(), vOurs.end()).size() == setOurs.size());
+    BOOST_CHECK(std::set<SecMsgToken>(vTheirs.begin(), vTheirs.end()).size() == setTheirs.size());
+    for (uint32_t i = 0; i < vOurs.size(); i++)
+        BOOST_CHECK(setOurs.count(vOurs[i]));
+    for (uint32_t i = 0; i < vTheirs.size(); i++)
+        BOOST_CHECK(setTheirs.count(vTheirs[i]));
+
+    // -- too many differences for the table must fail, not return garbage
+    SecMsgIblt ibltSmall(SMSG_IBLT_MIN_CELLS), ibltEmpty(SMSG_IBLT_MIN_CELLS);
+    for (it = setCommon.begin(); it != setCommon.end(); ++it)
+        ibltSmall.Insert(*it);
+    ibltSmall.Subtract(ibltEmpty);
+    BOOST_CHECK(!ibltSmall.Decode(vOurs, vTheirs));
+}
+
+BOOST_AUTO_TEST_CASE(smsg_iblt_bench)
+{
+    // -- bytes moved to sync one bucket where the peer has nNew messages this node lacks
+    //    and this node has nOld the peer lacks, as sized by the smsgInv handler.
+    int64_t now = GetTime();
+    int nSizes[] = {100, 1000, 5000};
+    int nDiffs[][2] = {{1, 0}, {5, 2}, {20, 10}, {50, 50}};
+
+    for (int s = 0; s < 3; s++)
+    {
+        for (int d = 0; d < 4; d++)
+        {
+            int nNew = nDiffs[d][0], nOld = nDiffs[d][1];
+            int nRuns = 20, nFailed = 0, nRetries = 0;
+            uint64_t nBytesFull = 0, nBytesRecon = 0;
+            int64_t nStart = GetTimeMicros();
+
+            for (int r = 0; r < nRuns; r++)
+            {
+                std::set<SecMsgToken> setOurs, setTheirs;
+                for (int i = 0; i < nSizes[s]; i++)
+                {
+                    SecMsgToken token = RandomToken(now + i);
+                    setOurs.insert(token);
+                    setTheirs.insert(token);
+                };
+                for (int i = 0; i < nNew; i++)
+                    setTheirs.insert(RandomToken(now + i));
+                for (int i = 0; i < nOld; i++)
+                    setOurs.insert(RandomToken(now + i));
+
+                // smsgShow, smsgHave with all peer tokens, smsgWant
+                nBytesFull += (4 + 8) + (8 + 16 * setTheirs.size()) + (8 + 16 * nNew);
+
+                uint32_t nDiff = setTheirs.size() > setOurs.size() ? setTheirs.size() - setOurs.size() : 0;
+                SecMsgIblt ibltOurs(SecMsgIblt::CellsFor(nDiff));
+                SecMsgIblt ibltTheirs(ibltOurs.vCells.size());
+                std::set<SecMsgToken>::iterator it;
+                for (it = setOurs.begin(); it != setOurs.end(); ++it)
+                    ibltOurs.Insert(*it);
+                for (it = setTheirs.begin(); it != setTheirs.end(); ++it)
+                    ibltTheirs.Insert(*it);
+
+                std::vector<SecMsgToken> vOurs, vTheirs;
+                bool fDecoded;
+                while (true)
+                {
+                    SecMsgIblt iblt(ibltTheirs);
+                    iblt.Subtract(ibltOurs);
+                    nBytesRecon += 12 + ibltOurs.SerializedSize();
+                    if ((fDecoded = iblt.Decode(vOurs, vTheirs)))
+                        break;
+
+                    // smsgIbltRetry and a larger smsgIblt
+                    uint32_t nCells = SecMsgIblt::RetryCells(ibltOurs.vCells.size(), setTheirs.size());
+                    if (nCells == 0)
+                        break;
+                    nBytesRecon += 12;
+                    nRetries++;
+                    ibltOurs = SecMsgIblt(nCells);
+                    ibltTheirs = SecMsgIblt(nCells);
+                    for (it = setOurs.begin(); it != setOurs.end(); ++it)
+                        ibltOurs.Insert(*it);
+                    for (it = setTheirs.begin(); it != setTheirs.end(); ++it)
+                        ibltTheirs.Insert(*it);
+                };
+
+                if (fDecoded)
+                {
+                    BOOST_CHECK(vOurs.size() == (size_t)nNew && vTheirs.size() == (size_t)nOld);
+                    // smsgHave with the missing tokens, both smsgWant
+                    nBytesRecon += (8 + 16 * nNew) + (8 + 16 * nNew) + (nOld ? 8 + 16 * nOld : 0);
+                } else
+                {
+                    // falls back to smsgHave with all tokens
+                    nFailed++;
+                    nBytesRecon += (8 + 16 * setTheirs.size()) + (8 + 16 * nNew);
+                };
+            };
+
+            BOOST_TEST_MESSAGE("smsg recon: bucket " << nSizes[s] << " +" << nNew << " -" << nOld
+                << ", full " << nBytesFull / nRuns << " bytes, iblt " << nBytesRecon / nRuns << " bytes, "
+                << nRetries << " retries, " << nFailed << "/" << nRuns << " full lists, "
+                << (GetTimeMicros() - nStart) / nRuns << " us");
+
+            if (nSizes[s] >= 1000)
+                BOOST_CHECK(nBytesRecon < nBytesFull);
+        };
+    };
+}
+
+BOOST_AUTO_TEST_CASE(smsg_db_cursor)
+{
+    LOCK(cs_smsgDB);
+    SecMsgDB db;
+    BOOST_REQUIRE(db.Open("cw"));
+
+    // -- 200 inbox messages written out of time order, every third one unread
+    int64_t now = GetTime();
+    uint8_t chKey[18];
+    SecMsgStored smsgStored;
+    for (int i = 0; i < 200; ++i)
+    {
+        int64_t timestamp = now - ((i * 37) % 200) * 60;
+        memcpy(&chKey[0], "im", 2);
+        memcpy(&chKey[2], &timestamp, 8);
+        GetRandBytes(&chKey[10], 8);
+        smsgStored.timeReceived = timestamp;
+        smsgStored.status = (timestamp / 60) % 3 == 0 ? SMSG_MASK_UNREAD : 0;
+        BOOST_CHECK(db.WriteSmesg(chKey, smsgStored));
+    };
+
+    BOOST_CHECK_EQUAL(db.CountSmesg("im", false), 200);
+    uint32_t nUnread = db.CountSmesg("im", true);
+    BOOST_CHECK(nUnread > 60 && nUnread < 70);
+
+    // -- a page of the newest messages, in order
+    SecMsgCursor cursor(db, "im");
+    BOOST_CHECK_EQUAL(cursor.Skip(10), 10);
+    int64_t timePrev = now - 10 * 60 + 1;
+    for (int i = 0; i < 50; ++i)
+    {
+        BOOST_REQUIRE(cursor.Next(chKey, smsgStored));
+        BOOST_CHECK(smsgStored.timeReceived < timePrev);
+        timePrev = smsgStored.timeReceived;
+    };
+
+    // -- marking read and erasing keep the indexes in step
+    SecMsgCursor cursorUnread(db, "im", true);
+    BOOST_REQUIRE(cursorUnread.Next(chKey, smsgStored));
+    smsgStored.status &= ~SMSG_MASK_UNREAD;
+    BOOST_CHECK(db.WriteSmesg(chKey, smsgStored));
+    BOOST_CHECK_EQUAL(db.CountSmesg("im", true), nUnread - 1);
+
+    BOOST_CHECK(db.EraseSmesg(chKey));
+    BOOST_CHECK_EQUAL(db.CountSmesg("im", false), 199);
+
+    // -- batched inbox writes land together and skip duplicates
+    {
+        SecMsgInboxBatch batch;
+        memcpy(&chKey[0], "im", 2);
+        memcpy(&chKey[2], &now, 8);
+        GetRandBytes(&chKey[10], 8);
+        smsgStored.status = SMSG_MASK_UNREAD;
+        BOOST_CHECK(batch.Add(chKey, smsgStored, false));
+        BOOST_CHECK(!batch.Add(chKey, smsgStored, false));
+        BOOST_CHECK_EQUAL(db.CountSmesg("im", false), 199);
+        BOOST_CHECK(batch.Commit());
+    }
+    BOOST_CHECK_EQUAL(db.CountSmesg("im", false), 200);
+    BOOST_CHECK_EQUAL(db.CountSmesg("im", true), nUnread);
+
+    // -- rebuilding from the records gives the same index
+    BOOST_CHECK(db.BuildIndexes());
+    BOOST_CHECK_EQUAL(db.CountSmesg("im", false), 200);
+    BOOST_CHECK_EQUAL(db.CountSmesg("im", true), nUnread);
+
+    // -- counting while another batch is pending counts again once it lands
+    BOOST_CHECK(db.BuildIndexes());
+    {
+        SecMsgDB db2;
+        BOOST_REQUIRE(db2.Open("cw"));
+        db2.TxnBegin();
+        memcpy(&chKey[0], "im", 2);
+        memcpy(&chKey[2], &now, 8);
+        GetRandBytes(&chKey[10], 8);
+        BOOST_CHECK(db2.WriteSmesg(chKey, smsgStored));
+        BOOST_CHECK_EQUAL(db.CountSmesg("im", false), 200);
+        BOOST_CHECK(db2.TxnCommit());
+    }
+    BOOST_CHECK_EQUAL(db.CountSmesg("im", false), 201);
+
+    // -- clean up for later tests
+    db.TxnBegin();
+    SecMsgCursor cursorAll(db, "im");
+    while (cursorAll.NextKey(chKey))
+        db.EraseSmesg(chKey);
+    BOOST_CHECK(db.TxnCommit());
+    BOOST_CHECK_EQUAL(db.CountSmesg("im", false), 0);
+}
+
+BOOST_AUTO_TEST_CASE(smsg_timer_wheel)
+{
+    int64_t nStart = 1400000000;
+    SecMsgTimerWheel wheel(nStart);
+
+    // -- timers on every level and the overflow list, some already due
+    const int64_t nOffsets[] = {-5, 0, 1, 63, 64, 65, 90, 4095, 4096, 4097, 60 * 60 * 48, 262143, 262144, 1 << 24, (1 << 24) + 7, 1 << 25};
+    const size_t nTimers = sizeof(nOffsets) / sizeof(nOffsets[0]);
+    for (size_t i = 0; i < nTimers; ++i)
+        wheel.Add(nStart + nOffsets[i], SMSG_TIMER_BUCKET_LOCK, i);
+    BOOST_CHECK_EQUAL(wheel.size(), nTimers);
+
+    // -- each fires on the second it is due, not before
+    std::vector<SecMsgTimer> vDue;
+    std::vector<int64_t> vFired(nTimers, 0);
+    bool fEarly = false;
+    for (int64_t now = nStart - 1; now <= nStart + (1 << 25); now += 1 + (now % 3))
+    {
+        vDue.clear();
+        wheel.Advance(now, vDue);
+        for (size_t i = 0; i < vDue.size(); ++i)
+        {
+            fEarly |= vDue[i].nDue > now;
+            vFired[vDue[i].nKey] = now;
+        };
+    };
+    BOOST_CHECK(!fEarly);
+    BOOST_CHECK_EQUAL(wheel.size(), 0);
+    for (size_t i = 0; i < nTimers; ++i)
+    {
+        BOOST_CHECK(vFired[i] >= nStart + nOffsets[i]);
+        BOOST_CHECK(vFired[i] <= std::max(nStart, nStart + nOffsets[i]) + 3);
+    };
+}
+
+BOOST_AUTO_TEST_CASE(smsg_key_filter)
+{
+    SecMsgKeyFilter filter;
+    CKeyID keyId;
+
+    // -- an unloaded filter can't rule anything out
+    GetRandBytes(keyId.begin(), sizeof(CKeyID));
+    BOOST_CHECK(filter.MayContain(keyId));
+
+    filter.Init(1 << 20);
+    std::vector<CKeyID> vIds(50000);
+    for (size_t i = 0; i < vIds.size(); ++i)
+    {
+        GetRandBytes(vIds[i].begin(), sizeof(CKeyID));
+        filter.Insert(vIds[i]);
+    };
+
+    // -- no false negatives, false positives near the expected rate
+    bool fAll = true;
+    for (size_t i = 0; i < vIds.size(); ++i)
+        fAll &= filter.MayContain(vIds[i]);
+    BOOST_CHECK(fAll);
+
+    uint32_t nFalse = 0;
+    for (int i = 0; i < 50000; ++i)
+    {
+        GetRandBytes(keyId.begin(), sizeof(CKeyID));
+        if (filter.MayContain(keyId))
+            nFalse++;
+    };
+    BOOST_TEST_MESSAGE("smsg key filter: " << nFalse << " false positives in 50000");
+    BOOST_CHECK(nFalse < 500);
+
+    // -- the scan tip is written with the key batch
+    LOCK(cs_smsgDB);
+    SecMsgDB db;
+    BOOST_REQUIRE(db.Open("cw"));
+
+    uint256 hashBlock = GetRandHash();
+    CPubKey pubKey;
+    leveldb::WriteBatch batch;
+    db.WriteScanTip(&batch, 1234, hashBlock);
+    db.WritePK(&batch, vIds[0], pubKey);
+    BOOST_CHECK(!db.ExistsPK(vIds[0]));
+    BOOST_CHECK(db.pdb->Write(leveldb::WriteOptions(), &batch).ok());
+
+    int nHeight;
+    uint256 hashRead;
+    BOOST_CHECK(db.ExistsPK(vIds[0]));
+    BOOST_CHECK(db.ReadScanTip(nHeight, hashRead));
+    BOOST_CHECK_EQUAL(nHeight, 1234);
+    BOOST_CHECK(hashRead == hashBlock);
+}
+
+BOOST_AUTO_TEST_CASE(smsg_encrypt_bench)
+{
+    fSecMsgEnabled = true;
+    std::string sMessage;
+    for (int i = 0; i < 40; i++)
+        sMessage += "Secure messages are compressed when over 128 bytes. ";
+
+    static const int nRecipients = 10;
+    CWallet keystore;
+    CKey keyFrom;
+    keyFrom.MakeNewKey(true);
+    std::vector<std::string> vAddressTo;
+    {
+        LOCK(keystore.cs_wallet);
+        keystore.AddKey(keyFrom);
+        for (int i = 0; i < nRecipients; i++)
+        {
+            CKey keyTo;
+            keyTo.MakeNewKey(true);
+            keystore.AddKey(keyTo);
+            vAddressTo.push_back(CBitcoinAddress(keyTo.GetPubKey().GetID()).ToString());
+        };
+    }
+    std::string sAddrFrom = CBitcoinAddress(keyFrom.GetPubKey().GetID()).ToString();
+
+    CWallet *pwalletMainOld = pwalletMain;
+    UnregisterWallet(pwalletMain);
+    pwalletMain = &keystore;
+    RegisterWallet(&keystore);
+
+    int rv;
+    MessageData msg;
+    {
+        // -- warm up the thread's context, after this no buffer should need to grow
+        SecureMessage smsg;
+        BOOST_CHECK_MESSAGE(0 == (rv = SecureMsgEncrypt(smsg, sAddrFrom, vAddressTo[0], sMessage)), "SecureMsgEncrypt " << rv);
+        BOOST_CHECK_MESSAGE(0 == (rv = SecureMsgDecrypt(false, vAddressTo[0], smsg, msg)), "SecureMsgDecrypt " << rv);
+    }
+    uint64_t nGrowths = SecMsgCryptoContext::Get().nGrowths;
+
+    static const int nRounds = 5;
+    int64_t nStart = GetTimeMicros();
+    for (int r = 0; r < nRounds; r++)
+    {
+        for (int i = 0; i < nRecipients; i++)
+        {
+            SecureMessage smsg;
+            BOOST_CHECK(0 == SecureMsgEncrypt(smsg, sAddrFrom, vAddressTo[i], sMessage));
+        };
+    };
+    int64_t nSingle = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int r = 0; r < nRounds; r++)
+    {
+        SecureMessage asmsg[nRecipients];
+        std::vector<SecureMessage*> vpsmsg;
+        for (int i = 0; i < nRecipients; i++)
+            vpsmsg.push_back(&asmsg[i]);
+        std::vector<int> vResult;
+        BOOST_CHECK(0 == SecureMsgEncryptBatch(vpsmsg, sAddrFrom, vAddressTo, sMessage, vResult));
+
+        // -- each copy decrypts only for its recipient
+        for (int i = 0; i < nRecipients && r == 0; i++)
+        {
+            BOOST_CHECK(vResult[i] == 0);
+            BOOST_CHECK_MESSAGE(0 == (rv = SecureMsgDecrypt(false, vAddressTo[i], asmsg[i], msg)), "SecureMsgDecrypt " << rv);
+            BOOST_CHECK(msg.vchMessage.size() - 1 == sMessage.size()
+                && 0 == memcmp(&msg.vchMessage[0], sMessage.data(), sMessage.size()));
+            BOOST_CHECK(1 == SecureMsgDecrypt(false, vAddressTo[(i+1) % nRecipients], asmsg[i], msg));
+        };
+    };
+    int64_t nBatch = GetTimeMicros() - nStart;
+
+    BOOST_CHECK_EQUAL(SecMsgCryptoContext::Get().nGrowths, nGrowths);
+
+    int nMessages = nRounds * nRecipients;
+    BOOST_TEST_MESSAGE("smsg encrypt: " << nMessages << " messages, single " << (nMessages * 1000000LL) / (nSingle + 1)
+        << " msg/s, batch of " << nRecipients << " " << (nMessages * 1000000LL) / (nBatch + 1) << " msg/s");
+
+    UnregisterWallet(&keystore);
+    pwalletMain = pwalletMainOld;
+    RegisterWallet(pwalletMain);
+    fSecMsgEnabled = false;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,131 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txdb.h"
+
+using namespace std;
+
+static CTransaction MakeTx(int64_t nValue)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = 1;
+    tx.vin[0].prevout.n = 0;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey << OP_TRUE;
+    return tx;
+}
+
+BOOST_AUTO_TEST_SUITE(transaction_tests)
+
+BOOST_AUTO_TEST_CASE(transaction_hash_cache)
+{
+    CTransaction tx = MakeTx(100);
+    uint256 hash = SerializeHash(tx);
+    BOOST_CHECK(!tx.fHashCached);
+    BOOST_CHECK(tx.GetHash() == hash);
+
+    BOOST_CHECK(tx.UpdateHash() == hash);
+    BOOST_CHECK(tx.fHashCached);
+    BOOST_CHECK(tx.hashCached == hash);
+
+    // GetHash() hands back the kept hash instead of hashing again
+    tx.hashCached = 1;
+    BOOST_CHECK(tx.GetHash() == uint256(1));
+    tx.hashCached = hash;
+
+    // copies keep the hash
+    CTransaction txCopy(tx);
+    BOOST_CHECK(txCopy.fHashCached);
+    BOOST_CHECK(txCopy.GetHash() == hash);
+
+    // a changed transaction is hashed again on UpdateHash()
+    txCopy.vout[0].nValue = 200;
+    BOOST_CHECK(txCopy.UpdateHash() == SerializeHash(txCopy));
+    BOOST_CHECK(txCopy.GetHash() != hash);
+
+    // reading over a transaction drops the hash it had
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+    ss >> txCopy;
+    BOOST_CHECK(!txCopy.fHashCached);
+    BOOST_CHECK(txCopy.GetHash() == hash);
+
+    txCopy.UpdateHash();
+    txCopy.SetNull();
+    BOOST_CHECK(!txCopy.fHashCached);
+}
+
+BOOST_AUTO_TEST_CASE(block_merkle_rehash)
+{
+    CBlock block;
+    block.vtx.push_back(MakeTx(1));
+    block.vtx.push_back(MakeTx(2));
+    block.vtx.push_back(MakeTx(3));
+
+    uint256 hashMerkle = block.BuildMerkleTree();
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        BOOST_CHECK(block.vtx[i].fHashCached);
+        BOOST_CHECK(block.vtx[i].GetHash() == SerializeHash(block.vtx[i]));
+    }
+
+    // the tree is built from fresh hashes, as after changing the coinbase extra nonce
+    block.vtx[0].vin[0].prevout.n = 1;
+    BOOST_CHECK(block.BuildMerkleTree() != hashMerkle);
+    BOOST_CHECK(block.vtx[0].GetHash() == SerializeHash(block.vtx[0]));
+}
+
+BOOST_AUTO_TEST_CASE(check_block_keeps_hashes)
+{
+    CBlock block;
+    block.nTime = GetAdjustedTime();
+
+    CTransaction txCoinBase = MakeTx(0);
+    txCoinBase.nTime = block.nTime;
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vin[0].scriptSig << OP_0 << OP_0;
+    block.vtx.push_back(txCoinBase);
+    for (int i = 1; i <= 3; i++)
+    {
+        CTransaction tx = MakeTx(i);
+        tx.nTime = block.nTime;
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    // copies keep the hashes, start from none so only CheckBlock() can set them
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        block.vtx[i].fHashCached = false;
+
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(block.CheckBlock(false, true, false));
+    }
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        BOOST_CHECK(block.vtx[i].fHashCached);
+        BOOST_CHECK(block.vtx[i].hashCached == SerializeHash(block.vtx[i]));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(mempool_accept_keeps_hash)
+{
+    LOCK(cs_main);
+
+    // standard, but its input is unknown so it stays out of the pool
+    CTransaction tx = MakeTx(COIN);
+    tx.vout[0].scriptPubKey.SetDestination(CKeyID(uint160(1)));
+    BOOST_CHECK(tx.IsStandard());
+    BOOST_CHECK(!tx.fHashCached);
+
+    CTxDB txdb("r");
+    bool fMissingInputs = false;
+    BOOST_CHECK(!AcceptToMemoryPool(mempool, tx, txdb, &fMissingInputs));
+    BOOST_CHECK(fMissingInputs);
+    BOOST_CHECK(tx.fHashCached);
+    BOOST_CHECK(tx.hashCached == SerializeHash(tx));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,170 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+
+#include "main.h"
+#include "txdb.h"
+
+using namespace std;
+
+// Serialized form of every entry in mapBlockIndex, to compare two loads
+static map<uint256, string> IndexContents()
+{
+    map<uint256, string> mapOut;
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    {
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << CDiskBlockIndex(mi->second) << mi->second->nChainTrust;
+        mapOut[mi->first] = ss.str();
+    }
+    return mapOut;
+}
+
+// Drop the loaded index and load it again, from the snapshot if it is still good
+static bool ReloadBlockIndex()
+{
+    BlockMap mapDiscard;
+    mapDiscard.swap(mapBlockIndex);
+    pindexGenesisBlock = NULL;
+    pindexBest = NULL;
+
+    CTxDB txdb;
+    return txdb.LoadBlockIndex();
+}
+
+static void CorruptSnapshot()
+{
+    boost::filesystem::path pathSnapshot = GetDataDir() / "blkindexsnap.dat";
+    boost::filesystem::fstream file(pathSnapshot, ios::in | ios::out | ios::binary);
+    file.seekg(boost::filesystem::file_size(pathSnapshot) / 2);
+    char ch = file.get();
+    file.seekp(boost::filesystem::file_size(pathSnapshot) / 2);
+    file.put(ch ^ 0x55);
+}
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+BOOST_AUTO_TEST_CASE(block_index_snapshot)
+{
+    LOCK(cs_main);
+
+    // keep the index the other tests run on, this one works on its own
+    BlockMap mapSaved;
+    mapSaved.swap(mapBlockIndex);
+    CBlockIndex* pindexGenesisSaved = pindexGenesisBlock;
+    CBlockIndex* pindexBestSaved = pindexBest;
+    uint256 hashBestChainSaved = hashBestChain;
+    int nBestHeightSaved = nBestHeight;
+    uint256 nBestChainTrustSaved = nBestChainTrust;
+    uint256 nBestInvalidTrustSaved = nBestInvalidTrust;
+    mapArgs["-checkbackground"] = "1"; // the fake blocks below are not on disk
+
+    // genesis, a chain of four headers on it and a fork block at height one
+    CDiskBlockIndex diskGenesis(pindexGenesisSaved);
+    vector<CBlockIndex> vIndex(6, *pindexGenesisSaved);
+    vector<uint256> vHash(6);
+    vHash[0] = pindexGenesisSaved->GetBlockHash();
+    for (unsigned int i = 1; i < vIndex.size(); i++)
+    {
+        CBlockIndex* pprev = &vIndex[i == 5 ? 0 : i - 1];
+        CBlock block;
+        block.nVersion = pprev->nVersion;
+        block.hashPrevBlock = vHash[pprev - &vIndex[0]];
+        block.nTime = pprev->nTime + 60 + (i == 5 ? 1 : 0);
+        block.nBits = pprev->nBits;
+        vHash[i] = block.GetHash();
+
+        CBlockIndex index(0, 0, block);
+        index.phashBlock = &vHash[i];
+        index.pprev = pprev;
+        index.nHeight = pprev->nHeight + 1;
+        vIndex[i] = index;
+    }
+    vIndex[0].phashBlock = &vHash[0];
+    for (unsigned int i = 0; i < 4; i++)
+        vIndex[i].pnext = &vIndex[i + 1];
+
+    CDiskBlockIndex diskFork(&vIndex[5]);
+    {
+        CTxDB txdb;
+        for (unsigned int i = 0; i < vIndex.size(); i++)
+            BOOST_CHECK(txdb.WriteBlockIndex(CDiskBlockIndex(&vIndex[i])));
+        BOOST_CHECK(txdb.WriteHashBestChain(vHash[4]));
+    }
+
+    // no snapshot yet, the full load sets the reference
+    BOOST_CHECK(ReloadBlockIndex());
+    map<uint256, string> mapExpected = IndexContents();
+    BOOST_CHECK_EQUAL(mapExpected.size(), vIndex.size());
+    BOOST_CHECK(pindexBest && pindexBest->GetBlockHash() == vHash[4]);
+
+    // round trip: with the fork block gone from the db only the snapshot can bring it back
+    {
+        CTxDB txdb;
+        BOOST_CHECK(txdb.WriteBlockIndexSnapshot());
+        BOOST_CHECK(txdb.EraseBlockIndex(vHash[5]));
+    }
+    BOOST_CHECK(ReloadBlockIndex());
+    BOOST_CHECK(IndexContents() == mapExpected);
+    BOOST_CHECK(pindexBest && pindexBest->GetBlockHash() == vHash[4]);
+
+    // a snapshot is good for one load only
+    BOOST_CHECK(ReloadBlockIndex());
+    BOOST_CHECK(!mapBlockIndex.count(vHash[5]));
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), vIndex.size() - 1);
+
+    // bad checksum: the full load runs and misses the fork block the snapshot still has
+    {
+        CTxDB txdb;
+        BOOST_CHECK(txdb.WriteBlockIndex(diskFork));
+    }
+    BOOST_CHECK(ReloadBlockIndex());
+    BOOST_CHECK(IndexContents() == mapExpected);
+    {
+        CTxDB txdb;
+        BOOST_CHECK(txdb.WriteBlockIndexSnapshot());
+        BOOST_CHECK(txdb.EraseBlockIndex(vHash[5]));
+    }
+    CorruptSnapshot();
+    BOOST_CHECK(ReloadBlockIndex());
+    BOOST_CHECK(!mapBlockIndex.count(vHash[5]));
+    BOOST_CHECK(pindexBest && pindexBest->GetBlockHash() == vHash[4]);
+
+    // best chain moved since the snapshot: the full load runs from the db's best chain
+    {
+        CTxDB txdb;
+        BOOST_CHECK(txdb.WriteBlockIndex(diskFork));
+    }
+    BOOST_CHECK(ReloadBlockIndex());
+    BOOST_CHECK(IndexContents() == mapExpected);
+    {
+        CTxDB txdb;
+        BOOST_CHECK(txdb.WriteBlockIndexSnapshot());
+        BOOST_CHECK(txdb.EraseBlockIndex(vHash[5]));
+        BOOST_CHECK(txdb.WriteHashBestChain(vHash[3]));
+    }
+    BOOST_CHECK(ReloadBlockIndex());
+    BOOST_CHECK(!mapBlockIndex.count(vHash[5]));
+    BOOST_CHECK(pindexBest && pindexBest->GetBlockHash() == vHash[3]);
+
+    // put the db and the index back as the other tests expect them
+    {
+        CTxDB txdb;
+        for (unsigned int i = 1; i < vIndex.size(); i++)
+            txdb.EraseBlockIndex(vHash[i]);
+        BOOST_CHECK(txdb.WriteBlockIndex(diskGenesis));
+        BOOST_CHECK(txdb.WriteHashBestChain(hashBestChainSaved));
+    }
+    boost::filesystem::remove(GetDataDir() / "blkindexsnap.dat");
+    mapArgs.erase("-checkbackground");
+
+    mapSaved.swap(mapBlockIndex);
+    pindexGenesisBlock = pindexGenesisSaved;
+    pindexBest = pindexBestSaved;
+    hashBestChain = hashBestChainSaved;
+    nBestHeight = nBestHeightSaved;
+    nBestChainTrust = nBestChainTrustSaved;
+    nBestInvalidTrust = nBestInvalidTrustSaved;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -451,33 +451,200 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = new (arenaBlockIndex.Alloc()) CBlockIndex();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
-bool CTxDB::LoadBlockIndex()
+static bool LoadDiskBlockIndex(const uint256& blockHash, const CDiskBlockIndex& diskindex)
 {
-    if (nNodeMode != NT_FULL)
-        return 0;
+    // Construct block index object
+    CBlockIndex* pindexNew       = InsertBlockIndex(blockHash);
+    pindexNew->pprev             = InsertBlockIndex(diskindex.hashPrev);
+    pindexNew->pnext             = InsertBlockIndex(diskindex.hashNext);
+    pindexNew->nFile             = diskindex.nFile;
+    pindexNew->nBlockPos         = diskindex.nBlockPos;
+    pindexNew->nHeight           = diskindex.nHeight;
+    pindexNew->nMint             = diskindex.nMint;
+    pindexNew->nMoneySupply      = diskindex.nMoneySupply;
+    pindexNew->nTokenSupply      = diskindex.nTokenSupply;
+    pindexNew->nFlags            = diskindex.nFlags;
+    pindexNew->nStakeModifier    = diskindex.nStakeModifier;
+    pindexNew->bnStakeModifierV2 = diskindex.bnStakeModifierV2;
+    pindexNew->prevoutStake      = diskindex.prevoutStake;
+    pindexNew->nStakeTime        = diskindex.nStakeTime;
+    pindexNew->hashProof         = diskindex.hashProof;
+    pindexNew->nVersion          = diskindex.nVersion;
+    pindexNew->hashMerkleRoot    = diskindex.hashMerkleRoot;
+    pindexNew->nTime             = diskindex.nTime;
+    pindexNew->nBits             = diskindex.nBits;
+    pindexNew->nNonce            = diskindex.nNonce;
+
+    // Watch for genesis block
+    if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
+        pindexGenesisBlock = pindexNew;
+
+    if (!pindexNew->CheckIndex())
+        return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+
+    // NovaCoin: build setStakeSeen
+    if (pindexNew->IsProofOfStake())
+        setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
 
-    if (mapBlockIndex.size() > 0)
+    return true;
+}
+
+static void ClearBlockIndex()
+{
+    mapBlockIndex.clear();
+    arenaBlockIndex.Clear();
+    setStakeSeen.clear();
+    pindexGenesisBlock = NULL;
+}
+
+bool CTxDB::WriteBlockIndexSnapshot()
+{
+    if (nNodeMode != NT_FULL || mapBlockIndex.empty())
+        return false;
+
+    // nothing to save if shutting down before the index finished loading
+    uint256 hashBest;
+    if (!ReadHashBestChain(hashBest) || !pindexBest || pindexBest->GetBlockHash() != hashBest)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+
+    // header, then each entry as it is stored under "bidx", then the checksum of it all
+    CDataStream ssIndex(SER_DISK, CLIENT_VERSION);
+    ssIndex << FLATDATA(Params().MessageStart());
+    ssIndex << hashBest;
+    ssIndex << (uint32_t)mapBlockIndex.size();
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
-        // Already loaded once in this session. It can happen during migration
-        // from BDB.
-        return true;
-    };
-    
-    
+        CDiskBlockIndex diskindex(mi->second);
+        ssIndex << mi->first << diskindex;
+    }
+    uint256 hash = Hash(ssIndex.begin(), ssIndex.end());
+    ssIndex << hash;
+
+    fs::path pathSnapshot = GetDataDir() / "blkindexsnap.dat";
+    fs::path pathTmp = GetDataDir() / "blkindexsnap.dat.new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("WriteBlockIndexSnapshot() : open failed");
+
+    try {
+        fileout << ssIndex;
+    }
+    catch (std::exception &e) {
+        return error("WriteBlockIndexSnapshot() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, pathSnapshot))
+        return error("WriteBlockIndexSnapshot() : Rename-into-place failed");
+
+    // the snapshot is only used while the db still holds its checksum
+    if (!Write(string("bidxSnapshot"), hash))
+        return error("WriteBlockIndexSnapshot() : writing checksum failed");
+
+    LogPrintf("WriteBlockIndexSnapshot() : %u entries, %u bytes, %dms\n",
+        mapBlockIndex.size(), ssIndex.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CTxDB::LoadBlockIndexSnapshot()
+{
+    uint256 hashExpected;
+    if (!Read(string("bidxSnapshot"), hashExpected))
+        return false;
+
+    // good for one load only, blocks connected from here on are not in it
+    if (!fReadOnly)
+        Erase(string("bidxSnapshot"));
+
+    int64_t nStart = GetTimeMillis();
+
+    fs::path pathSnapshot = GetDataDir() / "blkindexsnap.dat";
+    FILE *file = fopen(pathSnapshot.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("LoadBlockIndexSnapshot() : open failed");
+
+    // read it all in one go
+    int64_t fileSize = fs::file_size(pathSnapshot);
+    int64_t dataSize = fileSize - sizeof(uint256);
+    if (dataSize < 0)
+        return error("LoadBlockIndexSnapshot() : file too small");
+    vector<unsigned char> vchData;
+    vchData.resize(dataSize);
+    uint256 hashIn;
+    try {
+        filein.read((char *)&vchData[0], dataSize);
+        filein >> hashIn;
+    }
+    catch (std::exception &e) {
+        return error("LoadBlockIndexSnapshot() : I/O error or stream data corrupted");
+    }
+    filein.fclose();
+
+    CDataStream ssIndex(vchData, SER_DISK, CLIENT_VERSION);
+    vector<unsigned char>().swap(vchData);
+
+    uint256 hashTmp = Hash(ssIndex.begin(), ssIndex.end());
+    if (hashIn != hashTmp || hashIn != hashExpected)
+        return error("LoadBlockIndexSnapshot() : checksum mismatch, snapshot is stale or corrupted");
+
+    uint256 hashBest, hashBestDB;
+    uint32_t nEntries;
+    unsigned char pchMsgTmp[4];
+    try {
+        ssIndex >> FLATDATA(pchMsgTmp);
+        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)))
+            return error("LoadBlockIndexSnapshot() : invalid network magic number");
+
+        ssIndex >> hashBest >> nEntries;
+        if (!ReadHashBestChain(hashBestDB) || hashBest != hashBestDB)
+            return error("LoadBlockIndexSnapshot() : best chain moved since the snapshot");
+
+        // size the table once instead of growing it entry by entry
+        mapBlockIndex.rehash(nEntries);
+
+        for (uint32_t i = 0; i < nEntries; i++)
+        {
+            if (i % 10000 == 0)
+                boost::this_thread::interruption_point();
+
+            uint256 blockHash;
+            CDiskBlockIndex diskindex;
+            ssIndex >> blockHash >> diskindex;
+            if (!LoadDiskBlockIndex(blockHash, diskindex))
+            {
+                ClearBlockIndex();
+                return false;
+            }
+        }
+    }
+    catch (std::exception &e) {
+        ClearBlockIndex();
+        return error("LoadBlockIndexSnapshot() : I/O error or stream data corrupted");
+    }
+
+    LogPrintf("LoadBlockIndexSnapshot() : %u entries, %dms\n", nEntries, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CTxDB::LoadBlockIndexGuts()
+{
     // The block index is an in-memory structure that maps hashes to on-disk
     // locations where the contents of the block can be found. Here, we scan it
     // out of the DB and into mapBlockIndex.
@@ -510,45 +677,37 @@ bool CTxDB::LoadBlockIndex()
         CDiskBlockIndex diskindex;
         ssValue >> diskindex;
         
-        // Construct block index object
-        CBlockIndex* pindexNew       = InsertBlockIndex(blockHash);
-        pindexNew->pprev             = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext             = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile             = diskindex.nFile;
-        pindexNew->nBlockPos         = diskindex.nBlockPos;
-        pindexNew->nHeight           = diskindex.nHeight;
-        pindexNew->nMint             = diskindex.nMint;
-        pindexNew->nMoneySupply      = diskindex.nMoneySupply;
-        pindexNew->nTokenSupply      = diskindex.nTokenSupply;
-        pindexNew->nFlags            = diskindex.nFlags;
-        pindexNew->nStakeModifier    = diskindex.nStakeModifier;
-        pindexNew->bnStakeModifierV2 = diskindex.bnStakeModifierV2;
-        pindexNew->prevoutStake      = diskindex.prevoutStake;
-        pindexNew->nStakeTime        = diskindex.nStakeTime;
-        pindexNew->hashProof         = diskindex.hashProof;
-        pindexNew->nVersion          = diskindex.nVersion;
-        pindexNew->hashMerkleRoot    = diskindex.hashMerkleRoot;
-        pindexNew->nTime             = diskindex.nTime;
-        pindexNew->nBits             = diskindex.nBits;
-        pindexNew->nNonce            = diskindex.nNonce;
-
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
-            pindexGenesisBlock = pindexNew;
-
-        if (!pindexNew->CheckIndex()) {
+        if (!LoadDiskBlockIndex(blockHash, diskindex)) {
             delete iterator;
-            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+            return false;
         }
 
-        // NovaCoin: build setStakeSeen
-        if (pindexNew->IsProofOfStake())
-            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-
         iterator->Next();
     }
     delete iterator;
 
+    return true;
+}
+
+bool CTxDB::LoadBlockIndex()
+{
+    if (nNodeMode != NT_FULL)
+        return 0;
+
+    if (mapBlockIndex.size() > 0)
+    {
+        // Already loaded once in this session. It can happen during migration
+        // from BDB.
+        return true;
+    };
+    
+    // blkindexsnap.dat from a clean shutdown, otherwise every "bidx" entry in the db
+    if (!GetBoolArg("-indexsnapshot", true) || !LoadBlockIndexSnapshot())
+    {
+        if (!LoadBlockIndexGuts())
+            return false;
+    };
+
     boost::this_thread::interruption_point();
 
     // Load hashBestChain pointer to end of best chain
@@ -606,125 +765,287 @@ bool CTxDB::LoadBlockIndex()
     ReadBestInvalidTrust(bnBestInvalidTrust);
     nBestInvalidTrust = bnBestInvalidTrust.getuint256();
 
-    // Verify blocks in the best chain
-    int nCheckLevel = GetArg("-checklevel", 1);
-    int nCheckDepth = GetArg("-checkblocks", 2500);
-    if (nCheckDepth == 0)
-        nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > nBestHeight)
-        nCheckDepth = nBestHeight;
-    LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CBlockIndex* pindexFork = NULL;
-    map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
-    for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
+    // Verify blocks in the best chain, -checkbackground leaves it to ThreadVerifyBlockIndex()
+    if (GetBoolArg("-checkbackground", false))
+        return true;
+
+    return VerifyBlockIndex(false);
+}
+
+/** Outcome of the checks of one block, reported in chain order once all blocks are done */
+struct CBlockVerifyResult
+{
+    bool fReadFailed;
+    bool fBad;
+    std::vector<std::string> vMessages;
+
+    CBlockVerifyResult() : fReadFailed(false), fBad(false) {}
+
+    void Bad(const std::string& str)
     {
-        boost::this_thread::interruption_point();
-        if (pindex->nHeight < nBestHeight-nCheckDepth)
-            break;
-        CBlock block;
-        if (!block.ReadFromDisk(pindex))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        // check level 1: verify block validity
-        // check level 7: verify block signature too
-        if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
-        {
-            LogPrintf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-            pindexFork = pindex->pprev;
-        }
-        // check level 2: verify transaction index validity
-        if (nCheckLevel>1)
+        fBad = true;
+        vMessages.push_back(str);
+    }
+};
+
+typedef map<pair<unsigned int, unsigned int>, CBlockIndex*> MapBlockPos;
+
+static CCriticalSection cs_verifyStatus;
+static std::string strVerifyStatus = "not started";
+
+static void SetVerifyStatus(const std::string& str)
+{
+    LOCK(cs_verifyStatus);
+    strVerifyStatus = str;
+}
+
+std::string GetBlockVerifyStatus()
+{
+    LOCK(cs_verifyStatus);
+    return strVerifyStatus;
+}
+
+// The checks of one block, it only reads the block files and the txdb
+static void VerifyBlock(CTxDB& txdb, CBlockIndex* pindex, int nCheckLevel, int64_t nMaxBlockTime, const MapBlockPos& mapBlockPos, CBlockVerifyResult& result)
+{
+    CBlock block;
+    if (!block.ReadFromDisk(pindex))
+    {
+        result.fReadFailed = true;
+        return;
+    }
+    // check level 1: verify block validity
+    // check level 7: verify block signature too
+    if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6), nMaxBlockTime))
+        result.Bad(strprintf("LoadBlockIndex() : *** found bad block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString()));
+
+    // check level 2: verify transaction index validity
+    if (nCheckLevel<=1)
+        return;
+
+    BOOST_FOREACH(const CTransaction &tx, block.vtx)
+    {
+        uint256 hashTx = tx.GetHash();
+        CTxIndex txindex;
+        if (txdb.ReadTxIndex(hashTx, txindex))
         {
-            pair<unsigned int, unsigned int> pos = make_pair(pindex->nFile, pindex->nBlockPos);
-            mapBlockPos[pos] = pindex;
-            BOOST_FOREACH(const CTransaction &tx, block.vtx)
+            // check level 3: checker transaction hashes
+            if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
+            {
+                // either an error or a duplicate transaction
+                CTransaction txFound;
+                if (!txFound.ReadFromDisk(txindex.pos))
+                    result.Bad(strprintf("LoadBlockIndex() : *** cannot read mislocated transaction %s", hashTx.ToString()));
+                else
+                    if (txFound.GetHash() != hashTx) // not a duplicate tx
+                        result.Bad(strprintf("LoadBlockIndex(): *** invalid tx position for %s", hashTx.ToString()));
+            }
+            // check level 4: check whether spent txouts were spent within the main chain
+            unsigned int nOutput = 0;
+            if (nCheckLevel>3)
             {
-                uint256 hashTx = tx.GetHash();
-                CTxIndex txindex;
-                if (ReadTxIndex(hashTx, txindex))
+                BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
                 {
-                    // check level 3: checker transaction hashes
-                    if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
-                    {
-                        // either an error or a duplicate transaction
-                        CTransaction txFound;
-                        if (!txFound.ReadFromDisk(txindex.pos))
-                        {
-                            LogPrintf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString());
-                            pindexFork = pindex->pprev;
-                        }
-                        else
-                            if (txFound.GetHash() != hashTx) // not a duplicate tx
-                            {
-                                LogPrintf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString());
-                                pindexFork = pindex->pprev;
-                            }
-                    }
-                    // check level 4: check whether spent txouts were spent within the main chain
-                    unsigned int nOutput = 0;
-                    if (nCheckLevel>3)
+                    if (!txpos.IsNull())
                     {
-                        BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
+                        // spent in this block or one above it
+                        MapBlockPos::const_iterator mi = mapBlockPos.find(make_pair(txpos.nFile, txpos.nBlockPos));
+                        if (mi == mapBlockPos.end() || mi->second->nHeight < pindex->nHeight)
+                            result.Bad(strprintf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s", pindex->nHeight, pindex->GetBlockHash().ToString(), hashTx.ToString()));
+                        // check level 6: check whether spent txouts were spent by a valid transaction that consume them
+                        if (nCheckLevel>5)
                         {
-                            if (!txpos.IsNull())
+                            CTransaction txSpend;
+                            if (!txSpend.ReadFromDisk(txpos))
+                                result.Bad(strprintf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk", hashTx.ToString(), nOutput));
+                            else if (!txSpend.CheckTransaction())
+                                result.Bad(strprintf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid", hashTx.ToString(), nOutput));
+                            else
                             {
-                                pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
-                                if (!mapBlockPos.count(posFind))
-                                {
-                                    LogPrintf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString(), hashTx.ToString());
-                                    pindexFork = pindex->pprev;
-                                }
-                                // check level 6: check whether spent txouts were spent by a valid transaction that consume them
-                                if (nCheckLevel>5)
-                                {
-                                    CTransaction txSpend;
-                                    if (!txSpend.ReadFromDisk(txpos))
-                                    {
-                                        LogPrintf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else if (!txSpend.CheckTransaction())
-                                    {
-                                        LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else
-                                    {
-                                        bool fFound = false;
-                                        BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
-                                            if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
-                                                fFound = true;
-                                        if (!fFound)
-                                        {
-                                            LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString(), nOutput);
-                                            pindexFork = pindex->pprev;
-                                        }
-                                    }
-                                }
+                                bool fFound = false;
+                                BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
+                                    if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
+                                        fFound = true;
+                                if (!fFound)
+                                    result.Bad(strprintf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it", hashTx.ToString(), nOutput));
                             }
-                            nOutput++;
                         }
                     }
-                }
-                // check level 5: check whether all prevouts are marked spent
-                if (nCheckLevel>4)
-                {
-                     BOOST_FOREACH(const CTxIn &txin, tx.vin)
-                     {
-                          CTxIndex txindex;
-                          if (ReadTxIndex(txin.prevout.hash, txindex))
-                              if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
-                              {
-                                  LogPrintf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString(), txin.prevout.n, hashTx.ToString());
-                                  pindexFork = pindex->pprev;
-                              }
-                     }
+                    nOutput++;
                 }
             }
         }
+        // check level 5: check whether all prevouts are marked spent
+        if (nCheckLevel>4)
+        {
+             BOOST_FOREACH(const CTxIn &txin, tx.vin)
+             {
+                  CTxIndex txindex;
+                  if (txdb.ReadTxIndex(txin.prevout.hash, txindex))
+                      if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
+                          result.Bad(strprintf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s", txin.prevout.hash.ToString(), txin.prevout.n, hashTx.ToString()));
+             }
+        }
     }
+}
+
+/** Runs VerifyBlock() over a list of blocks on several threads, blocks are taken in list order */
+class CBlockVerifier
+{
+public:
+    CBlockVerifier(const std::vector<CBlockIndex*>& vBlocksIn, const MapBlockPos& mapBlockPosIn, int nCheckLevelIn, int64_t nMaxBlockTimeIn)
+        : vBlocks(vBlocksIn), mapBlockPos(mapBlockPosIn), nCheckLevel(nCheckLevelIn), nMaxBlockTime(nMaxBlockTimeIn)
+    {
+        vResults.resize(vBlocks.size());
+        nNext = 0;
+        nDone = 0;
+    };
+
+    ~CBlockVerifier()
+    {
+        threads.interrupt_all();
+        threads.join_all();
+    };
+
+    void Run(int nWorkers)
+    {
+        for (int i = 0; i < nWorkers; ++i)
+            threads.create_thread(boost::bind(&CBlockVerifier::ThreadVerify, this));
+
+        // report progress until the workers are through
+        while (true)
+        {
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                if (nDone == vBlocks.size())
+                    break;
+                condDone.timed_wait(lock, boost::posix_time::seconds(1));
+                if (nDone == vBlocks.size())
+                    break;
+            }
+            SetVerifyStatus(strprintf("verifying %u/%u", GetDone(), vBlocks.size()));
+        };
+        threads.join_all();
+    };
+
+    const CBlockVerifyResult& Result(size_t i) const { return vResults[i]; }
+
+private:
+    const std::vector<CBlockIndex*>& vBlocks;
+    const MapBlockPos& mapBlockPos;
+    int nCheckLevel;
+    int64_t nMaxBlockTime;
+    std::vector<CBlockVerifyResult> vResults;
+
+    boost::mutex cs;
+    boost::condition_variable condDone;
+    size_t nNext;
+    size_t nDone;
+    boost::thread_group threads;
+
+    size_t GetDone()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        return nDone;
+    };
+
+    void ThreadVerify()
+    {
+        RenameThread("procurrency-verify");
+        CTxDB txdb("r");
+        while (true)
+        {
+            size_t i;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                if (nNext == vBlocks.size())
+                    return;
+                i = nNext++;
+            }
+
+            boost::this_thread::interruption_point();
+            VerifyBlock(txdb, vBlocks[i], nCheckLevel, nMaxBlockTime, mapBlockPos, vResults[i]);
+
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                nDone++;
+            }
+            condDone.notify_one();
+        };
+    };
+};
+
+bool VerifyBlockIndex(bool fBackground)
+{
+    int nCheckLevel = GetArg("-checklevel", 1);
+    int nCheckDepth = GetArg("-checkblocks", 2500);
+    if (fBackground && nCheckLevel > 3)
+    {
+        // spends recorded by blocks connected meanwhile would show up as bad
+        LogPrintf("VerifyBlockIndex() : levels above 3 need the index at rest, checking at level 3\n");
+        nCheckLevel = 3;
+    }
+
+    // the blocks to check, best first, and the positions of all of them for the level 4 check
+    std::vector<CBlockIndex*> vBlocks;
+    MapBlockPos mapBlockPos;
+    // the workers check without cs_main while blocks may be connected meanwhile
+    int64_t nMaxBlockTime;
+    {
+        LOCK(cs_main);
+        nMaxBlockTime = GetMaxBlockTime();
+        if (nCheckDepth == 0)
+            nCheckDepth = 1000000000; // suffices until the year 19000
+        if (nCheckDepth > nBestHeight)
+            nCheckDepth = nBestHeight;
+        for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
+        {
+            if (pindex->nHeight < nBestHeight-nCheckDepth)
+                break;
+            vBlocks.push_back(pindex);
+            if (nCheckLevel>1)
+                mapBlockPos[make_pair(pindex->nFile, pindex->nBlockPos)] = pindex;
+        }
+    }
+
+    int nThreads = GetArg("-checkthreads", boost::thread::hardware_concurrency());
+    nThreads = std::max(1, std::min(nThreads, 16));
+
+    LogPrintf("Verifying last %i blocks at level %i on %d threads\n", nCheckDepth, nCheckLevel, nThreads);
+    int64_t nStart = GetTimeMillis();
+    SetVerifyStatus(strprintf("verifying 0/%u", vBlocks.size()));
+
+    CBlockVerifier verifier(vBlocks, mapBlockPos, nCheckLevel, nMaxBlockTime);
+    verifier.Run(nThreads);
+
+    // report in chain order, the chain goes back to before the lowest bad block
+    CBlockIndex* pindexFork = NULL;
+    for (size_t i = 0; i < vBlocks.size(); i++)
+    {
+        const CBlockVerifyResult& result = verifier.Result(i);
+        if (result.fReadFailed)
+        {
+            SetVerifyStatus(strprintf("failed, cannot read block %d", vBlocks[i]->nHeight));
+            return error("LoadBlockIndex() : block.ReadFromDisk failed");
+        }
+        BOOST_FOREACH(const std::string& strMessage, result.vMessages)
+            LogPrintf("%s\n", strMessage);
+        if (result.fBad)
+            pindexFork = vBlocks[i]->pprev;
+    }
+
+    LogPrintf("Verified %u blocks in %dms\n", vBlocks.size(), GetTimeMillis() - nStart);
+
     if (pindexFork)
     {
         boost::this_thread::interruption_point();
+        LOCK(cs_main);
+        // in the background the chain may have moved away from the fork meanwhile
+        if (fBackground && pindexFork != pindexBest && !pindexFork->pnext)
+        {
+            SetVerifyStatus(strprintf("found bad blocks above %d, no longer in the best chain", pindexFork->nHeight));
+            return true;
+        }
         // Reorg back to the fork
         LogPrintf("LoadBlockIndex() : *** moving best chain pointer back to block %d\n", pindexFork->nHeight);
         CBlock block;
@@ -732,11 +1053,20 @@ bool CTxDB::LoadBlockIndex()
             return error("LoadBlockIndex() : block.ReadFromDisk failed");
         CTxDB txdb;
         block.SetBestChain(txdb, pindexFork);
+        SetVerifyStatus(strprintf("found bad blocks, moved back to %d", pindexFork->nHeight));
+        return true;
     }
 
+    SetVerifyStatus(strprintf("done, %u blocks", vBlocks.size()));
     return true;
 }
 
+void ThreadVerifyBlockIndex()
+{
+    RenameThread("procurrency-verify");
+    VerifyBlockIndex(true);
+}
+
 bool CTxDB::LoadBlockThinIndex()
 {
     if (fDebug)
@@ -755,7 +1085,7 @@ bool CTxDB::LoadBlockThinIndex()
     uint256 hashNext = Params().HashGenesisBlock();
 
     CDiskBlockThinIndex diskindex;
-    map<uint256, CBlockThinIndex*>::iterator mi;
+    BlockThinMap::iterator mi;
     CBlockThinIndex* pIndexLast = NULL;
 
     while (hashNext != 0)
@@ -769,9 +1099,7 @@ bool CTxDB::LoadBlockThinIndex()
         //LogPrintf("[rem] bhidx %s\n", hashNext.ToString().c_str());
 
         // Construct block index object
-        CBlockThinIndex* pindexNew      = new CBlockThinIndex();
-        if (!pindexNew)
-            return error("LoadBlockThinIndex() : new CBlockIndex failed");
+        CBlockThinIndex* pindexNew      = new (arenaBlockThinIndex.Alloc()) CBlockThinIndex();
 
         mi = mapBlockThinIndex.insert(make_pair(hashNext, pindexNew)).first;
         pindexNew->phashBlock = &(mi->first);
@@ -819,12 +1147,12 @@ bool CTxDB::LoadBlockThinIndex()
             pindexRear = pindexRear->pnext;
             pindexRear->pprev = NULL;
 
-            std::map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.find(*pRemHash);
+            BlockThinMap::iterator mi = mapBlockThinIndex.find(*pRemHash);
 
 
             if (mi != mapBlockThinIndex.end())
             {
-                delete mi->second;
+                arenaBlockThinIndex.Delete(mi->second);
                 mapBlockThinIndex.erase(mi);
             };
         };
@@ -262,9 +262,19 @@ public:
     bool WriteCheckpointPubKey(const std::string& strPubKey);
     bool LoadBlockIndex();
     bool LoadBlockThinIndex();
+    // Dump the block index to blkindexsnap.dat for a fast load on the next start
+    bool WriteBlockIndexSnapshot();
 private:
     bool LoadBlockIndexGuts();
+    bool LoadBlockIndexSnapshot();
 };
 
+// Check the last -checkblocks blocks at -checklevel on -checkthreads threads, moving the best chain
+// back before the lowest bad one. The background run leaves the index to other threads meanwhile.
+bool VerifyBlockIndex(bool fBackground);
+void ThreadVerifyBlockIndex();
+// Progress of VerifyBlockIndex(), for getinfo
+std::string GetBlockVerifyStatus();
+
 
 #endif // BITCOIN_DB_H
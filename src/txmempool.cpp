@@ -19,6 +19,7 @@ bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
         nTransactionsUpdated++;
+        GetSpendSignals().TransactionInputs(tx, false, true);
     }
     return true;
 }
@@ -43,6 +44,7 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
             };
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
+            GetSpendSignals().TransactionInputs(tx, false, false); // tx may live in mapTx
             mapTx.erase(hash);
             
             if (tx.nVersion == ANON_TXN_VERSION)
@@ -38,6 +38,7 @@ namespace boost {
 #include <boost/filesystem/fstream.hpp>
 #include <boost/foreach.hpp>
 #include <boost/thread.hpp>
+#include <boost/atomic.hpp>
 #include <openssl/crypto.h>
 #include <openssl/rand.h>
 #include <openssl/err.h>
@@ -212,6 +213,9 @@ static boost::once_flag debugPrintInitFlag = BOOST_ONCE_INIT;
 static FILE* fileout = NULL;
 static boost::mutex* mutexDebugLog = NULL;
 
+// size of the stdio buffer of debug.log, it is flushed after every batch
+static const size_t LOG_FILE_BUFFER = 64 * 1024;
+
 static void DebugPrintInit()
 {
     assert(fileout == NULL);
@@ -219,7 +223,7 @@ static void DebugPrintInit()
 
     boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
     fileout = fopen(pathDebug.string().c_str(), "a");
-    if (fileout) setbuf(fileout, NULL); // unbuffered
+    if (fileout) setvbuf(fileout, NULL, _IOFBF, LOG_FILE_BUFFER);
 
     mutexDebugLog = new boost::mutex();
 }
@@ -229,6 +233,252 @@ bool IsLogOpen()
     return fileout != NULL;
 }
 
+/** Log lines waiting for the writer thread.
+ *
+ *  Bounded multi-producer queue of fixed slots: a producer claims a slot by advancing nHead with a
+ *  compare-and-swap and publishes it by bumping the slot's sequence number, the single consumer frees it
+ *  again the same way. Callers never wait on each other or on the disk, when the writer falls behind
+ *  and the ring is full the line is dropped and counted.
+ */
+class CLogRing
+{
+public:
+    enum { SLOTS = 8192 }; // power of two
+
+private:
+    struct Slot
+    {
+        boost::atomic<size_t> nSeq;
+        int64_t nTime;
+        std::string str;
+    };
+
+    Slot* slots;
+    boost::atomic<size_t> nHead;
+    size_t nTail;           // only touched by the consumer
+
+public:
+    boost::atomic<uint64_t> nDropped;
+
+    CLogRing() : nHead(0), nTail(0), nDropped(0)
+    {
+        slots = new Slot[SLOTS];
+        for (size_t i = 0; i < SLOTS; i++)
+            slots[i].nSeq.store(i, boost::memory_order_relaxed);
+    }
+
+    // Takes the contents of str, false if the ring is full
+    bool Push(std::string& str, int64_t nTime)
+    {
+        size_t nPos = nHead.load(boost::memory_order_relaxed);
+        Slot* slot;
+        while (true)
+        {
+            slot = &slots[nPos & (SLOTS - 1)];
+            size_t nSeq = slot->nSeq.load(boost::memory_order_acquire);
+            intptr_t nDiff = (intptr_t)nSeq - (intptr_t)nPos;
+            if (nDiff == 0)
+            {
+                if (nHead.compare_exchange_weak(nPos, nPos + 1, boost::memory_order_relaxed))
+                    break;
+            } else
+            if (nDiff < 0)
+            {
+                // slot still holds a line from the last round
+                nDropped.fetch_add(1, boost::memory_order_relaxed);
+                return false;
+            } else
+                nPos = nHead.load(boost::memory_order_relaxed);
+        }
+
+        slot->str.swap(str);
+        slot->nTime = nTime;
+        slot->nSeq.store(nPos + 1, boost::memory_order_release);
+        return true;
+    }
+
+    // Single consumer, str must be empty and gets the oldest line
+    bool Pop(std::string& str, int64_t& nTime)
+    {
+        Slot* slot = &slots[nTail & (SLOTS - 1)];
+        if (slot->nSeq.load(boost::memory_order_acquire) != nTail + 1)
+            return false;
+
+        str.swap(slot->str);
+        nTime = slot->nTime;
+        slot->nSeq.store(nTail + SLOTS, boost::memory_order_release);
+        nTail++;
+        return true;
+    }
+
+    bool Empty() const
+    {
+        return slots[nTail & (SLOTS - 1)].nSeq.load(boost::memory_order_acquire) != nTail + 1;
+    }
+};
+
+// Writer thread state, allocated once in StartDebugLogThread() and never freed for the same
+// reason as mutexDebugLog.
+static CLogRing* logRing = NULL;
+static boost::thread* threadLogWriter = NULL;
+static boost::mutex* mutexLogWriter = NULL;
+static boost::condition_variable* condLogWriter = NULL;
+static boost::atomic<bool> fLogWriterRunning(false);
+static boost::atomic<bool> fLogWriterIdle(false);
+static boost::atomic<bool> fLogWriterStop(false);
+// LogPrintStr() calls between checking fLogWriterRunning and handing their line over
+static boost::atomic<int> nLogProducers(0);
+
+// bytes gathered from the ring before they are written out
+static const size_t LOG_BATCH_BYTES = 64 * 1024;
+
+// Only touched with mutexDebugLog held
+static bool fStartedNewLine = false;
+static int64_t nLogTimeCached = -1;
+static std::string strLogTimeCached;
+
+static void AppendLogLine(std::string& strOut, const std::string& str, int64_t nTime)
+{
+    // Debug print useful for profiling
+    if (fLogTimestamps && fStartedNewLine)
+    {
+        if (nTime != nLogTimeCached)
+        {
+            strLogTimeCached = DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nTime) + " ";
+            nLogTimeCached = nTime;
+        }
+        strOut += strLogTimeCached;
+    }
+    if (!str.empty() && str[str.size()-1] == '\n')
+        fStartedNewLine = true;
+    else
+        fStartedNewLine = false;
+
+    strOut += str;
+}
+
+// Called with mutexDebugLog held
+static void WriteDebugLog(const std::string& str)
+{
+    // reopen the log file, if requested
+    if (fReopenDebugLog) {
+        fReopenDebugLog = false;
+        boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
+        if (freopen(pathDebug.string().c_str(),"a",fileout) != NULL)
+            setvbuf(fileout, NULL, _IOFBF, LOG_FILE_BUFFER);
+    }
+
+    fwrite(str.data(), 1, str.size(), fileout);
+    fflush(fileout);
+}
+
+// Move everything queued so far to debug.log, false if the ring was empty
+static bool FlushLogRing(std::string& strBatch)
+{
+    std::string str;
+    int64_t nTime;
+    bool fAny = false;
+    while (true)
+    {
+        boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+        strBatch.clear();
+        while (strBatch.size() < LOG_BATCH_BYTES && logRing->Pop(str, nTime))
+        {
+            AppendLogLine(strBatch, str, nTime);
+            str.clear();
+        }
+
+        uint64_t nDropped = logRing->nDropped.exchange(0);
+        if (nDropped > 0)
+        {
+            if (!fStartedNewLine)
+                strBatch += "\n";
+            AppendLogLine(strBatch, strprintf("%u log lines dropped, the writer fell behind\n", nDropped), GetTime());
+        }
+
+        if (strBatch.empty())
+            return fAny;
+
+        fAny = true;
+        WriteDebugLog(strBatch);
+    }
+}
+
+static void ThreadLogWriter()
+{
+    RenameThread("procurrency-log");
+
+    std::string strBatch;
+    strBatch.reserve(LOG_BATCH_BYTES + 4096);
+    while (true)
+    {
+        bool fStop = fLogWriterStop.load();
+        if (FlushLogRing(strBatch))
+            continue;
+        if (fStop)
+            break;
+
+        // producers only signal while we sleep, a line slipping in between the
+        // check and the wait is picked up after the timeout
+        boost::unique_lock<boost::mutex> lock(*mutexLogWriter);
+        fLogWriterIdle.store(true);
+        if (logRing->Empty() && !fLogWriterStop.load())
+            condLogWriter->timed_wait(lock, boost::posix_time::milliseconds(100));
+        fLogWriterIdle.store(false);
+    }
+}
+
+void StartDebugLogThread()
+{
+    if (fPrintToConsole || !fPrintToDebugLog || fLogWriterRunning.load())
+        return;
+
+    boost::call_once(&DebugPrintInit, debugPrintInitFlag);
+    if (fileout == NULL)
+        return;
+
+    if (logRing == NULL)
+    {
+        logRing = new CLogRing();
+        mutexLogWriter = new boost::mutex();
+        condLogWriter = new boost::condition_variable();
+    }
+
+    fLogWriterStop.store(false);
+    fLogWriterRunning.store(true);
+    threadLogWriter = new boost::thread(&ThreadLogWriter);
+}
+
+void StopDebugLogThread()
+{
+    if (!fLogWriterRunning.load())
+        return;
+
+    fLogWriterStop.store(true);
+    {
+        boost::unique_lock<boost::mutex> lock(*mutexLogWriter);
+        condLogWriter->notify_one();
+    }
+    threadLogWriter->join();
+    delete threadLogWriter;
+    threadLogWriter = NULL;
+
+    // later lines are written directly, wait for callers that still saw the writer
+    // running to finish their Push, then pick up what was queued meanwhile
+    fLogWriterRunning.store(false);
+    while (nLogProducers.load() != 0)
+        boost::this_thread::yield();
+    std::string strBatch;
+    FlushLogRing(strBatch);
+}
+
+/** -debug settings of the calling thread, looked up without building strings */
+struct CLogCategories
+{
+    bool fAll;
+    std::vector<std::string> vCategories;
+};
+
 bool LogAcceptCategory(const char* category)
 {
     if (category != NULL)
@@ -240,19 +490,25 @@ bool LogAcceptCategory(const char* category)
         // This helps prevent issues debugging global destructors,
         // where mapMultiArgs might be deleted before another
         // global destructor calls LogPrint()
-        static boost::thread_specific_ptr<set<string> > ptrCategory;
+        static boost::thread_specific_ptr<CLogCategories> ptrCategory;
         if (ptrCategory.get() == NULL)
         {
             const vector<string>& categories = mapMultiArgs["-debug"];
-            ptrCategory.reset(new set<string>(categories.begin(), categories.end()));
-            // thread_specific_ptr automatically deletes the set when the thread ends.
+            CLogCategories* pcategories = new CLogCategories();
+            pcategories->fAll = std::find(categories.begin(), categories.end(), string("")) != categories.end();
+            pcategories->vCategories = categories;
+            ptrCategory.reset(pcategories);
+            // thread_specific_ptr automatically deletes the settings when the thread ends.
         }
-        const set<string>& setCategories = *ptrCategory.get();
+        const CLogCategories& categories = *ptrCategory.get();
 
         // if not debugging everything and not debugging specific category, LogPrint does nothing.
-        if (setCategories.count(string("")) == 0 &&
-            setCategories.count(string(category)) == 0)
-            return false;
+        if (categories.fAll)
+            return true;
+        for (size_t i = 0; i < categories.vCategories.size(); i++)
+            if (strcmp(categories.vCategories[i].c_str(), category) == 0)
+                return true;
+        return false;
     }
     return true;
 }
@@ -267,7 +523,22 @@ int LogPrintStr(const std::string &str)
     } else
     if (fPrintToDebugLog)
     {
-        static bool fStartedNewLine = false;
+        nLogProducers.fetch_add(1);
+        if (fLogWriterRunning.load())
+        {
+            // hand the line to the writer thread, never waits
+            std::string strLine(str);
+            if (logRing->Push(strLine, GetTime()))
+            {
+                ret = str.size();
+                if (fLogWriterIdle.load())
+                    condLogWriter->notify_one();
+            }
+            nLogProducers.fetch_sub(1);
+            return ret;
+        }
+        nLogProducers.fetch_sub(1);
+
         boost::call_once(&DebugPrintInit, debugPrintInitFlag);
 
         if (fileout == NULL)
@@ -275,23 +546,10 @@ int LogPrintStr(const std::string &str)
 
         boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
 
-        // reopen the log file, if requested
-        if (fReopenDebugLog) {
-            fReopenDebugLog = false;
-            boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
-            if (freopen(pathDebug.string().c_str(),"a",fileout) != NULL)
-                setbuf(fileout, NULL); // unbuffered
-        }
-
-        // Debug print useful for profiling
-        if (fLogTimestamps && fStartedNewLine)
-            ret += fprintf(fileout, "%s ", DateTimeStrFormat("%Y-%m-%d %H:%M:%S", GetTime()).c_str());
-        if (!str.empty() && str[str.size()-1] == '\n')
-            fStartedNewLine = true;
-        else
-            fStartedNewLine = false;
-
-        ret = fwrite(str.data(), 1, str.size(), fileout);
+        std::string strOut;
+        AppendLogLine(strOut, str, GetTime());
+        WriteDebugLog(strOut);
+        ret = str.size();
     }
     
     return ret;
@@ -117,6 +117,10 @@ bool IsLogOpen();
 bool LogAcceptCategory(const char* category);
 /* Send a string to the log output */
 int LogPrintStr(const std::string &str);
+/* Write debug.log from a background thread, LogPrintStr() then only queues the line. Lines still queued are lost on a crash */
+void StartDebugLogThread();
+/* Write out queued lines and go back to writing debug.log directly */
+void StopDebugLogThread();
 
 #define LogPrintf(...) LogPrint(NULL, __VA_ARGS__)
 
@@ -768,7 +768,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, const uint256& hashIn)
                 {
                     //fInBlockIndex = mapBlockThinIndex.count(wtxIn.hashBlock);
 
-                    std::map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.find(wtxIn.hashBlock);
+                    BlockThinMap::iterator mi = mapBlockThinIndex.find(wtxIn.hashBlock);
                     if (mi == mapBlockThinIndex.end()
                         && !fThinFullIndex
                         && pindexRear)
@@ -1510,7 +1510,7 @@ void CWallet::ReacceptWalletTransactions()
                 || (wtx.IsCoinStake() && wtx.IsSpent(1)))
                 continue;
 
-            std::map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.find(wtx.hashBlock);
+            BlockThinMap::iterator mi = mapBlockThinIndex.find(wtx.hashBlock);
             if (mi == mapBlockThinIndex.end())
             {
                 if (!fThinFullIndex)
@@ -3040,13 +3040,13 @@ static int GetBlockHeightFromHash(const uint256& blockHash)
 
     if (nNodeMode == NT_FULL)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(blockHash);
+        BlockMap::iterator mi = mapBlockIndex.find(blockHash);
         if (mi == mapBlockIndex.end())
             return 0;
         return mi->second->nHeight;
     } else
     {
-        std::map<uint256, CBlockThinIndex*>::iterator mi = mapBlockThinIndex.find(blockHash);
+        BlockThinMap::iterator mi = mapBlockThinIndex.find(blockHash);
         if (mi == mapBlockThinIndex.end()
             && !fThinFullIndex
             && pindexRear)
@@ -5950,7 +5950,7 @@ bool CWallet::GetStakeWeightV1(int nHeight, const CKeyStore& keystore, uint64_t&
             if (nNodeMode == NT_THIN)
             {
                 // -- check txn is in chain
-                std::map<uint256, CBlockThinIndex*>::iterator mi (mapBlockThinIndex.find(pcoin.first->hashBlock));
+                BlockThinMap::iterator mi (mapBlockThinIndex.find(pcoin.first->hashBlock));
                 if (mi == mapBlockThinIndex.end())
                 {
                     if (fThinFullIndex
@@ -6020,7 +6020,7 @@ uint64_t CWallet::GetStakeWeight() const
             if (nNodeMode == NT_THIN)
             {
                 // -- check txn is in chain
-                std::map<uint256, CBlockThinIndex*>::iterator mi (mapBlockThinIndex.find(pcoin.first->hashBlock));
+                BlockThinMap::iterator mi (mapBlockThinIndex.find(pcoin.first->hashBlock));
                 if (mi == mapBlockThinIndex.end())
                 {
                     if (fThinFullIndex
@@ -9412,7 +9412,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const
     {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
-        std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+        BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
         if (blit != mapBlockIndex.end() && blit->second->IsInMainChain())
         {
             // ... which are already in a block